@@ -28,9 +28,28 @@
   #include <mbedtls/net_sockets.h>
   #include <mbedtls/platform.h>
   #include <mbedtls/ssl.h>
+  #include <mbedtls/version.h>
+  #include <mbedtls/platform_util.h>
+  #if MQTTTLSLowMemory == 1 && !defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    #warning "MBEDTLS_SSL_MAX_FRAGMENT_LENGTH isn't enabled in mbedtls configuration, so the TLS low memory profile can't negotiate smaller records"
+  #endif
 #endif
 // We need StackHeapBuffer to avoid stressing the heap allocator when it's not required
 #include "include/Platform/StackHeapBuffer.hpp"
+// We need the allocator interface too
+#include "include/Platform/Allocator.hpp"
+#if MQTTUseTopicRouter == 1 || MQTTUseLocalBroker == 1
+// We need the topic trie for routing the publications
+#include "include/Protocol/MQTT/TopicTrie.hpp"
+#endif
+#if MQTTUseClientPool == 1
+// We need the pool declaration
+#include "include/Network/Clients/MQTTPool.hpp"
+#endif
+#if MQTTUseLocalBroker == 1
+// We need the broker declaration
+#include "include/Network/Clients/MQTTBroker.hpp"
+#endif
 
 
 // This is the maximum allocation that'll be performed on the stack before it's being replaced by heap allocation
@@ -39,6 +58,673 @@
 
 namespace Network { namespace Client {
 
+#if MQTTMaxInFlight > 0
+    /** The table of publications that were sent but not acknowledged yet.
+        This is a fixed size table (no allocation) that's searched linearly since the window is expected to be small.
+        Entries are kept packed at the beginning of the table */
+    struct InFlightTable
+    {
+        /** An entry in the table */
+        struct Entry
+        {
+            /** The packet identifier */
+            uint16  packetID;
+            /** The next packet type we expect for this packet (PUBACK, PUBREC or PUBCOMP) */
+            uint8   expected;
+#if MQTTUseOfflineQueue == 1
+            /** A copy of the publication as an offline queue record, to queue it again if the connection is lost before the broker
+                received it (0 if there's none) */
+            uint8 * record;
+            /** The record size in bytes */
+            uint32  recordSize;
+#endif
+        };
+        /** The table entries */
+        Entry       entries[MQTTMaxInFlight];
+        /** The number of used entries */
+        uint16      count;
+        /** The current window (as allowed by the broker) */
+        uint16      window;
+
+        /** Find the entry with the given packet identifier
+            @return A pointer to the entry or 0 if not found */
+        Entry * find(const uint16 packetID)
+        {
+            for (uint16 i = 0; i < count; i++)
+                if (entries[i].packetID == packetID) return &entries[i];
+            return 0;
+        }
+        /** Check if the table is full */
+        bool isFull() const { return count >= window; }
+        /** Add an entry in the table
+            @return false if the table is full */
+        bool add(const uint16 packetID, const Protocol::MQTT::V5::ControlPacketType expected)
+        {
+            if (isFull()) return false;
+            entries[count].packetID = packetID;
+            entries[count].expected = (uint8)expected;
+#if MQTTUseOfflineQueue == 1
+            entries[count].record = 0;
+            entries[count].recordSize = 0;
+#endif
+            count++;
+            return true;
+        }
+        /** Remove the given entry from the table */
+        void remove(Entry * entry) { *entry = entries[--count]; }
+        /** Reset the table and its window to the default value */
+        void reset() { count = 0; window = MQTTMaxInFlight; }
+
+        InFlightTable() : count(0), window(MQTTMaxInFlight) {}
+    };
+#endif
+
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+    // The table is shared by the manual acknowledgement and the received QoS 2 publications
+  #if MQTTManualAckWindow > MQTTReceivedQoS2Max
+    #define MQTTInboundTableSize MQTTManualAckWindow
+  #else
+    #define MQTTInboundTableSize MQTTReceivedQoS2Max
+  #endif
+
+    /** The received QoS 1 and 2 publications that aren't completely acknowledged yet (@sa MQTTv5::setManualAck, MQTTReceivedQoS2Max).
+        Its size is advertised to the broker as our Receive Maximum, so a compliant broker can't overflow it */
+    struct InboundTable
+    {
+        /** An entry in the table */
+        struct Entry
+        {
+            /** The packet identifier */
+            uint16  packetID;
+            /** The next packet type we'll send for this packet (PUBACK or PUBREC until the application acknowledges it, then PUBCOMP) */
+            uint8   next;
+        };
+        /** The table entries */
+        Entry       entries[MQTTInboundTableSize];
+        /** The number of used entries */
+        uint16      count;
+
+        /** Find the entry with the given packet identifier
+            @return A pointer to the entry or 0 if not found */
+        Entry * find(const uint16 packetID)
+        {
+            for (uint16 i = 0; i < count; i++)
+                if (entries[i].packetID == packetID) return &entries[i];
+            return 0;
+        }
+        /** Add an entry in the table
+            @return false if the table is full */
+        bool add(const uint16 packetID, const Protocol::MQTT::V5::ControlPacketType next)
+        {
+            if (isFull()) return false;
+            entries[count].packetID = packetID;
+            entries[count].next = (uint8)next;
+            count++;
+            return true;
+        }
+        /** Check if the table is full */
+        bool isFull() const { return count >= MQTTInboundTableSize; }
+        /** Remove the given entry from the table */
+        void remove(Entry * entry) { *entry = entries[--count]; }
+        /** Remove the publications that aren't acknowledged yet, keeping the ones waiting for their release (PUBREL) */
+        void dropUnacknowledged()
+        {
+            for (uint16 i = count; i > 0; i--)
+                if (entries[i - 1].next != Protocol::MQTT::V5::PUBCOMP) remove(&entries[i - 1]);
+        }
+
+        InboundTable() : count(0) {}
+    };
+#endif
+
+#if MQTTReceiveBufferPool > 0
+    /** The spare receiving buffers (@sa MQTTv5::takeMessage).
+        A buffer is only taken from the event loop's task, but it's given back from any task, so the slots are atomic.
+        There is always a free slot for a given back buffer, since there's one more buffer than slots (the one receiving) */
+    struct ReceiveBufferPool
+    {
+        /** The spare buffers (0 if the slot is empty) */
+        std::atomic<uint8 *>    spares[MQTTReceiveBufferPool];
+        /** The allocator for the buffers */
+        Platform::Allocator &   allocator;
+        /** The buffers size in bytes */
+        const uint32            size;
+
+        /** Take a spare buffer
+            @return A pointer to a buffer or 0 if none is available */
+        uint8 * take()
+        {
+            for (uint32 i = 0; i < MQTTReceiveBufferPool; i++)
+                if (uint8 * buffer = spares[i].exchange(0)) return buffer;
+            return 0;
+        }
+        /** Give back a buffer to the pool. It's released if the pool is already full (it can't happen unless a buffer is given twice) */
+        void give(uint8 * buffer)
+        {
+            for (uint32 i = 0; i < MQTTReceiveBufferPool; i++)
+            {
+                uint8 * empty = 0;
+                if (spares[i].compare_exchange_strong(empty, buffer)) return;
+            }
+            allocator.release(buffer, size);
+        }
+
+        ReceiveBufferPool(Platform::Allocator & allocator, const uint32 size) : allocator(allocator), size(size)
+        {
+            for (uint32 i = 0; i < MQTTReceiveBufferPool; i++) spares[i] = (uint8*)allocator.allocate(size);
+        }
+        ~ReceiveBufferPool()
+        {   // Taken buffers must be released before destructing the client
+            for (uint32 i = 0; i < MQTTReceiveBufferPool; i++) allocator.release(spares[i].exchange(0), size);
+        }
+    };
+#endif
+
+#if MQTTPacketTrace > 0
+    /** The packet trace ring (@sa MQTTPacketTrace).
+        Recording a packet only copies a few bytes, the entries are only formatted when dumped */
+    struct PacketTrace
+    {
+        /** The ring entries */
+        MQTTv5::TraceEntry  entries[MQTTPacketTrace];
+        /** The number of recorded packets since the last reset (the next entry is at this index modulo the ring size) */
+        uint32              recorded;
+
+        /** Extract the packet identifier from the beginning of a packet
+            @return The packet identifier or 0 if the packet doesn't have any (or it's not captured) */
+        static uint16 getPacketID(const uint8 * packet, const uint32 size)
+        {
+            const uint8 type = packet[0] >> 4;
+            // Skip the remaining length
+            uint32 o = 1;
+            while (o < size && (packet[o] & 0x80)) o++;
+            o++;
+            if (type == Protocol::MQTT::V5::PUBLISH)
+            {   // The packet identifier follows the topic name, and only for QoS above 0
+                if (!(packet[0] & 6) || o + 2 > size) return 0;
+                o += 2 + ((packet[o] << 8) | packet[o + 1]);
+            }
+            else if (type < Protocol::MQTT::V5::PUBACK || type > Protocol::MQTT::V5::UNSUBACK) return 0;
+            return o + 2 <= size ? (uint16)((packet[o] << 8) | packet[o + 1]) : 0;
+        }
+
+        /** Record a packet, given in 2 parts (the second is optional) */
+        void record(const bool sent, const uint8 * header, const uint32 headerSize, const uint8 * payload = 0, const uint32 payloadSize = 0)
+        {
+            MQTTv5::TraceEntry & entry = entries[recorded++ % MQTTPacketTrace];
+            entry.timeMs = Platform::getMonotonicTimeMs();
+            entry.length = headerSize + payloadSize;
+            entry.sent = sent ? 1 : 0;
+            entry.typeAndFlags = header[0];
+            const uint32 fromHeader = min(headerSize, (uint32)MQTTv5::TraceEntry::CapturedBytes);
+            memcpy(entry.data, header, fromHeader);
+            if (fromHeader < entry.getCapturedSize())
+            {   // Without a payload (for a packet that's received in chunks), the missing part is zeroed
+                if (payload) memcpy(entry.data + fromHeader, payload, entry.getCapturedSize() - fromHeader);
+                else memset(entry.data + fromHeader, 0, entry.getCapturedSize() - fromHeader);
+            }
+            entry.packetID = getPacketID(entry.data, entry.getCapturedSize());
+        }
+
+        /** Copy the last entries, oldest first
+            @return The number of entries copied */
+        uint32 copy(MQTTv5::TraceEntry * out, const uint32 count) const
+        {
+            const uint32 n = min(min(count, recorded), (uint32)MQTTPacketTrace);
+            for (uint32 i = 0; i < n; i++) out[i] = entries[(recorded - n + i) % MQTTPacketTrace];
+            return n;
+        }
+
+        PacketTrace() : recorded(0) {}
+    };
+#endif
+
+#if MQTTOutTopicAliasMax > 0
+    /** The outbound topic alias table.
+        A topic is assigned an alias upon its first publication, and the least recently used alias is reassigned to
+        a new topic when the table is full. Alias value is the entry index plus one */
+    struct OutTopicAliasTable
+    {
+        /** An entry in the table */
+        struct Entry
+        {
+            /** The topic name for this alias */
+            Protocol::MQTT::V5::DynamicString topic;
+            /** The last time (in publication counter unit) this alias was used, 0 if unused */
+            uint32          lastUse;
+
+            Entry() : lastUse(0) {}
+        };
+        /** The table entries */
+        Entry       entries[MQTTOutTopicAliasMax];
+        /** The maximum number of aliases the broker accepts (0 means that aliases are disabled) */
+        uint16      maxAlias;
+        /** The publication counter used for the LRU algorithm */
+        uint32      useCounter;
+
+        /** Get the alias for the given topic, assigning one if required
+            @param topic    The topic name
+            @param length   The topic name length in bytes
+            @param known    On output, set to true if the broker already knows about this alias
+            @return The alias value or 0 if aliases are not allowed */
+        uint16 getAlias(const char * topic, const uint16 length, bool & known)
+        {
+            known = false;
+            if (!maxAlias) return 0;
+            uint16 lru = 0;
+            for (uint16 i = 0; i < maxAlias; i++)
+            {
+                Entry & entry = entries[i];
+                if (entry.lastUse && entry.topic.length == length && !memcmp(entry.topic.data, topic, length))
+                {
+                    entry.lastUse = ++useCounter;
+                    known = true;
+                    return i + 1;
+                }
+                if (entry.lastUse < entries[lru].lastUse) lru = i;
+            }
+            // Not found, so reuse the least recently used alias
+            entries[lru].topic.from(topic, length);
+            entries[lru].lastUse = ++useCounter;
+            return lru + 1;
+        }
+        /** Reset the table for a new connection */
+        void reset(const uint16 brokerMax)
+        {
+            maxAlias = min(brokerMax, (uint16)MQTTOutTopicAliasMax);
+            for (uint16 i = 0; i < MQTTOutTopicAliasMax; i++) entries[i].lastUse = 0;
+            useCounter = 0;
+        }
+
+        OutTopicAliasTable() : maxAlias(0), useCounter(0) {}
+    };
+#endif
+
+#if MQTTInTopicAliasMax > 0
+    /** The inbound topic alias table.
+        The broker sets an alias with a publication containing both the topic name and the Topic Alias property,
+        then it uses the alias with an empty topic name. Alias value is the entry index plus one */
+    struct InTopicAliasTable
+    {
+        /** The topic name for each alias (empty if unset) */
+        Protocol::MQTT::V5::DynamicString topics[MQTTInTopicAliasMax];
+
+        /** Resolve the topic name of a received publication
+            @param topic    The publication topic name. If empty, it's replaced by the topic for the alias, else the alias is set to it
+            @param alias    The Topic Alias property value
+            @return false if the alias is invalid (this is a protocol error) */
+        bool resolve(MQTTv5::DynamicStringView & topic, const uint16 alias)
+        {
+            if (!alias || alias > MQTTInTopicAliasMax) return false;
+            Protocol::MQTT::V5::DynamicString & entry = topics[alias - 1];
+            if (topic.length)
+            {
+                if (entry.length != topic.length || memcmp(entry.data, topic.data, topic.length))
+                    entry.from(topic.data, topic.length);
+                return true;
+            }
+            if (!entry.length) return false;
+            topic = entry;
+            return true;
+        }
+        /** Reset the table for a new connection */
+        void reset() { for (uint16 i = 0; i < MQTTInTopicAliasMax; i++) topics[i] = Protocol::MQTT::V5::DynamicString(); }
+    };
+#endif
+
+#if MQTTUseTopicRouter == 1
+    /** The subscription router.
+        The routes are stored in a topic trie. The routes with a subscription identifier are also stored in a list that's
+        checked first, since it avoids matching the topic name */
+    struct TopicRouter
+    {
+        /** A route in the trie */
+        struct Route
+        {
+            /** The handler to call */
+            SubscriptionHandler *   handler;
+            /** The subscription identifier (0 if none) */
+            uint32                  subscriptionID;
+
+            bool operator == (const Route & other) const { return handler == other.handler && subscriptionID == other.subscriptionID; }
+            Route(SubscriptionHandler * handler, const uint32 subscriptionID) : handler(handler), subscriptionID(subscriptionID) {}
+        };
+        /** A route with a subscription identifier */
+        struct IDRoute
+        {
+            /** The route itself */
+            Route                   route;
+            /** The number of topic filters using this route */
+            uint32                  uses;
+            /** The next route in the list */
+            IDRoute *               next;
+
+            IDRoute(const Route & route, IDRoute * next) : route(route), uses(1), next(next) {}
+        };
+        typedef Protocol::MQTT::Common::TopicTrie<Route> Filters;
+        /** The functor checking if a handler is used by the routes matched before the given one */
+        struct EarlierMatch
+        {
+            SubscriptionHandler *               handler;
+            const uint32                        before;
+            uint32                              visits;
+            bool                                found;
+
+            void operator() (const Route & route) { if (visits++ < before && route.handler == handler) found = true; }
+        };
+        /** The functor calling the handler for each matching route, once per handler */
+        struct Dispatcher
+        {
+            const Filters &                     filters;
+            const MQTTv5::DynamicStringView &   topic;
+            const MQTTv5::DynamicBinDataView &  payload;
+            const uint16                        packetID;
+            const MQTTv5::PropertiesView &      props;
+            /** The number of routes matched so far */
+            uint32                              visits;
+            /** The number of handlers called */
+            uint32                              called;
+
+            void operator() (const Route & route)
+            {
+                // A handler matching multiple filters (like "a/+" and "a/#") is only called for the first one.
+                // Matching never allocates, so the previous matches are found again instead of being stored (the usual case is a single match)
+                if (visits)
+                {
+                    EarlierMatch earlier = { route.handler, visits, 0, false };
+                    filters.match(topic.data, topic.length, earlier);
+                    if (earlier.found) { visits++; return; }
+                }
+                visits++; called++;
+                route.handler->messageReceived(topic, payload, packetID, props);
+            }
+        };
+
+        /** The topic filters trie */
+        Filters     filters;
+        /** The routes with a subscription identifier */
+        IDRoute *   ids;
+
+        /** Skip the shared subscription prefix ($share/name/) of a topic filter
+            @return The topic filter to match or 0 if it's invalid */
+        static const char * skipSharePrefix(const char * filter)
+        {
+            if (!filter || strncmp(filter, "$share/", 7)) return filter;
+            const char * sep = strchr(filter + 7, '/');
+            return sep ? sep + 1 : 0;
+        }
+        /** Check if the publication carries the given subscription identifier */
+        static bool hasID(const Protocol::MQTT::V5::PropertiesIndex & index, const uint32 subscriptionID)
+        {
+            Protocol::MQTT::V5::MappedVBInt id;
+            for (size_t i = 0; index.getProperty(Protocol::MQTT::V5::SubscriptionID, id, i); i++)
+                if (id.getValue() == subscriptionID) return true;
+            return false;
+        }
+        /** Find the route with a subscription identifier */
+        IDRoute ** findID(const Route & route)
+        {
+            IDRoute ** r = &ids;
+            while (*r && !((*r)->route == route)) r = &(*r)->next;
+            return r;
+        }
+
+        /** Add a route
+            @return false if the topic filter is invalid */
+        bool add(const char * filter, SubscriptionHandler * handler, const uint32 subscriptionID)
+        {
+            filter = skipSharePrefix(filter);
+            if (!filter || !handler || strlen(filter) > 65535) return false;
+            Route route(handler, subscriptionID);
+            if (!filters.insert(filter, (uint16)strlen(filter), route)) return false;
+            if (!subscriptionID) return true;
+            IDRoute ** r = findID(route);
+            if (*r) (*r)->uses++;
+            else ids = new IDRoute(route, ids);
+            return true;
+        }
+        /** Remove a route
+            @return false if the route was not found */
+        bool remove(const char * filter, SubscriptionHandler * handler, const uint32 subscriptionID)
+        {
+            filter = skipSharePrefix(filter);
+            if (!filter || strlen(filter) > 65535) return false;
+            Route route(handler, subscriptionID);
+            if (!filters.remove(filter, (uint16)strlen(filter), route)) return false;
+            if (!subscriptionID) return true;
+            IDRoute ** r = findID(route);
+            if (*r && !--(*r)->uses) { IDRoute * n = *r; *r = n->next; delete n; }
+            return true;
+        }
+        /** Dispatch a publication to the matching routes. Each handler is called at most once, even if multiple routes match
+            @return The number of handlers called */
+        uint32 dispatch(const MQTTv5::DynamicStringView & topic, const MQTTv5::DynamicBinDataView & payload, const uint16 packetID, const MQTTv5::PropertiesView & props,
+                        const Protocol::MQTT::V5::PropertiesIndex & index)
+        {
+            uint32 count = 0;
+            // A publication can have multiple subscription identifiers if it matches multiple subscriptions
+            for (IDRoute * r = ids; r; r = r->next)
+            {
+                if (!hasID(index, r->route.subscriptionID)) continue;
+                // Skip the handler if a previous route with one of the identifiers already called it
+                IDRoute * e = ids;
+                while (e != r && !(e->route.handler == r->route.handler && hasID(index, e->route.subscriptionID))) e = e->next;
+                if (e != r) continue;
+                r->route.handler->messageReceived(topic, payload, packetID, props);
+                count++;
+            }
+            if (count) return count;
+            Dispatcher dispatcher = { filters, topic, payload, packetID, props, 0, 0 };
+            filters.match(topic.data, topic.length, dispatcher);
+            return dispatcher.called;
+        }
+
+        TopicRouter() : ids(0) {}
+        ~TopicRouter() { while (ids) { IDRoute * n = ids->next; delete ids; ids = n; } }
+    };
+#endif
+
+#if MQTTUseOfflineQueue == 1
+#pragma pack(push, 1)
+    /** The header of a publication record in the offline queue.
+        It's followed by the topic name (including its terminating zero) and the payload.
+        The records never leave the device, so the native endianness is used */
+    struct QueuedPublication
+    {
+        enum Flags
+        {
+            QoSMask     = 3,    //!< The QoS for the publication
+            Retain      = 4,    //!< The retain flag
+            Duplicate   = 8,    //!< The publication was sent before (with the given packet identifier)
+        };
+        /** The flags (@sa Flags) */
+        uint8   flags;
+        /** The packet identifier, if it was sent before */
+        uint16  packetID;
+        /** The topic name length in bytes, including its terminating zero */
+        uint16  topicLength;
+        /** The payload length in bytes */
+        uint32  payloadLength;
+
+        /** Write a record's header and topic name
+            @return The number of bytes written, the payload follows */
+        static uint32 writeHead(uint8 * out, const uint8 flags, const uint16 packetID, const char * topic, const uint16 topicLength, const uint32 payloadLength)
+        {
+            QueuedPublication pub;
+            pub.flags = flags;
+            pub.packetID = packetID;
+            pub.topicLength = topicLength;
+            pub.payloadLength = payloadLength;
+            memcpy(out, &pub, sizeof(pub));
+            memcpy(out + sizeof(pub), topic, topicLength);
+            return sizeof(pub) + topicLength;
+        }
+    };
+#pragma pack(pop)
+#endif
+
+#if MQTTUseAutoReconnect == 1
+    /** The automatic reconnection state (@sa MQTTv5::setAutoReconnect).
+        The connection parameters are copied upon a successful connectTo, so the client can connect again by itself from the event loop.
+        The subscriptions are recorded too, so they can be replayed if the broker didn't keep the session. The subscription identifier is a
+        property of the SUBSCRIBE packet, so the subscriptions are replayed with a packet per subscription identifier (usually a single one) */
+    struct ReconnectState
+    {
+        /** A recorded subscription */
+        struct Subscription
+        {
+            /** The topic filter */
+            Protocol::MQTT::V5::DynamicString   topic;
+            /** The subscribe options */
+            uint8                               option;
+            /** The subscription identifier (0 if none) */
+            uint32                              subscriptionID;
+            /** The next subscription in the list */
+            Subscription *                      next;
+
+            Subscription(const MQTTv5::DynamicStringView & filter, const uint8 option, const uint32 subscriptionID)
+                : option(option), subscriptionID(subscriptionID), next(0) { topic.from(filter.data, filter.length); }
+        };
+
+        /** The server host name, including its terminating zero (empty if the parameters weren't recorded yet) */
+        Protocol::MQTT::V5::DynamicString   host;
+        /** The user name, including its terminating zero (empty if none) */
+        Protocol::MQTT::V5::DynamicString   userName;
+        /** The password */
+        Protocol::MQTT::V5::DynamicBinaryData password;
+        /** The will topic (empty if there's no will message) */
+        Protocol::MQTT::V5::DynamicString   willTopic;
+        /** The will payload */
+        Protocol::MQTT::V5::DynamicBinaryData willPayload;
+        /** The will properties (if any) */
+        Protocol::MQTT::V5::Properties *    willProperties;
+        /** The connect properties (if any) */
+        Protocol::MQTT::V5::Properties *    properties;
+        /** The server port */
+        uint16                              port;
+        /** The keep alive delay in seconds */
+        uint16                              keepAlive;
+        /** Whether to use TLS */
+        bool                                useTLS;
+        /** Whether a password was given */
+        bool                                hasPassword;
+        /** The will QoS */
+        uint8                               willQoS;
+        /** The will retain flag */
+        bool                                willRetain;
+
+        /** The minimum and maximum delays between attempts in milliseconds */
+        uint32                              minDelay, maxDelay;
+        /** The current delay between attempts in milliseconds (doubled after each failure) */
+        uint32                              delay;
+        /** The time of the next attempt (from the monotonic clock) */
+        uint32                              nextAttempt;
+        /** The jitter's pseudo random generator state */
+        uint32                              seed;
+        /** The recorded subscriptions */
+        Subscription *                      subscriptions;
+
+        /** Check if the parameters were recorded, so the client can reconnect */
+        bool isArmed() const { return host.length > 0; }
+        /** Forget the connection parameters, so the client doesn't reconnect anymore */
+        void disarm()
+        {
+            host = userName = willTopic = Protocol::MQTT::V5::DynamicString();
+            password = willPayload = Protocol::MQTT::V5::DynamicBinaryData();
+            delete0(willProperties); delete0(properties);
+        }
+        /** Record the connection parameters. The subscriptions are forgotten, since they are made again after a connectTo call */
+        void record(const char * serverHost, const uint16 serverPort, const bool tls, const uint16 keepAliveTimeInSec, const char * user,
+                    const MQTTv5::DynamicBinDataView * pass, const MQTTv5::WillMessage * will, const uint8 QoS, const bool retain,
+                    const Protocol::MQTT::V5::Properties * props)
+        {
+            disarm();
+            clearSubscriptions();
+            // The strings are given as is to connectTo, so they must be zero terminated
+            host.from(serverHost, strlen(serverHost) + 1);
+            if (user) userName.from(user, strlen(user) + 1);
+            hasPassword = pass != 0;
+            if (pass) password = Protocol::MQTT::V5::DynamicBinaryData(pass->length, pass->data);
+            if (will && will->willTopic.length)
+            {
+                willTopic.from(will->willTopic.data, will->willTopic.length);
+                willPayload = Protocol::MQTT::V5::DynamicBinaryData(will->willPayload.length, will->willPayload.data);
+                if (will->willProperties.head) willProperties = will->willProperties.clone();
+            }
+            if (props && props->head) properties = props->clone();
+            port = serverPort; keepAlive = keepAliveTimeInSec; useTLS = tls; willQoS = QoS; willRetain = retain;
+            delay = minDelay;
+        }
+
+        /** Schedule the next attempt after the connection was lost or an attempt failed.
+            The wait is randomly chosen between half the delay and the delay, so clients disconnected together don't reconnect together */
+        void connectionLost(const uint32 now)
+        {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; // Xorshift is enough for spreading the attempts
+            nextAttempt = now + delay / 2 + seed % (delay / 2 + 1);
+            delay = min(delay * 2, maxDelay);
+        }
+        /** Get the time before the next attempt in milliseconds */
+        uint32 timeBeforeAttempt(const uint32 now) const { return (int32)(nextAttempt - now) > 0 ? nextAttempt - now : 0; }
+
+        /** Find the given topic filter in the recorded subscriptions */
+        Subscription ** find(const MQTTv5::DynamicStringView & filter)
+        {
+            Subscription ** s = &subscriptions;
+            while (*s && ((*s)->topic.length != filter.length || memcmp((*s)->topic.data, filter.data, filter.length))) s = &(*s)->next;
+            return s;
+        }
+        /** Record a subscription (replacing the previous one for the same topic filter, like the broker does) */
+        void subscribe(const MQTTv5::DynamicStringView & filter, const uint8 option, const uint32 subscriptionID)
+        {
+            if (!filter.length) return;
+            Subscription ** s = find(filter);
+            if (*s) { (*s)->option = option; (*s)->subscriptionID = subscriptionID; return; }
+            *s = new Subscription(filter, option, subscriptionID);
+        }
+        /** Forget a subscription */
+        void unsubscribe(const MQTTv5::DynamicStringView & filter)
+        {
+            Subscription ** s = find(filter);
+            if (!*s) return;
+            Subscription * n = *s; *s = n->next; delete n;
+        }
+        /** Record the subscriptions of a SUBSCRIBE packet */
+        void subscribe(const MQTTv5::SubscribeTopic & topics, const Protocol::MQTT::V5::Properties & props)
+        {
+            // The subscription identifier is a variable byte integer property
+            uint32 subscriptionID = 0;
+            const Protocol::MQTT::V5::PropertyBase * prop = props.getProperty(Protocol::MQTT::V5::SubscriptionID);
+            uint8 buffer[5]; // The property type and up to 4 bytes for the value
+            if (prop && prop->getSize() <= sizeof(buffer) && prop->copyInto(buffer) > 1)
+                Protocol::MQTT::Common::decodeVBInt(buffer + 1, prop->getSize() - 1, subscriptionID);
+
+            for (const MQTTv5::SubscribeTopic * t = &topics; t; t = (const MQTTv5::SubscribeTopic *)t->getNext())
+                subscribe(t->getTopic(), t->option, subscriptionID);
+        }
+        /** Forget the subscriptions of an UNSUBSCRIBE packet */
+        void unsubscribe(const MQTTv5::UnsubscribeTopic & topics)
+        {
+            for (const Protocol::MQTT::V5::ScribeTopicBase * t = &topics; t; t = t->getNext())
+                unsubscribe(t->getTopic());
+        }
+        /** Forget all the subscriptions */
+        void clearSubscriptions() { while (subscriptions) { Subscription * n = subscriptions->next; delete subscriptions; subscriptions = n; } }
+
+        ReconnectState(const uint32 minDelay, const uint32 maxDelay, const uint32 seed)
+            : willProperties(0), properties(0), port(0), keepAlive(0), useTLS(false), hasPassword(false), willQoS(0), willRetain(false),
+              minDelay(minDelay), maxDelay(max(minDelay, maxDelay)), delay(minDelay), nextAttempt(0), seed(seed | 1), subscriptions(0) {}
+        ~ReconnectState() { disarm(); clearSubscriptions(); }
+    };
+
+    /** Sleep for the given time (using select here since it's cross platform in BSD socket API) */
+    static void sleepMs(const uint32 delayMs)
+    {
+        struct timeval v = { (time_t)(delayMs / 1000), (suseconds_t)((delayMs % 1000) * 1000) };
+        ::select(0, NULL, NULL, NULL, &v);
+    }
+#endif
+
 #if MQTTOnlyBSDSocket != 1
     /*  The socket class we are using for socket operations.
         There's a default implementation for Berkeley socket and (Open)SSL socket in the ClassPath, but
@@ -75,13 +761,23 @@ namespace Network { namespace Client {
         /** The default timeout in milliseconds */
         uint32                          timeoutMs;
 
-        /** The last communication time in second */
+        /** The last communication time in milliseconds (from the monotonic clock) */
         uint32                          lastCommunication;
         /** The publish current default identifier allocator */
         uint16                          publishCurrentId;
-        /** The keep alive delay in seconds */
+        /** The keep alive delay in seconds, as negotiated with the server (0 to disable it) */
         uint16                          keepAlive;
+        /** The time when the last ping request was sent in milliseconds */
+        uint32                          pingTime;
+        /** Set while waiting for the answer to a ping request */
+        bool                            pingPending;
+#if MQTTUseStatistics == 1
+        /** The runtime statistics */
+        MQTTv5::Stats                   stats;
+#endif
 
+        /** The allocator used for the receiving buffer and the temporary packet buffers */
+        Platform::Allocator &       allocator;
 
         /** The reading state. Because data on a TCP stream is
             a stream, we have to remember what state we are currently following while parsing data */
@@ -102,6 +798,40 @@ namespace Network { namespace Client {
         uint8   *           recvBuffer;
         /** The receiving VBInt size for the packet header */
         uint8               packetExpectedVBSize;
+#if MQTTMaxInFlight > 0
+        /** The publications waiting for their acknowledgement */
+        InFlightTable       inFlight;
+        /** The subscribe and unsubscribe requests waiting for their acknowledgement */
+        InFlightTable       pendingRequests;
+#endif
+#if MQTTOutTopicAliasMax > 0
+        /** The topic aliases used for publishing */
+        OutTopicAliasTable  outAliases;
+#endif
+#if MQTTInTopicAliasMax > 0
+        /** The topic aliases used by the broker */
+        InTopicAliasTable   inAliases;
+#endif
+#if MQTTUseTopicRouter == 1
+        /** The subscription router */
+        TopicRouter         router;
+#endif
+#if MQTTUseOfflineQueue == 1
+        /** The offline publication queue (if any) */
+        QueueStorage *      queue;
+        /** The time when the queued publications can be sent again after a failed attempt (from the monotonic clock) */
+        uint32              replayRetryTime;
+        /** Set if replaying the queue failed, so it's only retried at replayRetryTime */
+        bool                replayFailed;
+#endif
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+        /** Set if the broker resumed our session upon connection */
+        bool                sessionPresent;
+#endif
+#if MQTTUseAutoReconnect == 1
+        /** The automatic reconnection state (if enabled) */
+        ReconnectState *    reconnect;
+#endif
 
   #if MQTTUseAuth == 1
         /** Used to track the origin of the AUTH exchange */
@@ -111,10 +841,16 @@ namespace Network { namespace Client {
 
         uint16 allocatePacketID()
         {
-            return ++publishCurrentId;
+            // Packet identifier 0 is not allowed, and we can't reuse an identifier that's still in flight
+            if (!++publishCurrentId) ++publishCurrentId;
+#if MQTTMaxInFlight > 0
+            while (inFlight.find(publishCurrentId) || pendingRequests.find(publishCurrentId))
+                if (!++publishCurrentId) ++publishCurrentId;
+#endif
+            return publishCurrentId;
         }
 
-        Impl(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert)
+        Impl(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert, Platform::Allocator & allocator)
              : socket(0), brokerCert(brokerCert),
   #if MQTTUseTLS == 1
                sslContext(0),
@@ -122,17 +858,84 @@ namespace Network { namespace Client {
   #if MQTTUseAuth == 1
                authSource(0),
   #endif
-               clientID(clientID), cb(callback), timeoutMs(3000), lastCommunication(0), publishCurrentId(0), keepAlive(300),
-               recvState(Ready), recvBufferSize(max(callback->maxPacketSize(), 8U)), maxPacketSize(65535), available(0), recvBuffer((uint8*)::malloc(recvBufferSize)), packetExpectedVBSize(Protocol::MQTT::Common::VBInt(recvBufferSize).getSize())
+               clientID(clientID), cb(callback), timeoutMs(3000), lastCommunication(0), publishCurrentId(0), keepAlive(300), pingTime(0), pingPending(false),
+               allocator(allocator), recvState(Ready), recvBufferSize(max(callback->maxPacketSize(), 8U)), maxPacketSize(65535), available(0), recvBuffer((uint8*)allocator.allocate(recvBufferSize)), packetExpectedVBSize(Protocol::MQTT::Common::VBInt(recvBufferSize).getSize())
+#if MQTTUseOfflineQueue == 1
+               , queue(0), replayRetryTime(0), replayFailed(false)
+#endif
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+               , sessionPresent(false)
+#endif
+#if MQTTUseAutoReconnect == 1
+               , reconnect(0)
+#endif
         {}
-        ~Impl() { delete socket; socket = 0; ::free(recvBuffer); recvBuffer = 0; recvBufferSize = 0; }
+        ~Impl()
+        {
+            delete socket; socket = 0;
+#if MQTTUseAutoReconnect == 1
+            delete0(reconnect);
+#endif
+#if MQTTMaxInFlight > 0 && MQTTUseOfflineQueue == 1
+            for (uint16 i = 0; i < inFlight.count; i++) allocator.release(inFlight.entries[i].record, inFlight.entries[i].recordSize);
+#endif
+            allocator.release(recvBuffer, recvBufferSize); recvBuffer = 0; recvBufferSize = 0;
+        }
 
 
         inline void setTimeout(uint32 timeout) { timeoutMs = timeout; }
+        /** Get the default timeout in milliseconds */
+        inline uint32 getTimeout() const { return timeoutMs; }
+
+        /** Get the delay without communication before pinging the server in milliseconds.
+            It's a percentage of the keep alive delay so we always wake up before doom's clock */
+        inline uint32 getPingInterval() const { return (uint32)keepAlive * (MQTTKeepAlivePercent * 10); }
+        /** Get the maximum time to wait for the answer to a ping request in milliseconds.
+            That's what's left of the keep alive delay, but not less than the default timeout */
+        inline uint32 getPingTimeout() const { return max((uint32)keepAlive * 1000 - getPingInterval(), getTimeout()); }
+
+        bool shouldPing() const
+        {
+            return keepAlive && !pingPending && (Platform::getMonotonicTimeMs() - lastCommunication) >= getPingInterval();
+        }
+        /** Check if the server didn't answer the last ping request in time, meaning the link is dead */
+        bool pingTimedOut() const
+        {
+            return pingPending && (Platform::getMonotonicTimeMs() - pingTime) >= getPingTimeout();
+        }
+        /** Remember that a ping request was sent */
+        void pingSent() { lastCommunication = pingTime = Platform::getMonotonicTimeMs(); pingPending = true; }
+        /** Remember that a packet was received, so the link is alive */
+        void packetReceived() { lastCommunication = Platform::getMonotonicTimeMs(); pingPending = false; }
+#if MQTTUseStatistics == 1
+        /** Account for the packet that was received (call it before packetReceived) */
+        void countReceived(const uint32 size)
+        {
+            stats.received(recvBuffer[0], size);
+            if (pingPending && (recvBuffer[0] >> 4) == Protocol::MQTT::V5::PINGRESP) stats.pingAnswered(Platform::getMonotonicTimeMs() - pingTime);
+        }
+#endif
+
+        /** Get the time in milliseconds before the keep alive requires to ping the server (or to give up waiting for its answer) */
+        uint32 timeBeforePing() const
+        {
+            if (!keepAlive) return 0x7FFFFFFF; // Never, but don't confuse it with the disconnected state
+            const uint32 elapsed = Platform::getMonotonicTimeMs() - (pingPending ? pingTime : lastCommunication);
+            const uint32 delay = pingPending ? getPingTimeout() : getPingInterval();
+            return elapsed >= delay ? 0 : delay - elapsed;
+        }
 
-        bool shouldPing()
+        /** Wait until the given socket descriptor is readable or the delay expired.
+            This doesn't use any member so it can be called without holding the lock
+            @return 1 if the socket is readable, 0 on timeout, or negative on error */
+        static int waitReadable(const int fd, const uint32 delayMs)
         {
-            return (((uint32)time(NULL) - lastCommunication) >= keepAlive);
+            if (fd < 0) return -1;
+            struct timeval v = { (time_t)(delayMs / 1000), (suseconds_t)((delayMs % 1000) * 1000) };
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(fd, &set);
+            return ::select(fd + 1, &set, NULL, NULL, &v);
         }
 
         int send(const char * buffer, const uint32 length)
@@ -145,14 +948,29 @@ namespace Network { namespace Client {
             Protocol::MQTT::V5::FixedHeader header;
             header.raw = buffer[0];
             Logger::log(Logger::Dump, "> Sending packet: %s(R:%d,Q:%d,D:%d)%s", Protocol::MQTT::V5::Helper::getControlPacketName((Protocol::MQTT::Common::ControlPacketType)(uint8)header.type), header.retain, header.QoS, header.dup, (const char*)packetDump);
+#endif
+#if MQTTUseStatistics == 1
+            stats.sent(buffer[0], length);
 #endif
             return socket->sendReliably(buffer, (int)length, timeoutMs);
         }
 
+        int sendv(const char * header, const uint32 headerLength, const char * payload, const uint32 payloadLength)
+        {
+            int ret = send(header, headerLength);
+            if (ret != (int)headerLength || !socket) return ret;
+            // Send the payload without copying it
+#if MQTTUseStatistics == 1
+            stats.bytesSent += payloadLength;
+#endif
+            ret = socket->sendReliably(payload, (int)payloadLength, timeoutMs);
+            return ret < 0 ? ret : ret + (int)headerLength;
+        }
+
         bool hasValidLength() const
         {
-            Protocol::MQTT::Common::VBInt l;
-            return l.readFrom(recvBuffer + 1, available - 1) != Protocol::MQTT::Common::BadData;
+            uint32 remainingLength = 0;
+            return Protocol::MQTT::Common::decodeVBInt(recvBuffer + 1, available - 1, remainingLength) != Protocol::MQTT::Common::BadData;
         }
 
         /** Receive a control packet from the socket in the given time.
@@ -175,7 +993,6 @@ namespace Network { namespace Client {
             // If we haven't received packet length yet, we have to fetch the header very carefully
             // Else, we can enter a more general receiving loop until we have all bytes from the control packet
             int ret = 0;
-            Protocol::MQTT::Common::VBInt len;
 
 #if MQTTLowLatency == 1
             // In low latency mode, return as early as possible
@@ -197,8 +1014,8 @@ namespace Network { namespace Client {
                 if (timeout == 0) return -2;
                 // Deal with socket errors here
                 if (ret < 0 || available < 2) return -1;
-                // Depending on the packet type, let's wait for more data
-                if (recvBuffer[0] < 0xD0 || recvBuffer[1]) // Below ping response or packet size larger than 2 bytes
+                // If the remaining length doesn't fit in a single byte, let's wait for more data (else, we know the packet size already)
+                if (recvBuffer[1] & 0x80)
                 {
                     int querySize = (packetExpectedVBSize + 1) - available;
                     ret = socket->receiveReliably((char*)&recvBuffer[available], querySize, timeout);
@@ -215,7 +1032,8 @@ namespace Network { namespace Client {
             default: break;
             }
             // Here we should either have a valid control packet header
-            uint32 r = len.readFrom(&recvBuffer[1], available - 1);
+            uint32 remainingLength = 0;
+            uint32 r = Protocol::MQTT::Common::decodeVBInt(&recvBuffer[1], available - 1, remainingLength);
             if (r == Protocol::MQTT::Common::BadData)
                 return 0; // Close the socket here, the given data are wrong or not the right protocol
             if (r == Protocol::MQTT::Common::NotEnoughData)
@@ -229,8 +1047,7 @@ namespace Network { namespace Client {
                 recvState = GotType;
                 return -2;
             }
-            uint32 remainingLength = len;
-            uint32 totalPacketSize = remainingLength + 1 + len.getSize();
+            uint32 totalPacketSize = remainingLength + 1 + r;
             ret = totalPacketSize == available ? 0 : socket->receiveReliably((char*)&recvBuffer[available], (totalPacketSize - available), timeout);
             if (ret > 0) available += ret;
             if (timeout == 0) return -2;
@@ -248,13 +1065,48 @@ namespace Network { namespace Client {
                 header.raw = recvBuffer[0];
                 Logger::log(Logger::Dump, "< Received packet: %s(R:%d,Q:%d,D:%d)%s", Protocol::MQTT::V5::Helper::getControlPacketName((Protocol::MQTT::Common::ControlPacketType)(uint8)header.type), header.retain, header.QoS, header.dup, (const char*)packetDump);
 #endif
-                lastCommunication = (uint32)time(NULL);
+#if MQTTUseStatistics == 1
+                countReceived(available);
+#endif
+                packetReceived();
                 return (int)available;
             }
             // No yet, but we probably timed-out.
             return -2;
         }
 
+        /** Check if a complete packet is already received. There is no read ahead here, so it's only the current packet */
+        bool hasBufferedPacket() const { return recvState == GotCompletePacket; }
+        /** Check if a packet can be processed without waiting for the network */
+        bool hasPendingData() const { return recvState == GotCompletePacket; }
+#if MQTTUseOfflineQueue == 1
+        /** Check if a queued publication can be sent now (it waits for room in the in-flight window, or for the retry time after a failure otherwise) */
+        bool canReplayQueue() const { return timeBeforeReplay() == 0; }
+        /** Get the time in milliseconds before the queued publications can be sent again (0x7FFFFFFF if there's nothing to send) */
+        uint32 timeBeforeReplay() const
+        {
+            if (!queue || queue->isEmpty()) return 0x7FFFFFFF;
+  #if MQTTMaxInFlight > 0
+            // Once the window is full, an acknowledgement must be received first
+            if (inFlight.isFull()) return 0x7FFFFFFF;
+  #endif
+            if (!replayFailed) return 0;
+            const int32 left = (int32)(replayRetryTime - Platform::getMonotonicTimeMs());
+            return left > 0 ? (uint32)left : 0;
+        }
+        /** Remember that replaying the queue failed (like when the storage can't be read), so the event loop doesn't spin on it */
+        void replayFailedNow() { replayFailed = true; replayRetryTime = Platform::getMonotonicTimeMs() + getTimeout(); }
+#endif
+        /** Get the socket descriptor (or -1 if not connected) */
+        int getSocketHandle() const { return socket ? socket->getDescriptor() : -1; }
+#if MQTTStreamLargePublish == 1
+        /** Streaming large publications is not supported with ClassPath's socket code, they are rejected. */
+        bool isStreaming() const { return false; }
+        /** The size of the streamed publication that's not received yet (always 0 here) */
+        enum { streamLeft = 0 };
+        int receiveChunk(const uint32) { return -1; }
+#endif
+
         /** Get the last received packet type */
         Protocol::MQTT::V5::ControlPacketType getLastPacketType() const
         {
@@ -295,17 +1147,84 @@ namespace Network { namespace Client {
             return (int)r;
         }
 
+        /** Extract a publication reply of the given type (this is a faster version of extractControlPacket for these packets) */
+        int extractReplyPacket(const Protocol::MQTT::V5::ControlPacketType type, uint16 & packetID, uint8 & reasonCode)
+        {
+            if (recvState != GotCompletePacket)
+            {
+                int ret = receiveControlPacket();
+                if (ret <= 0) return ret;
+
+                if (recvState != GotCompletePacket)
+                    return -2;
+            }
+
+            // Check the packet is the last expected type
+            if (getLastPacketType() != type) return -3;
+
+            uint32 r = Protocol::MQTT::V5::FastPath::decodeReply(recvBuffer, recvBufferSize, packetID, reasonCode);
+            if (Protocol::MQTT::Common::isError(r)) return -4; // Parsing error
+
+            // Done with receiving the packet let's remember it
+            resetPacketReceivingState();
+            return (int)r;
+        }
+
+        /** Get the packet identifier of the last received packet (only valid for packets starting with a packet identifier) */
+        uint16 getLastPacketID() const
+        {
+            if (recvState != GotCompletePacket) return 0;
+            // Skip the remaining length VBInt
+            uint32 o = 2;
+            while (o < available && (recvBuffer[o - 1] & 0x80)) o++;
+            return o + 1 < available ? (uint16)((recvBuffer[o] << 8) | recvBuffer[o + 1]) : 0;
+        }
+
         void resetPacketReceivingState() { recvState = Ready; available = 0; }
 
         void close()
         {
+#if MQTTUseAutoReconnect == 1
+            // Schedule the next attempt if the connection (or the connection attempt) was lost
+            if (socket && reconnect && reconnect->isArmed()) reconnect->connectionLost(Platform::getMonotonicTimeMs());
+#endif
             delete0(socket);
+            pingPending = false;
+#if MQTTMaxInFlight > 0
+            // Report all pending publications as failed, unless they can be sent again from the offline queue once connected
+            const uint16 count = inFlight.count;
+            inFlight.count = 0;
+            for (uint16 i = 0; i < count; i++)
+            {
+                InFlightTable::Entry & entry = inFlight.entries[i];
+  #if MQTTUseOfflineQueue == 1
+                const bool queued = entry.record && queue && queue->push(entry.record, entry.recordSize, 0, 0);
+                allocator.release(entry.record, entry.recordSize);
+                entry.record = 0;
+                if (queued) continue;
+  #endif
+                cb->publishCompleted(entry.packetID, Protocol::MQTT::V5::UnspecifiedError);
+            }
+            // Same for the pending requests, with an empty reason code list
+            while (pendingRequests.count)
+            {
+                InFlightTable::Entry entry = pendingRequests.entries[--pendingRequests.count];
+                if (entry.expected == Protocol::MQTT::V5::SUBACK)
+                    cb->subscribeCompleted(entry.packetID, DynamicBinDataView(), Protocol::MQTT::V5::PropertiesView());
+                else
+                    cb->unsubscribeCompleted(entry.packetID, DynamicBinDataView(), Protocol::MQTT::V5::PropertiesView());
+            }
+#endif
         }
 
         bool isOpen()
         {
             return socket != nullptr;
         }
+#if MQTTUseAutoReconnect == 1
+        /** Check if the client isn't connected but will connect again by itself */
+        bool isAboutToConnect() { return !socket && reconnect && reconnect->isArmed(); }
+#endif
 
         int connectWith(const char * host, const uint16 port, const bool withTLS)
         {
@@ -316,15 +1235,17 @@ namespace Network { namespace Client {
                 if (!sslContext)
                 {   // If one certificate is given let's use it instead of the default CA bundle
                     sslContext = brokerCert ? new SSLContext(NULL, Crypto::SSLContext::Any) : new SSLContext();
-                }
-                if (!sslContext) return -2;
-                // Insert here any session specific configuration or certificate validator
-                if (brokerCert)
-                {
-                    if (const char * error = sslContext->loadCertificateFromDER(brokerCert->data, brokerCert->length))
+                    if (!sslContext) return -2;
+                    // Insert here any session specific configuration or certificate validator
+                    // The context is kept across connections, so the certificate is only loaded once
+                    if (brokerCert)
                     {
-                        Logger::log(Logger::Error, "Could not load the given certificate: %s", error);
-                        return -2;
+                        if (const char * error = sslContext->loadCertificateFromDER(brokerCert->data, brokerCert->length))
+                        {
+                            Logger::log(Logger::Error, "Could not load the given certificate: %s", error);
+                            delete0(sslContext);
+                            return -2;
+                        }
                     }
                 }
                 socket = new Network::Socket::SSL_TLS(*sslContext, Network::Socket::BaseSocket::Stream);
@@ -358,20 +1279,9 @@ namespace Network { namespace Client {
                 // Try to find the auth method, and the auth data
                 DynamicStringView authMethod;
                 DynamicBinDataView authData;
-                Protocol::MQTT::V5::VisitorVariant visitor;
-                while (packet.props.getProperty(visitor) && (authMethod.length == 0 || authData.length == 0))
-                {
-                    if (visitor.propertyType() == Protocol::MQTT::V5::AuthenticationMethod)
-                    {
-                        auto view = visitor.as< DynamicStringView >();
-                        authMethod = *view;
-                    }
-                    else if (visitor.propertyType() == Protocol::MQTT::V5::AuthenticationData)
-                    {
-                        auto data = visitor.as< DynamicBinDataView >();
-                        authData = *data;
-                    }
-                }
+                Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationMethod, authMethod);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationData, authData);
                 return cb->authReceived(packet.fixedVariableHeader.reason(), authMethod, authData, packet.props) ? MQTTv5::ErrorType::Success : MQTTv5::ErrorType::NetworkError;
             }
             return ErrorType::NetworkError;
@@ -383,11 +1293,10 @@ namespace Network { namespace Client {
             int ret = extractControlPacket(type, packet);
             if (ret > 0)
             {
-                // We are only interested in the result of the connection
-                if (packet.fixedVariableHeader.acknowledgeFlag & 1)
-                {   // Session is present on the server. For now, we don't care, do we ?
-
-                }
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+                // The publications and the subscriptions that were sent before are only known by the server if it kept our session
+                sessionPresent = (packet.fixedVariableHeader.acknowledgeFlag & 1) != 0;
+#endif
                 if (packet.fixedVariableHeader.reasonCode != 0
 #if MQTTUseAuth == 1
                     && packet.fixedVariableHeader.reasonCode != Protocol::MQTT::V5::NotAuthorized
@@ -398,50 +1307,44 @@ namespace Network { namespace Client {
                     // We have failed connection with the following reason:
                     return (MQTTv5::ReasonCodes)packet.fixedVariableHeader.reasonCode;
                 }
-                // Now, we are going to parse the other properties
+#if MQTTMaxInFlight > 0
+                // Without a Receive Maximum property, the broker accepts up to 65535 packets in flight
+                inFlight.reset();
+                pendingRequests.reset();
+#endif
+#if MQTTOutTopicAliasMax > 0
+                // Without a Topic Alias Maximum property, the broker does not accept any alias
+                outAliases.reset(0);
+#endif
+#if MQTTInTopicAliasMax > 0
+                // The broker's aliases don't survive the connection
+                inAliases.reset();
+#endif
+                // Now, we are going to parse the other properties. They are indexed in a single pass, so each lookup is O(1)
+                Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+                Protocol::MQTT::V5::LittleEndianPODVisitor<uint32> pod32;
+                Protocol::MQTT::V5::LittleEndianPODVisitor<uint16> pod16;
+                Protocol::MQTT::V5::DynamicStringView view;
+                if (index.getProperty(Protocol::MQTT::V5::PacketSizeMax, pod32))
+                    maxPacketSize = pod32.getValue();
+#if MQTTMaxInFlight > 0
+                if (index.getProperty(Protocol::MQTT::V5::ReceiveMax, pod16))
+                    inFlight.window = min((uint16)MQTTMaxInFlight, pod16.getValue());
+#endif
+#if MQTTOutTopicAliasMax > 0
+                if (index.getProperty(Protocol::MQTT::V5::TopicAliasMax, pod16))
+                    outAliases.reset(pod16.getValue());
+#endif
+                if (index.getProperty(Protocol::MQTT::V5::AssignedClientID, view))
+                    clientID.from(view.data, view.length); // This allocates memory for holding the copy
+                if (index.getProperty(Protocol::MQTT::V5::ServerKeepAlive, pod16))
+                    keepAlive = pod16.getValue(); // The ping interval is computed from it
 #if MQTTUseAuth == 1
                 DynamicStringView authMethod;
                 DynamicBinDataView authData;
+                index.getProperty(Protocol::MQTT::V5::AuthenticationMethod, authMethod);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationData, authData);
 #endif
-                Protocol::MQTT::V5::VisitorVariant visitor;
-                while (packet.props.getProperty(visitor))
-                {
-                    switch (visitor.propertyType())
-                    {
-                    case Protocol::MQTT::V5::PacketSizeMax:
-                    {
-                        auto pod = visitor.as< Protocol::MQTT::V5::LittleEndianPODVisitor<uint32> >();
-                        maxPacketSize = pod->getValue();
-                        break;
-                    }
-                    case Protocol::MQTT::V5::AssignedClientID:
-                    {
-                        auto view = visitor.as< Protocol::MQTT::V5::DynamicStringView >();
-                        clientID.from(view->data, view->length); // This allocates memory for holding the copy
-                        break;
-                    }
-                    case Protocol::MQTT::V5::ServerKeepAlive:
-                    {
-                        auto pod = visitor.as< Protocol::MQTT::V5::LittleEndianPODVisitor<uint16> >();
-                        keepAlive = (pod->getValue() + (pod->getValue()>>1)) >> 1; // Use 0.75 of the server's told value
-                        break;
-                    }
-#if MQTTUseAuth == 1
-                    case Protocol::MQTT::V5::AuthenticationMethod:
-                    {
-                        auto view = visitor.as<DynamicStringView>();
-                        authMethod = *view;
-                    } break;
-                    case Protocol::MQTT::V5::AuthenticationData:
-                    {
-                        auto data = visitor.as<DynamicBinDataView>();
-                        authData = *data;
-                    } break;
-#endif
-                    // Actually, we don't care about other properties. Maybe we should ?
-                    default: break;
-                    }
-                }
 #if MQTTUseAuth == 1
                 if (packet.fixedVariableHeader.reasonCode == Protocol::MQTT::V5::NotAuthorized
                  || packet.fixedVariableHeader.reasonCode == Protocol::MQTT::V5::BadAuthenticationMethod)
@@ -457,17 +1360,69 @@ namespace Network { namespace Client {
     };
 #else
 #ifndef MQTTLock
+  #ifndef _WIN32
+    /* A lock based on a pthread mutex (ESP-IDF implements them with FreeRTOS's mutexes), so a waiting task is
+       blocked until the lock is released instead of polling for it */
+    class MutexLock
+    {
+        pthread_mutex_t mutex;
+    public:
+  #if MQTTUseStatistics == 1
+        /** The number of times the lock was waited for */
+        uint32 contentions;
+        /** The total time spent waiting for the lock in milliseconds */
+        uint32 waitMs;
+
+        /** Construction */
+        MutexLock() : contentions(0), waitMs(0) { pthread_mutex_init(&mutex, NULL); }
+        /** Acquire the lock (the wait is only timed if the lock is already taken) */
+        inline void acquire()
+        {
+            if (pthread_mutex_trylock(&mutex) == 0) return;
+            const uint32 start = Platform::getMonotonicTimeMs();
+            pthread_mutex_lock(&mutex);
+            contentions++; waitMs += Platform::getMonotonicTimeMs() - start;
+        }
+  #else
+        /** Construction */
+        MutexLock() { pthread_mutex_init(&mutex, NULL); }
+        /** Acquire the lock */
+        inline void acquire() { pthread_mutex_lock(&mutex); }
+  #endif
+        ~MutexLock() { pthread_mutex_destroy(&mutex); }
+        /** Try to acquire the lock */
+        inline bool tryAcquire() { return pthread_mutex_trylock(&mutex) == 0; }
+        /** Release the lock */
+        inline void release() { pthread_mutex_unlock(&mutex); }
+    };
+
+    typedef MutexLock Lock;
+  #else
     /* If you have a true lock object in your system (for example, in FreeRTOS, use a mutex),
        you should provide one instead of this one as this one just burns CPU while waiting */
     class SpinLock
     {
         mutable std::atomic<bool> state;
     public:
+  #if MQTTUseStatistics == 1
+        /** The number of times the lock was waited for */
+        uint32 contentions;
+        /** The total time spent waiting for the lock in milliseconds */
+        uint32 waitMs;
+
+        /** Construction */
+        SpinLock() : state(false), contentions(0), waitMs(0) {}
+  #else
         /** Construction */
         SpinLock() : state(false) {}
+  #endif
         /** Acquire the lock */
         inline void acquire() volatile
         {
+  #if MQTTUseStatistics == 1
+            if (!state.exchange(true, std::memory_order_acq_rel)) return;
+            const uint32 start = Platform::getMonotonicTimeMs();
+  #endif
             while (state.exchange(true, std::memory_order_acq_rel))
             {
                 // Put a sleep method here (using select here since it's cross platform in BSD socket API)
@@ -475,6 +1430,9 @@ namespace Network { namespace Client {
                 tv.tv_sec = 0; tv.tv_usec = 500; // Wait 0.5ms per loop
                 select(0, NULL, NULL, NULL, &tv);
             }
+  #if MQTTUseStatistics == 1
+            contentions++; waitMs += Platform::getMonotonicTimeMs() - start;
+  #endif
         }
         /** Try to acquire the lock */
         inline bool tryAcquire() volatile { return state.exchange(true, std::memory_order_acq_rel) == false; }
@@ -485,6 +1443,7 @@ namespace Network { namespace Client {
     };
 
     typedef SpinLock Lock;
+  #endif
     struct ScopedLock
     {
         Lock & a;
@@ -532,7 +1491,41 @@ namespace Network { namespace Client {
         int     socket;
         struct timeval &         timeoutMs;
 
-        MQTTVirtual int connect(const char * host, uint16 port, const MQTTv5::DynamicBinDataView *)
+#ifdef MSG_NOSIGNAL
+        /** Don't raise SIGPIPE when sending to a connection closed by the server, the send call fails instead */
+        enum { SendFlags = MSG_NOSIGNAL };
+#else
+        enum { SendFlags = 0 };
+#endif
+
+        /** The socket flags before it was set as non blocking for connecting */
+        int     socketFlags;
+#if MQTTUseClientPool == 1
+        /** If set, only the data that's already received is returned, without waiting for the network (@sa MQTTv5::serviceFromPool) */
+        bool    noWait;
+#endif
+
+        /** Resolve the given host name to an IPv4 address. This waits for the DNS server */
+        static int resolve(const char * host, struct in_addr & address)
+        {
+            struct addrinfo hints = {};
+            hints.ai_family = AF_INET; // IPv4 only for now
+            hints.ai_flags = AI_ADDRCONFIG;
+            hints.ai_socktype = SOCK_STREAM;
+
+            // Resolve address
+            struct addrinfo *result = NULL;
+            if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL) return -5;
+            address = ((struct sockaddr_in *)(result->ai_addr))->sin_addr;
+
+            // free result
+            freeaddrinfo(result);
+            return 0;
+        }
+
+        /** Start connecting to the given address without waiting for the connection
+            @return 0 if connected already, 1 if the connection is in progress or a negative value on error */
+        int open(const struct in_addr & address, const uint16 port)
         {
             socket = ::socket(AF_INET, SOCK_STREAM, 0);
             if (socket == -1) return -2;
@@ -544,57 +1537,75 @@ namespace Network { namespace Client {
             // you must issue a select call here.
 
             // Set non blocking here
-            int socketFlags = ::fcntl(socket, F_GETFL, 0);
+            socketFlags = ::fcntl(socket, F_GETFL, 0);
             if (socketFlags == -1) return -3;
             if (::fcntl(socket, F_SETFL, (socketFlags | O_NONBLOCK)) != 0) return -3;
 
             // Let the socket be without Nagle's algorithm
             int flag = 1;
             if (::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0) return -4;
-            // Then connect the socket to the server
-            struct addrinfo hints = {};
-            hints.ai_family = AF_INET; // IPv4 only for now
-            hints.ai_flags = AI_ADDRCONFIG;
-            hints.ai_socktype = SOCK_STREAM;
-
-            // Resolve address
-            struct addrinfo *result = NULL;
-            if (getaddrinfo(host, NULL, &hints, &result) < 0 || result == NULL) return -5;
 
             // Then connect to it
-            struct sockaddr_in address;
-            address.sin_port = htons(port);
-            address.sin_family = AF_INET;
-            address.sin_addr = ((struct sockaddr_in *)(result->ai_addr))->sin_addr;
+            struct sockaddr_in sockAddress = {};
+            sockAddress.sin_port = htons(port);
+            sockAddress.sin_family = AF_INET;
+            sockAddress.sin_addr = address;
 
-            // free result
-            freeaddrinfo(result);
-            int ret = ::connect(socket, (const sockaddr*)&address, sizeof(address));
+            int ret = ::connect(socket, (const sockaddr*)&sockAddress, sizeof(sockAddress));
             if (ret < 0 && errno != EINPROGRESS) return -6;
-            if (ret == 0) return 0;
+            return ret == 0 ? 0 : 1;
+        }
+        /** Check if the connection started with open succeeded, once the socket is writable */
+        int connected()
+        {
+            int error = 0; socklen_t length = sizeof(error);
+            if (::getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) return -6;
+            return 0;
+        }
+        /** Restore the blocking behavior of the connected socket, with the default timeout */
+        MQTTVirtual int setBlocking()
+        {
+            // Restore blocking behavior here
+            if (::fcntl(socket, F_SETFL, socketFlags) != 0) return -3;
+            // And set timeouts for both recv and send
+            if (::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeoutMs, sizeof(timeoutMs)) < 0) return -4;
+            if (::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeoutMs, sizeof(timeoutMs)) < 0) return -4;
+            return 0;
+        }
+        /** Run the handshake of the secure layer (if any) on the connected socket.
+            @param step     If true, the socket is still non blocking, so only run what's possible without waiting for the network
+            @return 0 once done, 1 if it must be called again once the socket is readable, 2 once it's writable, or a negative value on error */
+        MQTTVirtual int handshake(const char *, const MQTTv5::DynamicBinDataView *, const bool) { return 0; }
 
-            // Here, we need to wait until connection happens or times out
-            if (select(false, true))
-            {
-                // Restore blocking behavior here
-                if (::fcntl(socket, F_SETFL, socketFlags) != 0) return -3;
-                // And set timeouts for both recv and send
-                if (::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeoutMs, sizeof(timeoutMs)) < 0) return -4;
-                if (::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeoutMs, sizeof(timeoutMs)) < 0) return -4;
-                // Ok, done!
-                return 0;
-            }
+        /** Connect to the given address, waiting for the connection (and the handshake) to complete */
+        int connect(const char * host, const struct in_addr & address, const uint16 port, const MQTTv5::DynamicBinDataView * brokerCert)
+        {
+            int ret = open(address, port);
+            if (ret < 0) return ret;
 
-            return -7;
+            // Here, we need to wait until connection happens or times out
+            if (ret == 1 && select(false, true) <= 0) return -7;
+            if ((ret = connected()) || (ret = setBlocking())) return ret;
+            return handshake(host, brokerCert, false);
         }
+        /** Receive at least minLength bytes, and up to maxLength bytes if they are already available (without waiting for them) */
         MQTTVirtual int recv(char * buffer, const uint32 minLength, const uint32 maxLength = 0)
         {
-            int ret = ::recv(socket, buffer, minLength, MSG_WAITALL);
-            if (ret <= 0) return ret;
-            if (maxLength <= minLength) return ret;
-
-            int nret = ::recv(socket, &buffer[ret], maxLength - ret, 0);
-            return nret <= 0 ? nret : nret + ret;
+            // A single call is usually enough since the socket gives us everything it has
+            const uint32 length = max(minLength, maxLength);
+#if MQTTUseClientPool == 1
+            const int flags = noWait ? MSG_DONTWAIT : 0;
+#else
+            const int flags = 0;
+#endif
+            uint32 ret = 0;
+            while (ret < minLength)
+            {
+                int r = ::recv(socket, &buffer[ret], length - ret, flags);
+                if (r <= 0) return ret ? (int)ret : r;
+                ret += (uint32)r;
+            }
+            return (int)ret;
         }
 
         MQTTVirtual int send(const char * buffer, const uint32 length)
@@ -602,7 +1613,40 @@ namespace Network { namespace Client {
 #if MQTTDumpCommunication == 1
             dumpBufferAsPacket("> Sending packet", (const uint8*)buffer, length);
 #endif
-            return ::send(socket, buffer, (int)length, 0);
+            return ::send(socket, buffer, (int)length, SendFlags);
+        }
+
+        /** Send a packet made of two distinct buffers (typically the packet header and its payload) without copying them */
+        MQTTVirtual int sendv(const char * header, const uint32 headerLength, const char * payload, const uint32 payloadLength)
+        {
+#if MQTTDumpCommunication == 1
+            dumpBufferAsPacket("> Sending packet header", (const uint8*)header, headerLength);
+#endif
+            struct iovec vec[2];
+            vec[0].iov_base = (void*)header;  vec[0].iov_len = headerLength;
+            vec[1].iov_base = (void*)payload; vec[1].iov_len = payloadLength;
+            struct msghdr msg = {};
+            msg.msg_iov = vec; msg.msg_iovlen = 2;
+
+            uint32 sent = 0;
+            while (msg.msg_iovlen)
+            {
+                int ret = ::sendmsg(socket, &msg, SendFlags);
+                if (ret <= 0) return ret;
+                sent += (uint32)ret;
+                // Partial send, so skip what was already sent
+                while (msg.msg_iovlen && (size_t)ret >= msg.msg_iov->iov_len)
+                {
+                    ret -= (int)msg.msg_iov->iov_len;
+                    msg.msg_iov++; msg.msg_iovlen--;
+                }
+                if (msg.msg_iovlen)
+                {
+                    msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + ret;
+                    msg.msg_iov->iov_len -= ret;
+                }
+            }
+            return (int)sent;
         }
 
         // Useful socket helpers functions here
@@ -619,24 +1663,49 @@ namespace Network { namespace Client {
             return ::select(socket + 1, reading ? &set : NULL, writing ? &set : NULL, NULL, &v);
         }
 
-        BaseSocket(struct timeval & timeoutMs) : socket(-1), timeoutMs(timeoutMs) {}
+        /** Check if some received data is already buffered (so that the socket might not be readable while data is available) */
+        MQTTVirtual bool hasPendingData() { return false; }
+
+#if MQTTUseClientPool == 1
+        BaseSocket(struct timeval & timeoutMs) : socket(-1), timeoutMs(timeoutMs), socketFlags(0), noWait(false) {}
+#else
+        BaseSocket(struct timeval & timeoutMs) : socket(-1), timeoutMs(timeoutMs), socketFlags(0) {}
+#endif
         MQTTVirtual ~BaseSocket() { ::closesocket(socket); socket = -1; }
     };
 
 
 #if MQTTUseTLS == 1
-    class MBTLSSocket : public BaseSocket
+    /** The TLS state that's kept across connections.
+        Parsing the CA chain, seeding the random generator and building the configuration are only done once per client, and the last
+        negotiated session is kept so reconnecting to the server uses an abbreviated handshake */
+    struct TLSContext
     {
         mbedtls_entropy_context entropy;
         mbedtls_ctr_drbg_context entropySource;
-        mbedtls_ssl_context ssl;
         mbedtls_ssl_config conf;
         mbedtls_x509_crt cacert;
-        mbedtls_net_context net;
+        /** Set once the configuration is built */
+        bool ready;
+  #if MQTTTLSSessionResumption == 1
+        /** The last negotiated session */
+        mbedtls_ssl_session session;
+        /** Set if the session is valid */
+        bool hasSession;
+        /** The session store (if any) */
+        TLSSessionStore * store;
+        /** The hash of the session that's in the store */
+        uint32 savedHash;
+  #endif
+  #if MQTTTLSLowMemory == 1
+        /** The largest packet the client accepts, used to choose the record size to negotiate */
+        uint32 maxPacketSize;
+  #endif
 
-    private:
-        bool buildConf(const MQTTv5::DynamicBinDataView * brokerCert)
+        /** Build the configuration if it's not done yet */
+        bool build(const MQTTv5::DynamicBinDataView * brokerCert)
         {
+            if (ready) return true;
             if (brokerCert)
             {   // Use given root certificate (if you have a recent version of mbedtls, you could use mbedtls_x509_crt_parse_der_nocopy instead to skip a useless copy here)
                 if (::mbedtls_x509_crt_parse_der(&cacert, brokerCert->data, brokerCert->length))
@@ -649,52 +1718,191 @@ namespace Network { namespace Client {
 
             ::mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
             ::mbedtls_ssl_conf_authmode(&conf, brokerCert ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
-
-            uint32_t ms = timeoutMs.tv_usec / 1000;
-            ::mbedtls_ssl_conf_read_timeout(&conf, ms < 50 ? 3000 : ms);
+  #if MQTTTLSLowMemory == 1 && defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+            // Ask the server for records that are just large enough for the packets we accept (RFC 6066), so the record buffers can shrink
+            if (::mbedtls_ssl_conf_max_frag_len(&conf, maxPacketSize <= 512 ? MBEDTLS_SSL_MAX_FRAG_LEN_512 : maxPacketSize <= 1024 ? MBEDTLS_SSL_MAX_FRAG_LEN_1024
+                                                     : maxPacketSize <= 2048 ? MBEDTLS_SSL_MAX_FRAG_LEN_2048 : MBEDTLS_SSL_MAX_FRAG_LEN_4096))
+                return false;
+  #endif
+  #if MQTTTLSSessionResumption == 1 && defined(MBEDTLS_SSL_SESSION_TICKETS)
+            ::mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+  #endif
 
             // Random number generator
             ::mbedtls_ssl_conf_rng(&conf, ::mbedtls_ctr_drbg_random, &entropySource);
             if (::mbedtls_ctr_drbg_seed(&entropySource, ::mbedtls_entropy_func, &entropy, NULL, 0))
                 return false;
 
-            if (::mbedtls_ssl_setup(&ssl, &conf))
-                return false;
-
+            ready = true;
             return true;
         }
 
-    public:
-        MBTLSSocket(struct timeval & timeoutMs) : BaseSocket(timeoutMs)
+  #if MQTTTLSSessionResumption == 1
+        /** Try to resume the last session on the given SSL context, loading it from the store if required */
+        void resume(mbedtls_ssl_context & ssl)
+        {
+    #if MBEDTLS_VERSION_NUMBER >= 0x02130000
+            if (!hasSession && store)
+            {
+                const uint32 length = store->loadSession(0, 0);
+                if (length)
+                {
+                    DeclareStackHeapBuffer(buffer, length, StackSizeAllocationLimit);
+                    hasSession = buffer && store->loadSession(buffer, length) == length && ::mbedtls_ssl_session_load(&session, buffer, length) == 0;
+                    // Hash the saved session before wiping it, so remember doesn't save the same session again
+                    if (hasSession) savedHash = hash(buffer, length);
+                    if (buffer) ::mbedtls_platform_zeroize(buffer, length);
+                }
+            }
+    #endif
+            if (hasSession) ::mbedtls_ssl_set_session(&ssl, &session);
+        }
+
+        /** Remember the session negotiated on the given SSL context, and save it in the store if it changed */
+        void remember(mbedtls_ssl_context & ssl)
+        {
+            forget();
+            hasSession = ::mbedtls_ssl_get_session(&ssl, &session) == 0;
+    #if MBEDTLS_VERSION_NUMBER >= 0x02130000
+            size_t length = 0;
+            if (!hasSession || !store || ::mbedtls_ssl_session_save(&session, 0, 0, &length) != MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL) return;
+            DeclareStackHeapBuffer(buffer, length, StackSizeAllocationLimit);
+            if (!buffer) return;
+            if (::mbedtls_ssl_session_save(&session, buffer, length, &length) == 0)
+            {
+                // A resumed session is the same session, so don't wear the storage
+                const uint32 h = hash(buffer, length);
+                if (h != savedHash) store->saveSession(buffer, (uint32)length);
+                savedHash = h;
+            }
+            ::mbedtls_platform_zeroize(buffer, length);
+    #endif
+        }
+
+        /** A simple FNV-1a hash used to detect if the session changed */
+        static uint32 hash(const uint8 * data, const size_t length)
+        {
+            uint32 h = 2166136261U;
+            for (size_t i = 0; i < length; i++) h = (h ^ data[i]) * 16777619U;
+            return h;
+        }
+
+        /** Forget the last session, the next handshake will be a full handshake */
+        void forget()
+        {
+            ::mbedtls_ssl_session_free(&session);
+            ::mbedtls_ssl_session_init(&session);
+            hasSession = false;
+        }
+  #endif
+
+        TLSContext() : ready(false)
+  #if MQTTTLSSessionResumption == 1
+            , hasSession(false), store(0), savedHash(0)
+  #endif
+  #if MQTTTLSLowMemory == 1
+            , maxPacketSize(0)
+  #endif
         {
-            mbedtls_ssl_init(&ssl);
             mbedtls_ssl_config_init(&conf);
             mbedtls_x509_crt_init(&cacert);
             mbedtls_ctr_drbg_init(&entropySource);
             mbedtls_entropy_init(&entropy);
+  #if MQTTTLSSessionResumption == 1
+            mbedtls_ssl_session_init(&session);
+  #endif
+        }
+        ~TLSContext()
+        {
+  #if MQTTTLSSessionResumption == 1
+            mbedtls_ssl_session_free(&session);
+  #endif
+            mbedtls_x509_crt_free(&cacert);
+            mbedtls_entropy_free(&entropy);
+            mbedtls_ssl_config_free(&conf);
+            mbedtls_ctr_drbg_free(&entropySource);
+        }
+    };
+
+    class MBTLSSocket : public BaseSocket
+    {
+        /** The shared TLS configuration (owned by the client) */
+        TLSContext & context;
+        mbedtls_ssl_context ssl;
+        mbedtls_net_context net;
+        /** Set once the SSL context is set up for this connection */
+        bool ready;
+
+    public:
+        MBTLSSocket(struct timeval & timeoutMs, TLSContext & context) : BaseSocket(timeoutMs), context(context), ready(false)
+        {
+            mbedtls_ssl_init(&ssl);
+        }
+
+#if MQTTUseClientPool == 1
+        /** The receiving method for mbedtls, that doesn't wait for the network if noWait is set */
+        static int receive(void * ctx, unsigned char * buffer, size_t length, uint32_t timeout)
+        {
+            MBTLSSocket & self = *(MBTLSSocket*)ctx;
+            if (self.noWait && self.BaseSocket::select(true, false, true) <= 0) return MBEDTLS_ERR_SSL_TIMEOUT;
+            return ::mbedtls_net_recv_timeout(&self.net, buffer, length, timeout);
+        }
+        /** The sending method for mbedtls */
+        static int transmit(void * ctx, const unsigned char * buffer, size_t length) { return ::mbedtls_net_send(&((MBTLSSocket*)ctx)->net, buffer, length); }
+#endif
+        /** Set the methods mbedtls uses to exchange data on the blocking socket */
+        void setBlockingIO()
+        {
+#if MQTTUseClientPool == 1
+            ::mbedtls_ssl_set_bio(&ssl, this, transmit, NULL, receive);
+#else
+            ::mbedtls_ssl_set_bio(&ssl, &net, ::mbedtls_net_send, NULL, ::mbedtls_net_recv_timeout);
+#endif
         }
 
-        int connect(const char * host, uint16 port, const MQTTv5::DynamicBinDataView * brokerCert)
+        int setBlocking()
         {
-            int ret = BaseSocket::connect(host, port, 0);
+            int ret = BaseSocket::setBlocking();
             if (ret) return ret;
 
             // MBedTLS doesn't deal with natural socket timeout correctly, so let's fix that
             struct timeval zeroTO = {};
             if (::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &zeroTO, sizeof(zeroTO)) < 0) return -4;
             if (::setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &zeroTO, sizeof(zeroTO)) < 0) return -4;
+            return 0;
+        }
 
-            net.fd = socket;
-
-            if (!buildConf(brokerCert))                                             return -8;
-            if (::mbedtls_ssl_set_hostname(&ssl, host))                             return -9;
-
-            // Set the method the SSL engine is using to fetch/send data to the other side
-            ::mbedtls_ssl_set_bio(&ssl, &net, ::mbedtls_net_send, NULL, ::mbedtls_net_recv_timeout);
+        int handshake(const char * host, const MQTTv5::DynamicBinDataView * brokerCert, const bool step)
+        {
+            if (!ready)
+            {
+                net.fd = socket;
+
+                if (!context.build(brokerCert))                                         return -8;
+                // The timeout can change between connections
+                uint32_t ms = timeoutMs.tv_usec / 1000;
+                ::mbedtls_ssl_conf_read_timeout(&context.conf, ms < 50 ? 3000 : ms);
+                if (::mbedtls_ssl_setup(&ssl, &context.conf))                          return -8;
+                if (::mbedtls_ssl_set_hostname(&ssl, host))                             return -9;
+
+                // Set the method the SSL engine is using to fetch/send data to the other side
+                // While the socket is non blocking, the receiving method must not wait either
+                if (step) ::mbedtls_ssl_set_bio(&ssl, &net, ::mbedtls_net_send, ::mbedtls_net_recv, NULL);
+                else setBlockingIO();
+#if MQTTTLSSessionResumption == 1
+                // If the server doesn't accept the session anymore, it falls back to a full handshake
+                context.resume(ssl);
+#endif
+                ready = true;
+            }
 
-            ret = ::mbedtls_ssl_handshake(&ssl);
+            int ret = ::mbedtls_ssl_handshake(&ssl);
+            if (step && (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE))
+                return ret == MBEDTLS_ERR_SSL_WANT_READ ? 1 : 2;
             if (ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
                 return -10;
+            // The socket is made blocking again after the handshake, so use the receiving method with timeout from now on
+            if (step) setBlockingIO();
 
             // Check certificate if one provided
             if (brokerCert)
@@ -706,27 +1914,76 @@ namespace Network { namespace Client {
                     char verify_buf[100] = {0};
                     mbedtls_x509_crt_verify_info(verify_buf, sizeof(verify_buf), "  ! ", flags);
                     printf("mbedtls_ssl_get_verify_result: %s flag: 0x%x\n", verify_buf, (unsigned int)flags);
+#endif
+#if MQTTTLSSessionResumption == 1
+                    context.forget();
 #endif
                     return -11;
                 }
             }
+#if MQTTTLSSessionResumption == 1
+            context.remember(ssl);
+#endif
             return 0;
         }
 
+        /** Write the complete buffer, since mbedtls only writes up to its maximum record size per call (returns what was written if it times out) */
+        int write(const uint8 * buffer, const uint32 length)
+        {
+            uint32 sent = 0;
+            while (sent < length)
+            {
+                int ret = ::mbedtls_ssl_write(&ssl, buffer + sent, length - sent);
+                if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+                {   // Wait for the socket to be ready (in the socket's timeout) instead of spinning on it
+                    int r = BaseSocket::select(ret == MBEDTLS_ERR_SSL_WANT_READ, ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+                    if (r > 0) continue;
+                    if (r == 0) errno = EWOULDBLOCK; // Remember it's a timeout
+                    return sent ? (int)sent : -1;
+                }
+                if (ret <= 0) return ret;
+                sent += (uint32)ret;
+            }
+            return (int)sent;
+        }
+
         int send(const char * buffer, const uint32 length)
         {
 #if MQTTDumpCommunication == 1
             dumpBufferAsPacket("> Sending packet", (const uint8*)buffer, length);
 #endif
-            return ::mbedtls_ssl_write(&ssl, (const uint8*)buffer, length);
+            return write((const uint8*)buffer, length);
+        }
+
+        int sendv(const char * header, const uint32 headerLength, const char * payload, const uint32 payloadLength)
+        {
+#if MQTTDumpCommunication == 1
+            dumpBufferAsPacket("> Sending packet header", (const uint8*)header, headerLength);
+#endif
+            // No scatter/gather in mbedtls, so it'll end up in (at least) 2 records
+            int ret = write((const uint8*)header, headerLength);
+            if (ret != (int)headerLength) return ret;
+            ret = write((const uint8*)payload, payloadLength);
+            return ret < 0 ? ret : ret + (int)headerLength;
+        }
+
+        bool hasPendingData() { return ::mbedtls_ssl_get_bytes_avail(&ssl) > 0; }
+
+        int select(bool reading, bool writing, bool instantaneous = false)
+        {
+            // Decrypted data can be waiting in mbedtls' buffer while the socket has nothing left to read
+            if (reading && ::mbedtls_ssl_get_bytes_avail(&ssl)) return 1;
+            return BaseSocket::select(reading, writing, instantaneous);
         }
 
         int recv(char * buffer, const uint32 minLength, const uint32 maxLength = 0)
         {
+            // mbedtls returns at most what's left in the current record, so it never waits for more than minLength bytes
+            const uint32 length = max(minLength, maxLength);
             uint32 ret = 0;
             while (ret < minLength)
             {
-                int r = ::mbedtls_ssl_read(&ssl, (uint8*)&buffer[ret], minLength - ret);
+                int r = ::mbedtls_ssl_read(&ssl, (uint8*)&buffer[ret], length - ret);
                 if (r <= 0)
                 {
                     // Those means that we need to call again the read method
@@ -734,32 +1991,125 @@ namespace Network { namespace Client {
                         continue;
                     if (r == MBEDTLS_ERR_SSL_TIMEOUT) {
                         errno = EWOULDBLOCK; // Remember it's a timeout
-                        return -1;
+                        return ret ? (int)ret : -1; // But don't lose what's already received
                     }
                     return ret ? (int)ret : r; // Silent error here
                 }
                 ret += (uint32)r;
             }
-            if (maxLength <= minLength) return ret;
-
-            // This one is a non blocking call
-            int nret = ::mbedtls_ssl_read(&ssl, (uint8*)&buffer[ret], maxLength - ret);
-            if (nret == MBEDTLS_ERR_SSL_TIMEOUT) return ret;
-            return nret <= 0 ? nret : nret + ret;
+            return (int)ret;
         }
 
         ~MBTLSSocket()
         {
             mbedtls_ssl_close_notify(&ssl);
-            mbedtls_x509_crt_free(&cacert);
-            mbedtls_entropy_free(&entropy);
-            mbedtls_ssl_config_free(&conf);
-            mbedtls_ctr_drbg_free(&entropySource);
             mbedtls_ssl_free(&ssl);
         }
     };
 #endif
 
+#if MQTTCacheBrokerAddress == 1
+    /** The last resolved broker address, so connecting again to the same broker doesn't wait for the DNS server */
+    struct AddressCache
+    {
+        /** The host name (empty if nothing is cached) */
+        Protocol::MQTT::V5::DynamicString   host;
+        /** The resolved address */
+        struct in_addr                      address;
+
+        /** Find the address for the given host name */
+        bool find(const char * name, struct in_addr & addr) const
+        {
+            if (!host.length || strlen(name) != host.length || memcmp(name, host.data, host.length)) return false;
+            addr = address;
+            return true;
+        }
+        /** Remember the address for the given host name */
+        void store(const char * name, const struct in_addr & addr) { host.from(name, strlen(name)); address = addr; }
+        /** Forget the cached address (typically because the broker couldn't be contacted there) */
+        void forget() { host = Protocol::MQTT::V5::DynamicString(); }
+
+        AddressCache() : address() {}
+    };
+#endif
+
+#if MQTTUseAsyncConnect == 1
+    /** The progress of an asynchronous connection (@sa MQTTv5::connectAsync).
+        The CONNECT packet is serialized when the connection is started, so the connection parameters don't need to outlive the call */
+    struct ConnectProgress
+    {
+        /** The connection steps */
+        enum Step
+        {
+            Idle = 0,           //!< Not connecting
+            Resolving,          //!< Resolving the server host name
+            TCPConnecting,      //!< Waiting for the socket to be connected
+            TLSHandshaking,     //!< Running the TLS handshake (if any)
+            WaitingConnACK,     //!< The CONNECT packet was sent, waiting for the server's answer
+        };
+        /** What the connection is waiting for (@sa MQTTv5::Impl::progressConnection) */
+        enum Wait
+        {
+            WaitRead = 1,       //!< Waiting for the socket to be readable
+            WaitWrite = 2,      //!< Waiting for the socket to be writable
+            NeedResolve = 3,    //!< The host name must be resolved
+        };
+
+        /** The current step */
+        Step                                step;
+        /** The server host name, including its terminating zero */
+        Protocol::MQTT::V5::DynamicString   host;
+        /** The server address, once resolved */
+        struct in_addr                      address;
+        /** The server port */
+        uint16                              port;
+        /** Whether to use TLS */
+        bool                                useTLS;
+        /** Set once the address is resolved */
+        bool                                resolved;
+        /** Set if this is an automatic reconnection */
+        bool                                reconnecting;
+        /** The attempt counter, to detect if the connection was restarted while resolving the host name */
+        uint32                              attempt;
+        /** The time when the current step started (from the monotonic clock) */
+        uint32                              stepStart;
+        /** The serialized CONNECT packet */
+        uint8 *                             packet;
+        /** The CONNECT packet size in bytes */
+        uint32                              packetSize;
+        /** The allocator used for the packet */
+        Platform::Allocator &               allocator;
+
+        /** Enter the given step */
+        void enter(const Step s) { step = s; stepStart = Platform::getMonotonicTimeMs(); }
+        /** Check if the current step took longer than the given timeout */
+        bool expired(const uint32 timeout) const { return Platform::getMonotonicTimeMs() - stepStart >= timeout; }
+        /** Get the time left for the current step, with the given timeout */
+        uint32 timeLeft(const uint32 timeout) const { const uint32 elapsed = Platform::getMonotonicTimeMs() - stepStart; return elapsed < timeout ? timeout - elapsed : 0; }
+        /** Stop connecting. The CONNECT packet contains the password, so it's wiped before being released */
+        void reset()
+        {
+            step = Idle; resolved = reconnecting = false;
+            if (packet)
+            {
+#if MQTTUseTLS == 1
+                ::mbedtls_platform_zeroize(packet, packetSize);
+#else
+                // Through a volatile pointer, so the compiler can't skip it
+                volatile uint8 * p = packet;
+                for (uint32 i = 0; i < packetSize; i++) p[i] = 0;
+#endif
+            }
+            allocator.release(packet, packetSize); packet = 0; packetSize = 0;
+            host = Protocol::MQTT::V5::DynamicString();
+        }
+
+        ConnectProgress(Platform::Allocator & allocator)
+            : step(Idle), address(), port(0), useTLS(false), resolved(false), reconnecting(false), attempt(0), stepStart(0), packet(0), packetSize(0), allocator(allocator) {}
+        ~ConnectProgress() { reset(); }
+    };
+#endif
+
     struct MQTTv5::Impl
     {
         /** The multithread protection for this object */
@@ -775,17 +2125,31 @@ namespace Network { namespace Client {
         /** The default timeout in milliseconds */
         struct timeval              timeoutMs;
 
-        /** The last communication time in second */
+        /** The last communication time in milliseconds (from the monotonic clock) */
         uint32                      lastCommunication;
         /** The publish current default identifier allocator */
         uint16                      publishCurrentId;
-        /** The keep alive delay in seconds */
+        /** The keep alive delay in seconds, as negotiated with the server (0 to disable it) */
         uint16                      keepAlive;
+        /** The time when the last ping request was sent in milliseconds */
+        uint32                      pingTime;
+        /** Set while waiting for the answer to a ping request */
+        bool                        pingPending;
+#if MQTTUseStatistics == 1
+        /** The runtime statistics */
+        MQTTv5::Stats               stats;
+#endif
+#if MQTTPacketTrace > 0
+        /** The packet trace ring */
+        PacketTrace                 trace;
+#endif
 #if MQTTUseAuth == 1
         /** Mask used to track the origin of the AUTH exchange and reentrancy issues */
         uint32                      authSource;
 #endif
 
+        /** The allocator used for the receiving buffer and the temporary packet buffers */
+        Platform::Allocator &       allocator;
 
         /** The reading state. Because data on a TCP stream is
             a stream, we have to remember what state we are currently following while parsing data */
@@ -800,42 +2164,238 @@ namespace Network { namespace Client {
         uint32              recvBufferSize;
         /** The maximum packet size the server is willing to accept */
         uint32              maxPacketSize;
-        /** The available data in the buffer */
+        /** The available data in the buffer (this includes the data read ahead past the current packet) */
         uint32              available;
+        /** The current packet size in bytes (only valid once the packet is complete) */
+        uint32              packetSize;
+        /** The size of the last processed packet that's still at the beginning of the buffer */
+        uint32              consumed;
         /** The receiving data buffer */
         uint8   *           recvBuffer;
         /** The receiving VBInt size for the packet header */
         uint8               packetExpectedVBSize;
+#if MQTTStreamLargePublish == 1
+        /** The size of the streamed publication that's not received yet (@sa MQTTStreamLargePublish) */
+        uint32              streamLeft;
+#endif
+#if MQTTMaxInFlight > 0
+        /** The publications waiting for their acknowledgement */
+        InFlightTable       inFlight;
+        /** The subscribe and unsubscribe requests waiting for their acknowledgement */
+        InFlightTable       pendingRequests;
+#endif
+#if MQTTOutTopicAliasMax > 0
+        /** The topic aliases used for publishing */
+        OutTopicAliasTable  outAliases;
+#endif
+#if MQTTInTopicAliasMax > 0
+        /** The topic aliases used by the broker */
+        InTopicAliasTable   inAliases;
+#endif
+#if MQTTUseTopicRouter == 1
+        /** The subscription router */
+        TopicRouter         router;
+#endif
+#if MQTTUseOfflineQueue == 1
+        /** The offline publication queue (if any) */
+        QueueStorage *      queue;
+        /** The time when the queued publications can be sent again after a failed attempt (from the monotonic clock) */
+        uint32              replayRetryTime;
+        /** Set if replaying the queue failed, so it's only retried at replayRetryTime */
+        bool                replayFailed;
+#endif
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+        /** Set if the broker resumed our session upon connection */
+        bool                sessionPresent;
+#endif
+#if MQTTUseAutoReconnect == 1
+        /** The automatic reconnection state (if enabled) */
+        ReconnectState *    reconnect;
+#endif
+#if MQTTUseAsyncConnect == 1
+        /** The asynchronous connection progress */
+        ConnectProgress     connecting;
+#endif
+#if MQTTCacheBrokerAddress == 1
+        /** The last resolved broker address */
+        AddressCache        addressCache;
+#endif
+#if MQTTUsePublishStream == 1
+        /** The payload size of the streamed publication that's not written yet (@sa MQTTv5::beginPublish) */
+        uint32              publishLeft;
+  #if MQTTUseStatistics == 1
+        /** The time when the streamed publication started, for its latency */
+        uint32              publishStart;
+  #endif
+        /** The streamed publication's packet identifier (0 for QoS AtMostOne) */
+        uint16              publishID;
+        /** The streamed publication's QoS */
+        uint8               publishQoS;
+        /** The task that started the streamed publication, since it owns the lock until the publication is done */
+        const void *        publisher;
+        /** Set while a publication is streamed, the lock is held meanwhile */
+        bool                publishing;
+        /** Set if the streamed publication is tracked in the in-flight table instead of being waited for */
+        bool                publishTracked;
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+        /** The received publications waiting for their acknowledgement or their release */
+        InboundTable        inbound;
+#endif
+#if MQTTManualAckWindow > 0
+        /** Set if the application acknowledges the received publications itself (@sa MQTTv5::setManualAck) */
+        bool                manualAck;
+#endif
+#if MQTTReceiveBufferPool > 0
+        /** The spare receiving buffers */
+        ReceiveBufferPool   spareBuffers;
+        /** The publication being dispatched, that can be taken by the application (0 if none) */
+        Protocol::MQTT::V5::ROPublishPacket * dispatching;
+#endif
+#if MQTTUseTLS == 1
+        /** The TLS configuration and session, kept across connections (allocated upon the first TLS connection) */
+        TLSContext *        tls;
+  #if MQTTTLSSessionResumption == 1
+        /** The TLS session store (if any) */
+        TLSSessionStore *   sessionStore;
+  #endif
+#endif
 
         uint16 allocatePacketID()
         {
-            return ++publishCurrentId;
+            // Packet identifier 0 is not allowed, and we can't reuse an identifier that's still in flight
+            if (!++publishCurrentId) ++publishCurrentId;
+#if MQTTMaxInFlight > 0
+            while (inFlight.find(publishCurrentId) || pendingRequests.find(publishCurrentId))
+                if (!++publishCurrentId) ++publishCurrentId;
+#endif
+            return publishCurrentId;
         }
 
-        Impl(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert)
-             : socket(0), brokerCert(brokerCert), clientID(clientID), cb(callback), timeoutMs({3, 0}), lastCommunication(0), publishCurrentId(0), keepAlive(300),
+        Impl(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert, Platform::Allocator & allocator)
+             : socket(0), brokerCert(brokerCert), clientID(clientID), cb(callback), timeoutMs({3, 0}), lastCommunication(0), publishCurrentId(0), keepAlive(300), pingTime(0), pingPending(false),
 #if MQTTUseAuth == 1
                authSource(0),
 #endif
-               recvState(Ready), recvBufferSize(max(callback->maxPacketSize(), 8U)), maxPacketSize(65535), available(0), recvBuffer((uint8*)::malloc(recvBufferSize)), packetExpectedVBSize(Protocol::MQTT::Common::VBInt(recvBufferSize).getSize())
+               allocator(allocator), recvState(Ready), recvBufferSize(max(callback->maxPacketSize(), 8U)), maxPacketSize(65535), available(0), packetSize(0), consumed(0), recvBuffer((uint8*)allocator.allocate(recvBufferSize)),
+#if MQTTStreamLargePublish == 1
+               packetExpectedVBSize(4), streamLeft(0) // Any packet size is accepted (larger publications are streamed)
+#else
+               packetExpectedVBSize(Protocol::MQTT::Common::VBInt(recvBufferSize).getSize())
+#endif
+#if MQTTUseOfflineQueue == 1
+               , queue(0), replayRetryTime(0), replayFailed(false)
+#endif
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+               , sessionPresent(false)
+#endif
+#if MQTTUseAutoReconnect == 1
+               , reconnect(0)
+#endif
+#if MQTTUseAsyncConnect == 1
+               , connecting(allocator)
+#endif
+#if MQTTUsePublishStream == 1
+               , publishLeft(0)
+  #if MQTTUseStatistics == 1
+               , publishStart(0)
+  #endif
+               , publishID(0), publishQoS(0), publisher(0), publishing(false), publishTracked(false)
+#endif
+#if MQTTManualAckWindow > 0
+               , manualAck(false)
+#endif
+#if MQTTReceiveBufferPool > 0
+               , spareBuffers(allocator, recvBufferSize), dispatching(0)
+#endif
+#if MQTTUseTLS == 1
+               , tls(0)
+  #if MQTTTLSSessionResumption == 1
+               , sessionStore(0)
+  #endif
+#endif
         {}
-        ~Impl() { delete0(socket); ::free(recvBuffer); recvBuffer = 0; recvBufferSize = 0; }
+        ~Impl()
+        {
+            delete0(socket);
+#if MQTTUseTLS == 1
+            delete0(tls);
+#endif
+#if MQTTUseAutoReconnect == 1
+            delete0(reconnect);
+#endif
+#if MQTTMaxInFlight > 0 && MQTTUseOfflineQueue == 1
+            for (uint16 i = 0; i < inFlight.count; i++) allocator.release(inFlight.entries[i].record, inFlight.entries[i].recordSize);
+#endif
+            allocator.release(recvBuffer, recvBufferSize); recvBuffer = 0; recvBufferSize = 0;
+        }
 
         inline void setTimeout(uint32 timeout)
         {
             timeoutMs.tv_sec = (uint32)timeout / 1024; // Avoid division here (compiler should shift the value here), the value is approximative anyway
             timeoutMs.tv_usec = ((uint32)timeout & 1023) * 977;  // Avoid modulo here and make sure it doesn't overflow (since 1023 * 977 < 1000000)
         }
+        /** Get the default timeout in milliseconds (with the same approximation as setTimeout) */
+        inline uint32 getTimeout() const { return (uint32)timeoutMs.tv_sec * 1024 + (uint32)timeoutMs.tv_usec / 977; }
 
-        bool shouldPing()
+        /** Get the delay without communication before pinging the server in milliseconds.
+            It's a percentage of the keep alive delay so we always wake up before doom's clock */
+        inline uint32 getPingInterval() const { return (uint32)keepAlive * (MQTTKeepAlivePercent * 10); }
+        /** Get the maximum time to wait for the answer to a ping request in milliseconds.
+            That's what's left of the keep alive delay, but not less than the default timeout */
+        inline uint32 getPingTimeout() const { return max((uint32)keepAlive * 1000 - getPingInterval(), getTimeout()); }
+
+        bool shouldPing() const
         {
-            return (((uint32)time(NULL) - lastCommunication) >= keepAlive);
+            return keepAlive && !pingPending && (Platform::getMonotonicTimeMs() - lastCommunication) >= getPingInterval();
         }
-
+        /** Check if the server didn't answer the last ping request in time, meaning the link is dead */
+        bool pingTimedOut() const
+        {
+            return pingPending && (Platform::getMonotonicTimeMs() - pingTime) >= getPingTimeout();
+        }
+        /** Remember that a ping request was sent */
+        void pingSent() { lastCommunication = pingTime = Platform::getMonotonicTimeMs(); pingPending = true; }
+        /** Remember that a packet was received, so the link is alive */
+        void packetReceived() { lastCommunication = Platform::getMonotonicTimeMs(); pingPending = false; }
+#if MQTTUseStatistics == 1
+        /** Account for the packet that was received (call it before packetReceived) */
+        void countReceived(const uint32 size)
+        {
+            stats.received(recvBuffer[0], size);
+            if (pingPending && (recvBuffer[0] >> 4) == Protocol::MQTT::V5::PINGRESP) stats.pingAnswered(Platform::getMonotonicTimeMs() - pingTime);
+        }
+#endif
+
+        /** Get the time in milliseconds before the keep alive requires to ping the server (or to give up waiting for its answer) */
+        uint32 timeBeforePing() const
+        {
+            if (!keepAlive) return 0x7FFFFFFF; // Never, but don't confuse it with the disconnected state
+            const uint32 elapsed = Platform::getMonotonicTimeMs() - (pingPending ? pingTime : lastCommunication);
+            const uint32 delay = pingPending ? getPingTimeout() : getPingInterval();
+            return elapsed >= delay ? 0 : delay - elapsed;
+        }
+
+        /** Wait until the given socket descriptor is readable or the delay expired.
+            This doesn't use any member so it can be called without holding the lock
+            @return 1 if the socket is readable, 0 on timeout, or negative on error */
+        static int waitReadable(const int fd, const uint32 delayMs) { return waitFor(fd, false, delayMs); }
+        /** Wait until the given socket is readable (or writable) for the given time
+            @return 1 if it's ready, 0 on timeout or a negative value on error */
+        static int waitFor(const int fd, const bool writing, const uint32 delayMs)
+        {
+            if (fd < 0) return -1;
+            struct timeval v = { (time_t)(delayMs / 1000), (suseconds_t)((delayMs % 1000) * 1000) };
+            fd_set set;
+            FD_ZERO(&set);
+            FD_SET(fd, &set);
+            return ::select(fd + 1, writing ? NULL : &set, writing ? &set : NULL, NULL, &v);
+        }
+
         bool hasValidLength() const
         {
-            Protocol::MQTT::Common::VBInt l;
-            return l.readFrom(recvBuffer + 1, available - 1) != Protocol::MQTT::Common::BadData;
+            uint32 remainingLength = 0;
+            return Protocol::MQTT::Common::decodeVBInt(recvBuffer + 1, available - 1, remainingLength) != Protocol::MQTT::Common::BadData;
         }
 
         /** Receive a control packet from the socket in the given time.
@@ -851,84 +2411,150 @@ namespace Network { namespace Client {
             //  - latency (returns as fast as possible when we've received a complete packet)
             //  - blocking time (don't return immediately if the data is currently in transfer, need to wait for it to arrive)
             //  - minimal syscalls (don't call recv byte per byte as the overhead will be significant)
-            //  - network queue (don't fetch more byte than necessary for getting a single control packet)
+            //  - bursts (many small packets are received at once, typically the retained publications upon subscribing)
             //  - streaming usage (this can be called while a control packet was being received and we timed out)
 
-            // So the algorithm used here depends on the current receiving state
-            // If we haven't received packet length yet, we have to fetch the header very carefully
-            // Else, we can enter a more general receiving loop until we have all bytes from the control packet
+            // So we read ahead as many bytes as the socket has and the buffer can hold (without waiting for them), and
+            // we only wait for the bytes we are missing for the current packet.
+            // The bytes read past the current packet are kept for the next call (@sa resetPacketReceivingState)
             int ret = 0;
-            Protocol::MQTT::Common::VBInt len;
+            uint32 remainingLength = 0;
 
+            if (recvState == GotCompletePacket) return (int)packetSize;
+            // Packets must be contiguous for parsing, so move the next one at the beginning of the buffer
+            if (consumed)
+            {
+                available -= consumed;
+                if (available) memmove(recvBuffer, &recvBuffer[consumed], available);
+                consumed = 0;
+            }
 #if MQTTLowLatency == 1
             // In low latency mode, return as early as possible
-            if (lowLatency && !socket->select(true, false, true)) return -2;
+            if (lowLatency && !hasBufferedPacket() && !socket->select(true, false, true)) return -2;
 #endif
 
-            // We want to keep track of complete timeout time over multiple operations
-            switch (recvState)
+            // Here, make sure we have the fixed header first
+            // It's parsed from the bytes already read ahead, so a small packet that arrived at once costs a single recv call
+            // The minimal size is 2 bytes for PINGRESP and shortcut DISCONNECT / AUTH.
+            uint32 r = Protocol::MQTT::Common::NotEnoughData;
+            while (r == Protocol::MQTT::Common::NotEnoughData)
             {
-            case Ready:
-            case GotType:
-            {   // Here, make sure we only fetch the length first
-                // The minimal size is 2 bytes for PINGRESP and shortcut DISCONNECT / AUTH.
-                // Because of this, we can't really outsmart the system everytime
-                ret = socket->recv((char*)&recvBuffer[available], 2 - available);
+                if (available >= 2)
+                {
+                    r = Protocol::MQTT::Common::decodeVBInt(&recvBuffer[1], available - 1, remainingLength);
+                    if (r == Protocol::MQTT::Common::BadData)
+                        return 0; // Close the socket here, the given data are wrong or not the right protocol
+                    if (r != Protocol::MQTT::Common::NotEnoughData) break;
+                    if (available >= (uint32)(packetExpectedVBSize + 1))
+                    {   // The server sends us a packet that's larger than the expected maximum size,
+                        // In MQTTv5 it's a protocol error, so let's disconnect
+                        return 0;
+                    }
+                }
+                ret = socket->recv((char*)&recvBuffer[available], available < 2 ? 2 - available : 1, recvBufferSize - available);
                 if (ret > 0) available += ret;
-                // Deal with timeout first
-                if (ret < 0 || available < 2)
-                    return (errno == EWOULDBLOCK) ? -2 : -1;
+                else
+                {   // Deal with timeout first
+                    recvState = available ? GotType : Ready;
+                    if (ret == 0) return 0; // The server closed the connection
+                    return errno == EWOULDBLOCK ? -2 : -1;
+                }
+            }
+            recvState = GotLength;
 
-                // Depending on the packet type, let's wait for more data
-                if (recvBuffer[0] < 0xD0 || recvBuffer[1]) // Below ping response or packet size larger than 2 bytes
+            uint32 totalPacketSize = remainingLength + 1 + r;
+            if (totalPacketSize > recvBufferSize)
+            {
+#if MQTTStreamLargePublish == 1
+                // A large publication is received in chunks. The first chunk fills the buffer (so it contains the
+                // complete packet header) and the remaining part is received by receiveChunk
+                if ((recvBuffer[0] >> 4) == Protocol::MQTT::V5::PUBLISH)
                 {
-                    int querySize = (packetExpectedVBSize + 1) - available;
-                    ret = socket->recv((char*)&recvBuffer[available], querySize);
-                    if (ret > 0) available += ret;
-                    // Deal with timeout first
-                    if (ret < 0) return (errno == EWOULDBLOCK) ? -2 : -1;
+                    if (available < recvBufferSize)
+                    {
+                        ret = socket->recv((char*)&recvBuffer[available], recvBufferSize - available, recvBufferSize - available);
+                        if (ret > 0) available += ret;
+                        if (ret < 0) return (errno == EWOULDBLOCK) ? -2 : -1;
+                        if (available < recvBufferSize) return -2;
+                    }
+                    recvState = GotCompletePacket;
+                    packetSize = recvBufferSize;
+                    streamLeft = totalPacketSize - recvBufferSize;
+  #if MQTTUseStatistics == 1
+                    countReceived(packetSize);
+  #endif
+  #if MQTTPacketTrace > 0
+                    trace.record(false, recvBuffer, packetSize, 0, streamLeft);
+  #endif
+                    packetReceived();
+                    return (int)packetSize;
                 }
-
-                recvState = GotLength;
-                break;
-            }
-            default: break;
+#endif
+                return 0; // Same as above, it can't fit in our buffer
             }
-            // Here we should either have a valid control packet header
-            uint32 r = len.readFrom(&recvBuffer[1], available - 1);
-            if (r == Protocol::MQTT::Common::BadData)
-                return 0; // Close the socket here, the given data are wrong or not the right protocol
-            if (r == Protocol::MQTT::Common::NotEnoughData)
+            if (available < totalPacketSize)
             {
-                if (available >= (packetExpectedVBSize+1))
-                {   // The server sends us a packet that's larger than the expected maximum size,
-                    // In MQTTv5 it's a protocol error, so let's disconnect
-                    return 0;
-                }
-                // We haven't received enough data in the given timeout to make progress, let's report a timeout
-                recvState = GotType;
-                return -2;
+                ret = socket->recv((char*)&recvBuffer[available], totalPacketSize - available, recvBufferSize - available);
+                if (ret > 0) available += ret;
+                if (ret == 0) return 0; // The server closed the connection
+                if (ret < 0) return (errno == EWOULDBLOCK) ? -2 : -1;
             }
-            uint32 remainingLength = len;
-            uint32 totalPacketSize = remainingLength + 1 + len.getSize();
-            ret = totalPacketSize == available ? 0 : socket->recv((char*)&recvBuffer[available], totalPacketSize - available);
-            if (ret > 0) available += ret;
-            if (ret < 0) return (errno == EWOULDBLOCK) ? -2 : -1;
 
             // Ok, let's check if we have received the complete packet
-            if (available == totalPacketSize)
+            if (available >= totalPacketSize)
             {
                 recvState = GotCompletePacket;
+                packetSize = totalPacketSize;
 #if MQTTDumpCommunication == 1
-                dumpBufferAsPacket("< Received packet", recvBuffer, available);
+                dumpBufferAsPacket("< Received packet", recvBuffer, packetSize);
 #endif
-                lastCommunication = (uint32)time(NULL);
-                return (int)available;
+#if MQTTUseStatistics == 1
+                countReceived(packetSize);
+#endif
+#if MQTTPacketTrace > 0
+                trace.record(false, recvBuffer, packetSize);
+#endif
+                packetReceived();
+                return (int)packetSize;
             }
             // No yet, but we probably timed-out.
             return -2;
         }
 
+        /** Check if a complete packet is already in the buffer, so it can be received without any network access */
+        bool hasBufferedPacket() const
+        {
+            if (recvState == GotCompletePacket) return true;
+            const uint32 left = available - consumed;
+            if (left < 2) return false;
+            uint32 remainingLength = 0, r = Protocol::MQTT::Common::decodeVBInt(&recvBuffer[consumed + 1], left - 1, remainingLength);
+            if (Protocol::MQTT::Common::isError(r)) return false;
+            return left >= remainingLength + 1 + r;
+        }
+
+        /** Check if a packet can be processed without waiting for the network (it's either received or decrypted already) */
+        bool hasPendingData() const { return hasBufferedPacket() || (socket && socket->hasPendingData()); }
+#if MQTTUseOfflineQueue == 1
+        /** Check if a queued publication can be sent now (it waits for room in the in-flight window, or for the retry time after a failure otherwise) */
+        bool canReplayQueue() const { return timeBeforeReplay() == 0; }
+        /** Get the time in milliseconds before the queued publications can be sent again (0x7FFFFFFF if there's nothing to send) */
+        uint32 timeBeforeReplay() const
+        {
+            if (!queue || queue->isEmpty()) return 0x7FFFFFFF;
+  #if MQTTMaxInFlight > 0
+            // Once the window is full, an acknowledgement must be received first
+            if (inFlight.isFull()) return 0x7FFFFFFF;
+  #endif
+            if (!replayFailed) return 0;
+            const int32 left = (int32)(replayRetryTime - Platform::getMonotonicTimeMs());
+            return left > 0 ? (uint32)left : 0;
+        }
+        /** Remember that replaying the queue failed (like when the storage can't be read), so the event loop doesn't spin on it */
+        void replayFailedNow() { replayFailed = true; replayRetryTime = Platform::getMonotonicTimeMs() + getTimeout(); }
+#endif
+        /** Get the socket descriptor (or -1 if not connected) */
+        int getSocketHandle() const { return socket ? socket->socket : -1; }
+
         /** Get the last received packet type */
         Protocol::MQTT::V5::ControlPacketType getLastPacketType() const
         {
@@ -969,30 +2595,372 @@ namespace Network { namespace Client {
             return (int)r;
         }
 
-        void resetPacketReceivingState() { recvState = Ready; available = 0; }
+        /** Extract a publication reply of the given type (this is a faster version of extractControlPacket for these packets) */
+        int extractReplyPacket(const Protocol::MQTT::V5::ControlPacketType type, uint16 & packetID, uint8 & reasonCode)
+        {
+            if (recvState != GotCompletePacket)
+            {
+                int ret = receiveControlPacket();
+                if (ret <= 0) return ret;
+
+                if (recvState != GotCompletePacket)
+                    return -2;
+            }
+
+            // Check the packet is the last expected type
+            if (getLastPacketType() != type) return -3;
+
+            uint32 r = Protocol::MQTT::V5::FastPath::decodeReply(recvBuffer, recvBufferSize, packetID, reasonCode);
+            if (Protocol::MQTT::Common::isError(r)) return -4; // Parsing error
+
+            // Done with receiving the packet let's remember it
+            resetPacketReceivingState();
+            return (int)r;
+        }
+
+        /** Get the packet identifier of the last received packet (only valid for packets starting with a packet identifier) */
+        uint16 getLastPacketID() const
+        {
+            if (recvState != GotCompletePacket) return 0;
+            // Skip the remaining length VBInt
+            uint32 o = 2;
+            while (o < packetSize && (recvBuffer[o - 1] & 0x80)) o++;
+            return o + 1 < packetSize ? (uint16)((recvBuffer[o] << 8) | recvBuffer[o + 1]) : 0;
+        }
+
+        /** Forget about the current packet, keeping the data read ahead for the next packet.
+            The packet is only removed from the buffer upon the next reception, since the views on it must stay valid until then */
+        void resetPacketReceivingState()
+        {
+            if (recvState == GotCompletePacket) consumed = packetSize;
+            recvState = Ready;
+            packetSize = 0;
+        }
+
+#if MQTTStreamLargePublish == 1
+        /** Check if the last received packet is a streamed publication whose payload isn't completely received */
+        bool isStreaming() const { return recvState == GotCompletePacket && streamLeft > 0; }
+
+        /** Receive the next part of a streamed publication's payload.
+            The data before the given offset in the buffer is left untouched.
+            @param offset       The offset in the buffer where to store the chunk
+            @retval positive    The number of bytes received (at most 65535 bytes)
+            @retval -1          Socket error
+            @retval -2          Timeout */
+        int receiveChunk(const uint32 offset)
+        {
+            if (!socket) return -1;
+            const uint32 size = min(min(streamLeft, recvBufferSize - offset), 65535U);
+            int ret = socket->recv((char*)&recvBuffer[offset], 1, size);
+            if (ret <= 0) return (ret < 0 && errno == EWOULDBLOCK) ? -2 : -1;
+            streamLeft -= (uint32)ret;
+  #if MQTTUseStatistics == 1
+            stats.bytesReceived += (uint32)ret;
+  #endif
+            packetReceived();
+            return ret;
+        }
+#endif
+
+        /** Drop all received data (upon connection and disconnection) */
+        void dropReceivedData()
+        {
+            recvState = Ready; available = 0; packetSize = 0; consumed = 0;
+#if MQTTStreamLargePublish == 1
+            streamLeft = 0;
+#endif
+        }
+
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+        /** Get the Receive Maximum to advertise to the broker, so it can't send more publications than we can track (0 for the default) */
+        uint16 getReceiveMaximum() const
+        {
+  #if MQTTManualAckWindow > 0
+            if (manualAck) return MQTTManualAckWindow;
+  #endif
+  #if MQTTReceivedQoS2Max > 0
+            return MQTTReceivedQoS2Max;
+  #else
+            return 0;
+  #endif
+        }
+#endif
 
         void close()
         {
+#if MQTTUseAutoReconnect == 1
+            // Schedule the next attempt if the connection (or the connection attempt) was lost
+            if (socket && reconnect && reconnect->isArmed()) reconnect->connectionLost(Platform::getMonotonicTimeMs());
+#endif
+#if MQTTUseAsyncConnect == 1
+            connecting.reset();
+#endif
             delete0(socket);
+            pingPending = false;
+            dropReceivedData();
+#if MQTTMaxInFlight > 0
+            // Report all pending publications as failed, unless they can be sent again from the offline queue once connected
+            const uint16 count = inFlight.count;
+            inFlight.count = 0;
+            for (uint16 i = 0; i < count; i++)
+            {
+                InFlightTable::Entry & entry = inFlight.entries[i];
+  #if MQTTUseOfflineQueue == 1
+                const bool queued = entry.record && queue && queue->push(entry.record, entry.recordSize, 0, 0);
+                allocator.release(entry.record, entry.recordSize);
+                entry.record = 0;
+                if (queued) continue;
+  #endif
+                cb->publishCompleted(entry.packetID, Protocol::MQTT::V5::UnspecifiedError);
+            }
+            // Same for the pending requests, with an empty reason code list
+            while (pendingRequests.count)
+            {
+                InFlightTable::Entry entry = pendingRequests.entries[--pendingRequests.count];
+                if (entry.expected == Protocol::MQTT::V5::SUBACK)
+                    cb->subscribeCompleted(entry.packetID, DynamicBinDataView(), Protocol::MQTT::V5::PropertiesView());
+                else
+                    cb->unsubscribeCompleted(entry.packetID, DynamicBinDataView(), Protocol::MQTT::V5::PropertiesView());
+            }
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+            // The broker sends the unacknowledged publications again if it resumes the session. The released ones are kept to
+            // detect the redeliveries, until we know if the session is resumed
+            inbound.dropUnacknowledged();
+#endif
+        }
+
+#if MQTTUsePublishStream == 1
+        /** Stop streaming the publication and release the lock, closing the connection if the publication is incomplete */
+        void stopPublishing(const bool abort)
+        {
+            if (abort) close();
+            publishing = false; publishLeft = 0; publisher = 0;
+            lock.release();
         }
+        /** Check if the calling task is streaming a publication. Only this task holds the lock, so it's the only one allowed to continue */
+        bool isPublisher() const { return publishing && publisher == Platform::getCurrentTaskID(); }
+#endif
 
         bool isOpen()
         {
+#if MQTTUseAsyncConnect == 1
+            // The socket isn't usable until the connection is established
+            return socket && !isConnecting();
+#else
             return socket;
+#endif
+        }
+#if MQTTUseAutoReconnect == 1 || MQTTUseAsyncConnect == 1
+        /** Check if the client isn't connected but will be without any user action (either connecting asynchronously or reconnecting) */
+        bool isAboutToConnect()
+        {
+  #if MQTTUseAsyncConnect == 1
+            if (isConnecting()) return true;
+  #endif
+  #if MQTTUseAutoReconnect == 1
+            if (!socket && reconnect && reconnect->isArmed()) return true;
+  #endif
+            return false;
         }
+#endif
 
-        int send(const char * buffer, const int size) { return socket ? socket->send(buffer, size) : -1; }
+        int send(const char * buffer, const int size)
+        {
+#if MQTTUseStatistics == 1
+            // The packet type is in the first byte, there's none for an empty buffer
+            if (size > 0) stats.sent(buffer[0], size);
+#endif
+#if MQTTPacketTrace > 0
+            trace.record(true, (const uint8*)buffer, (uint32)size);
+#endif
+            return socket ? socket->send(buffer, size) : -1;
+        }
+        int sendv(const char * header, const uint32 headerSize, const char * payload, const uint32 payloadSize)
+        {
+#if MQTTUseStatistics == 1
+            stats.sent(header[0], headerSize + payloadSize);
+#endif
+#if MQTTPacketTrace > 0
+            trace.record(true, (const uint8*)header, headerSize, (const uint8*)payload, payloadSize);
+#endif
+            return socket ? socket->sendv(header, headerSize, payload, payloadSize) : -1;
+        }
+#if MQTTUsePublishBatch == 1
+        /** Send many packets serialized back to back with a single write (they are still accounted one by one) */
+        int sendPackets(const char * buffer, const uint32 size)
+        {
+  #if MQTTUseStatistics == 1 || MQTTPacketTrace > 0
+            uint32 packetSize = 0;
+            for (uint32 o = 0; o < size; o += packetSize)
+            {
+                uint32 remainingLength = 0;
+                packetSize = 1 + Protocol::MQTT::Common::decodeVBInt((const uint8*)buffer + o + 1, size - o - 1, remainingLength) + remainingLength;
+    #if MQTTUseStatistics == 1
+                stats.sent(buffer[o], packetSize);
+    #endif
+    #if MQTTPacketTrace > 0
+                trace.record(true, (const uint8*)buffer + o, packetSize);
+    #endif
+            }
+  #endif
+            return socket ? socket->send(buffer, size) : -1;
+        }
+#endif
+#if MQTTUsePublishStream == 1
+        /** Send the next part of a packet whose header was sent already, so it's not counted as a new packet */
+        int sendPart(const char * buffer, const int size)
+        {
+  #if MQTTUseStatistics == 1
+            stats.bytesSent += size;
+  #endif
+            return socket ? socket->send(buffer, size) : -1;
+        }
+#endif
 
-        int connectWith(const char * host, const uint16 port, const bool withTLS)
+#if MQTTUseTLS == 1
+        /** Get the TLS context, creating it if required */
+        TLSContext * getTLSContext()
+        {
+            if (!tls)
+            {
+                tls = new TLSContext;
+  #if MQTTTLSSessionResumption == 1
+                if (tls) tls->store = sessionStore;
+  #endif
+  #if MQTTTLSLowMemory == 1
+                if (tls) tls->maxPacketSize = recvBufferSize;
+  #endif
+            }
+            return tls;
+        }
+#endif
+
+        /** Create the socket for a new connection */
+        BaseSocket * createSocket(const bool withTLS)
         {
-            if (isOpen()) return -1;
-            socket =
 #if MQTTUseTLS == 1
-                withTLS ? new MBTLSSocket(timeoutMs) :
+            if (withTLS) return getTLSContext() ? new MBTLSSocket(timeoutMs, *tls) : 0;
+#else
+            (void)withTLS;
+#endif
+            return new BaseSocket(timeoutMs);
+        }
+
+        /** Find the address of the given host without waiting for the DNS server (if it's a numeric address or it's cached) */
+        bool findAddress(const char * host, struct in_addr & address) const
+        {
+            if (::inet_pton(AF_INET, host, &address) == 1) return true;
+#if MQTTCacheBrokerAddress == 1
+            return addressCache.find(host, address);
+#else
+            return false;
+#endif
+        }
+        /** Remember the resolved address of the given host (if the cache is enabled) */
+        void storeAddress(const char * host, const struct in_addr & address)
+        {
+#if MQTTCacheBrokerAddress == 1
+            addressCache.store(host, address);
+#else
+            (void)host; (void)address;
+#endif
+        }
+        /** Forget the resolved address, since the broker couldn't be reached there (if the cache is enabled) */
+        void forgetAddress()
+        {
+#if MQTTCacheBrokerAddress == 1
+            addressCache.forget();
 #endif
-                new BaseSocket(timeoutMs);
-            return socket ? socket->connect(host, port, brokerCert) : -1;
         }
+        /** Get the address of the given host, resolving it if required */
+        int resolve(const char * host, struct in_addr & address)
+        {
+            if (findAddress(host, address)) return 0;
+            int ret = BaseSocket::resolve(host, address);
+            if (!ret) storeAddress(host, address);
+            return ret;
+        }
+
+        int connectWith(const char * host, const uint16 port, const bool withTLS)
+        {
+            if (isOpen()) return -1;
+            struct in_addr address;
+            if (int ret = resolve(host, address)) return ret;
+            socket = createSocket(withTLS);
+            int ret = socket ? socket->connect(host, address, port, brokerCert) : -1;
+            // The broker might have moved to another address, so resolve its name again next time
+            if (ret) forgetAddress();
+            return ret;
+        }
+
+#if MQTTUseAsyncConnect == 1
+        /** Check if an asynchronous connection is in progress */
+        bool isConnecting() const { return connecting.step != ConnectProgress::Idle; }
+
+        /** Start an asynchronous connection, the given CONNECT packet is sent once the socket is connected
+            @return false if the packet can't be serialized */
+        bool startConnection(const char * host, const uint16 port, const bool withTLS, Protocol::MQTT::V5::ControlPacketSerializable & packet)
+        {
+            connecting.reset();
+            const uint32 size = packet.computePacketSize();
+            connecting.packet = (uint8*)allocator.allocate(size);
+            if (!connecting.packet) return false;
+            connecting.packetSize = size;
+            if (packet.copyInto(connecting.packet) != size) { connecting.reset(); return false; }
+
+            connecting.host.from(host, strlen(host) + 1);
+            connecting.port = port;
+            connecting.useTLS = withTLS;
+            connecting.attempt++;
+            connecting.enter(ConnectProgress::Resolving);
+            return true;
+        }
+
+        /** Advance the asynchronous connection as far as possible without waiting for the network. The lock must be held
+            @return 0 once the server's answer to the CONNECT packet is received, a ConnectProgress::Wait value if it must wait,
+                    -7 if the current step timed out, or another negative value on error */
+        int progressConnection()
+        {
+            const uint32 timeout = getTimeout();
+            while (true)
+            {
+                int ret = 0;
+                switch (connecting.step)
+                {
+                case ConnectProgress::Idle: return -1;
+                case ConnectProgress::Resolving:
+                    if (!connecting.resolved && !findAddress(connecting.host.data, connecting.address)) return ConnectProgress::NeedResolve;
+                    socket = createSocket(connecting.useTLS);
+                    if (!socket) return -1;
+                    if ((ret = socket->open(connecting.address, connecting.port)) < 0) return ret;
+                    connecting.enter(ConnectProgress::TCPConnecting);
+                    break;
+                case ConnectProgress::TCPConnecting:
+                    if (socket->select(false, true, true) <= 0) return connecting.expired(timeout) ? -7 : ConnectProgress::WaitWrite;
+                    if ((ret = socket->connected())) return ret;
+                    connecting.enter(ConnectProgress::TLSHandshaking);
+                    break;
+                case ConnectProgress::TLSHandshaking:
+                    // This takes a while on a small CPU, but it never waits for the network
+                    if ((ret = socket->handshake(connecting.host.data, brokerCert, true)) < 0) return ret;
+                    if (ret > 0) return connecting.expired(timeout) ? -7 : ret;
+                    if ((ret = socket->setBlocking())) return ret;
+                    // The transport is ready, so send the CONNECT packet now
+                    resetPacketReceivingState();
+                    if (send((const char*)connecting.packet, connecting.packetSize) != (int)connecting.packetSize) return -1;
+                    connecting.enter(ConnectProgress::WaitingConnACK);
+                    break;
+                case ConnectProgress::WaitingConnACK:
+                    // Don't block on the socket until the answer starts arriving, it's short so it's then received at once
+                    if (!hasPendingData() && socket->select(true, false, true) <= 0) return connecting.expired(timeout) ? -7 : ConnectProgress::WaitRead;
+                    ret = receiveControlPacket();
+                    if (ret > 0) return 0;
+                    return ret == -2 ? -7 : -1;
+                }
+            }
+        }
+#endif
 
 #if MQTTUseAuth == 1
         MQTTv5::ErrorType handleAuth()
@@ -1005,20 +2973,9 @@ namespace Network { namespace Client {
                 // Try to find the auth method, and the auth data
                 DynamicStringView authMethod;
                 DynamicBinDataView authData;
-                Protocol::MQTT::V5::VisitorVariant visitor;
-                while (packet.props.getProperty(visitor) && (authMethod.length == 0 || authData.length == 0))
-                {
-                    if (visitor.propertyType() == Protocol::MQTT::V5::AuthenticationMethod)
-                    {
-                        auto view = visitor.as< DynamicStringView >();
-                        authMethod = *view;
-                    }
-                    else if (visitor.propertyType() == Protocol::MQTT::V5::AuthenticationData)
-                    {
-                        auto data = visitor.as< DynamicBinDataView >();
-                        authData = *data;
-                    }
-                }
+                Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationMethod, authMethod);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationData, authData);
                 return cb->authReceived(packet.fixedVariableHeader.reason(), authMethod, authData, packet.props) ? MQTTv5::ErrorType::Success : MQTTv5::ErrorType::NetworkError;
             }
             return ErrorType::NetworkError;
@@ -1031,11 +2988,14 @@ namespace Network { namespace Client {
             int ret = extractControlPacket(Protocol::MQTT::V5::CONNACK, packet);
             if (ret > 0)
             {
-                // We are only interested in the result of the connection
-                if (packet.fixedVariableHeader.acknowledgeFlag & 1)
-                {   // Session is present on the server. For now, we don't care, do we ?
-
-                }
+#if MQTTUseOfflineQueue == 1 || MQTTUseAutoReconnect == 1
+                // The publications and the subscriptions that were sent before are only known by the server if it kept our session
+                sessionPresent = (packet.fixedVariableHeader.acknowledgeFlag & 1) != 0;
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+                // A new session doesn't have any publication waiting for its release
+                if (!(packet.fixedVariableHeader.acknowledgeFlag & 1)) inbound.count = 0;
+#endif
                 if (packet.fixedVariableHeader.reasonCode != 0
 #if MQTTUseAuth == 1
                     && packet.fixedVariableHeader.reasonCode != Protocol::MQTT::V5::NotAuthorized
@@ -1046,50 +3006,44 @@ namespace Network { namespace Client {
                     // We have failed connection with the following reason:
                     return (MQTTv5::ReasonCodes)packet.fixedVariableHeader.reasonCode;
                 }
-                // Now, we are going to parse the other properties
+#if MQTTMaxInFlight > 0
+                // Without a Receive Maximum property, the broker accepts up to 65535 packets in flight
+                inFlight.reset();
+                pendingRequests.reset();
+#endif
+#if MQTTOutTopicAliasMax > 0
+                // Without a Topic Alias Maximum property, the broker does not accept any alias
+                outAliases.reset(0);
+#endif
+#if MQTTInTopicAliasMax > 0
+                // The broker's aliases don't survive the connection
+                inAliases.reset();
+#endif
+                // Now, we are going to parse the other properties. They are indexed in a single pass, so each lookup is O(1)
+                Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+                Protocol::MQTT::V5::LittleEndianPODVisitor<uint32> pod32;
+                Protocol::MQTT::V5::LittleEndianPODVisitor<uint16> pod16;
+                Protocol::MQTT::V5::DynamicStringView view;
+                if (index.getProperty(Protocol::MQTT::V5::PacketSizeMax, pod32))
+                    maxPacketSize = pod32.getValue();
+#if MQTTMaxInFlight > 0
+                if (index.getProperty(Protocol::MQTT::V5::ReceiveMax, pod16))
+                    inFlight.window = min((uint16)MQTTMaxInFlight, pod16.getValue());
+#endif
+#if MQTTOutTopicAliasMax > 0
+                if (index.getProperty(Protocol::MQTT::V5::TopicAliasMax, pod16))
+                    outAliases.reset(pod16.getValue());
+#endif
+                if (index.getProperty(Protocol::MQTT::V5::AssignedClientID, view))
+                    clientID.from(view.data, view.length); // This allocates memory for holding the copy
+                if (index.getProperty(Protocol::MQTT::V5::ServerKeepAlive, pod16))
+                    keepAlive = pod16.getValue(); // The ping interval is computed from it
 #if MQTTUseAuth == 1
                 DynamicStringView authMethod;
                 DynamicBinDataView authData;
+                index.getProperty(Protocol::MQTT::V5::AuthenticationMethod, authMethod);
+                index.getProperty(Protocol::MQTT::V5::AuthenticationData, authData);
 #endif
-                Protocol::MQTT::V5::VisitorVariant visitor;
-                while (packet.props.getProperty(visitor))
-                {
-                    switch (visitor.propertyType())
-                    {
-                    case Protocol::MQTT::V5::PacketSizeMax:
-                    {
-                        auto pod = visitor.as< Protocol::MQTT::V5::LittleEndianPODVisitor<uint32> >();
-                        maxPacketSize = pod->getValue();
-                        break;
-                    }
-                    case Protocol::MQTT::V5::AssignedClientID:
-                    {
-                        auto view = visitor.as< Protocol::MQTT::V5::DynamicStringView >();
-                        clientID.from(view->data, view->length); // This allocates memory for holding the copy
-                        break;
-                    }
-                    case Protocol::MQTT::V5::ServerKeepAlive:
-                    {
-                        auto pod = visitor.as< Protocol::MQTT::V5::LittleEndianPODVisitor<uint16> >();
-                        keepAlive = (pod->getValue() + (pod->getValue()>>1)) >> 1; // Use 0.75 of the server's told value
-                        break;
-                    }
-#if MQTTUseAuth == 1
-                    case Protocol::MQTT::V5::AuthenticationMethod:
-                    {
-                        auto view = visitor.as<DynamicStringView>();
-                        authMethod = *view;
-                    } break;
-                    case Protocol::MQTT::V5::AuthenticationData:
-                    {
-                        auto data = visitor.as<DynamicBinDataView>();
-                        authData = *data;
-                    } break;
-#endif
-                    // Actually, we don't care about other properties. Maybe we should ?
-                    default: break;
-                    }
-                }
 #if MQTTUseAuth == 1
                 if (packet.fixedVariableHeader.reasonCode == Protocol::MQTT::V5::NotAuthorized
                  || packet.fixedVariableHeader.reasonCode == Protocol::MQTT::V5::BadAuthenticationMethod)
@@ -1104,15 +3058,36 @@ namespace Network { namespace Client {
     };
 #endif
 
-    MQTTv5::MQTTv5(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert) : impl(new Impl(clientID, callback, brokerCert)) {}
+    MQTTv5::MQTTv5(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert, Platform::Allocator * allocator)
+        : impl(new Impl(clientID, callback, brokerCert, allocator ? *allocator : Platform::Allocator::getDefault())) {}
     MQTTv5::~MQTTv5() { delete impl; impl = 0; }
 
-    MQTTv5::ErrorType::Type MQTTv5::prepareSAR(Protocol::MQTT::V5::ControlPacketSerializable & packet, bool withAnswer)
+    MQTTv5::ErrorType::Type MQTTv5::prepareSAR(Protocol::MQTT::V5::ControlPacketSerializable & packet, bool withAnswer, bool isPublish)
     {
+        if (isPublish)
+        {   // Publications are the most frequent packets, so their header is encoded directly instead of field by field
+            typedef Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBLISH> Encoder;
+            Protocol::MQTT::V5::PublishPacket & publishPacket = (Protocol::MQTT::V5::PublishPacket&)packet;
+            const Protocol::MQTT::V5::DynString & topic = publishPacket.fixedVariableHeader.topicName;
+            const uint32 payloadSize = publishPacket.payload.size;
+            const uint32 headerSize = Encoder::getHeaderSize(topic.length, publishPacket.header.getQoS() > 0, publishPacket.props.getSize(), payloadSize);
+            // Large publish packets are sent in 2 parts to avoid allocating and copying the payload
+            const bool split = headerSize + payloadSize > StackSizeAllocationLimit;
+            const uint32 bufferSize = split ? headerSize : headerSize + payloadSize;
+            DeclareStackHeapBufferFrom(buffer, bufferSize, StackSizeAllocationLimit, impl->allocator);
+            if (!(void*)buffer || Encoder::encodeHeader(buffer, publishPacket.header.typeAndFlags, (const uint8*)topic.data, topic.length,
+                                                          publishPacket.fixedVariableHeader.packetID, publishPacket.props, payloadSize) != headerSize)
+                return ErrorType::UnknownError;
+
+            if (split) return sendRaw(buffer, headerSize, publishPacket.payload.data, payloadSize, withAnswer);
+            if (payloadSize) memcpy((uint8*)buffer + headerSize, publishPacket.payload.data, payloadSize);
+            return sendRaw(buffer, bufferSize, 0, 0, withAnswer);
+        }
+
         // Ok, setting are done, let's build this packet now
         uint32 packetSize = packet.computePacketSize();
-        DeclareStackHeapBuffer(buffer, packetSize, StackSizeAllocationLimit);
-        if (packet.copyInto(buffer) != packetSize)
+        DeclareStackHeapBufferFrom(buffer, packetSize, StackSizeAllocationLimit, impl->allocator);
+        if (!(void*)buffer || packet.copyInto(buffer) != packetSize)
             return ErrorType::UnknownError;
 
 #if MQTTDumpCommunication == 1
@@ -1120,10 +3095,20 @@ namespace Network { namespace Client {
 //      packet.dump(out, 2);
 //      printf("Prepared:\n%s\n", (const char*)out);
 #endif
+        return sendRaw(buffer, packetSize, 0, 0, withAnswer);
+    }
+
+    MQTTv5::ErrorType::Type MQTTv5::sendRaw(const uint8 * header, const uint32 headerSize, const uint8 * payload, const uint32 payloadSize, const bool withAnswer)
+    {
         // Make sure we are on a clean receiving state
         impl->resetPacketReceivingState();
 
-        if (impl->send((const char*)buffer, packetSize) != packetSize)
+        if (payloadSize)
+        {
+            if (impl->sendv((const char*)header, headerSize, (const char*)payload, payloadSize) != (int)(headerSize + payloadSize))
+                return ErrorType::NetworkError;
+        }
+        else if (impl->send((const char*)header, headerSize) != (int)headerSize)
             return ErrorType::NetworkError;
 
         if (!withAnswer) return ErrorType::Success;
@@ -1146,34 +3131,157 @@ namespace Network { namespace Client {
         if (serverHost == nullptr || !port)
             return ErrorType::BadParameter;
 
-        // Please do not move the line below as it must outlive the packet
-        Protocol::MQTT::V5::Property<uint32> maxProp(Protocol::MQTT::V5::PacketSizeMax, impl->recvBufferSize);
-        Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::CONNECT> packet;
-
         ScopedLock scope(impl->lock);
-        if (impl->isOpen()) return ErrorType::AlreadyConnected;
+        ErrorType ret = openConnection(serverHost, port, useTLS, keepAliveTimeInSec, cleanStart, userName, password, willMessage, willQoS, willRetain, properties);
+#if MQTTUseAutoReconnect == 1
+        // Remember how to connect again (the subscriptions are made again after this call)
+        if (ret == ErrorType::Success && impl->reconnect)
+            impl->reconnect->record(serverHost, port, useTLS, keepAliveTimeInSec, userName, password, willMessage, (uint8)willQoS, willRetain, properties);
+#endif
+        return ret;
+    }
 
-        // Capture properties (to avoid copying them)
-        packet.props.capture(properties);
+#if MQTTUseAsyncConnect == 1
+    MQTTv5::ErrorType MQTTv5::connectAsync(const char * serverHost, const uint16 port, bool useTLS, const uint16 keepAliveTimeInSec,
+        const bool cleanStart, const char * userName, const DynamicBinDataView * password, WillMessage * willMessage, const QoSDelivery willQoS, const bool willRetain,
+        Properties * properties)
+    {
+        if (serverHost == nullptr || !port)
+            return ErrorType::BadParameter;
 
-        // Check if we have a max packet size property and if not, append one to let the server know our limitation (if any)
-        if (impl->recvBufferSize < Protocol::MQTT::Common::VBInt::MaxPossibleSize)
+        ScopedLock scope(impl->lock);
+        ErrorType ret = openConnection(serverHost, port, useTLS, keepAliveTimeInSec, cleanStart, userName, password, willMessage, willQoS, willRetain, properties, true);
+  #if MQTTUseAutoReconnect == 1
+        // Remember how to connect again now, so a failed attempt is retried too
+        if (ret == ErrorType::InProgress && impl->reconnect)
+            impl->reconnect->record(serverHost, port, useTLS, keepAliveTimeInSec, userName, password, willMessage, (uint8)willQoS, willRetain, properties);
+  #endif
+        return ret;
+    }
+
+    bool MQTTv5::isConnecting() const
+    {
+        ScopedLock scope(impl->lock);
+        return impl->isConnecting();
+    }
+
+    MQTTv5::ErrorType MQTTv5::advanceConnection(const uint32 maxWaitMs)
+    {
+        int wait = 0, fd = -1;
+        uint32 delay = 0, attempt = 0;
+        Protocol::MQTT::V5::DynamicString host;
+        {
+            ScopedLock scope(impl->lock);
+            if (!impl->isConnecting()) return ErrorType::Success;
+            wait = impl->progressConnection();
+            if (wait <= 0) return finishConnection(wait);
+
+            if (wait == ConnectProgress::NeedResolve)
+            {
+                host = impl->connecting.host;
+                attempt = impl->connecting.attempt;
+            }
+            else
+            {
+                delay = min(maxWaitMs, impl->connecting.timeLeft(impl->getTimeout()));
+                fd = impl->getSocketHandle();
+            }
+        }
+
+        // Wait for the network without holding the lock, so the other tasks aren't blocked meanwhile.
+        // The BSD socket API can't resolve a name asynchronously, but at least the lock isn't held while waiting for the DNS server
+        struct in_addr address;
+        int ret = 0;
+        if (wait == ConnectProgress::NeedResolve) ret = BaseSocket::resolve(host.data, address);
+        else if (delay) ret = Impl::waitFor(fd, wait == ConnectProgress::WaitWrite, delay);
+
+        ScopedLock scope(impl->lock);
+        // Another task might have cancelled (or completed) the connection meanwhile
+        if (!impl->isConnecting()) return impl->isOpen() ? ErrorType::Success : ErrorType::NotConnected;
+        if (wait == ConnectProgress::NeedResolve && impl->connecting.attempt == attempt)
+        {
+            if (ret) return finishConnection(ret);
+            impl->storeAddress(host.data, address);
+            impl->connecting.address = address;
+            impl->connecting.resolved = true;
+        }
+        wait = impl->progressConnection();
+        if (wait > 0) return ErrorType::InProgress;
+        return finishConnection(wait);
+    }
+
+    MQTTv5::ErrorType MQTTv5::finishConnection(const int result)
+    {
+        const bool reconnecting = impl->connecting.reconnecting;
+        if (result < 0)
+        {
+            // The broker might have moved to another address, so resolve its name again next time
+            if (impl->connecting.resolved) impl->forgetAddress();
+            impl->close();
+        }
+        else impl->connecting.reset();
+        // Once the connection is established, the answer to the CONNECT packet is processed like a synchronous connection
+        ErrorType ret = result < 0 ? ErrorType(result == -7 ? ErrorType::TimedOut : ErrorType::NetworkError) : processConnectAnswer();
+  #if MQTTUseAutoReconnect == 1
+        ReconnectState * state = impl->reconnect;
+        if (ret != ErrorType::Success)
+        {   // The next attempt is scheduled when the socket is closed, but the attempt might have failed before opening it
+            if (state && state->isArmed() && !state->timeBeforeAttempt(Platform::getMonotonicTimeMs())) state->connectionLost(Platform::getMonotonicTimeMs());
+            return ret;
+        }
+        if (reconnecting && state) return reconnected();
+  #else
+        (void)reconnecting;
+  #endif
+        return ret;
+    }
+#endif
+
+    MQTTv5::ErrorType MQTTv5::openConnection(const char * serverHost, const uint16 port, bool useTLS, const uint16 keepAliveTimeInSec,
+        const bool cleanStart, const char * userName, const DynamicBinDataView * password, WillMessage * willMessage, const QoSDelivery willQoS, const bool willRetain,
+        Properties * properties, const bool async)
+    {
+        // Please do not move the line below as it must outlive the packet
+        Protocol::MQTT::V5::Property<uint32> maxProp(Protocol::MQTT::V5::PacketSizeMax, impl->recvBufferSize);
+#if MQTTInTopicAliasMax > 0
+        Protocol::MQTT::V5::Property<uint16> aliasMaxProp(Protocol::MQTT::V5::TopicAliasMax, MQTTInTopicAliasMax);
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+        Protocol::MQTT::V5::Property<uint16> receiveMaxProp(Protocol::MQTT::V5::ReceiveMax, impl->getReceiveMaximum());
+#endif
+        Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::CONNECT> packet;
+
+        if (impl->isOpen()) return ErrorType::AlreadyConnected;
+#if MQTTUseAsyncConnect == 1
+        if (impl->isConnecting()) return ErrorType::AlreadyConnected;
+#endif
+        // The allocator might not have been able to provide the receiving buffer
+        if (!impl->recvBuffer) return ErrorType::UnknownError;
+
+        // Capture properties (to avoid copying them)
+        packet.props.capture(properties);
+
+#if MQTTStreamLargePublish != 1
+        // Check if we have a max packet size property and if not, append one to let the server know our limitation (if any)
+        if (impl->recvBufferSize < Protocol::MQTT::Common::VBInt::MaxPossibleSize)
             packet.props.append(&maxProp); // It'll fail silently if it already exists
+#endif
+#if MQTTInTopicAliasMax > 0
+        // Let the server know it can use topic aliases
+        packet.props.append(&aliasMaxProp); // Same as above
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+        // Don't let the server send more unacknowledged publications than we can track
+        if (impl->getReceiveMaximum()) packet.props.append(&receiveMaxProp); // Same as above
+#endif
 
 #if MQTTAvoidValidation != 1
         if (!packet.props.checkPropertiesFor(Protocol::MQTT::V5::CONNECT))
             return ErrorType::BadProperties;
 #endif
 
-        // Check we can contact the server and connect to it (not initial write to the server is required here)
-        if (int ret = impl->connectWith(serverHost, port, useTLS))
-        {
-            impl->close();
-            return ret == -7 ? ErrorType::TimedOut : ErrorType::NetworkError;
-        }
-
         // Create the header object now
-        impl->keepAlive = (keepAliveTimeInSec + (keepAliveTimeInSec / 2)) / 2; // Make it 75% of what's given so we always wake up before doom's clock
+        impl->keepAlive = keepAliveTimeInSec;
         packet.fixedVariableHeader.keepAlive = keepAliveTimeInSec;
         packet.fixedVariableHeader.cleanStart = cleanStart ? 1 : 0;
         packet.fixedVariableHeader.willFlag = willMessage != nullptr ? 1 : 0;
@@ -1188,14 +3296,32 @@ namespace Network { namespace Client {
         if (userName != nullptr)    packet.payload.username = userName;
         if (password != nullptr)    packet.payload.password = *password;
 
+#if MQTTUseAsyncConnect == 1
+        // The packet is sent by the event loop once the socket is connected
+        if (async) return impl->startConnection(serverHost, port, useTLS, packet) ? ErrorType::InProgress : ErrorType::UnknownError;
+#else
+        (void)async;
+#endif
+
+        // Check we can contact the server and connect to it (not initial write to the server is required here)
+        if (int ret = impl->connectWith(serverHost, port, useTLS))
+        {
+            impl->close();
+            return ret == -7 ? ErrorType::TimedOut : ErrorType::NetworkError;
+        }
+
         // Ok, setting are done, let's build this packet now
         if (ErrorType ret = prepareSAR(packet))
         {
             impl->close();
             return ret;
         }
+        return processConnectAnswer();
+    }
 
-        // Then extract the packet type
+    MQTTv5::ErrorType MQTTv5::processConnectAnswer()
+    {
+        // Extract the packet type
         Protocol::MQTT::V5::ControlPacketType type = impl->getLastPacketType();
         if (type == Protocol::MQTT::V5::CONNACK)
         {
@@ -1321,12 +3447,34 @@ namespace Network { namespace Client {
     }
 
     MQTTv5::ErrorType MQTTv5::subscribe(SubscribeTopic & topics, Properties * properties)
+    {
+        return sendSubscribe(topics, properties, 0);
+    }
+
+#if MQTTMaxInFlight > 0
+    MQTTv5::ErrorType MQTTv5::subscribeAsync(SubscribeTopic & topics, Properties * properties, uint16 * packetIdentifier)
+    {
+        uint16 packetID = 0;
+        ErrorType ret = sendSubscribe(topics, properties, &packetID);
+        if (packetIdentifier) *packetIdentifier = packetID;
+        return ret;
+    }
+#endif
+
+    // Build and send a subscribe packet
+    MQTTv5::ErrorType MQTTv5::sendSubscribe(SubscribeTopic & topics, Properties * properties, uint16 * requestIdentifier)
     {
         ScopedLock scope(impl->lock);
         if (!impl->isOpen()) return ErrorType::NotConnected;
         // If we are interrupting while receiving a packet, let's stop before make any more damage
         if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
             return ErrorType::TranscientPacket;
+#if MQTTMaxInFlight > 0
+        if (requestIdentifier && impl->pendingRequests.isFull())
+            return ErrorType::OutOfWindow;
+#else
+        (void)requestIdentifier;
+#endif
 
         Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::SUBSCRIBE> packet;
         // Capture properties (to avoid copying them)
@@ -1341,43 +3489,78 @@ namespace Network { namespace Client {
         packet.fixedVariableHeader.packetID = impl->allocatePacketID();
         packet.payload.topics = &topics;
 
+#if MQTTMaxInFlight > 0
+        if (requestIdentifier)
+        {   // Don't wait for the answer, it'll be processed in the event loop
+            if (ErrorType ret = prepareSAR(packet, false))
+                return ret;
+  #if MQTTUseAutoReconnect == 1
+            if (impl->reconnect) impl->reconnect->subscribe(topics, packet.props);
+  #endif
+            impl->pendingRequests.add(packet.fixedVariableHeader.packetID, Protocol::MQTT::V5::SUBACK);
+            *requestIdentifier = packet.fixedVariableHeader.packetID;
+            return ErrorType::Success;
+        }
+#endif
+
         // Then send the packet
         if (ErrorType ret = prepareSAR(packet))
             return ret;
+#if MQTTUseAutoReconnect == 1
+        // The subscription is recorded once sent, whatever the broker answers
+        if (impl->reconnect) impl->reconnect->subscribe(topics, packet.props);
+#endif
 
-        // Then extract the packet type
-        Protocol::MQTT::V5::ControlPacketType type = impl->getLastPacketType();
-        if (type == Protocol::MQTT::V5::SUBACK)
-        {
-            Protocol::MQTT::V5::ROSubACKPacket rpacket;
-            int ret = impl->extractControlPacket(type, rpacket);
-            if (ret <= 0) return ErrorType::TranscientPacket;
-
-            if (rpacket.fixedVariableHeader.packetID != packet.fixedVariableHeader.packetID)
-                return ErrorType::TranscientPacket;
+        // Process any packet received before our acknowledgement
+        if (ErrorType ret = waitForReply(Protocol::MQTT::V5::SUBACK, packet.fixedVariableHeader.packetID))
+            return ret;
 
-            // Then check reason codes
-            SubscribeTopic * topic = packet.payload.topics;
-            uint32 count = topic->count();
-            if (!rpacket.payload.data || rpacket.payload.size < count)
-                return ReasonCodes::ProtocolError;
-            for (uint32 i = 0; i < count; i++)
-                if (rpacket.payload.data[i] >= ReasonCodes::UnspecifiedError)
-                    return (ReasonCodes)rpacket.payload.data[i];
+        // Then extract the packet
+        Protocol::MQTT::V5::ROSubACKPacket rpacket;
+        int ret = impl->extractControlPacket(Protocol::MQTT::V5::SUBACK, rpacket);
+        if (ret <= 0) return ErrorType::TranscientPacket;
 
-            return ErrorType::Success;
-        }
+        // Then check reason codes
+        SubscribeTopic * topic = packet.payload.topics;
+        uint32 count = topic->count();
+        if (!rpacket.payload.data || rpacket.payload.size < count)
+            return ReasonCodes::ProtocolError;
+        for (uint32 i = 0; i < count; i++)
+            if (rpacket.payload.data[i] >= ReasonCodes::UnspecifiedError)
+                return (ReasonCodes)rpacket.payload.data[i];
 
-        return MQTTv5::ErrorType::NetworkError;
+        return ErrorType::Success;
     }
 
     MQTTv5::ErrorType MQTTv5::unsubscribe(UnsubscribeTopic & topics, Properties * properties)
+    {
+        return sendUnsubscribe(topics, properties, 0);
+    }
+
+#if MQTTMaxInFlight > 0
+    MQTTv5::ErrorType MQTTv5::unsubscribeAsync(UnsubscribeTopic & topics, Properties * properties, uint16 * packetIdentifier)
+    {
+        uint16 packetID = 0;
+        ErrorType ret = sendUnsubscribe(topics, properties, &packetID);
+        if (packetIdentifier) *packetIdentifier = packetID;
+        return ret;
+    }
+#endif
+
+    // Build and send an unsubscribe packet
+    MQTTv5::ErrorType MQTTv5::sendUnsubscribe(UnsubscribeTopic & topics, Properties * properties, uint16 * requestIdentifier)
     {
         ScopedLock scope(impl->lock);
         if (!impl->isOpen()) return ErrorType::NotConnected;
         // If we are interrupting while receiving a packet, let's stop before make any more damage
         if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
             return ErrorType::TranscientPacket;
+#if MQTTMaxInFlight > 0
+        if (requestIdentifier && impl->pendingRequests.isFull())
+            return ErrorType::OutOfWindow;
+#else
+        (void)requestIdentifier;
+#endif
 
         Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::UNSUBSCRIBE> packet;
         // Capture properties (to avoid copying them)
@@ -1392,36 +3575,77 @@ namespace Network { namespace Client {
         packet.fixedVariableHeader.packetID = impl->allocatePacketID();
         packet.payload.topics = &topics;
 
+#if MQTTMaxInFlight > 0
+        if (requestIdentifier)
+        {   // Don't wait for the answer, it'll be processed in the event loop
+            if (ErrorType ret = prepareSAR(packet, false))
+                return ret;
+  #if MQTTUseAutoReconnect == 1
+            if (impl->reconnect) impl->reconnect->unsubscribe(topics);
+  #endif
+            impl->pendingRequests.add(packet.fixedVariableHeader.packetID, Protocol::MQTT::V5::UNSUBACK);
+            *requestIdentifier = packet.fixedVariableHeader.packetID;
+            return ErrorType::Success;
+        }
+#endif
+
         // Then send the packet
         if (ErrorType ret = prepareSAR(packet))
             return ret;
+#if MQTTUseAutoReconnect == 1
+        // The unsubscription is recorded once sent, whatever the broker answers
+        if (impl->reconnect) impl->reconnect->unsubscribe(topics);
+#endif
 
-        // Then extract the packet type
-        Protocol::MQTT::V5::ControlPacketType type = impl->getLastPacketType();
-        if (type == Protocol::MQTT::V5::UNSUBACK)
-        {
-            Protocol::MQTT::V5::ROUnsubACKPacket rpacket;
-            int ret = impl->extractControlPacket(type, rpacket);
-            if (ret <= 0) return ErrorType::TranscientPacket;
-
-            if (rpacket.fixedVariableHeader.packetID != packet.fixedVariableHeader.packetID)
-                return ErrorType::TranscientPacket;
+        // Process any packet received before our acknowledgement
+        if (ErrorType ret = waitForReply(Protocol::MQTT::V5::UNSUBACK, packet.fixedVariableHeader.packetID))
+            return ret;
 
-            // Then check reason codes
-            UnsubscribeTopic * topic = packet.payload.topics;
-            uint32 count = topic->count();
-            if (!rpacket.payload.data || rpacket.payload.size < count)
-                return ReasonCodes::ProtocolError;
-            for (uint32 i = 0; i < count; i++)
-                if (rpacket.payload.data[i] >= ReasonCodes::UnspecifiedError)
-                    return (ReasonCodes)rpacket.payload.data[i];
+        // Then extract the packet
+        Protocol::MQTT::V5::ROUnsubACKPacket rpacket;
+        int ret = impl->extractControlPacket(Protocol::MQTT::V5::UNSUBACK, rpacket);
+        if (ret <= 0) return ErrorType::TranscientPacket;
 
-            return ErrorType::Success;
-        }
+        // Then check reason codes
+        UnsubscribeTopic * topic = packet.payload.topics;
+        uint32 count = topic->count();
+        if (!rpacket.payload.data || rpacket.payload.size < count)
+            return ReasonCodes::ProtocolError;
+        for (uint32 i = 0; i < count; i++)
+            if (rpacket.payload.data[i] >= ReasonCodes::UnspecifiedError)
+                return (ReasonCodes)rpacket.payload.data[i];
 
-        return MQTTv5::ErrorType::NetworkError;
+        return ErrorType::Success;
     }
 
+    // Wait for an acknowledgement
+    MQTTv5::ErrorType MQTTv5::waitForReply(const Protocol::MQTT::V5::ControlPacketType type, const uint16 packetID)
+    {
+        while (true)
+        {
+            Protocol::MQTT::V5::ControlPacketType last = impl->getLastPacketType();
+            if (last == type && impl->getLastPacketID() == packetID) return ErrorType::Success;
+            if (last != Protocol::MQTT::V5::RESERVED)
+            {   // Broker can send us any packet before the acknowledgement (typically, the retained publications for a subscription)
+                // Processing errors for these packets don't concern our request, only a connection loss does
+                ErrorType ret = dispatchPacket(last);
+                if (!impl->isOpen()) return ErrorType::NotConnected;
+                if (ret && impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
+                {   // Unless the packet couldn't be processed (like a malformed packet), we'd spin on it forever
+                    impl->resetPacketReceivingState();
+                    return ret;
+                }
+            }
+            if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED) continue;
+
+            int ret = impl->receiveControlPacket();
+            if (ret <= 0)
+            {
+                if (ret == 0) impl->close();
+                return ret == -2 ? ErrorType::TimedOut : ErrorType::NetworkError;
+            }
+        }
+    }
 
     // Enter publish cycle
     MQTTv5::ErrorType MQTTv5::enterPublishCycle(Protocol::MQTT::V5::ControlPacketSerializableImpl & publishPacket, bool sending)
@@ -1430,9 +3654,26 @@ namespace Network { namespace Client {
         uint8 QoS = ((Protocol::MQTT::V5::FixedHeaderType<Protocol::MQTT::V5::PUBLISH, 0>&)publishPacket.header).getQoS();
         uint16 packetID = ((Protocol::MQTT::V5::FixedField<Protocol::MQTT::V5::PUBLISH> &)publishPacket.fixedVariableHeader).packetID;
 
-        static Protocol::MQTT::V5::ControlPacketType nexts[3] = { Protocol::MQTT::V5::RESERVED, Protocol::MQTT::V5::PUBACK, Protocol::MQTT::V5::PUBREC };
-        Protocol::MQTT::V5::ControlPacketType next = nexts[QoS];
+        if (sending)
+        {
+#if MQTTUseStatistics == 1
+            const uint32 start = Platform::getMonotonicTimeMs();
+#endif
+            if (ErrorType ret = prepareSAR(publishPacket, QoS != 0, true))
+                return ret;
+            // Receive packet so we are at the same position in the state machine in runPublishCycle
+#if MQTTUseStatistics == 1
+            ErrorType ret = runPublishCycle(QoS, packetID, sending);
+            if (QoS && ret == ErrorType::Success) impl->stats.published(Platform::getMonotonicTimeMs() - start);
+            return ret;
+#endif
+        }
+        return runPublishCycle(QoS, packetID, sending);
+    }
 
+    MQTTv5::ErrorType MQTTv5::runPublishCycle(const uint8 QoS, const uint16 packetID, bool sending)
+    {
+        static Protocol::MQTT::V5::ControlPacketType nexts[3] = { Protocol::MQTT::V5::RESERVED, Protocol::MQTT::V5::PUBACK, Protocol::MQTT::V5::PUBREC };
         /* The state machine is like this:
                     SEND                         RECV
                    [ PUB ] => Send
@@ -1450,29 +3691,41 @@ namespace Network { namespace Client {
                             |
                            Stop
         */
-
-        if (sending)
-        {
-            if (ErrorType ret = prepareSAR(publishPacket, next != Protocol::MQTT::V5::RESERVED))
-                return ret;
-            // Receive packet so we are at the same position in the state machine above
-        }
+        Protocol::MQTT::V5::ControlPacketType next = nexts[QoS];
 
         while (next != Protocol::MQTT::V5::RESERVED)
         {
             if (sending)
             {   // Skip this if received a Publish packet since it's not the same format
-                Protocol::MQTT::V5::PublishReplyPacket reply(next);
-
                 Protocol::MQTT::V5::ControlPacketType type = impl->getLastPacketType();
+#if MQTTMaxInFlight > 0
+                // Acknowledgements for asynchronous publications and requests can be received while waiting for ours
+                while (((type == Protocol::MQTT::V5::PUBACK || type == Protocol::MQTT::V5::PUBREC || type == Protocol::MQTT::V5::PUBCOMP)
+                        && impl->getLastPacketID() != packetID)
+                       || ((type == Protocol::MQTT::V5::SUBACK || type == Protocol::MQTT::V5::UNSUBACK) && impl->pendingRequests.find(impl->getLastPacketID())))
+                {
+                    bool isRequest = type == Protocol::MQTT::V5::SUBACK || type == Protocol::MQTT::V5::UNSUBACK;
+                    if (ErrorType ret = isRequest ? handleRequestReply(type) : handleInFlightReply(type))
+                        return ret;
+
+                    int ret = impl->receiveControlPacket();
+                    if (ret <= 0)
+                    {
+                        if (ret == 0) impl->close();
+                        return ret == -2 ? ErrorType::TimedOut : ErrorType::NetworkError;
+                    }
+                    type = impl->getLastPacketType();
+                }
+#endif
                 if (type != next) return Protocol::MQTT::V5::ProtocolError;
 
-                int ret = impl->extractControlPacket(next, reply);
+                uint16 replyID = 0; uint8 reasonCode = 0;
+                int ret = impl->extractReplyPacket(next, replyID, reasonCode);
                 if (ret == -3) return ErrorType::TranscientPacket;
                 if (ret <= 0) return ErrorType::NetworkError;
 
                 // Ensure it's matching the packet ID
-                if (reply.fixedVariableHeader.packetID != packetID)
+                if (replyID != packetID)
                     // Could be a protocol error, but this will be checked in the next call to eventLoop
                     return ErrorType::TranscientPacket;
 
@@ -1483,27 +3736,127 @@ namespace Network { namespace Client {
             } else sending = true;
 
             // Check if we need to send something
-            Protocol::MQTT::V5::PublishReplyPacket answer(next);
-            answer.fixedVariableHeader.packetID = packetID;
+            uint8 answer[Protocol::MQTT::V5::FastPath::ReplyEncoder<Protocol::MQTT::V5::PUBACK>::MaxSize];
+            uint32 answerSize = Protocol::MQTT::V5::FastPath::encodeReply(next, answer, packetID);
             next = Protocol::MQTT::Common::Helper::getNextPacketType(next);
-            if (ErrorType err = prepareSAR(answer, next != Protocol::MQTT::V5::RESERVED))
+#if MQTTUseClientPool == 1 && MQTTOnlyBSDSocket == 1
+            // Serviced from the pool, so don't wait for the PUBREL here, it's answered when it's dispatched (@sa handleRelease)
+            if (impl->socket->noWait) return sendRaw(answer, answerSize, 0, 0, false);
+#endif
+            if (ErrorType err = sendRaw(answer, answerSize, 0, 0, next != Protocol::MQTT::V5::RESERVED))
                 return err;
         }
         return ErrorType::Success;
     }
 
-    // Publish to a topic.
-    MQTTv5::ErrorType MQTTv5::publish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS, const uint16 packetIdentifier, Properties * properties)
+#if MQTTMaxInFlight > 0
+    // Handle a reply packet for an asynchronous publication
+    MQTTv5::ErrorType MQTTv5::handleInFlightReply(const Protocol::MQTT::V5::ControlPacketType type)
+    {
+        uint16 packetID = 0; uint8 reasonCode = 0;
+        int ret = impl->extractReplyPacket(type, packetID, reasonCode);
+        if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
+        if (ret < 0) return ErrorType::NetworkError;
+
+        InFlightTable::Entry * entry = impl->inFlight.find(packetID);
+        // Unknown packet identifier or unexpected reply, we should not answer this (as per 4.3.3)
+        if (!entry || entry->expected != (uint8)type) return ErrorType::Success;
+
+        ReasonCodes reason = (ReasonCodes)reasonCode;
+#if MQTTUseOfflineQueue == 1
+        // The broker received the publication, so it must not be sent again if the connection is lost
+        impl->allocator.release(entry->record, entry->recordSize);
+        entry->record = 0;
+#endif
+        if (type == Protocol::MQTT::V5::PUBREC && reason < ReasonCodes::UnspecifiedError)
+        {   // Need to release the packet now, the cycle will complete upon PUBCOMP
+            uint8 answer[Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBREL>::MaxSize];
+            entry->expected = Protocol::MQTT::V5::PUBCOMP;
+            return sendRaw(answer, Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBREL>::encode(answer, packetID), 0, 0, false);
+        }
+        // Done with this publication
+        impl->inFlight.remove(entry);
+        impl->cb->publishCompleted(packetID, reason);
+        return ErrorType::Success;
+    }
+
+    // Handle a reply packet for an asynchronous request
+    MQTTv5::ErrorType MQTTv5::handleRequestReply(const Protocol::MQTT::V5::ControlPacketType type)
+    {
+        InFlightTable::Entry * entry = impl->pendingRequests.find(impl->getLastPacketID());
+        // Unknown packet identifier or unexpected reply, let's ignore it
+        if (!entry || entry->expected != (uint8)type)
+        {
+            impl->resetPacketReceivingState();
+            return ErrorType::Success;
+        }
+        uint16 packetID = entry->packetID;
+
+        if (type == Protocol::MQTT::V5::SUBACK)
+        {
+            Protocol::MQTT::V5::ROSubACKPacket reply;
+            int ret = impl->extractControlPacket(type, reply);
+            if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
+            if (ret < 0) return ErrorType::NetworkError;
+
+            impl->pendingRequests.remove(entry);
+            impl->cb->subscribeCompleted(packetID, DynamicBinDataView(reply.payload.size, reply.payload.data), reply.props);
+        }
+        else
+        {
+            Protocol::MQTT::V5::ROUnsubACKPacket reply;
+            int ret = impl->extractControlPacket(type, reply);
+            if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
+            if (ret < 0) return ErrorType::NetworkError;
+
+            impl->pendingRequests.remove(entry);
+            impl->cb->unsubscribeCompleted(packetID, DynamicBinDataView(reply.payload.size, reply.payload.data), reply.props);
+        }
+        return ErrorType::Success;
+    }
+#endif
+
+    // Build and send a publish packet
+    MQTTv5::ErrorType MQTTv5::sendPublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                          const uint16 packetIdentifier, Properties * properties, uint16 * inFlightIdentifier)
     {
         if (topic == nullptr)
             return ErrorType::BadParameter;
 
         ScopedLock scope(impl->lock);
+#if MQTTUseOfflineQueue == 1
+        // Only the QoS publications without properties are queued
+        const bool queueable = impl->queue && QoS != QoSDelivery::AtMostOne && (!properties || !properties->head);
+        // Keep the publications order while the queue isn't drained
+        if (queueable && (!impl->isOpen() || !impl->queue->isEmpty()))
+        {
+            if (inFlightIdentifier) *inFlightIdentifier = 0;
+            return queuePublish(topic, payload, payloadLength, retain, QoS, 0, false);
+        }
+
+        ErrorType ret = emitPublish(topic, payload, payloadLength, retain, QoS, packetIdentifier, properties, inFlightIdentifier, false);
+        // If the connection was lost while waiting for the acknowledgement, the broker might have received the publication
+        // so it's queued as a duplicate with the same packet identifier
+        if (queueable && !inFlightIdentifier && (ret == ErrorType::NetworkError || ret == ErrorType::NotConnected))
+            return queuePublish(topic, payload, payloadLength, retain, QoS, packetIdentifier ? packetIdentifier : impl->publishCurrentId, true);
+        return ret;
+#else
+        return emitPublish(topic, payload, payloadLength, retain, QoS, packetIdentifier, properties, inFlightIdentifier, false);
+#endif
+    }
+
+    MQTTv5::ErrorType MQTTv5::emitPublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                          const uint16 packetIdentifier, Properties * properties, uint16 * inFlightIdentifier, const bool duplicate)
+    {
         if (!impl->isOpen()) return ErrorType::NotConnected;
         // If we are interrupting while receiving a packet, let's stop before make any more damage
         if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
             return ErrorType::TranscientPacket;
 
+#if MQTTOutTopicAliasMax > 0
+        // Please do not move the line below as it must outlive the packet
+        Protocol::MQTT::V5::Property<uint16> aliasProp(Protocol::MQTT::V5::TopicAlias, 0);
+#endif
         Protocol::MQTT::V5::PublishPacket packet;
         // Capture properties (to avoid copying them)
         packet.props.capture(properties);
@@ -1515,66 +3868,1202 @@ namespace Network { namespace Client {
 
         // Create header now
         bool withAnswer = QoS != QoSDelivery::AtMostOne;
+#if MQTTMaxInFlight > 0
+        if (withAnswer && inFlightIdentifier && impl->inFlight.isFull())
+            return ErrorType::OutOfWindow;
+#else
+        (void)inFlightIdentifier;
+#endif
         packet.header.setRetain(retain);
         packet.header.setQoS((uint8)QoS);
-        packet.header.setDup(false); // At first, it's not a duplicate message
-        packet.fixedVariableHeader.packetID = withAnswer ? impl->allocatePacketID() : 0; // Only if QoS is not 0
+        packet.header.setDup(duplicate); // At first, it's not a duplicate message
+#if MQTTUseStatistics == 1
+        if (duplicate) impl->stats.retransmits++;
+#endif
+        packet.fixedVariableHeader.packetID = withAnswer ? (packetIdentifier ? packetIdentifier : impl->allocatePacketID()) : 0; // Only if QoS is not 0
         packet.fixedVariableHeader.topicName = topic;
+#if MQTTOutTopicAliasMax > 0
+        // Use a topic alias unless the application already set one
+        if (!packet.props.getProperty(Protocol::MQTT::V5::TopicAlias))
+        {
+            bool known = false;
+            if (uint16 alias = impl->outAliases.getAlias(topic, (uint16)strlen(topic), known))
+            {
+                aliasProp.value = alias;
+                packet.props.append(&aliasProp);
+                // The broker knows this alias, so don't send the topic name anymore
+                if (known) packet.fixedVariableHeader.topicName = "";
+            }
+        }
+#endif
         packet.payload.setExpectedPacketSize(payloadLength);
         packet.payload.readFrom(payload, payloadLength);
 
-        return enterPublishCycle(packet, true);
-    }
-
-    // The client event loop you must call regularly.
-    MQTTv5::ErrorType MQTTv5::eventLoop()
-    {
-        ScopedLock scope(impl->lock);
-        if (!impl->isOpen()) return ErrorType::NotConnected;
-
-        // Check if we have a packet ready for reading now
-        Protocol::MQTT::Common::ControlPacketType type = impl->getLastPacketType();
-        if (type == Protocol::MQTT::V5::RESERVED)
-        {
-            // Check if we need to ping the server
-            if (impl->shouldPing())
+#if MQTTMaxInFlight > 0
+        if (withAnswer && inFlightIdentifier)
+        {   // Asynchronous mode, don't wait for the answer, it'll be processed in the event loop
+  #if MQTTUseOfflineQueue == 1
+            // Keep a copy of a queueable publication, so it's queued again if the connection is lost before the broker receives it
+            uint8 * record = 0;
+            const uint16 topicLength = (uint16)strlen(topic) + 1;
+            const uint32 recordSize = sizeof(QueuedPublication) + topicLength + payloadLength;
+            if (impl->queue && (!properties || !properties->head))
             {
-                // Create a Ping request packet and send it
-                Protocol::MQTT::V5::PingReqPacket packet;
-                if (ErrorType ret = prepareSAR(packet, false))
-                    return ret;
+                record = (uint8*)impl->allocator.allocate(recordSize);
+                if (!record) return ErrorType::UnknownError;
+                const uint8 flags = (uint8)QoS | (retain ? QueuedPublication::Retain : 0) | QueuedPublication::Duplicate;
+                uint32 headSize = QueuedPublication::writeHead(record, flags, packet.fixedVariableHeader.packetID, topic, topicLength, payloadLength);
+                if (payloadLength) memcpy(record + headSize, payload, payloadLength);
             }
-            // Check the server for any packet...
-            int ret = impl->receiveControlPacket(true);
-            if (ret == 0)
+            if (ErrorType ret = prepareSAR(packet, false, true))
             {
-                impl->close();
-                return ErrorType::NotConnected;
+                impl->allocator.release(record, recordSize);
+                return ret;
             }
-            // No answer in time, it's not an error here
-            if (ret == -2) return ErrorType::Success;
-            if (ret < 0)   return ErrorType::NetworkError;
-            // Ok, now we have a packet read it
-            type = impl->getLastPacketType();
+  #else
+            if (ErrorType ret = prepareSAR(packet, false, true))
+                return ret;
+  #endif
+
+            *inFlightIdentifier = packet.fixedVariableHeader.packetID;
+            impl->inFlight.add(*inFlightIdentifier, QoS == QoSDelivery::AtLeastOne ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC);
+  #if MQTTUseOfflineQueue == 1
+            InFlightTable::Entry * entry = impl->inFlight.find(*inFlightIdentifier);
+            entry->record = record;
+            entry->recordSize = record ? recordSize : 0;
+  #endif
+            return ErrorType::Success;
         }
+#endif
+        return enterPublishCycle(packet, true);
+    }
 
+#if MQTTUseOfflineQueue == 1
+    MQTTv5::ErrorType MQTTv5::queuePublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                           const uint16 packetIdentifier, const bool duplicate)
+    {
+        const uint16 topicLength = (uint16)strlen(topic) + 1;
+        const uint32 headSize = sizeof(QueuedPublication) + topicLength;
+        DeclareStackHeapBufferFrom(head, headSize, StackSizeAllocationLimit, impl->allocator);
+        if (!(void*)head) return ErrorType::UnknownError;
+
+        const uint8 flags = (uint8)QoS | (retain ? QueuedPublication::Retain : 0) | (duplicate ? QueuedPublication::Duplicate : 0);
+        QueuedPublication::writeHead(head, flags, packetIdentifier, topic, topicLength, payloadLength);
+        return impl->queue->push(head, headSize, payload, payloadLength) ? ErrorType::Success : ErrorType::OutOfWindow;
+    }
 
+    MQTTv5::ErrorType MQTTv5::replayQueuedPublication()
+    {
+        const uint32 size = impl->queue->frontSize();
+        DeclareStackHeapBufferFrom(buffer, size, StackSizeAllocationLimit, impl->allocator);
+        QueuedPublication pub;
+        if (!(void*)buffer || size < sizeof(pub) || !impl->queue->front(buffer, size))
+            return ErrorType::UnknownError;
 
-        switch (type)
-        {
-        case Protocol::MQTT::V5::PINGRESP: break; // We ignore ping response
-        case Protocol::MQTT::V5::DISCONNECT: impl->close(); return ErrorType::NotConnected; // No work to perform upon server sending disconnect
-        case Protocol::MQTT::V5::PUBLISH:
-        {
-            Protocol::MQTT::V5::ROPublishPacket packet;
-            int ret = impl->extractControlPacket(type, packet);
-            if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
-            if (ret < 0) return ErrorType::NetworkError;
-            impl->cb->messageReceived(packet.fixedVariableHeader.topicName, DynamicBinDataView(packet.payload.size, packet.payload.data), packet.fixedVariableHeader.packetID, packet.props);
-            return enterPublishCycle(packet, false);
+        memcpy(&pub, buffer, sizeof(pub));
+        const char * topic = (const char*)buffer + sizeof(pub);
+        if (!pub.topicLength || size != sizeof(pub) + pub.topicLength + pub.payloadLength || topic[pub.topicLength - 1])
+        {   // Corrupted record, drop it
+            impl->queue->pop();
+            return ErrorType::BadParameter;
         }
-#if MQTTUseAuth == 1
-        case Protocol::MQTT::V5::AUTH:
+
+        // The server only remembers the packet identifier if it resumed our session
+        const bool duplicate = (pub.flags & QueuedPublication::Duplicate) && impl->sessionPresent;
+#if MQTTMaxInFlight > 0
+        uint16 packetID = 0;
+        uint16 * inFlightIdentifier = &packetID;
+#else
+        uint16 * inFlightIdentifier = 0;
+#endif
+        const bool retain = (pub.flags & QueuedPublication::Retain) != 0;
+        const QoSDelivery QoS = (QoSDelivery)(pub.flags & QueuedPublication::QoSMask);
+        const uint8 * payload = (const uint8*)topic + pub.topicLength;
+        const uint16 lastID = impl->publishCurrentId;
+        ErrorType ret = emitPublish(topic, payload, pub.payloadLength, retain, QoS, duplicate ? pub.packetID : 0, 0, inFlightIdentifier, duplicate);
+        // Only done once acknowledged (or once in flight, the in-flight table takes care of it then)
+        if (ret == ErrorType::Success)
+        {
+            impl->queue->pop();
+            return ret;
+        }
+        // Nothing was sent (like when the window is full or the packet couldn't be allocated), so it's retried later as is
+        const uint16 sentID = duplicate ? pub.packetID : (impl->publishCurrentId != lastID ? impl->publishCurrentId : 0);
+        if (!sentID || ret == ErrorType::UnknownError) return ret;
+        // Else, it might have reached the broker without being acknowledged. A publication can only be sent again upon reconnection, so
+        // the connection is closed and it's queued again as a duplicate with this identifier (the broker won't deliver it twice if it resumes
+        // the session). It's only moved to the end of the queue if its identifier changed
+        const bool recorded = (pub.flags & QueuedPublication::Duplicate) && pub.packetID == sentID;
+        if (!recorded && queuePublish(topic, payload, pub.payloadLength, retain, QoS, sentID, true) == ErrorType::Success)
+            impl->queue->pop();
+        impl->close();
+        return ErrorType::NotConnected;
+    }
+
+    void MQTTv5::setOfflineQueue(QueueStorage * storage)
+    {
+        ScopedLock scope(impl->lock);
+        impl->queue = storage;
+    }
+#endif
+
+    // Publish to a topic.
+    MQTTv5::ErrorType MQTTv5::publish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS, const uint16 packetIdentifier, Properties * properties)
+    {
+        return sendPublish(topic, payload, payloadLength, retain, QoS, packetIdentifier, properties, 0);
+    }
+
+    MQTTv5::ErrorType MQTTv5::preparePublish(PreparedPublish & prepared, const char * topic, const bool retain, const QoSDelivery QoS, Properties * properties)
+    {
+        if (!topic || !*topic || (uint8)QoS > 2) return ErrorType::BadParameter;
+        prepared.clear();
+
+        Protocol::MQTT::V5::PublishPacket packet;
+        // Capture properties (to avoid copying them)
+        packet.props.capture(properties);
+#if MQTTAvoidValidation != 1
+        if (!packet.props.checkPropertiesFor(Protocol::MQTT::V5::PUBLISH))
+            return ErrorType::BadProperties;
+#endif
+        packet.header.setRetain(retain);
+        packet.header.setQoS((uint8)QoS);
+        packet.fixedVariableHeader.packetID = 0; // Patched for each publication
+        packet.fixedVariableHeader.topicName = topic;
+        packet.payload.setExpectedPacketSize(0);
+
+        // Serialize the header so it ends at the same position than the final packet header, whatever the remaining length's size
+        const uint32 headerSize = packet.computePacketSize();
+        const uint32 variableSize = (uint32)packet.remLength;
+        uint8 * buffer = (uint8*)impl->allocator.allocate(PreparedPublish::HeaderRoom + variableSize);
+        if (!buffer) return ErrorType::UnknownError;
+        if (packet.copyHeaderInto(buffer + PreparedPublish::HeaderRoom + variableSize - headerSize) != headerSize)
+        {
+            impl->allocator.release(buffer, PreparedPublish::HeaderRoom + variableSize);
+            return ErrorType::UnknownError;
+        }
+
+        prepared.buffer = buffer;
+        prepared.variableSize = variableSize;
+        prepared.packetIDPos = QoS != QoSDelivery::AtMostOne ? PreparedPublish::HeaderRoom + packet.fixedVariableHeader.topicName.getSize() : 0;
+        prepared.typeAndFlags = packet.header.typeAndFlags;
+        prepared.allocator = &impl->allocator;
+        return ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTv5::sendPrepared(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength, uint16 * inFlightIdentifier)
+    {
+        if (!prepared.isValid() || prepared.allocator != &impl->allocator || (payloadLength && !payload)) return ErrorType::BadParameter;
+
+        ScopedLock scope(impl->lock);
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+#if MQTTUseOfflineQueue == 1
+        // Don't overtake the queued publications
+        if (impl->queue && !impl->queue->isEmpty()) return ErrorType::OutOfWindow;
+#endif
+        // If we are interrupting while receiving a packet, let's stop before make any more damage
+        if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
+            return ErrorType::TranscientPacket;
+
+        const uint8 QoS = (uint8)prepared.getQoS();
+#if MQTTMaxInFlight > 0
+        if (QoS && inFlightIdentifier && impl->inFlight.isFull())
+            return ErrorType::OutOfWindow;
+#else
+        (void)inFlightIdentifier;
+#endif
+        // Patch the packet identifier and the remaining length
+        const uint16 packetID = QoS ? impl->allocatePacketID() : 0;
+        if (QoS)
+        {
+            prepared.buffer[prepared.packetIDPos] = (uint8)(packetID >> 8);
+            prepared.buffer[prepared.packetIDPos + 1] = (uint8)packetID;
+        }
+        Protocol::MQTT::Common::VBInt remLength(prepared.variableSize + payloadLength);
+        if (!remLength.checkImpl()) return ErrorType::BadParameter;
+        uint8 * header = prepared.buffer + PreparedPublish::HeaderRoom - 1 - remLength.getSize();
+        header[0] = prepared.typeAndFlags;
+        remLength.copyInto(header + 1);
+        const uint32 headerSize = (uint32)(prepared.buffer + PreparedPublish::HeaderRoom + prepared.variableSize - header);
+
+#if MQTTMaxInFlight > 0
+        if (QoS && inFlightIdentifier)
+        {   // Asynchronous mode, don't wait for the answer, it'll be processed in the event loop
+            if (ErrorType ret = sendRaw(header, headerSize, payload, payloadLength, false))
+                return ret;
+
+            *inFlightIdentifier = packetID;
+            impl->inFlight.add(packetID, QoS == 1 ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC);
+            return ErrorType::Success;
+        }
+#endif
+        if (ErrorType ret = sendRaw(header, headerSize, payload, payloadLength, QoS != 0))
+            return ret;
+        return runPublishCycle(QoS, packetID, true);
+    }
+
+    MQTTv5::ErrorType MQTTv5::publish(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength)
+    {
+        return sendPrepared(prepared, payload, payloadLength, 0);
+    }
+
+#if MQTTMaxInFlight > 0
+    // Publish to a topic without waiting for the acknowledgement
+    MQTTv5::ErrorType MQTTv5::publishAsync(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS, Properties * properties, uint16 * packetIdentifier)
+    {
+        uint16 packetID = 0;
+        ErrorType ret = sendPublish(topic, payload, payloadLength, retain, QoS, 0, properties, &packetID);
+        if (packetIdentifier) *packetIdentifier = packetID;
+        return ret;
+    }
+
+    MQTTv5::ErrorType MQTTv5::publishAsync(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength, uint16 * packetIdentifier)
+    {
+        uint16 packetID = 0;
+        ErrorType ret = sendPrepared(prepared, payload, payloadLength, &packetID);
+        if (packetIdentifier) *packetIdentifier = packetID;
+        return ret;
+    }
+#endif
+
+#if MQTTUsePublishStream == 1
+    MQTTv5::ErrorType MQTTv5::sendPublishHeader(const char * topic, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                                Properties * properties, const bool tracked)
+    {
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+  #if MQTTUseOfflineQueue == 1
+        // Don't overtake the queued publications
+        if (impl->queue && !impl->queue->isEmpty()) return ErrorType::OutOfWindow;
+  #endif
+        // If we are interrupting while receiving a packet, let's stop before make any more damage
+        if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
+            return ErrorType::TranscientPacket;
+
+        Protocol::MQTT::V5::PublishPacket packet;
+        // Capture properties (to avoid copying them)
+        packet.props.capture(properties);
+  #if MQTTAvoidValidation != 1
+        if (!packet.props.checkPropertiesFor(Protocol::MQTT::V5::PUBLISH))
+            return ErrorType::BadProperties;
+  #endif
+        const bool withID = QoS != QoSDelivery::AtMostOne;
+  #if MQTTMaxInFlight > 0
+        if (withID && tracked && impl->inFlight.isFull())
+            return ErrorType::OutOfWindow;
+  #endif
+        // The whole packet must be describable by its remaining length, even if it's never in memory
+        const uint32 topicLength = (uint32)strlen(topic);
+        const uint32 propertiesSize = packet.props.getSize();
+        if (topicLength > 65535 || payloadLength > Protocol::MQTT::Common::VBInt::MaxPossibleSize - (4 + topicLength + propertiesSize))
+            return ErrorType::BadParameter;
+
+        packet.header.setRetain(retain);
+        packet.header.setQoS((uint8)QoS);
+        const uint16 packetID = withID ? impl->allocatePacketID() : 0;
+
+        // Only the header is serialized, the payload is written directly to the socket afterwards
+        typedef Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBLISH> Encoder;
+        const uint32 headerSize = Encoder::getHeaderSize(topicLength, withID, propertiesSize, payloadLength);
+        DeclareStackHeapBufferFrom(buffer, headerSize, StackSizeAllocationLimit, impl->allocator);
+        if (!(void*)buffer || Encoder::encodeHeader(buffer, packet.header.typeAndFlags, (const uint8*)topic, (uint16)topicLength,
+                                                      packetID, packet.props, payloadLength) != headerSize)
+            return ErrorType::UnknownError;
+
+        if (ErrorType ret = sendRaw(buffer, headerSize, 0, 0, false))
+            return ret;
+
+        impl->publishLeft = payloadLength;
+        impl->publishID = packetID;
+        impl->publishQoS = (uint8)QoS;
+  #if MQTTMaxInFlight > 0
+        impl->publishTracked = withID && tracked;
+  #else
+        impl->publishTracked = false;
+  #endif
+        impl->publisher = Platform::getCurrentTaskID();
+        impl->publishing = true;
+        return ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTv5::beginPublish(const char * topic, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                           Properties * properties, uint16 * packetIdentifier)
+    {
+        if (!topic || !*topic || (uint8)QoS > 2) return ErrorType::BadParameter;
+        impl->lock.acquire();
+  #if MQTTUseStatistics == 1
+        impl->publishStart = Platform::getMonotonicTimeMs();
+  #endif
+        ErrorType ret = sendPublishHeader(topic, payloadLength, retain, QoS, properties, packetIdentifier != 0);
+        if (ret != ErrorType::Success)
+        {   // A partially sent header can't be recovered
+            impl->stopPublishing(ret == ErrorType::NetworkError);
+            return ret;
+        }
+        if (packetIdentifier) *packetIdentifier = impl->publishTracked ? impl->publishID : 0;
+        // The lock is kept until endPublish
+        return ret;
+    }
+
+    MQTTv5::ErrorType MQTTv5::writePublish(const uint8 * chunk, const uint32 length)
+    {
+        // The lock is held by beginPublish until the publication is done
+        if (!impl->isPublisher()) return ErrorType::BadParameter;
+        if ((length && !chunk) || length > impl->publishLeft)
+        {
+            impl->stopPublishing(true);
+            return ErrorType::BadParameter;
+        }
+        if (!length) return ErrorType::Success;
+
+        if (impl->sendPart((const char*)chunk, (int)length) != (int)length)
+        {
+            impl->stopPublishing(true);
+            return ErrorType::NetworkError;
+        }
+        impl->publishLeft -= length;
+        return ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTv5::endPublish()
+    {
+        if (!impl->isPublisher()) return ErrorType::BadParameter;
+        if (impl->publishLeft)
+        {   // The server would wait for the missing payload forever
+            impl->stopPublishing(true);
+            return ErrorType::BadParameter;
+        }
+
+        const uint8 QoS = impl->publishQoS;
+        const uint16 packetID = impl->publishID;
+  #if MQTTMaxInFlight > 0
+        if (impl->publishTracked)
+        {   // Asynchronous mode, the acknowledgement is processed in the event loop
+            impl->inFlight.add(packetID, QoS == 1 ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC);
+            impl->stopPublishing(false);
+            return ErrorType::Success;
+        }
+  #endif
+        if (!QoS)
+        {
+            impl->stopPublishing(false);
+            return ErrorType::Success;
+        }
+        // Receive the first acknowledgement like sendRaw does, so we are at the expected position in runPublishCycle's state machine
+        int receivedPacketSize = impl->receiveControlPacket();
+        if (receivedPacketSize <= 0)
+        {
+            if (receivedPacketSize == 0) impl->close();
+            impl->stopPublishing(false);
+            return receivedPacketSize == -2 ? ErrorType::TimedOut : ErrorType::NetworkError;
+        }
+        ErrorType ret = runPublishCycle(QoS, packetID, true);
+  #if MQTTUseStatistics == 1
+        if (ret == ErrorType::Success) impl->stats.published(Platform::getMonotonicTimeMs() - impl->publishStart);
+  #endif
+        impl->stopPublishing(false);
+        return ret;
+    }
+#endif
+
+#if MQTTInTopicAliasMax > 0
+    MQTTv5::ErrorType MQTTv5::resolveTopicAlias(Protocol::MQTT::V5::ROPublishPacket & packet, const Protocol::MQTT::V5::PropertiesIndex & index)
+    {
+        Protocol::MQTT::V5::LittleEndianPODVisitor<uint16> pod;
+        if (index.getProperty(Protocol::MQTT::V5::TopicAlias, pod) && !impl->inAliases.resolve(packet.fixedVariableHeader.topicName, pod.getValue()))
+        {   // This is a protocol error, so we must close the connection (section 3.3.2.3.4)
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::DISCONNECT> answer;
+            answer.fixedVariableHeader.reasonCode = ReasonCodes::TopicAliasInvalid;
+            prepareSAR(answer, false);
+            impl->close();
+            return ReasonCodes::TopicAliasInvalid;
+        }
+        return ErrorType::Success;
+    }
+#endif
+
+    MQTTv5::ErrorType MQTTv5::dispatchPublish(Protocol::MQTT::V5::ROPublishPacket & packet)
+    {
+#if MQTTInTopicAliasMax > 0 || MQTTUseTopicRouter == 1
+        // The properties are parsed once for both the topic alias and the subscription identifiers
+        Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+#endif
+#if MQTTInTopicAliasMax > 0
+        if (ErrorType err = resolveTopicAlias(packet, index))
+            return err;
+#endif
+        DynamicStringView & topic = packet.fixedVariableHeader.topicName;
+        DynamicBinDataView payload(packet.payload.size, packet.payload.data);
+#if MQTTReceiveBufferPool > 0
+        // Let the callback take this publication (@sa takeMessage)
+        impl->dispatching = &packet;
+#endif
+#if MQTTUseTopicRouter == 1
+        if (!impl->router.dispatch(topic, payload, packet.fixedVariableHeader.packetID, packet.props, index))
+#endif
+            impl->cb->messageReceived(topic, payload, packet.fixedVariableHeader.packetID, packet.props);
+#if MQTTReceiveBufferPool > 0
+        impl->dispatching = 0;
+#endif
+        return ErrorType::Success;
+    }
+
+#if MQTTReceiveBufferPool > 0
+    bool MQTTv5::takeMessage(ReceivedMessage & message)
+    {
+        // Only the publication being dispatched can be taken, and only once
+        Protocol::MQTT::V5::ROPublishPacket * packet = impl->dispatching;
+        if (!packet || message.isValid()) return false;
+        uint8 * spare = impl->spareBuffers.take();
+        if (!spare) return false;
+
+        // The publication is at the beginning of the buffer, followed by the data read ahead
+        uint8 * buffer = impl->recvBuffer;
+        const uint32 used = impl->consumed;
+        DynamicStringView topic = packet->fixedVariableHeader.topicName;
+        const bool inBuffer = (const uint8*)topic.data >= buffer && (const uint8*)topic.data < buffer + used;
+        if (!inBuffer && topic.length > impl->recvBufferSize - used)
+        {
+            impl->spareBuffers.give(spare);
+            return false;
+        }
+        // Continue receiving in the spare buffer
+        impl->available -= used;
+        if (impl->available) memcpy(spare, buffer + used, impl->available);
+        impl->consumed = 0;
+        impl->recvBuffer = spare;
+        if (!inBuffer)
+        {   // The topic name was resolved from an alias, so copy it after the publication, since the alias can be reassigned meanwhile
+            memcpy(buffer + used, topic.data, topic.length);
+            topic.data = (const char*)buffer + used;
+        }
+
+        message.topic = topic;
+        message.payload = DynamicBinDataView(packet->payload.size, packet->payload.data);
+        message.properties.length = packet->props.length;
+        message.properties.buffer = packet->props.buffer;
+        message.packetIdentifier = packet->fixedVariableHeader.packetID;
+        message.buffer = buffer;
+        message.owner = this;
+        impl->dispatching = 0;
+        return true;
+    }
+
+    void MQTTv5::ReceivedMessage::release()
+    {
+        if (buffer) owner->impl->spareBuffers.give(buffer);
+        buffer = 0; owner = 0;
+        topic = DynamicStringView(); payload = DynamicBinDataView(); properties.length = 0U; properties.buffer = 0; packetIdentifier = 0;
+    }
+#endif
+
+#if MQTTStreamLargePublish == 1
+    MQTTv5::ErrorType MQTTv5::dispatchStreamedPublish()
+    {
+        // Only the beginning of the packet is in the buffer, so parse its header only (the payload starts after it)
+        Protocol::MQTT::V5::ROPublishPacket packet;
+        uint32 headerSize = packet.readHeaderFrom(impl->recvBuffer, impl->packetSize);
+        if (Protocol::MQTT::Common::isError(headerSize))
+        {   // The buffer is too small for the topic name and the properties, we can't process this packet
+            impl->close();
+            return ErrorType::NotConnected;
+        }
+#if MQTTInTopicAliasMax > 0
+        if (ErrorType err = resolveTopicAlias(packet, Protocol::MQTT::V5::PropertiesIndex(packet.props)))
+            return err;
+#endif
+
+#if MQTTReceivedQoS2Max > 0
+        // The broker sent it again since it didn't get our PUBREC, but the application already got it, so only drain it
+        const bool duplicate = packet.header.getQoS() == 2 && impl->inbound.find(packet.fixedVariableHeader.packetID);
+#else
+        const bool duplicate = false;
+#endif
+
+        const uint32 totalLength = impl->packetSize - headerSize + impl->streamLeft;
+        const uint8 * chunk = impl->recvBuffer + headerSize;
+        uint32 chunkSize = impl->packetSize - headerSize;
+        uint32 offset = 0;
+        while (true)
+        {
+            while (chunkSize)
+            {   // A view is limited to 65535 bytes
+                const uint16 size = (uint16)min(chunkSize, 65535U);
+                if (!duplicate) impl->cb->messageChunkReceived(packet.fixedVariableHeader.topicName, DynamicBinDataView(size, chunk), offset, totalLength,
+                                               packet.fixedVariableHeader.packetID, packet.props);
+                offset += size; chunk += size; chunkSize -= size;
+            }
+            if (offset == totalLength) break;
+
+            // Receive the next chunk after the packet header, so the topic name and properties views remain valid
+            int ret = impl->receiveChunk(headerSize);
+            if (ret <= 0)
+            {   // We can't resume in the middle of a packet
+                impl->close();
+                return ret == -2 ? ErrorType::TimedOut : ErrorType::NetworkError;
+            }
+            chunk = impl->recvBuffer + headerSize;
+            chunkSize = (uint32)ret;
+        }
+        // The packet was received up to its last byte, so there was nothing read ahead
+        impl->dropReceivedData();
+#if MQTTReceivedQoS2Max > 0
+        if (duplicate) return sendPublishReply(Protocol::MQTT::V5::PUBREC, packet.fixedVariableHeader.packetID, 0);
+        // Don't wait for the PUBREL if there's room to remember this publication
+        if (packet.header.getQoS() == 2 && impl->inbound.add(packet.fixedVariableHeader.packetID, Protocol::MQTT::V5::PUBCOMP))
+            return sendPublishReply(Protocol::MQTT::V5::PUBREC, packet.fixedVariableHeader.packetID, 0);
+#endif
+        return enterPublishCycle(packet, false);
+    }
+#endif
+
+#if MQTTUsePublishBatch == 1
+    MQTTv5::ErrorType MQTTv5::publishBatch(BatchPublication * publications, const uint32 count)
+    {
+        if (!publications || !count) return ErrorType::BadParameter;
+
+        ScopedLock scope(impl->lock);
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+  #if MQTTUseOfflineQueue == 1
+        // Don't overtake the queued publications
+        if (impl->queue && !impl->queue->isEmpty()) return ErrorType::OutOfWindow;
+  #endif
+        // If we are interrupting while receiving a packet, let's stop before make any more damage
+        if (impl->getLastPacketType() != Protocol::MQTT::V5::RESERVED)
+            return ErrorType::TranscientPacket;
+
+        // First pass to validate the publications and compute the batch size
+        typedef Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBLISH> Encoder;
+        Protocol::MQTT::V5::Properties noProps;
+        uint32 size = 0, withAnswer = 0;
+        for (uint32 i = 0; i < count; i++)
+        {
+            const BatchPublication & pub = publications[i];
+            if (!pub.topic || !*pub.topic || (uint8)pub.QoS > 2 || (pub.payloadLength && !pub.payload)) return ErrorType::BadParameter;
+            const uint32 topicLength = (uint32)strlen(pub.topic);
+            if (topicLength > 65535 || pub.payloadLength > Protocol::MQTT::Common::VBInt::MaxPossibleSize - (4 + topicLength + noProps.getSize()))
+                return ErrorType::BadParameter;
+            const uint32 packetSize = Encoder::getHeaderSize(topicLength, pub.QoS != QoSDelivery::AtMostOne, noProps.getSize(), pub.payloadLength) + pub.payloadLength;
+            if (packetSize > (uint32)~0 - size) return ErrorType::BadParameter;
+            size += packetSize;
+            withAnswer += pub.QoS != QoSDelivery::AtMostOne;
+        }
+  #if MQTTMaxInFlight > 0
+        if (impl->inFlight.count + withAnswer > impl->inFlight.window) return ErrorType::OutOfWindow;
+  #else
+        if (withAnswer) return ErrorType::BadParameter;
+  #endif
+
+        // Then serialize the whole batch
+        DeclareStackHeapBufferFrom(buffer, size, StackSizeAllocationLimit, impl->allocator);
+        if (!(void*)buffer) return ErrorType::UnknownError;
+        uint8 * packet = buffer;
+        for (uint32 i = 0; i < count; i++)
+        {
+            BatchPublication & pub = publications[i];
+            const uint16 packetID = pub.QoS != QoSDelivery::AtMostOne ? impl->allocatePacketID() : 0;
+            const uint8 typeAndFlags = (uint8)((Protocol::MQTT::V5::PUBLISH << 4) | ((uint8)pub.QoS << 1) | (pub.retain ? 1 : 0));
+            packet += Encoder::encodeHeader(packet, typeAndFlags, (const uint8*)pub.topic, (uint16)strlen(pub.topic), packetID, noProps, pub.payloadLength);
+            if (pub.payloadLength) memcpy(packet, pub.payload, pub.payloadLength);
+            packet += pub.payloadLength;
+            pub.packetIdentifier = packetID;
+  #if MQTTMaxInFlight > 0
+            // Registered now so the next allocated identifiers don't collide with it
+            if (packetID) impl->inFlight.add(packetID, pub.QoS == QoSDelivery::AtLeastOne ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC);
+  #endif
+        }
+
+        // Make sure we are on a clean receiving state
+        impl->resetPacketReceivingState();
+        if (impl->sendPackets((const char*)(uint8*)buffer, size) != (int)size)
+        {
+  #if MQTTMaxInFlight > 0
+            for (uint32 i = 0; i < count; i++)
+                if (InFlightTable::Entry * entry = publications[i].packetIdentifier ? impl->inFlight.find(publications[i].packetIdentifier) : 0)
+                    impl->inFlight.remove(entry);
+  #endif
+            return ErrorType::NetworkError;
+        }
+        return ErrorType::Success;
+    }
+#endif
+
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0 || MQTTUseClientPool == 1
+    MQTTv5::ErrorType MQTTv5::sendPublishReply(const Protocol::MQTT::V5::ControlPacketType type, const uint16 packetID, const uint8 reasonCode)
+    {
+        // Not using sendRaw here, since a packet might be partially received when called from another task
+        uint8 answer[Protocol::MQTT::V5::FastPath::ReplyEncoder<Protocol::MQTT::V5::PUBACK>::MaxSize];
+        uint32 answerSize = Protocol::MQTT::V5::FastPath::encodeReply(type, answer, packetID, reasonCode);
+        if (impl->send((const char*)answer, answerSize) != (int)answerSize)
+            return ErrorType::NetworkError;
+        return ErrorType::Success;
+    }
+#endif
+
+#if MQTTManualAckWindow > 0
+    MQTTv5::ErrorType MQTTv5::holdPublish(Protocol::MQTT::V5::ROPublishPacket & packet)
+    {
+        const uint16 packetID = packet.fixedVariableHeader.packetID;
+        if (InboundTable::Entry * entry = impl->inbound.find(packetID))
+        {   // The broker sent it again, but the application already got it. Only repeat the PUBREC if we've sent it already
+            if (entry->next == Protocol::MQTT::V5::PUBCOMP) return sendPublishReply(Protocol::MQTT::V5::PUBREC, packetID, 0);
+            return ErrorType::Success;
+        }
+        if (!impl->inbound.add(packetID, packet.header.getQoS() == 1 ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC))
+            return refuseInbound();
+        return dispatchPublish(packet);
+    }
+#endif
+
+#if MQTTReceivedQoS2Max > 0
+    MQTTv5::ErrorType MQTTv5::receiveQoS2Publish(Protocol::MQTT::V5::ROPublishPacket & packet)
+    {
+        const uint16 packetID = packet.fixedVariableHeader.packetID;
+        // The broker sent it again since it didn't get our PUBREC, but the application already got it
+        if (impl->inbound.find(packetID)) return sendPublishReply(Protocol::MQTT::V5::PUBREC, packetID, 0);
+        if (impl->inbound.isFull()) return refuseInbound();
+
+        if (ErrorType err = dispatchPublish(packet))
+            return err;
+        // The PUBREL is handled by the event loop when it's received
+        impl->inbound.add(packetID, Protocol::MQTT::V5::PUBCOMP);
+        return sendPublishReply(Protocol::MQTT::V5::PUBREC, packetID, 0);
+    }
+#endif
+
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+    MQTTv5::ErrorType MQTTv5::refuseInbound()
+    {
+        // The broker ignored our Receive Maximum, this is a protocol error (section 3.3.4)
+        Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::DISCONNECT> answer;
+        answer.fixedVariableHeader.reasonCode = ReasonCodes::ReceiveMaximumExceeded;
+        prepareSAR(answer, false);
+        impl->close();
+        return ReasonCodes::ReceiveMaximumExceeded;
+    }
+#endif
+
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0 || MQTTUseClientPool == 1
+    MQTTv5::ErrorType MQTTv5::handleRelease()
+    {
+        uint16 packetID = 0; uint8 reasonCode = 0;
+        int ret = impl->extractReplyPacket(Protocol::MQTT::V5::PUBREL, packetID, reasonCode);
+        if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
+        if (ret < 0) return ErrorType::NetworkError;
+
+  #if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+        InboundTable::Entry * entry = impl->inbound.find(packetID);
+        // The application didn't acknowledge the publication yet, so the broker can't release it
+        if (entry && entry->next != Protocol::MQTT::V5::PUBCOMP) return ErrorType::Success;
+        if (entry) impl->inbound.remove(entry);
+        // Answer even if unknown (like after a reconnection), so the broker can forget about it
+        return sendPublishReply(Protocol::MQTT::V5::PUBCOMP, packetID, entry ? 0 : (uint8)ReasonCodes::PacketIdentifierNotFound);
+  #else
+        // Without a table, this is the release of a publication the pool received without waiting for it (@sa runPublishCycle)
+        return sendPublishReply(Protocol::MQTT::V5::PUBCOMP, packetID, 0);
+  #endif
+    }
+#endif
+
+#if MQTTManualAckWindow > 0
+    MQTTv5::ErrorType MQTTv5::setManualAck(const bool enable)
+    {
+        ScopedLock scope(impl->lock);
+        // The Receive Maximum is only advertised in the CONNECT packet
+        if (impl->isOpen()) return ErrorType::AlreadyConnected;
+  #if MQTTUseAsyncConnect == 1
+        if (impl->isConnecting()) return ErrorType::AlreadyConnected;
+  #endif
+        impl->manualAck = enable;
+        return ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTv5::ack(const uint16 packetIdentifier, const ReasonCodes reasonCode)
+    {
+        ScopedLock scope(impl->lock);
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+        InboundTable::Entry * entry = impl->inbound.find(packetIdentifier);
+        if (!entry || entry->next == Protocol::MQTT::V5::PUBCOMP) return ErrorType::BadParameter;
+
+        const Protocol::MQTT::V5::ControlPacketType type = (Protocol::MQTT::V5::ControlPacketType)entry->next;
+        // A QoS 2 publication is only done upon PUBREL, unless it's refused
+        if (type == Protocol::MQTT::V5::PUBREC && reasonCode < ReasonCodes::UnspecifiedError) entry->next = Protocol::MQTT::V5::PUBCOMP;
+        else impl->inbound.remove(entry);
+        return sendPublishReply(type, packetIdentifier, (uint8)reasonCode);
+    }
+#endif
+
+#if MQTTUseTopicRouter == 1
+    MQTTv5::ErrorType MQTTv5::addRoute(const char * topicFilter, SubscriptionHandler * handler, const uint32 subscriptionID)
+    {
+        ScopedLock scope(impl->lock);
+        return impl->router.add(topicFilter, handler, subscriptionID) ? ErrorType::Success : ErrorType::BadParameter;
+    }
+
+    MQTTv5::ErrorType MQTTv5::removeRoute(const char * topicFilter, SubscriptionHandler * handler, const uint32 subscriptionID)
+    {
+        ScopedLock scope(impl->lock);
+        return impl->router.remove(topicFilter, handler, subscriptionID) ? ErrorType::Success : ErrorType::BadParameter;
+    }
+#endif
+
+    int MQTTv5::getSocketHandle() const
+    {
+        ScopedLock scope(impl->lock);
+        return impl->getSocketHandle();
+    }
+
+    uint32 MQTTv5::getNextDeadline() const
+    {
+        ScopedLock scope(impl->lock);
+#if MQTTUseAsyncConnect == 1
+        // The event loop waits for the connection progress by itself
+        if (impl->isConnecting()) return 0;
+#endif
+#if MQTTUseAutoReconnect == 1
+        if (!impl->isOpen() && impl->reconnect && impl->reconnect->isArmed())
+            return impl->reconnect->timeBeforeAttempt(Platform::getMonotonicTimeMs());
+#endif
+        if (!impl->isOpen()) return (uint32)-1;
+#if MQTTUseOfflineQueue == 1
+        // The event loop sends the queued publications (typically after a reconnection), unless it failed to and waits to retry
+        if (impl->hasPendingData()) return 0;
+        return min(impl->timeBeforeReplay(), impl->timeBeforePing());
+#else
+        return impl->hasPendingData() ? 0 : impl->timeBeforePing();
+#endif
+    }
+
+#if MQTTUseStatistics == 1
+    void MQTTv5::getStats(Stats & stats) const
+    {
+        ScopedLock scope(impl->lock);
+        stats = impl->stats;
+  #if MQTTOnlyBSDSocket == 1 && !defined(MQTTLock)
+        // The lock counters are kept by the lock itself
+        stats.lockContentions = impl->lock.contentions;
+        stats.lockWaitMs = impl->lock.waitMs;
+  #endif
+    }
+
+    void MQTTv5::resetStats()
+    {
+        ScopedLock scope(impl->lock);
+        impl->stats.reset();
+  #if MQTTOnlyBSDSocket == 1 && !defined(MQTTLock)
+        impl->lock.contentions = impl->lock.waitMs = 0;
+  #endif
+    }
+#endif
+
+#if MQTTPacketTrace > 0
+    uint32 MQTTv5::getTrace(TraceEntry * entries, const uint32 count) const
+    {
+        ScopedLock scope(impl->lock);
+        return impl->trace.copy(entries, count);
+    }
+
+    void MQTTv5::dumpTrace() const
+    {
+        // Copy the entries first, so the lock isn't held while printing. This is usually called upon an error, so don't use the heap
+        // unless the ring is larger than the stack allocation limit
+        DeclareStackHeapBufferFrom(buffer, sizeof(TraceEntry) * MQTTPacketTrace, StackSizeAllocationLimit, impl->allocator);
+        if (!(void*)buffer) return;
+        TraceEntry * entries = buffer;
+        const uint32 count = getTrace(entries, MQTTPacketTrace);
+        for (uint32 i = 0; i < count; i++)
+        {
+            const TraceEntry & entry = entries[i];
+            printf("%10u %c %-11s id:%-5u len:%-6u ", (unsigned)entry.timeMs, entry.sent ? '>' : '<',
+                   Protocol::MQTT::V5::Helper::getControlPacketName((Protocol::MQTT::Common::ControlPacketType)(entry.typeAndFlags >> 4)),
+                   (unsigned)entry.packetID, (unsigned)entry.length);
+            for (uint32 j = 0; j < entry.getCapturedSize(); j++) printf("%02X", entry.data[j]);
+            printf("\n");
+        }
+    }
+
+    void MQTTv5::clearTrace()
+    {
+        ScopedLock scope(impl->lock);
+        impl->trace.recorded = 0;
+    }
+#endif
+
+    MQTTv5::ErrorType MQTTv5::waitForActivity(const uint32 maxWaitMs)
+    {
+        uint32 delay = 0; int fd = -1;
+        {
+            ScopedLock scope(impl->lock);
+            if (impl->isOpen())
+            {
+                // Some data might be ready without any network access
+                if (impl->hasPendingData()) return ErrorType::Success;
+#if MQTTUseOfflineQueue == 1
+                // The event loop sends the queued publications (typically after a reconnection)
+                if (impl->canReplayQueue()) return ErrorType::Success;
+                delay = min(impl->timeBeforeReplay(), impl->timeBeforePing());
+#else
+                delay = impl->timeBeforePing();
+#endif
+                fd = impl->getSocketHandle();
+            }
+#if MQTTUseAsyncConnect == 1
+            // The event loop waits for the connection progress by itself
+            else if (impl->isConnecting()) return ErrorType::Success;
+#endif
+#if MQTTUseAutoReconnect == 1
+            // The event loop connects again once the next attempt is due, so wait for it
+            else if (impl->reconnect && impl->reconnect->isArmed())
+                delay = impl->reconnect->timeBeforeAttempt(Platform::getMonotonicTimeMs());
+#endif
+            else return ErrorType::NotConnected;
+        }
+        // Wait without holding the lock, so other tasks can publish meanwhile
+        const bool deadline = delay <= maxWaitMs;
+#if MQTTUseAutoReconnect == 1
+        if (fd < 0)
+        {
+            if (delay) sleepMs(deadline ? delay : maxWaitMs);
+            return deadline ? ErrorType::Success : ErrorType::TimedOut;
+        }
+#endif
+        int ret = delay ? Impl::waitReadable(fd, deadline ? delay : maxWaitMs) : 0;
+        if (ret < 0) return ErrorType::NetworkError;
+        return ret > 0 || deadline ? ErrorType::Success : ErrorType::TimedOut;
+    }
+
+#if MQTTUseAutoReconnect == 1
+    void MQTTv5::setAutoReconnect(const uint32 minDelayMs, const uint32 maxDelayMs)
+    {
+        ScopedLock scope(impl->lock);
+        delete0(impl->reconnect);
+        // Seed the jitter differently for each client, so they don't reconnect in lockstep
+        if (minDelayMs) impl->reconnect = new ReconnectState(minDelayMs, maxDelayMs, Platform::getMonotonicTimeMs() ^ (uint32)(size_t)this);
+    }
+
+    MQTTv5::ErrorType MQTTv5::reconnectIfRequired(const uint32 maxWaitMs)
+    {
+        uint32 delay = 0;
+        {
+            ScopedLock scope(impl->lock);
+            if (impl->isOpen() || !impl->reconnect || !impl->reconnect->isArmed()) return ErrorType::Success;
+  #if MQTTUseAsyncConnect == 1
+            // The event loop is already connecting
+            if (impl->isConnecting()) return ErrorType::Success;
+  #endif
+            delay = impl->reconnect->timeBeforeAttempt(Platform::getMonotonicTimeMs());
+        }
+        // Wait for the next attempt without holding the lock, so the other tasks can publish (in the offline queue) meanwhile
+        if (delay && maxWaitMs) sleepMs(min(delay, maxWaitMs));
+        if (delay > maxWaitMs) return ErrorType::NotConnected;
+
+        ScopedLock scope(impl->lock);
+        ReconnectState * state = impl->reconnect;
+        // Another task might have connected (or disabled the automatic reconnection) while we were waiting
+        if (impl->isOpen() || !state || !state->isArmed()) return ErrorType::Success;
+  #if MQTTUseAsyncConnect == 1
+        if (impl->isConnecting()) return ErrorType::Success;
+  #endif
+
+        WillMessage will(state->willTopic, state->willPayload);
+        if (state->willProperties) will.willProperties.capture(state->willProperties);
+        DynamicBinDataView password(state->password);
+  #if MQTTUseAsyncConnect == 1
+        // Don't block the event loop for the whole connection
+        const bool async = true;
+  #else
+        const bool async = false;
+  #endif
+        // Don't start a clean session, so the broker can resume it
+        ErrorType ret = openConnection(state->host.data, state->port, state->useTLS, state->keepAlive, false, state->userName.length ? state->userName.data : nullptr,
+                                       state->hasPassword ? &password : nullptr, state->willTopic.length ? &will : nullptr, (QoSDelivery)state->willQoS,
+                                       state->willRetain, state->properties, async);
+  #if MQTTUseAsyncConnect == 1
+        // The connection is made by the event loop (@sa finishConnection)
+        if (ret == ErrorType::InProgress)
+        {
+            impl->connecting.reconnecting = true;
+            return ErrorType::Success;
+        }
+  #endif
+        if (ret != ErrorType::Success)
+        {   // The next attempt is scheduled when the socket is closed, but the attempt might have failed before opening it
+            if (!state->timeBeforeAttempt(Platform::getMonotonicTimeMs())) state->connectionLost(Platform::getMonotonicTimeMs());
+            return ret;
+        }
+        return reconnected();
+    }
+
+    MQTTv5::ErrorType MQTTv5::reconnected()
+    {
+        ReconnectState * state = impl->reconnect;
+        state->delay = state->minDelay;
+#if MQTTUseStatistics == 1
+        impl->stats.reconnections++;
+#endif
+        // If the broker kept our session, it also kept our subscriptions
+        if (!impl->sessionPresent)
+            if (ErrorType err = replaySubscriptions())
+                return err;
+        impl->cb->reconnected(impl->sessionPresent);
+        return ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTv5::replaySubscriptions()
+    {
+        ReconnectState * state = impl->reconnect;
+        for (ReconnectState::Subscription * s = state->subscriptions; s; s = s->next)
+        {
+            // A packet is sent per subscription identifier, so skip the identifiers that were already sent
+            ReconnectState::Subscription * p = state->subscriptions;
+            while (p != s && p->subscriptionID != s->subscriptionID) p = p->next;
+            if (p != s) continue;
+
+            // Please do not move the line below as it must outlive the packet
+            Protocol::MQTT::V5::Property<Protocol::MQTT::Common::VBInt> idProp(Protocol::MQTT::V5::SubscriptionID, s->subscriptionID);
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::SUBSCRIBE> packet;
+            if (s->subscriptionID) packet.props.append(&idProp);
+            packet.fixedVariableHeader.packetID = impl->allocatePacketID();
+            for (; p; p = p->next)
+            {
+                if (p->subscriptionID != s->subscriptionID) continue;
+                // The topics are heap allocated, so the packet deletes them
+                SubscribeTopic * topic = new SubscribeTopic(p->topic, 0, false, false, 0);
+                topic->option = p->option;
+                if (packet.payload.topics) packet.payload.topics->append(topic);
+                else packet.payload.topics = topic;
+            }
+            // The subscriptions were accepted before, so don't wait for the acknowledgement (it's ignored by the event loop)
+            if (ErrorType ret = prepareSAR(packet, false))
+                return ret;
+        }
+        return ErrorType::Success;
+    }
+#endif
+
+    MQTTv5::ErrorType MQTTv5::sendPendingPackets()
+    {
+#if MQTTUseOfflineQueue == 1
+        // Send the queued publications first, as many as the in-flight window allows (or one in synchronous mode)
+        while (impl->getLastPacketType() == Protocol::MQTT::V5::RESERVED && impl->canReplayQueue())
+        {
+            ErrorType ret = replayQueuedPublication();
+            if (ret == ErrorType::NetworkError || ret == ErrorType::NotConnected) return ret;
+            if (ret == ErrorType::OutOfWindow) break; // Sent again once an acknowledgement is received
+            if (ret != ErrorType::Success)
+            {   // Retry later, after the default timeout
+                impl->replayFailedNow();
+                break;
+            }
+            impl->replayFailed = false;
+  #if MQTTMaxInFlight == 0
+            break; // Synchronous publications wait for their acknowledgement, so only send one per call
+  #endif
+        }
+#endif
+        // Check if the server answered our last ping in time, else the link is dead and we'd wait for the TCP timeout to notice
+        if (impl->pingTimedOut())
+        {
+#if MQTTUseStatistics == 1
+            impl->stats.pingTimeouts++;
+#endif
+            impl->close();
+            return ErrorType::TimedOut;
+        }
+        // Check if we need to ping the server
+        if (impl->getLastPacketType() == Protocol::MQTT::V5::RESERVED && impl->shouldPing())
+        {
+            // Send a Ping request packet
+            uint8 ping[Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PINGREQ>::Size];
+            if (ErrorType ret = sendRaw(ping, Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PINGREQ>::encode(ping), 0, 0, false))
+                return ret;
+            // Don't ping again until the answer is received, we'll give up after the ping timeout
+            impl->pingSent();
+        }
+        return ErrorType::Success;
+    }
+
+#if MQTTUseClientPool == 1
+    MQTTv5::ErrorType MQTTv5::serviceFromPool(const bool readable)
+    {
+#if MQTTUseAutoReconnect == 1 || MQTTUseAsyncConnect == 1
+        ErrorType ret = runFromPool(readable);
+        if (ret == ErrorType::Success) return ret;
+        // A client that connects by itself isn't failing, the pool calls it again when the next attempt is due or when the
+        // connection can progress (@sa getNextDeadline)
+        ScopedLock scope(impl->lock);
+        if (impl->isAboutToConnect()) return ErrorType::Success;
+        return ret;
+    }
+
+    MQTTv5::ErrorType MQTTv5::runFromPool(const bool readable)
+    {
+        // The pool's thread is shared, so never wait for the next attempt or the network while connecting
+  #if MQTTUseAutoReconnect == 1
+        if (ErrorType ret = reconnectIfRequired(0))
+            return ret;
+  #endif
+  #if MQTTUseAsyncConnect == 1
+        if (ErrorType ret = advanceConnection(0))
+            return ret;
+  #endif
+#endif
+        ScopedLock scope(impl->lock);
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+#if MQTTUseStatistics == 1
+        impl->stats.eventLoops++;
+#endif
+        if (ErrorType ret = sendPendingPackets())
+            return ret;
+        // Nothing to receive, so only the keep alive and the pending publications needed to be taken care of
+        if (!readable && !impl->hasPendingData()) return ErrorType::Success;
+#if MQTTOnlyBSDSocket == 1
+        // Only process what the socket already has, a partially received packet is completed on the next call
+        impl->socket->noWait = true;
+        ErrorType ret = processIncoming(0);
+        if (impl->socket) impl->socket->noWait = false;
+        return ret;
+#else
+        return processIncoming(0);
+#endif
+    }
+#endif
+
+    // The client event loop you must call regularly.
+    MQTTv5::ErrorType MQTTv5::eventLoop(const uint32 maxPackets)
+    {
+#if MQTTUseAutoReconnect == 1
+  #if MQTTLowLatency == 1
+        if (ErrorType ret = reconnectIfRequired(0))
+  #else
+        if (ErrorType ret = reconnectIfRequired(impl->getTimeout()))
+  #endif
+            return ret;
+#endif
+#if MQTTUseAsyncConnect == 1
+  #if MQTTLowLatency == 1
+        if (ErrorType ret = advanceConnection(0))
+  #else
+        if (ErrorType ret = advanceConnection(impl->getTimeout()))
+  #endif
+            return ret;
+#endif
+        int fd = -1;
+        {
+            ScopedLock scope(impl->lock);
+            if (!impl->isOpen()) return ErrorType::NotConnected;
+#if MQTTUseStatistics == 1
+            impl->stats.eventLoops++;
+#endif
+
+            if (ErrorType ret = sendPendingPackets())
+                return ret;
+            if (impl->getLastPacketType() == Protocol::MQTT::V5::RESERVED && !impl->hasPendingData())
+                fd = impl->getSocketHandle();
+        }
+        if (fd >= 0)
+        {
+            // Wait for the network without holding the lock, so the other tasks can publish meanwhile.
+            // The lock is only held while the received data is processed
+#if MQTTLowLatency == 1
+            int ret = Impl::waitReadable(fd, 0);
+#else
+            int ret = Impl::waitReadable(fd, impl->getTimeout());
+#endif
+            if (ret < 0) return ErrorType::NetworkError;
+            if (ret == 0) return ErrorType::Success; // No answer in time, it's not an error here
+        }
+
+        ScopedLock scope(impl->lock);
+        return processIncoming(maxPackets);
+    }
+
+    // Receive and dispatch the packets the socket has
+    MQTTv5::ErrorType MQTTv5::processIncoming(const uint32 maxPackets)
+    {
+        if (!impl->isOpen()) return ErrorType::NotConnected;
+
+        // Check if we have a packet ready for reading now
+        Protocol::MQTT::Common::ControlPacketType type = impl->getLastPacketType();
+        if (type == Protocol::MQTT::V5::RESERVED)
+        {
+            // Another task might have received the data while we were waiting, don't block on the socket in that case
+            if (!impl->hasPendingData() && Impl::waitReadable(impl->getSocketHandle(), 0) <= 0)
+                return ErrorType::Success;
+            // Check the server for any packet...
+            int ret = impl->receiveControlPacket(true);
+            if (ret == 0)
+            {
+                impl->close();
+                return ErrorType::NotConnected;
+            }
+            // No answer in time, it's not an error here
+            if (ret == -2) return ErrorType::Success;
+            if (ret < 0)   return ErrorType::NetworkError;
+            // Ok, now we have a packet read it
+            type = impl->getLastPacketType();
+        }
+
+        for (uint32 count = 1; ; count++)
+        {
+            if (ErrorType ret = dispatchPacket(type))
+                return ret;
+            // Then process the packets that are already received, without waiting for the network
+            if ((maxPackets && count >= maxPackets) || !impl->isOpen() || !impl->hasBufferedPacket())
+                break;
+            int ret = impl->receiveControlPacket();
+            if (ret <= 0)
+            {
+                if (ret == 0) impl->close();
+                return ret == 0 ? ErrorType::NotConnected : ErrorType::NetworkError;
+            }
+            type = impl->getLastPacketType();
+        }
+        return ErrorType::Success;
+    }
+
+    // Process the last received packet
+    MQTTv5::ErrorType MQTTv5::dispatchPacket(const Protocol::MQTT::V5::ControlPacketType type)
+    {
+        switch (type)
+        {
+        case Protocol::MQTT::V5::PINGRESP: break; // We ignore ping response
+        case Protocol::MQTT::V5::DISCONNECT: impl->close(); return ErrorType::NotConnected; // No work to perform upon server sending disconnect
+        case Protocol::MQTT::V5::PUBLISH:
+        {
+#if MQTTStreamLargePublish == 1
+            if (impl->isStreaming()) return dispatchStreamedPublish();
+#endif
+            Protocol::MQTT::V5::ROPublishPacket packet;
+            int ret = impl->extractControlPacket(type, packet);
+            if (ret == 0) { impl->close(); return ErrorType::NotConnected; }
+            // Skip a malformed packet, else it would be dispatched again on the next call
+            if (ret < 0) { impl->resetPacketReceivingState(); return ErrorType::NetworkError; }
+#if MQTTManualAckWindow > 0
+            if (impl->manualAck && packet.header.getQoS())
+                return holdPublish(packet);
+#endif
+#if MQTTReceivedQoS2Max > 0
+            if (packet.header.getQoS() == 2)
+                return receiveQoS2Publish(packet);
+#endif
+            if (ErrorType err = dispatchPublish(packet))
+                return err;
+            return enterPublishCycle(packet, false);
+        }
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0 || MQTTUseClientPool == 1
+        case Protocol::MQTT::V5::PUBREL:
+            return handleRelease();
+#endif
+#if MQTTMaxInFlight > 0
+        case Protocol::MQTT::V5::PUBACK:
+        case Protocol::MQTT::V5::PUBREC:
+        case Protocol::MQTT::V5::PUBCOMP:
+            return handleInFlightReply(type);
+        case Protocol::MQTT::V5::SUBACK:
+        case Protocol::MQTT::V5::UNSUBACK:
+            return handleRequestReply(type);
+#endif
+#if MQTTUseAuth == 1
+        case Protocol::MQTT::V5::AUTH:
         {
             return impl->handleAuth();
         }
@@ -1595,6 +5084,14 @@ namespace Network { namespace Client {
 
 
         ScopedLock scope(impl->lock);
+#if MQTTUseAutoReconnect == 1
+        // The user wants to be disconnected, so don't connect again until the next connectTo call
+        if (impl->reconnect) impl->reconnect->disarm();
+#endif
+#if MQTTUseAsyncConnect == 1
+        // Abort the connection in progress (if any)
+        if (impl->isConnecting()) impl->close();
+#endif
         if (!impl->isOpen()) return ErrorType::Success;
 
         Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::DISCONNECT> packet;
@@ -1615,9 +5112,913 @@ namespace Network { namespace Client {
         return ErrorType::Success;
     }
 
+#if MQTTUseTLS == 1 && MQTTTLSSessionResumption == 1 && MQTTOnlyBSDSocket == 1
+    void MQTTv5::setTLSSessionStore(TLSSessionStore * store)
+    {
+        ScopedLock scope(impl->lock);
+        impl->sessionStore = store;
+        if (impl->tls) impl->tls->store = store;
+    }
+#endif
+
     void MQTTv5::setDefaultTimeout(const uint32 timeoutMs)
     {
         impl->setTimeout(timeoutMs);
     }
 
+#if MQTTUseClientPool == 1
+    uint32 MQTTv5Pool::getTimeMs()
+    {
+        return Platform::getMonotonicTimeMs();
+    }
+
+    void MQTTv5Pool::link(Entry & entry)
+    {
+        Entry *& slot = slots[(entry.expiry >> TickShift) & (SlotCount - 1)];
+        entry.prev = 0;
+        entry.next = slot;
+        if (slot) slot->prev = &entry;
+        slot = &entry;
+    }
+
+    void MQTTv5Pool::unlink(Entry & entry)
+    {
+        Entry *& slot = slots[(entry.expiry >> TickShift) & (SlotCount - 1)];
+        if (entry.prev) entry.prev->next = entry.next;
+        else if (slot == &entry) slot = entry.next;
+        if (entry.next) entry.next->prev = entry.prev;
+        entry.prev = entry.next = 0;
+    }
+
+    bool MQTTv5Pool::schedule(Entry & entry, const uint32 now)
+    {
+        const uint32 delay = entry.client->getNextDeadline();
+        if (delay == (uint32)-1) return false;
+        unlink(entry);
+        entry.expiry = now + delay;
+        link(entry);
+        return true;
+    }
+
+    uint32 MQTTv5Pool::timeBeforeExpiry(const uint32 now, const uint32 maxWaitMs) const
+    {
+        // Visit the slots in time order, the first slot with an entry for this revolution has the earliest expiry
+        const uint32 tick = now >> TickShift;
+        for (uint32 i = 0; i < SlotCount && (i << TickShift) <= maxWaitMs + (1 << TickShift); i++)
+        {
+            uint32 earliest = maxWaitMs;
+            bool found = false;
+            for (const Entry * e = slots[(tick + i) & (SlotCount - 1)]; e; e = e->next)
+            {
+                const int32 left = (int32)(e->expiry - now);
+                if (left <= 0) return 0;
+                if ((e->expiry >> TickShift) != tick + i) continue; // For a later revolution
+                earliest = min(earliest, (uint32)left);
+                found = true;
+            }
+            if (found) return earliest;
+        }
+        return maxWaitMs;
+    }
+
+    uint32 MQTTv5Pool::find(const MQTTv5 & client) const
+    {
+        for (uint32 i = 0; i < count; i++)
+            if (entries[i]->client == &client) return i;
+        return count;
+    }
+
+    void MQTTv5Pool::removeAt(const uint32 index)
+    {
+        Entry * entry = entries[index];
+        unlink(*entry);
+        if (entry->due)
+        {
+            Entry ** e = &pending;
+            while (*e != entry) e = &(*e)->nextDue;
+            *e = entry->nextDue;
+        }
+        entries[index] = entries[--count];
+        delete entry;
+    }
+
+    MQTTv5::ErrorType MQTTv5Pool::add(MQTTv5 & client)
+    {
+        if (find(client) != count) return MQTTv5::ErrorType::BadParameter;
+        const int fd = client.getSocketHandle();
+        if (fd < 0) return MQTTv5::ErrorType::NotConnected;
+        if (fd >= FD_SETSIZE) return MQTTv5::ErrorType::BadParameter;
+
+        if (count == capacity)
+        {
+            const uint32 size = capacity ? capacity * 2 : 4;
+            Entry ** array = (Entry **)::realloc(entries, size * sizeof(*entries));
+            if (!array) return MQTTv5::ErrorType::UnknownError;
+            entries = array;
+            capacity = size;
+        }
+        Entry * entry = new Entry(client);
+        entries[count++] = entry;
+        if (!schedule(*entry, getTimeMs()))
+        {
+            removeAt(count - 1);
+            return MQTTv5::ErrorType::NotConnected;
+        }
+        return MQTTv5::ErrorType::Success;
+    }
+
+    bool MQTTv5Pool::remove(MQTTv5 & client)
+    {
+        const uint32 index = find(client);
+        if (index == count) return false;
+        removeAt(index);
+        return true;
+    }
+
+    int MQTTv5Pool::run(const uint32 maxWaitMs)
+    {
+        // Wait on all the sockets at once, up to the earliest keep alive deadline
+        fd_set set;
+        FD_ZERO(&set);
+        int maxFD = -1;
+        for (uint32 i = 0; i < count; i++)
+        {
+            const int fd = entries[i]->client->getSocketHandle();
+            if (fd < 0 || fd >= FD_SETSIZE) continue; // The timer will find out it's disconnected
+            FD_SET(fd, &set);
+            if (fd > maxFD) maxFD = fd;
+        }
+        const uint32 delay = timeBeforeExpiry(getTimeMs(), maxWaitMs);
+        struct timeval v = { (time_t)(delay / 1000), (suseconds_t)((delay % 1000) * 1000) };
+        int ret = ::select(maxFD + 1, &set, NULL, NULL, &v);
+        if (ret < 0) return -1;
+
+        // Collect the clients with readable sockets
+        for (uint32 i = 0; ret > 0 && i < count; i++)
+        {
+            Entry & entry = *entries[i];
+            const int fd = entry.client->getSocketHandle();
+            if (fd < 0 || fd >= FD_SETSIZE || !FD_ISSET(fd, &set)) continue;
+            entry.readable = entry.due = true;
+            entry.nextDue = pending;
+            pending = &entry;
+        }
+        // And the clients whose timer expired, from the slots that were passed since the last run (including the current one)
+        const uint32 now = getTimeMs(), tick = now >> TickShift;
+        const uint32 span = min(tick - cursor + 1, (uint32)SlotCount);
+        for (uint32 i = 0; i < span; i++)
+        {
+            for (Entry * e = slots[(cursor + i) & (SlotCount - 1)]; e; e = e->next)
+            {
+                if (e->due || (int32)(e->expiry - now) > 0) continue;
+                e->due = true;
+                e->nextDue = pending;
+                pending = e;
+            }
+        }
+        cursor = tick;
+
+        // Then service them
+        int serviced = 0;
+        while (pending)
+        {
+            Entry & entry = *pending;
+            pending = entry.nextDue;
+            const bool readable = entry.readable;
+            entry.due = entry.readable = false;
+
+            MQTTv5::ErrorType err = entry.client->serviceFromPool(readable);
+            serviced++;
+            if (err == MQTTv5::ErrorType::Success && schedule(entry, getTimeMs())) continue;
+
+            MQTTv5 & client = *entry.client;
+            removeAt(find(client));
+            // A client without deadline is disconnected, even if servicing it succeeded
+            if (listener) listener->clientFailed(client, err == MQTTv5::ErrorType::Success ? MQTTv5::ErrorType(MQTTv5::ErrorType::NotConnected) : err);
+        }
+        return serviced;
+    }
+
+    MQTTv5Pool::MQTTv5Pool(Listener * listener)
+        : entries(0), count(0), capacity(0), cursor(getTimeMs() >> TickShift), pending(0), listener(listener)
+    {
+        memset(slots, 0, sizeof(slots));
+    }
+
+    MQTTv5Pool::~MQTTv5Pool()
+    {
+        while (count) removeAt(count - 1);
+        ::free(entries);
+    }
+#endif
+
+#if MQTTUseLocalBroker == 1
+    /** A client's connection to the local broker */
+    struct BrokerSession
+    {
+        /** A topic filter the client subscribed to. They are recorded to remove them from the broker's trie upon disconnection */
+        struct Filter
+        {
+            /** The topic filter */
+            Protocol::MQTT::Common::DynamicString   filter;
+            /** The next filter for this client */
+            Filter *                                next;
+
+            Filter(const char * text, const uint16 length, Filter * next) : next(next) { filter.from(text, length); }
+        };
+
+        /** The connection */
+        BaseSocket                                  socket;
+        /** The receiving buffer (it's the broker's maximum packet size long) */
+        uint8 *                                     buffer;
+        /** The number of bytes in the receiving buffer */
+        uint32                                      available;
+        /** The client identifier */
+        Protocol::MQTT::Common::DynamicString       clientID;
+        /** The maximum packet size the client accepts */
+        uint32                                      maxPacketSize;
+        /** The maximum time between two packets from the client in milliseconds (0 if the keep alive is disabled) */
+        uint32                                      keepAliveMs;
+        /** The time when the client is considered gone, in milliseconds. Before the CONNECT packet, it's the time limit to receive it */
+        uint32                                      expiry;
+        /** The identifier of the last publication sent to this client, so it's sent once even if many of its filters match */
+        uint32                                      delivered;
+        /** The filters the client subscribed to */
+        Filter *                                    filters;
+        /** The will message's topic */
+        Protocol::MQTT::Common::DynamicString       willTopic;
+        /** The will message's payload */
+        Protocol::MQTT::Common::DynamicBinaryData   willPayload;
+        /** Set once the client is connected (its CONNECT packet was accepted) */
+        bool                                        connected;
+        /** Set if the will message must be published when the connection is closed */
+        bool                                        hasWill;
+        /** Set if the connection must be closed. It's closed once all the connections are serviced */
+        bool                                        failed;
+        /** The next session */
+        BrokerSession *                             next;
+
+        BrokerSession(struct timeval & timeout, const int fd, uint8 * buffer, const uint32 expiry)
+            : socket(timeout), buffer(buffer), available(0), maxPacketSize(Protocol::MQTT::Common::VBInt::MaxPossibleSize), keepAliveMs(0), expiry(expiry),
+              delivered(0), filters(0), connected(false), hasWill(false), failed(false), next(0) { socket.socket = fd; }
+    };
+
+    /** A subscription in the broker's topic trie */
+    struct BrokerSubscriber
+    {
+        /** The subscribed client */
+        BrokerSession * session;
+        /** The subscription options, as received */
+        uint8           options;
+
+        /** Only the client matters, since a client has a single subscription per filter */
+        bool operator == (const BrokerSubscriber & other) const { return session == other.session; }
+        BrokerSubscriber(BrokerSession * session, const uint8 options = 0) : session(session), options(options) {}
+    };
+
+    /** A bridged topic filter in the broker's topic trie */
+    struct BrokerBridge
+    {
+        /** The upstream client */
+        MQTTv5 *    client;
+        /** The QoS for the forwarded publications */
+        uint8       QoS;
+
+        /** Only the client matters, since a client has a single bridge per filter */
+        bool operator == (const BrokerBridge & other) const { return client == other.client; }
+        BrokerBridge(MQTTv5 * client = 0, const uint8 QoS = 0) : client(client), QoS(QoS) {}
+    };
+
+    /** The topic trie visitor sending a publication to the subscribers */
+    struct BrokerDelivery
+    {
+        /** The publishing client (0 for the application) */
+        const BrokerSession *   from;
+        /** The publication header (everything but the payload), that's the same for all the subscribers */
+        const uint8 *           header;
+        /** The header size in bytes */
+        uint32                  headerLength;
+        /** The publication payload */
+        const uint8 *           payload;
+        /** The payload size in bytes */
+        uint32                  payloadLength;
+        /** The publication identifier */
+        uint32                  id;
+
+        void operator()(const BrokerSubscriber & subscriber)
+        {
+            BrokerSession & to = *subscriber.session;
+            if (to.failed || to.delivered == id) return;
+            // The No Local option prevents a client from receiving its own publications
+            if (&to == from && (subscriber.options & 4)) return;
+            to.delivered = id;
+            // A publication that's larger than what the client accepts must be discarded
+            if (headerLength + payloadLength > to.maxPacketSize) return;
+            if (to.socket.sendv((const char*)header, headerLength, (const char*)payload, payloadLength) != (int)(headerLength + payloadLength))
+                to.failed = true;
+        }
+    };
+
+    /** The topic trie visitor collecting the upstream clients to forward a publication to */
+    struct BrokerForward
+    {
+        /** The maximum number of distinct upstream clients, MQTTBroker::bridge refuses more */
+        enum { MaxClients = 4 };
+
+        /** The matching bridges, one per client */
+        BrokerBridge    bridges[MaxClients];
+        /** The number of matching bridges */
+        uint32          count;
+
+        void operator()(const BrokerBridge & bridge)
+        {
+            for (uint32 i = 0; i < count; i++)
+                if (bridges[i].client == bridge.client) { bridges[i].QoS = max(bridges[i].QoS, bridge.QoS); return; }
+            if (count < MaxClients) bridges[count++] = bridge;
+        }
+
+        BrokerForward() : count(0) {}
+    };
+
+    struct MQTTBroker::Impl
+    {
+        /** The time allowed to a new connection to send its CONNECT packet, and the time allowed to send a packet to a client, in milliseconds */
+        enum { ConnectTimeoutMs = 10000, SendTimeoutMs = 3000 };
+
+        /** The lock protecting the sessions and the tries */
+        Lock                    lock;
+        /** The listening socket */
+        int                     listener;
+        /** The sending timeout for the connections */
+        struct timeval          timeout;
+        /** The maximum packet size accepted from the clients (that's the size of their receiving buffer) */
+        const uint32            maxPacketSize;
+        /** The maximum number of connections */
+        uint32                  maxClients;
+        /** The number of connections */
+        uint32                  count;
+        /** The last publication identifier */
+        uint32                  lastID;
+        /** The last assigned client identifier */
+        uint32                  lastAssignedID;
+        /** The allocator for the receiving buffers */
+        Platform::Allocator &   allocator;
+        /** The connections */
+        BrokerSession *         sessions;
+        /** The clients' subscriptions */
+        Protocol::MQTT::Common::TopicTrie<BrokerSubscriber> subscriptions;
+        /** The bridged filters */
+        Protocol::MQTT::Common::TopicTrie<BrokerBridge>     bridges;
+        /** The bridged clients (0 for a free entry), so a publication can always be forwarded to all of them (@sa BrokerForward) */
+        MQTTv5 *                upstreams[BrokerForward::MaxClients];
+        /** The number of filters bridged to each client */
+        uint32                  upstreamFilters[BrokerForward::MaxClients];
+
+        /** Get the current time in milliseconds from a monotonic clock */
+        static uint32 getTimeMs() { return Platform::getMonotonicTimeMs(); }
+        /** Check if the given topic name is valid for a publication */
+        static bool isValidTopic(const char * topic, const uint16 length) { return length && !memchr(topic, '+', length) && !memchr(topic, '#', length); }
+        /** Find the entry of the given bridged client (or a free entry if 0)
+            @return The entry index, or BrokerForward::MaxClients if not found */
+        uint32 findUpstream(const MQTTv5 * client) const
+        {
+            uint32 i = 0;
+            while (i < BrokerForward::MaxClients && upstreams[i] != client) i++;
+            return i;
+        }
+
+        /** Send a buffer to a client, the connection is marked as failed on error */
+        bool send(BrokerSession & session, const uint8 * buffer, const uint32 length)
+        {
+            if (session.socket.send((const char*)buffer, length) == (int)length) return true;
+            session.failed = true;
+            return false;
+        }
+        /** Serialize and send a packet to a client */
+        bool sendPacket(BrokerSession & session, Protocol::MQTT::V5::ControlPacketSerializable & packet)
+        {
+            const uint32 size = packet.computePacketSize();
+            DeclareStackHeapBufferFrom(buffer, size, StackSizeAllocationLimit, allocator);
+            if (!(void*)buffer || packet.copyInto(buffer) != size) { session.failed = true; return false; }
+            return send(session, buffer, size);
+        }
+        /** Disconnect a client with the given reason. The connection is closed once all the connections are serviced */
+        void disconnect(BrokerSession & session, const Protocol::MQTT::V5::ReasonCodes reason)
+        {
+            // The DISCONNECT packet can only be sent once the client is connected
+            if (session.connected && !session.failed)
+            {
+                Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::DISCONNECT> packet;
+                packet.fixedVariableHeader.reasonCode = reason;
+                sendPacket(session, packet);
+            }
+            session.failed = true;
+        }
+
+        /** Send a publication to the local subscribers
+            @param from         The publishing client (0 for the application)
+            @param props        The serialized publication properties (including their length) */
+        void deliver(const BrokerSession * from, const char * topic, const uint16 topicLength, const uint8 * props, const uint32 propsLength,
+                     const uint8 * payload, const uint32 payloadLength)
+        {
+            // The publications are sent with QoS 0 and without the retain flag, so the header is built once for all the subscribers
+            const uint32 remLength = 2 + topicLength + propsLength + payloadLength;
+            const uint32 headerLength = 1 + Protocol::MQTT::V5::FastPath::getVBIntSize(remLength) + 2 + topicLength + propsLength;
+            DeclareStackHeapBufferFrom(buffer, headerLength, StackSizeAllocationLimit, allocator);
+            uint8 * header = buffer;
+            if (!header) return;
+            uint32 o = 1; header[0] = Protocol::MQTT::V5::PUBLISH << 4;
+            o += Protocol::MQTT::V5::FastPath::writeVBInt(header + o, remLength);
+            Protocol::MQTT::V5::FastPath::writeUInt16(header + o, topicLength); o += 2;
+            memcpy(header + o, topic, topicLength); o += topicLength;
+            memcpy(header + o, props, propsLength);
+
+            if (!++lastID) ++lastID; // 0 is the identifier of the sessions that never received anything
+            BrokerDelivery delivery = { from, header, headerLength, payload, payloadLength, lastID };
+            subscriptions.match(topic, topicLength, delivery);
+        }
+        /** Forward a publication to the bridged clients.
+            The lock is released while publishing, so an upstream client can call MQTTBroker::publish from its callback */
+        void forward(const char * topic, const uint16 topicLength, const uint8 * payload, const uint32 payloadLength)
+        {
+            BrokerForward forward;
+            if (!bridges.match(topic, topicLength, forward)) return;
+            // The client expects a C string for the topic name
+            DeclareStackHeapBuffer(buffer, topicLength + 1, StackSizeAllocationLimit);
+            char * name = buffer;
+            if (!name) return;
+            memcpy(name, topic, topicLength); name[topicLength] = 0;
+
+            lock.release();
+            for (uint32 i = 0; i < forward.count; i++)
+            {
+                // Failures aren't reported, the upstream client might be reconnecting or its in-flight window might be full
+#if MQTTMaxInFlight > 0
+                forward.bridges[i].client->publishAsync(name, payload, payloadLength, false, (MQTTv5::QoSDelivery)forward.bridges[i].QoS);
+#else
+                forward.bridges[i].client->publish(name, payload, payloadLength, false, (MQTTv5::QoSDelivery)forward.bridges[i].QoS);
+#endif
+            }
+            lock.acquire();
+        }
+
+        /** Accept a new connection */
+        void accept()
+        {
+            const int fd = ::accept(listener, NULL, NULL);
+            if (fd < 0) return;
+            uint8 * buffer = count < maxClients && fd < FD_SETSIZE ? (uint8*)allocator.allocate(maxPacketSize) : 0;
+            if (!buffer) { ::closesocket(fd); return; }
+
+            int flag = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            // A client that doesn't read its data can't block the broker for long
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            BrokerSession * session = new BrokerSession(timeout, fd, buffer, getTimeMs() + ConnectTimeoutMs);
+            session->next = sessions;
+            sessions = session;
+            count++;
+        }
+        /** Delete a session that's not linked anymore, with its subscriptions */
+        void release(BrokerSession * session)
+        {
+            while (BrokerSession::Filter * filter = session->filters)
+            {
+                subscriptions.remove(filter->filter.data, filter->filter.length, BrokerSubscriber(session));
+                session->filters = filter->next;
+                delete filter;
+            }
+            allocator.release(session->buffer, maxPacketSize);
+            delete session;
+        }
+        /** Close the failed connections, publishing their will message if required */
+        void sweep()
+        {
+            BrokerSession ** s = &sessions;
+            while (*s)
+            {
+                if (!(*s)->failed) { s = &(*s)->next; continue; }
+                BrokerSession * session = *s;
+                *s = session->next;
+                count--;
+                if (session->connected && session->hasWill)
+                {
+                    static const uint8 noProperties = 0;
+                    deliver(session, session->willTopic.data, session->willTopic.length, &noProperties, 1, session->willPayload.data, session->willPayload.length);
+                    forward(session->willTopic.data, session->willTopic.length, session->willPayload.data, session->willPayload.length);
+                }
+                release(session);
+            }
+        }
+        /** Close all the connections without publishing their will message */
+        void stop()
+        {
+            while (BrokerSession * session = sessions)
+            {
+                disconnect(*session, Protocol::MQTT::V5::ServerShuttingDown);
+                sessions = session->next;
+                release(session);
+            }
+            count = 0;
+            if (listener >= 0) ::closesocket(listener);
+            listener = -1;
+        }
+
+        /** Receive the available data from a client and process the complete packets
+            @return The number of packets processed */
+        int receive(BrokerSession & session)
+        {
+            const int ret = ::recv(session.socket.socket, (char*)session.buffer + session.available, maxPacketSize - session.available, MSG_DONTWAIT);
+            if (ret <= 0)
+            {   // The connection was closed by the client (or it failed), so its will message is published
+                if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) session.failed = true;
+                return 0;
+            }
+            session.available += (uint32)ret;
+            if (session.connected && session.keepAliveMs) session.expiry = getTimeMs() + session.keepAliveMs;
+
+            int processed = 0;
+            uint32 offset = 0;
+            while (!session.failed && session.available - offset >= 2)
+            {
+                uint32 remLength = 0;
+                const uint32 s = Protocol::MQTT::Common::decodeVBInt(session.buffer + offset + 1, session.available - offset - 1, remLength);
+                if (s == Protocol::MQTT::Common::NotEnoughData) break;
+                if (Protocol::MQTT::Common::isError(s)) { disconnect(session, Protocol::MQTT::V5::MalformedPacket); break; }
+                const uint32 length = 1 + s + remLength;
+                if (length > maxPacketSize) { disconnect(session, Protocol::MQTT::V5::PacketTooLarge); break; }
+                if (session.available - offset < length) break;
+
+                process(session, session.buffer + offset, length);
+                processed++;
+                offset += length;
+            }
+            // Keep the incomplete packet (if any) at the beginning of the buffer
+            session.available -= offset;
+            if (offset && session.available) memmove(session.buffer, session.buffer + offset, session.available);
+            return processed;
+        }
+        /** Process a packet received from a client */
+        void process(BrokerSession & session, const uint8 * packet, const uint32 length)
+        {
+            const Protocol::MQTT::V5::ControlPacketType type = (Protocol::MQTT::V5::ControlPacketType)(packet[0] >> 4);
+            // The CONNECT packet must be the first packet, and it's only sent once
+            if (session.connected == (type == Protocol::MQTT::V5::CONNECT)) { disconnect(session, Protocol::MQTT::V5::ProtocolError); return; }
+
+            switch (type)
+            {
+            case Protocol::MQTT::V5::CONNECT:       return connect(session, packet, length);
+            case Protocol::MQTT::V5::PUBLISH:       return publish(session, packet, length);
+            case Protocol::MQTT::V5::SUBSCRIBE:     return subscribe(session, packet, length);
+            case Protocol::MQTT::V5::UNSUBSCRIBE:   return unsubscribe(session, packet, length);
+            case Protocol::MQTT::V5::PUBREL:
+            {   // The QoS 2 publications are delivered upon reception, so there's nothing to release
+                uint16 packetID = 0; uint8 reasonCode = 0;
+                if (Protocol::MQTT::Common::isError(Protocol::MQTT::V5::FastPath::decodeReply(packet, length, packetID, reasonCode)))
+                    return disconnect(session, Protocol::MQTT::V5::MalformedPacket);
+                uint8 reply[Protocol::MQTT::V5::FastPath::ReplyEncoder<Protocol::MQTT::V5::PUBCOMP>::MaxSize];
+                send(session, reply, Protocol::MQTT::V5::FastPath::Encoder<Protocol::MQTT::V5::PUBCOMP>::encode(reply, packetID));
+                return;
+            }
+            case Protocol::MQTT::V5::PINGREQ:
+            {
+                static const uint8 pong[2] = { Protocol::MQTT::V5::PINGRESP << 4, 0 };
+                send(session, pong, sizeof(pong));
+                return;
+            }
+            case Protocol::MQTT::V5::DISCONNECT:
+            {   // The will message is only published if the client asks for it
+                Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::DISCONNECT, true> packetDisconnect;
+                if (Protocol::MQTT::Common::isError(packetDisconnect.readFrom(packet, length))
+                    || packetDisconnect.fixedVariableHeader.reason() != Protocol::MQTT::V5::DisconnectWithWillMessage)
+                    session.hasWill = false;
+                session.failed = true;
+                return;
+            }
+            // The publications are only sent with QoS 0, so there's no acknowledgement to expect
+            case Protocol::MQTT::V5::PUBACK:
+            case Protocol::MQTT::V5::PUBREC:
+            case Protocol::MQTT::V5::PUBCOMP:       return;
+            default:                                return disconnect(session, Protocol::MQTT::V5::ProtocolError);
+            }
+        }
+        /** Answer a CONNECT packet with the broker's capabilities */
+        void acknowledge(BrokerSession & session, const Protocol::MQTT::V5::ReasonCodes reason, const bool assignedID)
+        {
+            // Please do not move the lines below as they must outlive the packet
+            Protocol::MQTT::V5::Property<uint8> retainProp(Protocol::MQTT::V5::RetainAvailable, 0);
+            Protocol::MQTT::V5::Property<uint8> sharedProp(Protocol::MQTT::V5::SharedSubAvailable, 0);
+            Protocol::MQTT::V5::Property<uint8> subIDProp(Protocol::MQTT::V5::SubIDAvailable, 0);
+            Protocol::MQTT::V5::Property<uint32> maxProp(Protocol::MQTT::V5::PacketSizeMax, maxPacketSize);
+            Protocol::MQTT::V5::Property<Protocol::MQTT::V5::DynamicStringView> idProp(Protocol::MQTT::V5::AssignedClientID, Protocol::MQTT::V5::DynamicStringView(session.clientID));
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::CONNACK> packet;
+            packet.fixedVariableHeader.reasonCode = reason;
+            if (reason == Protocol::MQTT::V5::Success)
+            {   // The client must know what isn't supported, since the default is to support everything
+                packet.props.append(&retainProp);
+                packet.props.append(&sharedProp);
+                packet.props.append(&subIDProp);
+                packet.props.append(&maxProp);
+                if (assignedID) packet.props.append(&idProp);
+            }
+            sendPacket(session, packet);
+        }
+        /** Process a CONNECT packet */
+        void connect(BrokerSession & session, const uint8 * buffer, const uint32 length)
+        {
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::CONNECT, true> packet;
+            const uint32 ret = packet.readFrom(buffer, length);
+            const Protocol::MQTT::V5::FixedField<Protocol::MQTT::V5::CONNECT> & header = packet.fixedVariableHeader;
+            Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+
+            Protocol::MQTT::V5::ReasonCodes reason = Protocol::MQTT::V5::Success;
+            if (Protocol::MQTT::Common::isError(ret) || (header.willFlag && !packet.payload.willMessage)) reason = Protocol::MQTT::V5::MalformedPacket;
+            else if (memcmp(header.protocolName, header.expectedProtocolName(), sizeof(header.protocolName)) || header.protocolVersion != 5)
+                reason = Protocol::MQTT::V5::UnsupportedProtocolVersion;
+#if MQTTAvoidValidation != 1
+            // The client identifier isn't checked, the clients can use an empty one or any character here
+            else if (header.reserved0 || header.willQoS > 2 || !packet.props.checkPropertiesFor(Protocol::MQTT::V5::CONNECT)
+                  || (header.willFlag && !packet.payload.willMessage->check()))
+                reason = Protocol::MQTT::V5::MalformedPacket;
+#endif
+            // The authentication, the retained messages and the topic aliases aren't supported
+            else if (index.has(Protocol::MQTT::V5::AuthenticationMethod)) reason = Protocol::MQTT::V5::BadAuthenticationMethod;
+            else if (header.willFlag && header.willRetain) reason = Protocol::MQTT::V5::RetainNotSupported;
+            else if (header.willFlag && !isValidTopic(packet.payload.willMessage->willTopic.data, packet.payload.willMessage->willTopic.length))
+                reason = Protocol::MQTT::V5::TopicNameInvalid;
+
+            bool assignedID = false;
+            if (reason == Protocol::MQTT::V5::Success)
+            {
+                const Protocol::MQTT::V5::DynString & clientID = packet.payload.clientID;
+                if (clientID.length) session.clientID.from(clientID.data, clientID.length);
+                else
+                {
+                    char name[24];
+                    snprintf(name, sizeof(name), "eMQTT5-local-%u", (unsigned)++lastAssignedID);
+                    session.clientID.from(name, (int)strlen(name));
+                    assignedID = true;
+                }
+                // A client connecting again takes the session over (there's no persistent session here)
+                for (BrokerSession * s = sessions; s; s = s->next)
+                    if (s != &session && s->connected && s->clientID.length == session.clientID.length && !memcmp(s->clientID.data, session.clientID.data, s->clientID.length))
+                        disconnect(*s, Protocol::MQTT::V5::SessionTakenOver);
+
+                Protocol::MQTT::V5::LittleEndianPODVisitor<uint32> pod32;
+                if (index.getProperty(Protocol::MQTT::V5::PacketSizeMax, pod32) && pod32.getValue())
+                    session.maxPacketSize = pod32.getValue();
+                // The client is considered gone after one and a half keep alive period without any packet
+                session.keepAliveMs = (uint32)header.keepAlive * 1500;
+                session.expiry = getTimeMs() + session.keepAliveMs;
+                if (header.willFlag)
+                {
+                    const Protocol::MQTT::V5::WillMessage & will = *packet.payload.willMessage;
+                    session.willTopic.from(will.willTopic.data, will.willTopic.length);
+                    session.willPayload = Protocol::MQTT::Common::DynamicBinaryData(will.willPayload.length, will.willPayload.data);
+                    session.hasWill = true;
+                }
+            }
+            // The will message is allocated while reading the packet, but it's not owned by the packet
+            delete0(packet.payload.willMessage);
+
+            acknowledge(session, reason, assignedID);
+            if (reason == Protocol::MQTT::V5::Success) session.connected = true;
+            else session.failed = true;
+        }
+        /** Process a PUBLISH packet */
+        void publish(BrokerSession & session, const uint8 * buffer, const uint32 length)
+        {
+            Protocol::MQTT::V5::ROPublishPacket packet;
+            if (Protocol::MQTT::Common::isError(packet.readFrom(buffer, length)) || packet.header.getQoS() > 2)
+                return disconnect(session, Protocol::MQTT::V5::MalformedPacket);
+            if (packet.header.isRetain())
+                return disconnect(session, Protocol::MQTT::V5::RetainNotSupported);
+            const Protocol::MQTT::V5::DynString & topic = packet.fixedVariableHeader.topicName;
+            if (!isValidTopic(topic.data, topic.length))
+                return disconnect(session, Protocol::MQTT::V5::TopicNameInvalid);
+            // No topic alias maximum is advertised, so the clients can't use them
+            Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+            if (index.has(Protocol::MQTT::V5::TopicAlias))
+                return disconnect(session, Protocol::MQTT::V5::TopicAliasInvalid);
+
+            // The properties are forwarded as they were received, they are just before the payload
+            const uint32 propsLength = packet.props.getSize();
+            deliver(&session, topic.data, topic.length, packet.payload.data - propsLength, propsLength, packet.payload.data, packet.payload.size);
+            if (const uint8 QoS = packet.header.getQoS())
+            {   // The QoS 2 publications are delivered right away, so their release is answered without any state
+                uint8 reply[Protocol::MQTT::V5::FastPath::ReplyEncoder<Protocol::MQTT::V5::PUBACK>::MaxSize];
+                send(session, reply, Protocol::MQTT::V5::FastPath::encodeReply(QoS == 1 ? Protocol::MQTT::V5::PUBACK : Protocol::MQTT::V5::PUBREC, reply, packet.fixedVariableHeader.packetID));
+            }
+            // Only the publications from the local clients are forwarded (the payload is still in the receiving buffer)
+            forward(topic.data, topic.length, packet.payload.data, packet.payload.size);
+        }
+        /** Process a SUBSCRIBE packet */
+        void subscribe(BrokerSession & session, const uint8 * buffer, const uint32 length)
+        {
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::SUBSCRIBE, true> packet;
+            if (Protocol::MQTT::Common::isError(packet.readFrom(buffer, length)) || !packet.payload.topics)
+                return disconnect(session, Protocol::MQTT::V5::MalformedPacket);
+            Protocol::MQTT::V5::PropertiesIndex index(packet.props);
+            if (index.has(Protocol::MQTT::V5::SubscriptionID))
+                return disconnect(session, Protocol::MQTT::V5::SubscriptionIdentifiersNotSupported);
+
+            const uint32 topicCount = packet.payload.topics->count();
+            DeclareStackHeapBuffer(reasons, topicCount, StackSizeAllocationLimit);
+            uint8 * reason = reasons;
+            if (!reason) return disconnect(session, Protocol::MQTT::V5::UnspecifiedError);
+            for (const Protocol::MQTT::V5::SubscribeTopic * t = packet.payload.topics; t; t = (const Protocol::MQTT::V5::SubscribeTopic*)t->getNext())
+            {
+                const Protocol::MQTT::V5::DynString & filter = t->getTopic();
+                if (filter.length >= 7 && !memcmp(filter.data, "$share/", 7)) { *reason++ = Protocol::MQTT::V5::SharedSubscriptionsNotSupported; continue; }
+                // Subscribing again to the same filter replaces its options
+                const bool existing = subscriptions.remove(filter.data, filter.length, BrokerSubscriber(&session));
+                if (!subscriptions.insert(filter.data, filter.length, BrokerSubscriber(&session, t->option))) { *reason++ = Protocol::MQTT::V5::TopicFilterInvalid; continue; }
+                if (!existing) session.filters = new BrokerSession::Filter(filter.data, filter.length, session.filters);
+                // The publications are delivered with QoS 0, whatever the requested QoS
+                *reason++ = Protocol::MQTT::V5::Success;
+            }
+
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::SUBACK> reply;
+            reply.fixedVariableHeader.packetID = (uint16)packet.fixedVariableHeader.packetID;
+            reply.payload.data = reasons;
+            reply.payload.size = topicCount;
+            sendPacket(session, reply);
+        }
+        /** Process an UNSUBSCRIBE packet */
+        void unsubscribe(BrokerSession & session, const uint8 * buffer, const uint32 length)
+        {
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::UNSUBSCRIBE, true> packet;
+            if (Protocol::MQTT::Common::isError(packet.readFrom(buffer, length)) || !packet.payload.topics)
+                return disconnect(session, Protocol::MQTT::V5::MalformedPacket);
+
+            const uint32 topicCount = packet.payload.topics->count();
+            DeclareStackHeapBuffer(reasons, topicCount, StackSizeAllocationLimit);
+            uint8 * reason = reasons;
+            if (!reason) return disconnect(session, Protocol::MQTT::V5::UnspecifiedError);
+            for (const Protocol::MQTT::V5::ScribeTopicBase * t = packet.payload.topics; t; t = t->getNext())
+            {
+                const Protocol::MQTT::V5::DynString & filter = t->getTopic();
+                if (!subscriptions.remove(filter.data, filter.length, BrokerSubscriber(&session))) { *reason++ = Protocol::MQTT::V5::NoSubscriptionExisted; continue; }
+                for (BrokerSession::Filter ** f = &session.filters; *f; f = &(*f)->next)
+                {
+                    if ((*f)->filter.length != filter.length || memcmp((*f)->filter.data, filter.data, filter.length)) continue;
+                    BrokerSession::Filter * n = *f; *f = n->next; delete n;
+                    break;
+                }
+                *reason++ = Protocol::MQTT::V5::Success;
+            }
+
+            Protocol::MQTT::V5::ControlPacket<Protocol::MQTT::V5::UNSUBACK> reply;
+            reply.fixedVariableHeader.packetID = (uint16)packet.fixedVariableHeader.packetID;
+            reply.payload.data = reasons;
+            reply.payload.size = topicCount;
+            sendPacket(session, reply);
+        }
+
+        Impl(const uint32 maxPacketSize, Platform::Allocator & allocator)
+            : listener(-1), maxPacketSize(maxPacketSize), maxClients(0), count(0), lastID(0), lastAssignedID(0), allocator(allocator), sessions(0)
+        {
+            timeout.tv_sec = SendTimeoutMs / 1000;
+            timeout.tv_usec = (SendTimeoutMs % 1000) * 1000;
+            memset(upstreams, 0, sizeof(upstreams));
+            memset(upstreamFilters, 0, sizeof(upstreamFilters));
+        }
+        ~Impl() { stop(); }
+    };
+
+    MQTTv5::ErrorType MQTTBroker::start(const uint16 port, const uint32 maxClients)
+    {
+        ScopedLock scope(impl->lock);
+        if (impl->listener >= 0) return MQTTv5::ErrorType::AlreadyConnected;
+
+        const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return MQTTv5::ErrorType::NetworkError;
+        int flag = 1;
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (fd >= FD_SETSIZE || ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0
+         || ::bind(fd, (const sockaddr*)&address, sizeof(address)) < 0 || ::listen(fd, 4) < 0)
+        {
+            ::closesocket(fd);
+            return MQTTv5::ErrorType::NetworkError;
+        }
+        impl->listener = fd;
+        impl->maxClients = maxClients;
+        return MQTTv5::ErrorType::Success;
+    }
+
+    void MQTTBroker::stop()
+    {
+        ScopedLock scope(impl->lock);
+        impl->stop();
+    }
+
+    int MQTTBroker::run(const uint32 maxWaitMs)
+    {
+        // Wait on all the sockets at once, up to the earliest keep alive deadline
+        fd_set set;
+        FD_ZERO(&set);
+        int maxFD = -1;
+        uint32 delay = maxWaitMs;
+        {
+            ScopedLock scope(impl->lock);
+            if (impl->listener < 0) return -1;
+            FD_SET(impl->listener, &set);
+            maxFD = impl->listener;
+            const uint32 now = Impl::getTimeMs();
+            for (BrokerSession * s = impl->sessions; s; s = s->next)
+            {
+                FD_SET(s->socket.socket, &set);
+                if (s->socket.socket > maxFD) maxFD = s->socket.socket;
+                if (s->connected && !s->keepAliveMs) continue;
+                const int32 left = (int32)(s->expiry - now);
+                delay = left <= 0 ? 0 : min(delay, (uint32)left);
+            }
+        }
+        struct timeval v = { (time_t)(delay / 1000), (suseconds_t)((delay % 1000) * 1000) };
+        int ret = ::select(maxFD + 1, &set, NULL, NULL, &v);
+        if (ret < 0) return -1;
+
+        ScopedLock scope(impl->lock);
+        if (impl->listener < 0) return -1;
+        int processed = 0;
+        const uint32 now = Impl::getTimeMs();
+        for (BrokerSession * s = impl->sessions; s; s = s->next)
+        {
+            if (ret > 0 && FD_ISSET(s->socket.socket, &set)) processed += impl->receive(*s);
+            else if ((!s->connected || s->keepAliveMs) && (int32)(now - s->expiry) >= 0) impl->disconnect(*s, Protocol::MQTT::V5::KeepAliveTimeout);
+        }
+        if (ret > 0 && FD_ISSET(impl->listener, &set)) impl->accept();
+        impl->sweep();
+        return processed;
+    }
+
+    MQTTv5::ErrorType MQTTBroker::publish(const char * topic, const uint8 * payload, const uint32 payloadLength)
+    {
+        const size_t length = topic ? strlen(topic) : 0;
+        if (length > 65535 || !Impl::isValidTopic(topic, (uint16)length)) return MQTTv5::ErrorType::BadParameter;
+
+        ScopedLock scope(impl->lock);
+        if (impl->listener < 0) return MQTTv5::ErrorType::NotConnected;
+        // The failed connections are closed by the run method, so they are not modified here
+        static const uint8 noProperties = 0;
+        impl->deliver(0, topic, (uint16)length, &noProperties, 1, payload, payloadLength);
+        return MQTTv5::ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTBroker::bridge(const char * topicFilter, MQTTv5 & upstream, const MQTTv5::QoSDelivery QoS)
+    {
+        const size_t length = topicFilter ? strlen(topicFilter) : 0;
+        if (length > 65535 || (uint8)QoS > 2) return MQTTv5::ErrorType::BadParameter;
+#if MQTTMaxInFlight == 0
+        // Without the asynchronous mode, the broker would wait for each upstream acknowledgement and all the local clients with it
+        if (QoS != MQTTv5::QoSDelivery::AtMostOne) return MQTTv5::ErrorType::BadParameter;
+#endif
+
+        ScopedLock scope(impl->lock);
+        uint32 slot = impl->findUpstream(&upstream);
+        if (slot == BrokerForward::MaxClients) slot = impl->findUpstream(0);
+        if (slot == BrokerForward::MaxClients) return MQTTv5::ErrorType::BadParameter;
+
+        // Bridging again the same filter to the same client replaces its QoS
+        const bool replaced = impl->bridges.remove(topicFilter, (uint16)length, BrokerBridge(&upstream));
+        if (!impl->bridges.insert(topicFilter, (uint16)length, BrokerBridge(&upstream, (uint8)QoS)))
+            return MQTTv5::ErrorType::BadParameter;
+        impl->upstreams[slot] = &upstream;
+        if (!replaced) impl->upstreamFilters[slot]++;
+        return MQTTv5::ErrorType::Success;
+    }
+
+    MQTTv5::ErrorType MQTTBroker::unbridge(const char * topicFilter, MQTTv5 & upstream)
+    {
+        const size_t length = topicFilter ? strlen(topicFilter) : 0;
+        if (length > 65535) return MQTTv5::ErrorType::BadParameter;
+
+        ScopedLock scope(impl->lock);
+        if (!impl->bridges.remove(topicFilter, (uint16)length, BrokerBridge(&upstream)))
+            return MQTTv5::ErrorType::BadParameter;
+        // Free the client's entry once its last filter is removed
+        const uint32 slot = impl->findUpstream(&upstream);
+        if (slot < BrokerForward::MaxClients && !--impl->upstreamFilters[slot]) impl->upstreams[slot] = 0;
+        return MQTTv5::ErrorType::Success;
+    }
+
+    uint32 MQTTBroker::getClientCount() const
+    {
+        ScopedLock scope(impl->lock);
+        uint32 count = 0;
+        for (const BrokerSession * s = impl->sessions; s; s = s->next)
+            if (s->connected && !s->failed) count++;
+        return count;
+    }
+
+    MQTTBroker::MQTTBroker(const uint32 maxPacketSize, Platform::Allocator * allocator)
+        : impl(new Impl(max(maxPacketSize, 16U), allocator ? *allocator : Platform::Allocator::getDefault())) {}
+
+    MQTTBroker::~MQTTBroker() { delete impl; impl = 0; }
+#endif
+
 }}
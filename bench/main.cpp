@@ -0,0 +1,294 @@
+// Host benchmark for the eMQTT5 client.
+// The client publishes to an in-process broker stub over the loopback interface, so only the client's own cost is measured:
+// the stub answers the CONNECT and acknowledges the publications (PUBACK, PUBREC / PUBCOMP) without any processing.
+// For each QoS and payload size, it reports:
+//   - the throughput in messages per second
+//   - the publish-to-ack latency percentiles (for QoS 0, this is the time spent in publish, since there is no ack)
+//   - the bytes allocated on the heap per message (malloc, calloc, realloc and new are counted)
+//   - the peak stack used by the publish call
+// Usage: eMQTT5Bench [messages per run]
+#include <Network/Clients/MQTT.hpp>
+#include <pthread.h>
+#include <atomic>
+#include <time.h>
+
+using namespace Network::Client;
+
+// Heap accounting (glibc only, the allocation functions are interposed)
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t count, size_t size);
+extern "C" void * __libc_realloc(void * ptr, size_t size);
+extern "C" void   __libc_free(void * ptr);
+
+static std::atomic<uint64> allocatedBytes(0), allocationCount(0);
+
+extern "C" void * malloc(size_t size) { allocatedBytes += size; allocationCount++; return __libc_malloc(size); }
+extern "C" void * calloc(size_t count, size_t size) { allocatedBytes += count * size; allocationCount++; return __libc_calloc(count, size); }
+extern "C" void * realloc(void * ptr, size_t size) { allocatedBytes += size; allocationCount++; return __libc_realloc(ptr, size); }
+extern "C" void   free(void * ptr) { __libc_free(ptr); }
+
+/** Get a monotonic time in microseconds */
+static uint64 getTimeUs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/** The broker stub: it accepts connections one after the other and acknowledges everything */
+struct BrokerStub
+{
+    int                     server;
+    uint16                  port;
+    pthread_t               thread;
+    std::atomic<uint32>     received;
+    std::atomic<bool>       exiting;
+    uint8 *                 buffer;
+    enum { BufferSize = 128 * 1024 };
+
+    static bool sendAll(int fd, const uint8 * data, const uint32 size)
+    {
+        for (uint32 o = 0; o < size; )
+        {
+            ssize_t r = ::send(fd, data + o, size - o, MSG_NOSIGNAL);
+            if (r <= 0) return false;
+            o += (uint32)r;
+        }
+        return true;
+    }
+
+    /** Handle a complete packet, return false to close the connection */
+    bool process(int fd, const uint8 * packet, const uint32 headerSize, const uint32 remLength)
+    {
+        const uint8 type = packet[0] >> 4;
+        const uint8 * body = packet + headerSize;
+        switch (type)
+        {
+        case Protocol::MQTT::V5::CONNECT:
+        {   // Success, no properties
+            static const uint8 connack[] = { 0x20, 0x03, 0x00, 0x00, 0x00 };
+            return sendAll(fd, connack, sizeof(connack));
+        }
+        case Protocol::MQTT::V5::PUBLISH:
+        {
+            const uint8 QoS = (packet[0] >> 1) & 3;
+            received++;
+            if (!QoS) return true;
+            if (remLength < 4) return false;
+            const uint32 topicLength = (body[0] << 8) | body[1];
+            if (remLength < topicLength + 4) return false;
+            uint8 ack[4] = { (uint8)(QoS == 1 ? 0x40 : 0x50), 0x02, body[2 + topicLength], body[3 + topicLength] };
+            return sendAll(fd, ack, sizeof(ack));
+        }
+        case Protocol::MQTT::V5::PUBREL:
+        {
+            if (remLength < 2) return false;
+            uint8 comp[4] = { 0x70, 0x02, body[0], body[1] };
+            return sendAll(fd, comp, sizeof(comp));
+        }
+        case Protocol::MQTT::V5::PINGREQ:
+        {
+            static const uint8 pingresp[] = { 0xD0, 0x00 };
+            return sendAll(fd, pingresp, sizeof(pingresp));
+        }
+        case Protocol::MQTT::V5::DISCONNECT: return false;
+        default: return true;
+        }
+    }
+
+    void serve(int fd)
+    {
+        uint32 available = 0;
+        for (;;)
+        {
+            ssize_t r = ::recv(fd, buffer + available, BufferSize - available, 0);
+            if (r <= 0) return;
+            available += (uint32)r;
+            uint32 o = 0;
+            while (available - o >= 2)
+            {
+                uint32 remLength = 0;
+                uint32 s = Protocol::MQTT::Common::decodeVBInt(buffer + o + 1, available - o - 1, remLength);
+                if (s == Protocol::MQTT::Common::BadData || 1 + s + remLength > BufferSize) return;
+                if (Protocol::MQTT::Common::isError(s) || available - o < 1 + s + remLength) break;
+                if (!process(fd, buffer + o, 1 + s, remLength)) return;
+                o += 1 + s + remLength;
+            }
+            available -= o;
+            if (available) memmove(buffer, buffer + o, available);
+        }
+    }
+
+    static void * run(void * arg)
+    {
+        BrokerStub & b = *(BrokerStub*)arg;
+        while (!b.exiting)
+        {
+            int fd = ::accept(b.server, 0, 0);
+            if (fd < 0) continue;
+            int flag = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+            b.serve(fd);
+            ::close(fd);
+        }
+        return 0;
+    }
+
+    bool start()
+    {
+        server = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (server < 0) return false;
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (::bind(server, (struct sockaddr*)&addr, sizeof(addr)) || ::listen(server, 1) || ::getsockname(server, (struct sockaddr*)&addr, &len))
+            return false;
+        port = ntohs(addr.sin_port);
+        return pthread_create(&thread, 0, run, this) == 0;
+    }
+    void stop()
+    {
+        exiting = true;
+        ::shutdown(server, SHUT_RDWR);
+        ::close(server);
+        pthread_join(thread, 0);
+    }
+
+    BrokerStub() : server(-1), port(0), received(0), exiting(false), buffer((uint8*)::malloc(BufferSize)) {}
+    ~BrokerStub() { ::free(buffer); }
+};
+
+struct Receiver : public MessageReceived
+{
+    void messageReceived(const MQTTv5::DynamicStringView &, const MQTTv5::DynamicBinDataView &, const uint16, const MQTTv5::PropertiesView &) {}
+#if MQTTStreamLargePublish == 1
+    void messageChunkReceived(const MQTTv5::DynamicStringView &, const MQTTv5::DynamicBinDataView &, const uint32, const uint32, const uint16, const MQTTv5::PropertiesView &) {}
+#endif
+};
+
+/** A benchmark run for a QoS and a payload size, executed on its own thread with a painted stack */
+struct Run
+{
+    enum { StackSize = 1024 * 1024, Pattern = 0xA5, Warmup = 16 };
+
+    BrokerStub &    broker;
+    uint8           QoS;
+    uint32          payloadSize;
+    uint32          count;
+    uint8 *         stack;
+
+    // Results
+    bool            failed;
+    double          messagesPerSecond;
+    uint64          p50, p99;
+    double          bytesPerMessage, allocationsPerMessage;
+    uint32          peakStack;
+
+    static int compare(const void * a, const void * b) { uint64 x = *(const uint64*)a, y = *(const uint64*)b; return x < y ? -1 : x > y; }
+
+    /** Paint the unused part of the stack, below this function's frame */
+    static __attribute__((noinline)) void paint(uint8 * base)
+    {
+        volatile uint8 * p = base;
+        // Keep a safety margin for this function's own frame
+        uint8 * end = (uint8*)__builtin_frame_address(0) - 256;
+        while (p < end) *p++ = Pattern;
+    }
+    /** Find the deepest stack position that was used since painting */
+    uint8 * deepest() const
+    {
+        uint8 * p = stack;
+        while (*p == Pattern) p++;
+        return p;
+    }
+
+    void execute()
+    {
+        Receiver receiver;
+        MQTTv5 client("bench", &receiver);
+        uint8 * payload = (uint8*)::malloc(payloadSize);
+        uint64 * latencies = (uint64*)::malloc(count * sizeof(*latencies));
+        memset(payload, 'x', payloadSize);
+        const uint32 received = broker.received + Warmup;
+        failed = !payload || !latencies || client.connectTo("127.0.0.1", broker.port, false, 300);
+        for (uint32 i = 0; !failed && i < Warmup; i++)
+            failed = client.publish("bench/topic", payload, payloadSize, false, (MQTTv5::QoSDelivery)QoS) != MQTTv5::ErrorType::Success;
+
+        paint(stack);
+        while (!failed && broker.received < received) {} // Make sure the warmup publications are processed
+        const uint64 bytes = allocatedBytes, allocations = allocationCount;
+        const uint64 start = getTimeUs();
+        for (uint32 i = 0; !failed && i < count; i++)
+        {
+            const uint64 before = getTimeUs();
+            failed = client.publish("bench/topic", payload, payloadSize, false, (MQTTv5::QoSDelivery)QoS) != MQTTv5::ErrorType::Success;
+            latencies[i] = getTimeUs() - before;
+        }
+        // For QoS 0, wait until the broker got everything so the throughput isn't only filling the socket buffer
+        while (!failed && broker.received < received + count) {}
+        const uint64 elapsed = getTimeUs() - start;
+        bytesPerMessage = (double)(allocatedBytes - bytes) / count;
+        allocationsPerMessage = (double)(allocationCount - allocations) / count;
+        peakStack = (uint32)((uint8*)__builtin_frame_address(0) - deepest());
+
+        if (!failed)
+        {
+            messagesPerSecond = count * 1000000.0 / (elapsed ? elapsed : 1);
+            qsort(latencies, count, sizeof(*latencies), compare);
+            p50 = latencies[count / 2];
+            p99 = latencies[(uint32)(count * 0.99)];
+        }
+        client.disconnect(MQTTv5::ReasonCodes::NormalDisconnection);
+        ::free(latencies);
+        ::free(payload);
+    }
+
+    static void * start(void * arg) { ((Run*)arg)->execute(); return 0; }
+
+    bool launch()
+    {
+        pthread_attr_t attr;
+        pthread_t thread;
+        memset(stack, Pattern, StackSize);
+        if (pthread_attr_init(&attr) || pthread_attr_setstack(&attr, stack, StackSize) || pthread_create(&thread, &attr, start, this))
+            return false;
+        pthread_join(thread, 0);
+        pthread_attr_destroy(&attr);
+        return !failed;
+    }
+
+    Run(BrokerStub & broker, const uint8 QoS, const uint32 payloadSize, const uint32 count, uint8 * stack)
+        : broker(broker), QoS(QoS), payloadSize(payloadSize), count(count), stack(stack), failed(true), messagesPerSecond(0), p50(0), p99(0),
+          bytesPerMessage(0), allocationsPerMessage(0), peakStack(0) {}
+};
+
+int main(int argc, char ** argv)
+{
+    static const uint32 sizes[] = { 16, 128, 1024, 4096, 16384, 65536 };
+    const uint32 fixedCount = argc > 1 ? (uint32)atoi(argv[1]) : 0;
+
+    BrokerStub broker;
+    if (!broker.buffer || !broker.start()) { fprintf(stderr, "Can't start the broker stub\n"); return 1; }
+    uint8 * stack = (uint8*)::aligned_alloc(4096, Run::StackSize);
+    if (!stack) return 1;
+
+    printf("QoS  Payload(B)  Messages      msg/s  p50(us)  p99(us)  Heap(B/msg)  Allocs/msg  Stack(B)\n");
+    int ret = 0;
+    for (uint8 QoS = 0; QoS < 3; QoS++)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++)
+        {
+            // Send about 8MB per run, but at least 200 messages for the percentiles to make sense
+            const uint32 count = fixedCount ? fixedCount : min(max((uint32)(8 * 1024 * 1024 / sizes[s]), 200U), 20000U);
+            Run run(broker, QoS, sizes[s], count, stack);
+            if (!run.launch()) { printf("%3u  %10u  failed\n", QoS, sizes[s]); ret = 1; continue; }
+            printf("%3u  %10u  %8u  %9.0f  %7llu  %7llu  %11.1f  %10.2f  %8u\n", QoS, sizes[s], count, run.messagesPerSecond,
+                   (unsigned long long)run.p50, (unsigned long long)run.p99, run.bytesPerMessage, run.allocationsPerMessage, run.peakStack);
+        }
+    }
+
+    broker.stop();
+    ::free(stack);
+    return ret;
+}
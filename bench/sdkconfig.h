@@ -0,0 +1,38 @@
+#ifndef hpp_BenchSDKConfig_hpp
+#define hpp_BenchSDKConfig_hpp
+
+// This replaces the configuration generated by ESP-IDF from the Kconfig file for the host build.
+// The default values are the Kconfig's default values, each can be overridden on the compiler's command line
+// (for example with cmake -DCMAKE_CXX_FLAGS="-DCONFIG_ESP_EMQTT5_MAX_INFLIGHT=8")
+#ifndef CONFIG_ESP_EMQTT5_ENABLED
+  #define CONFIG_ESP_EMQTT5_ENABLED 1
+#endif
+#ifndef CONFIG_ESP_EMQTT5_STACK_SIZE
+  #define CONFIG_ESP_EMQTT5_STACK_SIZE 256
+#endif
+#ifndef CONFIG_ESP_EMQTT5_TLS_ENABLE
+  #define CONFIG_ESP_EMQTT5_TLS_ENABLE 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_LOW_LATENCY
+  #define CONFIG_ESP_EMQTT5_LOW_LATENCY 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_KEEPALIVE_PERCENT
+  #define CONFIG_ESP_EMQTT5_KEEPALIVE_PERCENT 75
+#endif
+#ifndef CONFIG_ESP_EMQTT5_MAX_INFLIGHT
+  #define CONFIG_ESP_EMQTT5_MAX_INFLIGHT 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_OUT_ALIAS_MAX
+  #define CONFIG_ESP_EMQTT5_OUT_ALIAS_MAX 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_IN_ALIAS_MAX
+  #define CONFIG_ESP_EMQTT5_IN_ALIAS_MAX 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_DUMP
+  #define CONFIG_ESP_EMQTT5_DUMP 0
+#endif
+#ifndef CONFIG_ESP_EMQTT5_SKIPVAL
+  #define CONFIG_ESP_EMQTT5_SKIPVAL 0
+#endif
+
+#endif
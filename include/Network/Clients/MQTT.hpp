@@ -5,6 +5,12 @@
 #include "MQTTConfig.hpp"
 // We need protocol declaration for this client
 #include "../../Protocol/MQTT/MQTT.hpp"
+// We need the allocator interface for the buffers
+#include "../../Platform/Allocator.hpp"
+#if MQTTUseOfflineQueue == 1
+// We need the queue storage interface
+#include "OfflineQueue.hpp"
+#endif
 
 
 
@@ -26,17 +32,36 @@ namespace Network
             /** This is called upon published message reception.
                 @param topic            The topic for this publication
                 @param payload          The payload for this publication (can be empty)
-                @param packetIdentifier If non zero, contains the packet identifier. This is usually ignored
+                @param packetIdentifier If non zero, contains the packet identifier. This is usually ignored, unless the publications
+                                        are acknowledged manually (@sa MQTTv5::setManualAck)
                 @param properties       If any attached to the packet, you'll find the list here. */
             virtual void messageReceived(const DynamicStringView & topic, const DynamicBinDataView & payload, 
                                          const uint16 packetIdentifier, const PropertiesView & properties) = 0;
             /** This is usually called upon creation to know what it the maximum packet size you'll support.
                 By default, MQTT allows up to 256MB control packets. 
                 On embedded system, this is very unlikely to be supported. 
-                This implementation does not support streaming so a buffer is created on the heap with this size 
-                to store the received control packet. 
+                A buffer is created with this size (with the allocator given to the client) to store the received control packet.
+                If MQTTStreamLargePublish is enabled, larger publications are received in chunks of this buffer size
+                (@sa messageChunkReceived), else they are rejected.
                 @return Defaults to 2048 bytes */
             virtual uint32 maxPacketSize() const { return 2048U; }
+#if MQTTStreamLargePublish == 1
+            /** This is called upon reception of a publication that's larger than the receiving buffer (@sa maxPacketSize).
+                The payload is given in successive chunks, in order, and the method is called until the complete payload is received.
+                The topic and properties are the same for all the chunks of a publication.
+                The chunks are only valid during the call, so you must copy or process them immediately.
+                @param topic            The topic for this publication
+                @param chunk            The current part of the payload
+                @param offset           The offset of this chunk in the payload in bytes
+                @param totalLength      The complete payload size in bytes. The last chunk is when offset + chunk.length == totalLength
+                @param packetIdentifier If non zero, contains the packet identifier. This is usually ignored
+                @param properties       If any attached to the packet, you'll find the list here.
+                @warning Large publications are never dispatched to the subscription router (if any)
+                @warning If the remaining chunks aren't received in time, the connection is closed since it can't resume in the middle of a packet
+                By default, the large publications are ignored (but still acknowledged) */
+            virtual void messageChunkReceived(const DynamicStringView & topic, const DynamicBinDataView & chunk, const uint32 offset, const uint32 totalLength,
+                                              const uint16 packetIdentifier, const PropertiesView & properties) {}
+#endif
 
 #if MQTTUseAuth == 1
             /** An authentication packet was received.
@@ -51,9 +76,78 @@ namespace Network
             { 
                 return false; 
             }
+#endif
+#if MQTTMaxInFlight > 0
+            /** An asynchronous publication is completed.
+                This is called from the event loop when the final acknowledgement (PUBACK for QoS 1, PUBCOMP for QoS 2) is
+                received for a packet published with MQTTv5::publishAsync, or when the connection is lost before it happened.
+                @param packetIdentifier The packet identifier for the publication (as returned by MQTTv5::publishAsync)
+                @param reasonCode       The reason code from the broker. Any value below UnspecifiedError means a success.
+                                        If the connection was closed before the publication was acknowledged, this is UnspecifiedError
+                                        (unless it's sent again from the offline queue, @sa MQTTv5::setOfflineQueue) */
+            virtual void publishCompleted(const uint16 packetIdentifier, const ReasonCodes reasonCode) {}
+            /** An asynchronous subscription is completed.
+                This is called from the event loop when the SUBACK packet is received for a request made with MQTTv5::subscribeAsync,
+                or when the connection is lost before it happened.
+                @param packetIdentifier The packet identifier for the request (as returned by MQTTv5::subscribeAsync)
+                @param reasonCodes      The reason code for each topic in the request, in the same order. Any value below UnspecifiedError
+                                        means a success (and it's the granted QoS). If the connection was closed before the request was
+                                        acknowledged, this is empty
+                @param properties       If any attached to the SUBACK packet, you'll find the list here. */
+            virtual void subscribeCompleted(const uint16 packetIdentifier, const DynamicBinDataView & reasonCodes, const PropertiesView & properties) {}
+            /** An asynchronous unsubscription is completed.
+                Same as subscribeCompleted for a request made with MQTTv5::unsubscribeAsync */
+            virtual void unsubscribeCompleted(const uint16 packetIdentifier, const DynamicBinDataView & reasonCodes, const PropertiesView & properties) {}
+#endif
+#if MQTTUseAutoReconnect == 1
+            /** The client connected again by itself after the connection was lost (@sa MQTTv5::setAutoReconnect).
+                This is called from the event loop, once the subscriptions were sent again (if required)
+                @param sessionPresent   If true, the broker resumed the previous session, so the subscriptions weren't sent again */
+            virtual void reconnected(const bool sessionPresent) {}
 #endif
             virtual ~MessageReceived() {}
         };
+
+#if MQTTUseTopicRouter == 1
+        /** A subscription handler interface you must overload to receive the publications for a route.
+            @sa MQTTv5::addRoute */
+        struct SubscriptionHandler
+        {
+            typedef Protocol::MQTT::V5::DynamicStringView           DynamicStringView;
+            typedef Protocol::MQTT::V5::DynamicBinDataView          DynamicBinDataView;
+            typedef Protocol::MQTT::V5::PropertiesView              PropertiesView;
+
+            /** This is called upon published message reception on a topic matching the route.
+                @param topic            The topic for this publication (topic aliases are already resolved)
+                @param payload          The payload for this publication (can be empty)
+                @param packetIdentifier If non zero, contains the packet identifier. This is usually ignored, unless the publications
+                                        are acknowledged manually (@sa MQTTv5::setManualAck)
+                @param properties       If any attached to the packet, you'll find the list here. */
+            virtual void messageReceived(const DynamicStringView & topic, const DynamicBinDataView & payload,
+                                         const uint16 packetIdentifier, const PropertiesView & properties) = 0;
+
+            virtual ~SubscriptionHandler() {}
+        };
+#endif
+#if MQTTUseTLS == 1 && MQTTTLSSessionResumption == 1
+        /** The storage interface for the TLS session, so it survives a reboot or a deep sleep (in NVS for example).
+            With a saved session, the next connection to the same server uses an abbreviated handshake.
+            @sa MQTTv5::setTLSSessionStore */
+        struct TLSSessionStore
+        {
+            /** Save the session negotiated with the server
+                @param data     The serialized session. It contains the session's secret, so store it in a protected area
+                @param length   The serialized session length in bytes */
+            virtual void saveSession(const uint8 * data, const uint32 length) = 0;
+            /** Load the last saved session
+                @param buffer   The buffer to load the session into. If 0, only the session length is returned
+                @param size     The buffer size in bytes
+                @return The session length in bytes, or 0 if no session is saved (or it doesn't fit in the buffer) */
+            virtual uint32 loadSession(uint8 * buffer, const uint32 size) = 0;
+
+            virtual ~TLSSessionStore() {}
+        };
+#endif
 #define HasMsgRecvCB
 #endif
 
@@ -101,6 +195,8 @@ namespace Network
                     NetworkError        = -6,   //!< A communication with the network failed
                     NotConnected        = -7,   //!< Not connected to the server
                     TranscientPacket    = -8,   //!< A transcient packet was captured and need to be processed first
+                    OutOfWindow         = -9,   //!< The in-flight window is full, call eventLoop to process the pending acknowledgements first
+                    InProgress          = -10,  //!< The connection is in progress, call eventLoop until it's established (@sa connectAsync)
                
                     UnknownError        = -1,   //!< An unknown error happened (or the developer was too lazy to create a valid entry in this table...)
                 };
@@ -113,7 +209,180 @@ namespace Network
                 ErrorType(const ErrorType & type) : errorCode(type.errorCode) {}
             };
 
-            
+            /** A publication template, for publishing repeatedly on the same topic with the same QoS, retain flag and properties.
+                The topic name and the properties are validated and serialized once (@sa preparePublish), so each publication only
+                patches the remaining length and the packet identifier before sending the payload (without copying it).
+                The topic aliases aren't used for a prepared publication (unless you add a TopicAlias property yourself).
+                A prepared publication is bound to the client that prepared it, but it can be used across reconnections. */
+            struct PreparedPublish
+            {
+                /** The serialized packet header, with room for the largest fixed header before the topic name */
+                uint8 *                 buffer;
+                /** The size of the topic name, packet identifier and properties in bytes */
+                uint32                  variableSize;
+                /** The offset of the packet identifier in the buffer (0 if the QoS doesn't use any) */
+                uint32                  packetIDPos;
+                /** The PUBLISH packet type and flags */
+                uint8                   typeAndFlags;
+                /** The allocator used for the buffer */
+                Platform::Allocator *   allocator;
+
+                /** The room for the largest fixed header (1 byte for the type and up to 4 bytes for the remaining length) */
+                enum { HeaderRoom = 5 };
+
+                /** Check if this publication is prepared */
+                bool isValid() const { return buffer != 0; }
+                /** Get the QoS for this publication */
+                QoSDelivery getQoS() const { return (QoSDelivery)((typeAndFlags >> 1) & 3); }
+                /** Release the serialized header */
+                void clear() { if (allocator) allocator->release(buffer, HeaderRoom + variableSize); buffer = 0; variableSize = packetIDPos = 0; allocator = 0; }
+
+                PreparedPublish() : buffer(0), variableSize(0), packetIDPos(0), typeAndFlags(0), allocator(0) {}
+                ~PreparedPublish() { clear(); }
+            private:
+                PreparedPublish(const PreparedPublish &);
+                PreparedPublish & operator = (const PreparedPublish &);
+            };
+
+#if MQTTUsePublishBatch == 1
+            /** A publication in a batch (@sa publishBatch) */
+            struct BatchPublication
+            {
+                /** The topic to publish into */
+                const char *            topic;
+                /** The payload for this publication (can be null) */
+                const uint8 *           payload;
+                /** The payload length in bytes */
+                uint32                  payloadLength;
+                /** The quality of service delivery flag to use */
+                QoSDelivery             QoS;
+                /** The retain flag for this publication */
+                bool                    retain;
+                /** On output, the packet identifier allocated for this publication (0 for QoS AtMostOne) */
+                uint16                  packetIdentifier;
+
+                BatchPublication(const char * topic = 0, const uint8 * payload = 0, const uint32 payloadLength = 0, const QoSDelivery QoS = QoSDelivery::AtMostOne, const bool retain = false)
+                    : topic(topic), payload(payload), payloadLength(payloadLength), QoS(QoS), retain(retain), packetIdentifier(0) {}
+            };
+#endif
+
+#if MQTTReceiveBufferPool > 0
+            /** A received publication owned by the application (@sa takeMessage).
+                Its views point into a receiving buffer leased from the client, so they stay valid until the message is released.
+                The message can be released from any task, but it must be released before the client is destructed. */
+            struct ReceivedMessage
+            {
+                /** The topic for this publication (topic aliases are already resolved) */
+                DynamicStringView       topic;
+                /** The payload for this publication (can be empty) */
+                DynamicBinDataView      payload;
+                /** The properties attached to the publication */
+                PropertiesView          properties;
+                /** The packet identifier (0 for QoS AtMostOne), as given to the callback */
+                uint16                  packetIdentifier;
+
+                /** Check if this message holds a publication */
+                bool isValid() const { return buffer != 0; }
+                /** Give the receiving buffer back to the client. The views are cleared */
+                void release();
+
+                ReceivedMessage() : packetIdentifier(0), buffer(0), owner(0) {}
+                ~ReceivedMessage() { release(); }
+            private:
+                /** The leased receiving buffer */
+                uint8 *                 buffer;
+                /** The client the buffer belongs to */
+                MQTTv5 *                owner;
+                friend struct MQTTv5;
+
+                ReceivedMessage(const ReceivedMessage &);
+                ReceivedMessage & operator = (const ReceivedMessage &);
+            };
+#endif
+
+#if MQTTPacketTrace > 0
+            /** A packet trace entry (@sa getTrace).
+                The layout doesn't depend on the platform (except for the endianness), so the entries can be saved as is and decoded
+                offline (@sa tools/TraceDecoder) */
+            struct TraceEntry
+            {
+                /** The number of bytes captured at the beginning of each packet */
+                enum { CapturedBytes = MQTTPacketTraceBytes };
+
+                /** The monotonic time when the packet was sent or received in milliseconds */
+                uint32  timeMs;
+                /** The packet size in bytes. The captured bytes are the first min(length, CapturedBytes) bytes of the packet */
+                uint32  length;
+                /** The packet identifier (0 if the packet doesn't have any) */
+                uint16  packetID;
+                /** 1 if the packet was sent, 0 if it was received */
+                uint8   sent;
+                /** The packet's first byte (the type in the upper 4 bits and the flags) */
+                uint8   typeAndFlags;
+                /** The first bytes of the packet */
+                uint8   data[CapturedBytes];
+
+                /** Get the number of bytes captured for this packet */
+                uint32 getCapturedSize() const { return length < (uint32)CapturedBytes ? length : (uint32)CapturedBytes; }
+            };
+#endif
+
+#if MQTTUseStatistics == 1
+            /** The runtime statistics of a client (@sa getStats).
+                The counters are only incremented on the hot path (no allocation, no logging), so they are cheap enough to be left
+                enabled in production. They are never reset unless you call resetStats, and wrap around on overflow. */
+            struct Stats
+            {
+                /** The number of buckets in the publication latency histogram */
+                enum { LatencyBuckets = 12 };
+
+                /** The number of bytes sent to the server (MQTT level, without the TLS overhead) */
+                uint64 bytesSent;
+                /** The number of bytes received from the server (MQTT level, without the TLS overhead) */
+                uint64 bytesReceived;
+                /** The number of packets sent, indexed by control packet type (@sa Protocol::MQTT::V5::ControlPacketType) */
+                uint32 packetsSent[16];
+                /** The number of packets received, indexed by control packet type */
+                uint32 packetsReceived[16];
+                /** The number of publications sent again (with the DUP flag set) */
+                uint32 retransmits;
+                /** The number of pings that weren't answered in time (the connection was closed) */
+                uint32 pingTimeouts;
+                /** The last ping round trip time in milliseconds */
+                uint32 lastPingRTTMs;
+                /** The largest ping round trip time in milliseconds */
+                uint32 maxPingRTTMs;
+                /** The time between sending a QoS 1 or 2 publication and receiving its last acknowledgement (with the blocking publish).
+                    The bucket i counts the publications that took less than 2^i ms, and the last bucket counts the longer ones */
+                uint32 publishLatency[LatencyBuckets];
+                /** The number of event loop calls */
+                uint32 eventLoops;
+                /** The number of times a task had to wait for the client's lock (only counted with the default locks) */
+                uint32 lockContentions;
+                /** The total time spent waiting for the client's lock in milliseconds (only counted with the default locks) */
+                uint32 lockWaitMs;
+                /** The number of automatic reconnections (@sa setAutoReconnect) */
+                uint32 reconnections;
+
+                /** Account for a packet that was sent */
+                inline void sent(const uint8 typeAndFlags, const uint32 size) { bytesSent += size; packetsSent[typeAndFlags >> 4]++; }
+                /** Account for a packet that was received */
+                inline void received(const uint8 typeAndFlags, const uint32 size) { bytesReceived += size; packetsReceived[typeAndFlags >> 4]++; }
+                /** Account for a ping answer */
+                inline void pingAnswered(const uint32 rttMs) { lastPingRTTMs = rttMs; if (rttMs > maxPingRTTMs) maxPingRTTMs = rttMs; }
+                /** Account for a completed publication cycle */
+                inline void published(const uint32 durationMs)
+                {
+                    uint32 i = 0;
+                    while (i < LatencyBuckets - 1 && (durationMs >> i)) i++;
+                    publishLatency[i]++;
+                }
+                /** Reset all the counters */
+                void reset() { memset(this, 0, sizeof(*this)); }
+
+                Stats() { reset(); }
+            };
+#endif
 
 
             struct Impl;
@@ -123,13 +392,129 @@ namespace Network
             /** The PImpl idiom used here to avoid exposing the internal implementation */
             Impl * impl;
             friend struct Impl;
+#if MQTTUseClientPool == 1
+            friend class MQTTv5Pool;
+#endif
 
             // Helpers
         private:
-            /** Prepare, send and receive a packet */
-            ErrorType::Type prepareSAR(Protocol::MQTT::V5::ControlPacketSerializable & packet, bool withAnswer = true);
+            /** Connect to the server (@sa connectTo). The lock must be held
+                @param async    If true, the connection is only started and made by the event loop (@sa connectAsync) */
+            ErrorType openConnection(const char * serverHost, const uint16 port, bool useTLS, const uint16 keepAliveTimeInSec,
+                const bool cleanStart, const char * userName, const DynamicBinDataView * password,
+                WillMessage * willMessage, const QoSDelivery willQoS, const bool willRetain, Properties * properties, const bool async = false);
+            /** Process the server's answer to the CONNECT packet (either CONNACK or AUTH). The lock must be held */
+            ErrorType processConnectAnswer();
+#if MQTTUseAsyncConnect == 1
+            /** Advance the asynchronous connection (if any), waiting up to the given time for the network
+                @return Success if connected (or if there's no connection in progress), InProgress if it's not done yet, or the error
+                        that made the connection fail */
+            ErrorType advanceConnection(const uint32 maxWaitMs);
+            /** Finish the asynchronous connection with the given progress result (@sa advanceConnection). The lock must be held */
+            ErrorType finishConnection(const int result);
+#endif
+#if MQTTUseAutoReconnect == 1
+            /** Connect again with the recorded parameters if the connection was lost, waiting up to the given time for the next attempt
+                @return Success if connected (or if the automatic reconnection isn't armed), NotConnected if the next attempt isn't due yet,
+                        or the error of the failed attempt */
+            ErrorType reconnectIfRequired(const uint32 maxWaitMs);
+            /** Finish a successful automatic reconnection, sending the subscriptions again if required. The lock must be held */
+            ErrorType reconnected();
+            /** Send the recorded subscriptions again, without waiting for their acknowledgement. The lock must be held */
+            ErrorType replaySubscriptions();
+#endif
+            /** Prepare, send and receive a packet.
+                If isPublish is true, the packet must be a PublishPacket and its payload is sent without copying it if it's large */
+            ErrorType::Type prepareSAR(Protocol::MQTT::V5::ControlPacketSerializable & packet, bool withAnswer = true, bool isPublish = false);
+            /** Send an already serialized packet (in 2 parts, the payload being optional) and receive the answer if required */
+            ErrorType::Type sendRaw(const uint8 * header, const uint32 headerSize, const uint8 * payload, const uint32 payloadSize, const bool withAnswer);
             /** Enter a publish cycle. This is called upon publishing or receiving a published packet */
             ErrorType enterPublishCycle(Protocol::MQTT::V5::ControlPacketSerializableImpl & publishPacket, bool sending = false);
+            /** Run the publish cycle state machine for the given QoS and packet identifier (@sa enterPublishCycle).
+                If sending, the publication must have been sent and its first acknowledgement received already */
+            ErrorType runPublishCycle(const uint8 QoS, const uint16 packetID, bool sending);
+            /** Send a prepared publication, either waiting for its acknowledgement or tracking it in the in-flight table */
+            ErrorType sendPrepared(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength, uint16 * inFlightIdentifier);
+            /** Build and send a publish packet, either waiting for its acknowledgement or tracking it in the in-flight table */
+            ErrorType sendPublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                  const uint16 packetIdentifier, Properties * properties, uint16 * inFlightIdentifier);
+            /** Same as sendPublish, without the queueing logic. The lock must be held */
+            ErrorType emitPublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                  const uint16 packetIdentifier, Properties * properties, uint16 * inFlightIdentifier, const bool duplicate);
+#if MQTTUsePublishStream == 1
+            /** Send the header of a streamed publication (@sa beginPublish). The lock must be held */
+            ErrorType sendPublishHeader(const char * topic, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                        Properties * properties, const bool tracked);
+#endif
+#if MQTTUseOfflineQueue == 1
+            /** Append a publication to the offline queue */
+            ErrorType queuePublish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain, const QoSDelivery QoS,
+                                   const uint16 packetIdentifier, const bool duplicate);
+            /** Send the first publication of the offline queue, and remove it from the queue once it's acknowledged (or in flight).
+                If it might have reached the broker without being acknowledged, the connection is closed and it's kept as a duplicate to be
+                sent again upon reconnection */
+            ErrorType replayQueuedPublication();
+#endif
+            /** Send the pending outgoing packets and ping the server if the keep alive period expired, without waiting for the network.
+                The lock must be held */
+            ErrorType sendPendingPackets();
+#if MQTTUseClientPool == 1
+            /** Service this client from a MQTTv5Pool, either because its socket is readable or because its keep alive timer expired.
+                This never waits on the network if the socket isn't readable */
+            ErrorType serviceFromPool(const bool readable);
+  #if MQTTUseAutoReconnect == 1 || MQTTUseAsyncConnect == 1
+            /** The servicing part of serviceFromPool, including the connection steps. The errors are filtered by serviceFromPool, since a
+                client that connects by itself must stay in the pool */
+            ErrorType runFromPool(const bool readable);
+  #endif
+#endif
+            /** Receive the packets the socket has and dispatch them, up to maxPackets (0 for all the buffered packets).
+                This is the part of eventLoop that runs once the socket is readable. The lock must be held */
+            ErrorType processIncoming(const uint32 maxPackets);
+            /** Process the last received packet, whatever its type. This is what eventLoop does once a packet is received */
+            ErrorType dispatchPacket(const Protocol::MQTT::V5::ControlPacketType type);
+            /** Wait for the acknowledgement with the given type and packet identifier, processing any other packet received meanwhile */
+            ErrorType waitForReply(const Protocol::MQTT::V5::ControlPacketType type, const uint16 packetID);
+            /** Build and send a subscribe packet, either waiting for its acknowledgement or tracking it in the pending requests table */
+            ErrorType sendSubscribe(SubscribeTopic & topics, Properties * properties, uint16 * requestIdentifier);
+            /** Build and send an unsubscribe packet, either waiting for its acknowledgement or tracking it in the pending requests table */
+            ErrorType sendUnsubscribe(UnsubscribeTopic & topics, Properties * properties, uint16 * requestIdentifier);
+            /** Dispatch a received publication to the routes or the message received callback, after resolving its topic alias */
+            ErrorType dispatchPublish(Protocol::MQTT::V5::ROPublishPacket & packet);
+#if MQTTInTopicAliasMax > 0
+            /** Replace the topic alias of a received publication with its topic name, closing the connection if it's invalid
+                @param packet   The received publication
+                @param index    The index of the publication's properties */
+            ErrorType resolveTopicAlias(Protocol::MQTT::V5::ROPublishPacket & packet, const Protocol::MQTT::V5::PropertiesIndex & index);
+#endif
+#if MQTTStreamLargePublish == 1
+            /** Receive the publication that's larger than the receiving buffer and give it to the callback in chunks */
+            ErrorType dispatchStreamedPublish();
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0 || MQTTUseClientPool == 1
+            /** Send a publication reply (PUBACK, PUBREC or PUBCOMP) without touching the receiving state */
+            ErrorType sendPublishReply(const Protocol::MQTT::V5::ControlPacketType type, const uint16 packetID, const uint8 reasonCode);
+            /** Handle a received PUBREL packet, completing the QoS 2 flow of an acknowledged publication */
+            ErrorType handleRelease();
+#endif
+#if MQTTManualAckWindow > 0 || MQTTReceivedQoS2Max > 0
+            /** Disconnect from the broker because it sent more unacknowledged publications than our Receive Maximum */
+            ErrorType refuseInbound();
+#endif
+#if MQTTManualAckWindow > 0
+            /** Dispatch a received QoS 1 or 2 publication without acknowledging it, unless it's a redelivery (@sa setManualAck) */
+            ErrorType holdPublish(Protocol::MQTT::V5::ROPublishPacket & packet);
+#endif
+#if MQTTReceivedQoS2Max > 0
+            /** Dispatch a received QoS 2 publication and send its PUBREC, without waiting for the PUBREL (unless it's a redelivery) */
+            ErrorType receiveQoS2Publish(Protocol::MQTT::V5::ROPublishPacket & packet);
+#endif
+#if MQTTMaxInFlight > 0
+            /** Handle a received PUBACK, PUBREC or PUBCOMP packet for an asynchronous publication */
+            ErrorType handleInFlightReply(const Protocol::MQTT::V5::ControlPacketType type);
+            /** Handle a received SUBACK or UNSUBACK packet for an asynchronous request */
+            ErrorType handleRequestReply(const Protocol::MQTT::V5::ControlPacketType type);
+#endif
 
             // Interface
         public:
@@ -141,7 +526,9 @@ namespace Network
                 @param serverHost           The server host name (without any scheme or port). This should be like the DNS name for the server or a IP address
                 @param port                 The server port value 
                 @param useTLS               Should the connection happen over TLS
-                @param keepAliveTimeInSec   The keep alive delay in seconds (this is an hint, the server can force its own) 
+                @param keepAliveTimeInSec   The keep alive delay in seconds (this is an hint, the server can force its own), 0 to disable it.
+                                            The server is pinged if nothing was exchanged for a part of this delay (@sa MQTTKeepAlivePercent) and the
+                                            connection is closed if it doesn't answer in time
                 @param cleanStart           If true, both the server and client will discard any previous session, else the server will try to reuse any previous live session
                 @param userName             If provided, this username is used for authentication against the server
                 @param password             If provided, this password is used for authentication against the server
@@ -157,6 +544,27 @@ namespace Network
                 WillMessage * willMessage = nullptr, const QoSDelivery willQoS = QoSDelivery::AtMostOne, const bool willRetain = false, 
                 Properties * properties = nullptr);
 
+#if MQTTUseAsyncConnect == 1
+            /** Start connecting to the given server, without waiting for the network.
+                This takes the same parameters as connectTo, but it returns immediately. The connection is then made in steps by eventLoop:
+                resolving the host name, connecting the socket, the TLS handshake and the CONNECT / CONNACK exchange. Each step must
+                complete within the default timeout, and eventLoop waits at most the default timeout for it (or not at all in low latency mode).
+                The lock isn't held while waiting for the network, so the other tasks using this client aren't blocked meanwhile.
+                eventLoop returns InProgress until the connection is established, then Success. If the connection fails, it returns the
+                error instead and the client is disconnected. With the automatic reconnection (@sa setAutoReconnect), the parameters are
+                recorded now, so a failed connection is retried too.
+                The host name resolution can't be made asynchronous with the BSD socket API, it still waits for the DNS server (without
+                the lock) unless the host is a numeric address or it's cached (@sa MQTTCacheBrokerAddress).
+                @sa connectTo for the parameters
+                @return InProgress if the connection is started, AlreadyConnected if connected (or connecting) already, or an error */
+            ErrorType connectAsync(const char * serverHost, const uint16 port, bool useTLS = false, const uint16 keepAliveTimeInSec = 300,
+                const bool cleanStart = true, const char * userName = nullptr, const DynamicBinDataView * password = nullptr,
+                WillMessage * willMessage = nullptr, const QoSDelivery willQoS = QoSDelivery::AtMostOne, const bool willRetain = false,
+                Properties * properties = nullptr);
+            /** Check if an asynchronous connection is in progress (@sa connectAsync) */
+            bool isConnecting() const;
+#endif
+
 #if MQTTUseAuth == 1
             /** Authenticate with the given server.
                 This must be called after connectTo succeeded with the auth callback has been called 
@@ -190,6 +598,8 @@ namespace Network
             /** Subscribe to some topics.
 
                 Upon message receiving, the MessageReceived callback will be called.
+                This waits for the SUBACK packet. Any packet received meanwhile (like a retained publication) is processed as if
+                eventLoop was called.
 
                 @param topics               The topics to subscribe to. This can be a filter in the form `a/b/prefix*` (prefix can be missing too)
                                             The topics represent a chained list that are successively subscribed to.
@@ -208,6 +618,52 @@ namespace Network
                 @return An ErrorType */
             ErrorType unsubscribe(UnsubscribeTopic & topics, Properties * properties = nullptr);
 
+#if MQTTMaxInFlight > 0
+            /** Subscribe to some topics without waiting for the acknowledgement.
+                The request is registered in the pending requests table and this method returns as soon as the packet is sent.
+                The SUBACK packet is processed in the eventLoop and, once received, MessageReceived::subscribeCompleted is called
+                with the packet identifier. This allows to send many subscriptions back-to-back without waiting a round trip for each.
+
+                @param topics               The topics to subscribe to. @sa subscribe
+                @param properties           If provided those properties will be sent along the subscribe packet. @sa subscribe
+                @param packetIdentifier     If provided, will be filled with the packet identifier allocated for this request
+                @return An ErrorType. If it's ErrorType::OutOfWindow, too many requests are waiting for their acknowledgement,
+                        so you'll need to run the eventLoop and retry later */
+            ErrorType subscribeAsync(SubscribeTopic & topics, Properties * properties = nullptr, uint16 * packetIdentifier = nullptr);
+            /** Unsubscribe from some topics without waiting for the acknowledgement.
+                Same as subscribeAsync, but MessageReceived::unsubscribeCompleted is called upon receiving the UNSUBACK packet.
+
+                @param topics               The topics to unsubscribe from. @sa unsubscribe
+                @param properties           If provided those properties will be sent along the unsubscribe packet. @sa unsubscribe
+                @param packetIdentifier     If provided, will be filled with the packet identifier allocated for this request
+                @return An ErrorType. @sa subscribeAsync */
+            ErrorType unsubscribeAsync(UnsubscribeTopic & topics, Properties * properties = nullptr, uint16 * packetIdentifier = nullptr);
+#endif
+
+
+#if MQTTUseTopicRouter == 1
+            /** Route the publications matching a topic filter to a handler.
+                The routes are only used for dispatching the received publications, you still need to subscribe to the topic filter.
+                When a publication matches one or more routes, the matching handlers are called instead of MessageReceived::messageReceived.
+                A handler is called once per publication, even if it's used by multiple matching routes (like "a/+" and "a/#").
+                If no route matches, MessageReceived::messageReceived is called as usual.
+
+                @param topicFilter          The topic filter to match, as given to subscribe. Wildcards '+' and '#' are supported and
+                                            the shared subscription prefix (`$share/name/`) is ignored
+                @param handler              The handler called for each matching publication. No ownership is taken so it must outlive the route
+                @param subscriptionID       If non zero, the publications carrying this Subscription Identifier property are routed to this handler
+                                            without matching their topic. You must subscribe with a Subscription Identifier property set to this value.
+                                            The topic filter is still used if the broker does not send the identifier
+                @return An ErrorType (BadParameter if the topic filter is invalid) */
+            ErrorType addRoute(const char * topicFilter, SubscriptionHandler * handler, const uint32 subscriptionID = 0);
+            /** Remove a route added with addRoute.
+                @param topicFilter          The topic filter, as given to addRoute
+                @param handler              The handler, as given to addRoute
+                @param subscriptionID       The subscription identifier, as given to addRoute
+                @return An ErrorType (BadParameter if the route does not exist)
+                @warning Don't add or remove routes from a SubscriptionHandler::messageReceived callback */
+            ErrorType removeRoute(const char * topicFilter, SubscriptionHandler * handler, const uint32 subscriptionID = 0);
+#endif
 
             /** Publish to a topic.
                 @param topic                The topic to publish into.
@@ -219,7 +675,8 @@ namespace Network
                 @param properties           If provided those properties will be sent along the publish packet. Allowed properties for publish packet are: 
                                             Payload Format Indicator, Message Expiry Interval, Topic Alias, 
                                             Response topic, Correlation Data, Subscription Identifier, User property, Content Type
-                @return An ErrorType
+                @return An ErrorType. If an offline queue is set (@sa setOfflineQueue), the QoS publications without properties are queued
+                        while disconnected and this returns Success (or OutOfWindow if the queue is full)
                 @note You can call this method anytime from anywhere (including from inside a messageReceived callback). However, you must observe the return type carefully
                       If it is ErrorType::TranscientPacket, then this means that the publication failed and must be retried AFTER calling eventLoop, since a transcient
                       packet was received while waiting for packet's ACK. If you publish inside a messageReceived callback, this means that you must return from it first,
@@ -228,6 +685,196 @@ namespace Network
             ErrorType publish(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain = false, const QoSDelivery QoS = QoSDelivery::AtMostOne, 
                               const uint16 packetIdentifier = 0, Properties * properties = nullptr);
 
+#if MQTTMaxInFlight > 0
+            /** Publish to a topic without waiting for the acknowledgement.
+                For QoS AtLeastOnce and ExactlyOne, the publication is registered in the in-flight table and this method returns
+                as soon as the packet is sent. The acknowledgements are processed in the eventLoop (including sending the PUBREL packet
+                for ExactlyOne QoS) and, once done, MessageReceived::publishCompleted is called with the packet identifier.
+                For QoS AtMostOne, this is equivalent to publish.
+
+                @param topic                The topic to publish into.
+                @param payload              The payload to send to this publication, can be null
+                @param payloadLength        The length of the payload in bytes
+                @param retain               The retain flag for this message. If true, this message will stick to the topic and will (usually) be send to new subscribers.
+                @param QoS                  The quality of service delivery flag to use.
+                @param properties           If provided those properties will be sent along the publish packet. @sa publish
+                @param packetIdentifier     If provided, will be filled with the packet identifier allocated for this publication
+                @return An ErrorType. If it's ErrorType::OutOfWindow, too many publications are waiting for their acknowledgement,
+                        so you'll need to run the eventLoop and retry later. If the publication is queued (@sa setOfflineQueue), this returns
+                        Success and packetIdentifier is set to 0, the identifier given to publishCompleted is allocated when it's sent */
+            ErrorType publishAsync(const char * topic, const uint8 * payload, const uint32 payloadLength, const bool retain = false, const QoSDelivery QoS = QoSDelivery::AtLeastOne,
+                                   Properties * properties = nullptr, uint16 * packetIdentifier = nullptr);
+#endif
+
+            /** Prepare a publication template for publishing repeatedly on the same topic.
+                @param prepared             The publication to prepare (if it was already prepared, it's replaced)
+                @param topic                The topic to publish into.
+                @param retain               The retain flag for the publications.
+                @param QoS                  The quality of service delivery flag to use.
+                @param properties           If provided those properties will be sent along each publication. @sa publish
+                @return An ErrorType. BadProperties if the properties aren't allowed for a publication */
+            ErrorType preparePublish(PreparedPublish & prepared, const char * topic, const bool retain = false, const QoSDelivery QoS = QoSDelivery::AtMostOne,
+                                     Properties * properties = nullptr);
+
+            /** Publish with a prepared publication template.
+                This behaves like the other publish method, but the packet header isn't serialized again.
+                @param prepared             The prepared publication (@sa preparePublish)
+                @param payload              The payload to send to this publication, can be null
+                @param payloadLength        The length of the payload in bytes
+                @return An ErrorType. If an offline queue is set (@sa setOfflineQueue), prepared publications aren't queued, so this
+                        returns NotConnected while disconnected, and OutOfWindow until the queue is drained */
+            ErrorType publish(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength);
+
+#if MQTTMaxInFlight > 0
+            /** Publish with a prepared publication template without waiting for the acknowledgement.
+                @param prepared             The prepared publication (@sa preparePublish)
+                @param payload              The payload to send to this publication, can be null
+                @param payloadLength        The length of the payload in bytes
+                @param packetIdentifier     If provided, will be filled with the packet identifier allocated for this publication
+                @return An ErrorType. @sa publishAsync */
+            ErrorType publishAsync(PreparedPublish & prepared, const uint8 * payload, const uint32 payloadLength, uint16 * packetIdentifier = nullptr);
+#endif
+
+#if MQTTUsePublishStream == 1
+            /** Start a publication whose payload is written in chunks.
+                Only the publication's header is sent here, with the given payload length. The payload is then written with writePublish,
+                straight to the socket, in as many chunks as required, and the publication is finished with endPublish. This allows to
+                publish a large payload (like a file read from flash or a camera frame) without having it in memory at once.
+                The client's lock is held from a successful call to this method until endPublish returns (or a writePublish fails), so the
+                other tasks using this client are blocked meanwhile. Don't call any other method of this client (including eventLoop) from
+                this task before endPublish, or it'll deadlock.
+                Unlike publish, the topic isn't replaced with an alias and the publication isn't queued while disconnected.
+                @code
+                    if (client.beginPublish("log/file", fileSize) == MQTTv5::ErrorType::Success)
+                    {
+                        bool failed = false;
+                        while (size_t len = !failed ? fread(chunk, 1, sizeof(chunk), file) : 0)
+                            failed = client.writePublish(chunk, len) != MQTTv5::ErrorType::Success;
+                        if (!failed) client.endPublish(); // A failed write already aborted the publication
+                    }
+                @endcode
+                @param topic                The topic to publish into.
+                @param payloadLength        The total length of the payload in bytes. Exactly this amount must be written before calling endPublish
+                @param retain               The retain flag for this message.
+                @param QoS                  The quality of service delivery flag to use.
+                @param properties           If provided those properties will be sent along the publish packet. @sa publish
+                @param packetIdentifier     If provided (and MQTTMaxInFlight isn't 0), the publication isn't waited for in endPublish but tracked in the
+                                            in-flight table like with publishAsync, and this is filled with its packet identifier.
+                @return An ErrorType. If it's not Success, the lock isn't held and endPublish must not be called.
+                        If an offline queue is set (@sa setOfflineQueue), this returns OutOfWindow until the queue is drained */
+            ErrorType beginPublish(const char * topic, const uint32 payloadLength, const bool retain = false, const QoSDelivery QoS = QoSDelivery::AtMostOne,
+                                   Properties * properties = nullptr, uint16 * packetIdentifier = nullptr);
+            /** Write a chunk of the payload of the publication started with beginPublish.
+                @param chunk                The next part of the payload
+                @param length               The chunk length in bytes
+                @return An ErrorType. BadParameter if no publication is started by the calling task or if the chunk overflows the declared
+                        payload length (in the former case, the publication started by another task, if any, isn't aborted).
+                        On any error, the publication is aborted: the connection is closed (since the packet can't be completed), the
+                        lock is released and endPublish must not be called */
+            ErrorType writePublish(const uint8 * chunk, const uint32 length);
+            /** Finish the publication started with beginPublish, waiting for its acknowledgement if required, and release the lock.
+                If the declared payload length wasn't written entirely, the connection is closed since the packet can't be completed.
+                @return An ErrorType, like publish (or publishAsync if it's tracked in the in-flight table). BadParameter if the payload
+                        is incomplete or if the publication wasn't started by the calling task */
+            ErrorType endPublish();
+#endif
+
+#if MQTTUsePublishBatch == 1
+            /** Publish many messages at once.
+                The publications are serialized back to back in a single buffer and sent with a single socket write, so with TLS, they
+                are sent in a single record instead of one record per publication. This saves a lot of bandwidth and processing for bursts
+                of small messages (like sensor readings).
+                The batch isn't waited for: the QoS AtLeastOne and ExactlyOne publications are registered in the in-flight table like with
+                publishAsync, and MessageReceived::publishCompleted is called with each packet identifier once acknowledged. So the in-flight
+                window must have room for all of them (and MQTTMaxInFlight must not be 0 for using them).
+                Like prepared publications, the topic aliases aren't used and the publications can't have properties.
+                The buffer for the batch is allocated from the client's allocator if it doesn't fit in StackSizeAllocationLimit.
+                @param publications         The publications to send. On output, their packet identifier is set
+                @param count                The number of publications
+                @return An ErrorType. OutOfWindow if the in-flight window can't hold the batch's publications, so you'll need to run the
+                        eventLoop and retry later (or if an offline queue isn't drained yet, @sa setOfflineQueue). BadParameter if a publication
+                        is invalid. Nothing is sent unless this returns Success (or NetworkError) */
+            ErrorType publishBatch(BatchPublication * publications, const uint32 count);
+#endif
+
+#if MQTTManualAckWindow > 0
+            /** Enable the manual acknowledgement of the received publications.
+                By default, a QoS 1 or 2 publication is acknowledged as soon as MessageReceived::messageReceived (or the route's handler)
+                returns, so a slow handler stalls all the inbound traffic. Once enabled, the callback should only hand the publication to
+                another task (with its packet identifier) and return. The publication is acknowledged when ack is called, in any order.
+                The QoS 2 flow is then completed by the event loop upon receiving the broker's PUBREL.
+                The broker is told (with the Receive Maximum property) that up to MQTTManualAckWindow publications can be waiting for their
+                acknowledgement, so it stops sending QoS 1 and 2 publications once this window is full.
+                The received data is only valid during the callback, so the topic, payload and properties must be copied to be processed later.
+                A redelivered publication that's waiting for its acknowledgement isn't given to the callback again. The large streamed
+                publications (@sa MQTTStreamLargePublish) are still acknowledged automatically.
+                @param enable       If true, the received publications must be acknowledged with ack
+                @return An ErrorType. AlreadyConnected if the client is connected (or connecting), since the Receive Maximum can only be
+                        advertised in the CONNECT packet. This must be set before connecting */
+            ErrorType setManualAck(const bool enable);
+            /** Acknowledge a received publication (@sa setManualAck).
+                This can be called from any task, but not from the MessageReceived::messageReceived callback (the lock is held there).
+                The pending acknowledgements are dropped when the connection is lost. If the broker resumes the session, it sends the
+                publications again and they are given to the callback again.
+                @param packetIdentifier     The packet identifier given to the callback
+                @param reasonCode           The reason code to send to the broker. Any value above or equal to UnspecifiedError refuses the
+                                            publication (and ends its QoS 2 flow)
+                @return An ErrorType. BadParameter if there's no publication waiting for an acknowledgement with this identifier */
+            ErrorType ack(const uint16 packetIdentifier, const ReasonCodes reasonCode = ReasonCodes::Success);
+#endif
+
+#if MQTTReceiveBufferPool > 0
+            /** Take the publication being received, without copying it.
+                This must be called from the MessageReceived::messageReceived callback (or a route's handler). The receiving buffer holding the
+                publication is handed to the message and the client continues with a spare buffer (@sa MQTTReceiveBufferPool), so the message
+                can be queued to another task and processed later. Once done, release the message so the buffer returns to the pool.
+                With the manual acknowledgement (@sa setManualAck), the message's packet identifier is the one to give to ack.
+                @param message      The message to fill. It must not hold a publication already
+                @return true if the publication is taken, false if no spare buffer is available (copy the publication instead), if it's
+                        called outside of the callback or if the publication was already taken (by another route's handler) */
+            bool takeMessage(ReceivedMessage & message);
+#endif
+
+#if MQTTUseOfflineQueue == 1
+            /** Set the offline publication queue.
+                While the client is disconnected, the QoS AtLeastOne and ExactlyOne publications without properties are appended to this
+                queue instead of failing. Once connected, the queued publications are sent again in order from the eventLoop (as many as the
+                in-flight window allows, or one per call in synchronous mode), and the new publications are queued until the queue is drained.
+                A synchronous publication whose connection is lost while waiting for its acknowledgement is queued too. It's sent again with
+                the DUP flag and the same packet identifier if the broker resumed the session (Session Present), else as a new publication.
+                The asynchronous publications (@sa publishAsync) that the broker didn't receive yet when the connection is lost are queued
+                too, as duplicates. A copy of each queueable publication is kept (with the client's allocator) until the broker receives it
+                for this. MessageReceived::publishCompleted is then called once it's acknowledged after the reconnection, with the same
+                packet identifier if the broker resumed the session (else with the one allocated when it's sent again).
+                @param storage      The queue storage to use (@sa MemoryQueueStorage, PartitionQueueStorage). No ownership is taken so it must
+                                    outlive this client. Use 0 to disable the queue */
+            void setOfflineQueue(QueueStorage * storage);
+#endif
+#if MQTTUseAutoReconnect == 1
+            /** Enable the automatic reconnection.
+                Once enabled, the parameters of the next successful connectTo call are kept and the subscriptions made afterwards are recorded.
+                If the connection is lost (network error, unanswered ping or server disconnection), the event loop then connects again by itself,
+                without starting a clean session. If the broker resumed the session (Session Present), the subscriptions are still active and
+                aren't sent again, else they are all sent in a single SUBSCRIBE packet (one per Subscription Identifier). Then
+                MessageReceived::reconnected is called.
+                The attempts are spaced with an exponential backoff: the delay doubles after each failed attempt, up to the maximum delay, and
+                the actual wait is randomly chosen between half the delay and the delay, so the clients disconnected together (like when the
+                broker restarts) don't reconnect together.
+                To keep the session on the broker while disconnected, give a Session Expiry Interval property to connectTo.
+                Calling disconnect stops the automatic reconnection until the next connectTo call.
+                @param minDelayMs   The delay before the first attempt in milliseconds, use 0 to disable the automatic reconnection
+                @param maxDelayMs   The maximum delay between attempts in milliseconds */
+            void setAutoReconnect(const uint32 minDelayMs = 1000, const uint32 maxDelayMs = 60000);
+#endif
+#if MQTTUseTLS == 1 && MQTTTLSSessionResumption == 1 && MQTTOnlyBSDSocket == 1
+            /** Set the storage for the TLS session.
+                The TLS configuration and the last negotiated session are always kept in memory by this client, so reconnecting to the
+                server uses an abbreviated handshake. With a storage, the session is saved after each full handshake and loaded before
+                the first connection, so this also works after a reboot or a deep sleep.
+                @param store        The session store to use. No ownership is taken so it must outlive this client. Use 0 to disable it */
+            void setTLSSessionStore(TLSSessionStore * store);
+#endif
+
             /** The client event loop you must call regularly.
                 MQTT is a bidirectional protocol where the server sends packet to the client even without it asking for it.
                 So you must call this method regularly to fetch any pending message and prevent the client from being disconnected from the server.
@@ -235,8 +882,50 @@ namespace Network
                 You'll likely call this in thread/task to avoid disrupting your main application flow.
                 It's safe to be called from any thread. This method will likely call MessageReceived::messageReceived callback upon receiving a message.
 
+                @param maxPackets           The maximum number of packets to process in this call. The network is only waited for the first packet,
+                                            the following packets are only processed if they are already received (the client reads ahead as
+                                            many bytes as possible). Use 0 to process all the received packets.
+                @return Success, TimedOut if the server didn't answer the keep alive ping in time (the connection is closed then), or an error.
+                        With the automatic reconnection (@sa setAutoReconnect), this waits for the next attempt (up to the default timeout) and
+                        returns NotConnected or the attempt's error while disconnected, so keep calling it.
+                        While an asynchronous connection is in progress (@sa connectAsync), this returns InProgress
                 @warning Don't call eventLoop from your MessageReceived::messageReceived callback to avoid recursion. */
-            ErrorType eventLoop();
+            ErrorType eventLoop(const uint32 maxPackets = 1);
+
+            /** Wait until the event loop has something to do, without spinning.
+                This sleeps on the socket until some data is received or the keep alive deadline expires (@sa getNextDeadline), so the
+                task calling the event loop only wakes up when required. This is useful on battery powered nodes, instead of calling
+                eventLoop in a loop (which either blocks for the default timeout or busy waits in low latency mode).
+                The lock isn't held while waiting, so other tasks can publish meanwhile.
+                A typical task loop is:
+                @code
+                    for (;;)
+                    {
+                        MQTTv5::ErrorType ret = client.waitForActivity(60000);
+                        if (ret == MQTTv5::ErrorType::TimedOut) continue; // Nothing happened, do your own periodic work here
+                        if (ret || (ret = client.eventLoop(0))) break; // Error, reconnect here
+                    }
+                @endcode
+
+                @param maxWaitMs            The maximum time to wait in milliseconds
+                @return Success if eventLoop should be called now, TimedOut if nothing happened in the given time, or an error */
+            ErrorType waitForActivity(const uint32 maxWaitMs);
+
+            /** Get the time before the event loop must be called for the keep alive.
+                If you wait on the socket yourself (@sa getSocketHandle), for example with a single select call on many sockets,
+                use this as your timeout.
+                @return The time in milliseconds before the event loop must be called, 0 if it must be called now (data is already
+                        buffered, queued publications can be sent, the server must be pinged or its ping answer is late), or 0xFFFFFFFF if not connected. With the automatic
+                        reconnection, this is the time before the next attempt while disconnected. While connecting asynchronously, this
+                        is 0 since the event loop waits for the connection progress by itself */
+            uint32 getNextDeadline() const;
+
+            /** Get the socket descriptor of the connection.
+                You can use it to wait for incoming data with your own select or poll call (not to read or write it).
+                When it's readable, call eventLoop.
+                @warning With TLS, decrypted data can be buffered while the socket isn't readable, check getNextDeadline before waiting
+                @return The socket descriptor or -1 if not connected */
+            int getSocketHandle() const;
 
             /** Disconnect from the server
                 @param code                 The disconnection reason
@@ -248,6 +937,30 @@ namespace Network
             /** Set the default network timeout used in millisecond */
             void setDefaultTimeout(const uint32 timeoutMs); 
 
+#if MQTTPacketTrace > 0
+            /** Get the last packets from the trace ring (@sa MQTTPacketTrace).
+                This is consistent (taken under the client's lock), so it can be called from any task. Save the entries as is to decode
+                them offline with the tools/TraceDecoder tool.
+                @param entries  An array of entries to fill, oldest first
+                @param count    The number of entries in the array
+                @return The number of entries filled (less than count if fewer packets were exchanged) */
+            uint32 getTrace(TraceEntry * entries, const uint32 count) const;
+            /** Print the trace ring's entries, oldest first, one line per packet.
+                This is meant to be called upon an error (like when eventLoop fails), since printing is slow. The entries are copied on
+                the stack, or with the client's allocator if the ring is larger than the stack allocation limit */
+            void dumpTrace() const;
+            /** Clear the trace ring */
+            void clearTrace();
+#endif
+#if MQTTUseStatistics == 1
+            /** Get a snapshot of the runtime statistics.
+                This is consistent (taken under the client's lock), so it can be exported to your metrics from any task
+                @param stats    On output, the current counters */
+            void getStats(Stats & stats) const;
+            /** Reset the runtime statistics */
+            void resetStats();
+#endif
+
             // Construction and destruction
         public:
             /** Default constructor 
@@ -259,8 +972,10 @@ namespace Network
                                     If you don't have a PEM encoded certificate, use this command to save the server's certificate to a .PEM file
                                     $ echo | openssl s_client -servername your.server.com -connect your.server.com:8883 2>/dev/null | openssl x509 > cert.pem                                    
                                     If you have a PEM encoded certificate, use this code to convert it to (33% smaller) DER format 
-                                    $ openssl x509 -in cert.pem -outform der -out cert.der */
-            MQTTv5(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert = 0);
+                                    $ openssl x509 -in cert.pem -outform der -out cert.der
+                @param allocator    If provided, the allocator to use for the receiving buffer and the temporary packet buffers (like a static
+                                    arena or a PSRAM pool, @sa Platform::ArenaAllocator). It must outlive this client. Defaults to the heap */
+            MQTTv5(const char * clientID, MessageReceived * callback, const DynamicBinDataView * brokerCert = 0, Platform::Allocator * allocator = 0);
             /** Default destructor */
             ~MQTTv5();
             
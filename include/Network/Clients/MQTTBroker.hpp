@@ -0,0 +1,118 @@
+#ifndef hpp_CPP_MQTTBroker_CPP_hpp
+#define hpp_CPP_MQTTBroker_CPP_hpp
+
+// We need the client declaration
+#include "MQTT.hpp"
+
+#if MQTTUseLocalBroker == 1
+namespace Network
+{
+    namespace Client
+    {
+        /** A lightweight MQTT v5 broker for the local network.
+
+            The devices on the same network can exchange their publications through this broker without a round trip to the cloud
+            broker. The topic filters of all the connected clients are stored in a single topic trie, so a publication is matched once
+            and sent to each subscriber straight from the receiving buffer (its header is built once for all the subscribers).
+            The topics matching a bridged filter (@sa bridge) are also forwarded upstream with a connected MQTTv5 client.
+
+            To remain small, this broker has some limitations, that are advertised to the clients upon connection as the standard requires:
+            - publications are delivered to the local subscribers with QoS 0 (QoS 1 and 2 publications are acknowledged upon reception,
+              without any state, so a QoS 2 publication that's sent again is delivered again)
+            - no retained messages, no shared subscriptions, no subscription identifiers and no topic aliases
+            - no persistent session (a client reconnecting starts a new session) and no authentication
+
+            All the connections are serviced from a single task with the run method, like this:
+            @code
+                MQTTBroker broker;
+                if (broker.start(1883) != MQTTv5::ErrorType::Success) return;
+                // Forward the sensors' data to the cloud broker, with an already connected client
+                broker.bridge("sensors/#", cloudClient);
+
+                for (;;)
+                {
+                    if (broker.run(1000) < 0) break;
+                    // Do your own periodic work here
+                }
+            @endcode
+
+            The publications received from the cloud broker can be given to the local subscribers with the publish method (typically from
+            the upstream client's MessageReceived::messageReceived callback). They aren't forwarded upstream again.
+
+            @warning The bridged clients are published to without holding the broker's lock (so it's safe to call publish from their callbacks),
+                     so only bridge and unbridge them from the task calling run (or while it's not running)
+            @warning The connections are waited with select, so the socket descriptors must be lower than FD_SETSIZE */
+        class MQTTBroker
+        {
+            // Type definition and enumeration
+        public:
+            struct Impl;
+
+            // Members
+        private:
+            /** The PImpl idiom used here to avoid exposing the internal implementation */
+            Impl * impl;
+
+            // Interface
+        public:
+            /** Start listening for the clients' connections on the given port
+                @param port         The TCP port to listen on (usually 1883)
+                @param maxClients   The maximum number of simultaneous connections, the following ones are closed upon acceptance
+                @return Success, AlreadyConnected if already started, or NetworkError if the port can't be listened on */
+            MQTTv5::ErrorType start(const uint16 port, const uint32 maxClients = 8);
+            /** Stop the broker, closing all the connections (their will messages aren't published).
+                Don't call this while run is waiting on another task */
+            void stop();
+            /** Wait for activity on the listening socket and on the connections, and service them.
+                The received packets are processed, the new connections are accepted and the clients whose keep alive expired are
+                disconnected (publishing their will message, if any).
+                @param maxWaitMs    The maximum time to wait in milliseconds, if there's nothing to do
+                @return The number of packets processed (0 on timeout), or -1 if not started or on select error */
+            int run(const uint32 maxWaitMs);
+
+            /** Publish to the local subscribers.
+                This is used to inject publications from the application or from an upstream client. It's not forwarded to the bridged
+                clients. This can be called from any task.
+                @param topic            The topic name to publish into
+                @param payload          The payload to send to this publication, can be null
+                @param payloadLength    The length of the payload in bytes
+                @return Success, NotConnected if not started or BadParameter if the topic name is invalid */
+            MQTTv5::ErrorType publish(const char * topic, const uint8 * payload, const uint32 payloadLength);
+
+            /** Forward the publications matching the given topic filter to an upstream client.
+                A publication matching many filters of the same client is only forwarded once, with the largest QoS.
+                Up to 4 different upstream clients can be bridged (with as many filters as required).
+                The publications are forwarded without their properties, with MQTTv5::publishAsync if MQTTMaxInFlight isn't 0 (else with
+                MQTTv5::publish, so only with QoS AtMostOne, since the broker would wait for the upstream acknowledgement of each publication).
+                The forwarding is never waited for: a publication is dropped silently if the upstream client isn't connected or if its
+                in-flight window is full (OutOfWindow).
+                The upstream client is not owned, it must outlive the broker (or be unbridged).
+                @param topicFilter      The topic filter, it can contain '+' and '#' wildcards
+                @param upstream         The client to forward the publications with
+                @param QoS              The QoS for the forwarded publications
+                @return Success or BadParameter if the topic filter is invalid, if the QoS isn't AtMostOne while MQTTMaxInFlight is 0, or
+                        if 4 other upstream clients are already bridged */
+            MQTTv5::ErrorType bridge(const char * topicFilter, MQTTv5 & upstream, const MQTTv5::QoSDelivery QoS = MQTTv5::QoSDelivery::AtMostOne);
+            /** Stop forwarding the publications matching the given topic filter to an upstream client
+                @return Success or BadParameter if the filter wasn't bridged to this client */
+            MQTTv5::ErrorType unbridge(const char * topicFilter, MQTTv5 & upstream);
+
+            /** Get the number of connected clients */
+            uint32 getClientCount() const;
+
+            // Construction and destruction
+        public:
+            /** Build a broker
+                @param maxPacketSize    The maximum packet size accepted from the clients (advertised to them). Each connection has a
+                                        receiving buffer of this size
+                @param allocator        If provided, the allocator to use for the receiving buffers. It must outlive this broker.
+                                        Defaults to the heap */
+            MQTTBroker(const uint32 maxPacketSize = 2048, Platform::Allocator * allocator = 0);
+            /** The broker is stopped if required */
+            ~MQTTBroker();
+        };
+    }
+}
+#endif
+
+#endif
@@ -4,9 +4,23 @@
 // Configuration is done via macros
 #include "sdkconfig.h"
 
+/** Local broker
+    If set to 1, a lightweight broker can run on the device (@sa MQTTBroker), so the devices on the local network exchange their
+    publications directly instead of going through the cloud broker and back. Selected topics are forwarded upstream with a bridged
+    MQTTv5 client. This enables the server side of the protocol (see below), yet the received packets are still parsed in place.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTUseLocalBroker CONFIG_ESP_EMQTT5_BROKER
+
 /** Is the protocol going to be used as a client only or as a broker.
+    This is deduced from MQTTUseLocalBroker.
     Default: 1. */
-#define MQTTClientOnlyImplementation 1
+#if MQTTUseLocalBroker == 1
+  #define MQTTClientOnlyImplementation 0
+#else
+  #define MQTTClientOnlyImplementation 1
+#endif
 
 /** Authentication support. Set to 1 if your broker is using and expecting AUTH packet for connection.
     Typically unused for the majority of broker, this saves binary size if left disabled
@@ -26,6 +40,28 @@
     Default: 0 */
 #define MQTTDumpCommunication CONFIG_ESP_EMQTT5_DUMP
 
+/** Packet trace ring
+    If set to a value above 0, the client records a compact binary entry for each packet it sends or receives in a ring of this number
+    of entries: the time, the direction, the packet type and flags, the packet identifier, the length and the first MQTTPacketTraceBytes bytes.
+    Unlike MQTTDumpCommunication, nothing is formatted or printed while communicating, so it's cheap enough to be left enabled in the field.
+    The last entries are read with MQTTv5::getTrace (to save them) or printed with MQTTv5::dumpTrace, typically when an error happens.
+    The saved entries can be decoded on a computer with the tool in the tools/TraceDecoder folder.
+    Each entry costs 12 bytes of RAM plus the captured bytes.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTPacketTrace CONFIG_ESP_EMQTT5_TRACE_ENTRIES
+
+/** Number of bytes captured for each packet in the trace ring
+    The beginning of a packet holds its header (and the topic name for a publication), so a few bytes are usually enough.
+
+    Default: 16 */
+#if defined(CONFIG_ESP_EMQTT5_TRACE_BYTES)
+  #define MQTTPacketTraceBytes CONFIG_ESP_EMQTT5_TRACE_BYTES
+#else
+  #define MQTTPacketTraceBytes 16
+#endif
+
 /** Remove all validation from MQTT types.
     This removes validation check for all MQTT types in order to save binary size.
     This is only recommanded if you are sure about your broker implementation (don't set this to 1 if you
@@ -42,6 +78,28 @@
     Default: 1 */
 #define MQTTUseTLS          CONFIG_ESP_EMQTT5_TLS_ENABLE
 
+/** TLS session resumption.
+    If set to 1, the session negotiated with the server is kept (and optionally saved, @sa MQTTv5::setTLSSessionStore), so
+    reconnecting uses an abbreviated handshake (session ticket or session ID), saving seconds of CPU time and a lot of heap on
+    an ESP32. The session costs a few hundred bytes of RAM (more if mbedtls keeps the peer certificate).
+    The TLS configuration and the CA chain are kept across reconnections anyway, whatever this value.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+    Default: 0 */
+#define MQTTTLSSessionResumption CONFIG_ESP_EMQTT5_TLS_RESUME
+
+/** TLS low memory profile.
+    By default, mbedtls uses 16kB records, so it needs two buffers of about 16kB per connection.
+    If set to 1, the client asks the server for smaller records (RFC 6066 Max Fragment Length extension), choosing the smallest of
+    512, 1024, 2048 or 4096 bytes that holds the largest packet the client accepts (@sa MessageReceived::maxPacketSize). Larger
+    packets are simply split in many records.
+    The record buffers are sized by mbedtls' configuration, so to actually save memory, either enable MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+    (mbedtls then shrinks its buffers once the length is negotiated), or reduce MBEDTLS_SSL_IN_CONTENT_LEN and MBEDTLS_SSL_OUT_CONTENT_LEN
+    if the server is known to accept the extension. On ESP-IDF, MBEDTLS_DYNAMIC_BUFFER also releases the buffers while they aren't used.
+    This requires MBEDTLS_SSL_MAX_FRAGMENT_LENGTH in mbedtls' configuration.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+    Default: 0 */
+#define MQTTTLSLowMemory    CONFIG_ESP_EMQTT5_TLS_LOW_MEMORY
+
 /** Simple socket code.
     If set to true, this disables the optimized network code from ClassPath and fallback to the minimal subset
     of BSD socket API (typically send / recv / connect / select / close / setsockopt).
@@ -68,6 +126,172 @@
     Default: 0 */
 #define MQTTLowLatency  CONFIG_ESP_EMQTT5_LOW_LATENCY
 
+/** Maximum number of QoS 1 and 2 publications in flight
+    If set to a value above 0, this enables the asynchronous publishing mode (MQTTv5::publishAsync) where
+    publications don't wait for their acknowledgement. Up to this number of publications can be waiting for their
+    acknowledgement (the actual window is the minimum of this value and the broker's Receive Maximum property).
+    Acknowledgements are processed in the event loop and reported via MessageReceived::publishCompleted.
+    This also enables MQTTv5::subscribeAsync and MQTTv5::unsubscribeAsync, with up to this number of requests pending.
+    Each entry in the in-flight and pending requests tables costs 4 bytes of RAM.
+
+    Default: 0 */
+#define MQTTMaxInFlight CONFIG_ESP_EMQTT5_MAX_INFLIGHT
+
+/** Maximum number of outbound topic aliases
+    If set to a value above 0, the client automatically replaces the topic name of the publications with a 2 bytes
+    topic alias once the broker knows about it. The aliases are assigned to the most recently used topics, up to the
+    minimum of this value and the broker's Topic Alias Maximum property.
+    Each alias costs a copy of the topic name on the heap.
+
+    Default: 0 */
+#define MQTTOutTopicAliasMax CONFIG_ESP_EMQTT5_OUT_ALIAS_MAX
+
+/** Maximum number of inbound topic aliases
+    If set to a value above 0, the client tells the broker (via the Topic Alias Maximum property of the CONNECT packet)
+    that it accepts up to this number of topic aliases on the publications it receives. The aliases are resolved
+    by the client so the callbacks always get the full topic name.
+    Each alias costs a copy of the topic name on the heap.
+
+    Default: 0 */
+#define MQTTInTopicAliasMax CONFIG_ESP_EMQTT5_IN_ALIAS_MAX
+
+/** Subscription router
+    If set to 1, the received publications can be dispatched to a SubscriptionHandler per topic filter
+    (@sa MQTTv5::addRoute) instead of the single MessageReceived::messageReceived callback.
+    The topic filters are compiled in a trie, so finding the handlers costs O(topic levels), or even less
+    if the subscription is done with a Subscription Identifier property.
+
+    Default: 0 */
+#define MQTTUseTopicRouter CONFIG_ESP_EMQTT5_TOPIC_ROUTER
+
+/** Large publication streaming
+    If set to 1, the publications that are larger than the receiving buffer (@sa MessageReceived::maxPacketSize) are
+    not rejected anymore. Instead, their payload is given to MessageReceived::messageChunkReceived in chunks as they are
+    received, so the receiving buffer only needs to hold the topic name and the properties.
+    The client doesn't advertise its buffer size as its Maximum Packet Size property to the broker in that case.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTStreamLargePublish CONFIG_ESP_EMQTT5_STREAMING
+
+/** Offline publication queue
+    If set to 1, the QoS 1 and 2 publications made while the client is disconnected are stored in a queue (@sa MQTTv5::setOfflineQueue)
+    instead of being rejected. They are sent again, in order, from the event loop once the client is connected.
+    The queue can be stored in RAM (MemoryQueueStorage), in a flash partition (PartitionQueueStorage with ESP-IDF) or in your
+    own QueueStorage implementation.
+
+    Default: 0 */
+#define MQTTUseOfflineQueue CONFIG_ESP_EMQTT5_OFFLINE_QUEUE
+
+/** Client pool
+    If set to 1, many clients can be serviced from a single thread with a MQTTv5Pool, instead of running an event loop per client.
+    The pool waits on all the sockets with a single select call and tracks the keep alive deadlines in a timing wheel.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTUseClientPool CONFIG_ESP_EMQTT5_POOL
+
+/** Runtime statistics
+    If set to 1, the client counts the bytes and packets sent and received (per packet type), the retransmissions, the ping
+    round trip time, the publication latency (as an histogram) and the time spent waiting for its lock. The counters can be read
+    with MQTTv5::getStats, to export them to your metrics without logging each packet like MQTTDumpCommunication does.
+    This costs about 220 bytes of RAM per client.
+
+    Default: 0 */
+#define MQTTUseStatistics CONFIG_ESP_EMQTT5_STATS
+
+/** Automatic reconnection
+    If set to 1, the client can reconnect by itself from the event loop when the connection is lost (@sa MQTTv5::setAutoReconnect),
+    with a jittered exponential backoff. The subscriptions are recorded and sent again if the broker didn't keep the session.
+    This costs a copy of the connection parameters and of the subscribed topic filters on the heap.
+
+    Default: 0 */
+#define MQTTUseAutoReconnect CONFIG_ESP_EMQTT5_RECONNECT
+
+/** Asynchronous connection
+    If set to 1, the client can connect without blocking (@sa MQTTv5::connectAsync): the connection is made in steps (name resolution,
+    TCP connection, TLS handshake, CONNECT / CONNACK exchange) by the event loop, without holding the client's lock while waiting for
+    the network. The automatic reconnection (@sa MQTTUseAutoReconnect) uses it too, so the other tasks aren't blocked while reconnecting.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTUseAsyncConnect CONFIG_ESP_EMQTT5_ASYNC_CONNECT
+
+/** Broker address cache
+    If set to 1, the resolved address of the broker is kept, so connecting again to the same broker doesn't wait for the DNS server.
+    The cached address is forgotten if the broker can't be reached there, so the next attempt resolves its name again.
+    Numeric addresses are never resolved, whatever this value.
+
+    Default: 0 */
+#define MQTTCacheBrokerAddress CONFIG_ESP_EMQTT5_DNS_CACHE
+
+/** Streaming publication
+    If set to 1, a publication can be sent in chunks (@sa MQTTv5::beginPublish), so the payload doesn't need to be in memory at once.
+    Only the header is serialized, and each payload chunk is written to the socket as soon as it's given.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTUsePublishStream CONFIG_ESP_EMQTT5_PUBLISH_STREAM
+
+/** Batch publication
+    If set to 1, many publications can be sent at once (@sa MQTTv5::publishBatch): they are serialized back to back in a single
+    buffer and written with a single socket write. With TLS, this makes a single record instead of one per publication, saving the
+    record overhead and the MAC computation for each of them.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTUsePublishBatch CONFIG_ESP_EMQTT5_PUBLISH_BATCH
+
+/** Maximum number of received publications waiting for a manual acknowledgement
+    If set to a value above 0, the QoS 1 and 2 publications can be acknowledged by the application once processed (@sa MQTTv5::setManualAck)
+    instead of as soon as MessageReceived::messageReceived returns, so they can be handed to other tasks without stalling the event loop.
+    This value is advertised to the broker as the client's Receive Maximum property, so the broker never sends more unacknowledged
+    publications than this. Each entry costs 4 bytes of RAM.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTManualAckWindow CONFIG_ESP_EMQTT5_MANUAL_ACK_WINDOW
+
+/** Maximum number of received QoS 2 publications waiting for their release
+    If set to a value above 0, the event loop doesn't wait for the broker's PUBREL after receiving a QoS 2 publication (so any other
+    packet received meanwhile doesn't break the flow). The PUBREC is sent once the publication is dispatched and its packet identifier
+    is kept in a table until the PUBREL is received, then the PUBCOMP is sent from the event loop.
+    A publication that's received again while in the table (because the broker didn't get the PUBREC) isn't given to the application
+    twice, it's only acknowledged again. The table is kept across reconnections if the broker resumes the session.
+    This value is advertised to the broker as the client's Receive Maximum (unless the manual acknowledgement is enabled, @sa
+    MQTTManualAckWindow, whose table is shared). Each entry costs 4 bytes.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTReceivedQoS2Max CONFIG_ESP_EMQTT5_QOS2_RECEIVED_MAX
+
+/** Number of spare receiving buffers
+    If set to a value above 0, a received publication can be taken by the application from the MessageReceived::messageReceived callback
+    (@sa MQTTv5::takeMessage): the receiving buffer holding it is handed over as is, and the client switches to a spare buffer. So the
+    publication can be processed later on another task without copying it. The buffer returns to the pool once the message is released.
+    Each spare buffer costs MessageReceived::maxPacketSize bytes, allocated with the client's allocator upon construction.
+    This only works with the BSD socket code (MQTTOnlyBSDSocket set to 1).
+
+    Default: 0 */
+#define MQTTReceiveBufferPool CONFIG_ESP_EMQTT5_RECV_BUFFERS
+
+#if MQTTReceiveBufferPool > 0 && MQTTOnlyBSDSocket != 1
+  #error "The spare receiving buffers (MQTTReceiveBufferPool) require the BSD socket code (MQTTOnlyBSDSocket set to 1)"
+#endif
+
+/** Keep alive ping delay
+    The percentage of the keep alive delay without any communication after which the server is pinged. The server must then
+    answer before the keep alive delay expires (or the default timeout, whichever is longer), else the connection is
+    considered dead and closed. A lower value detects a dead link earlier and gives more time for the answer, at the cost of
+    more pings.
+
+    Default: 75 */
+#if defined(CONFIG_ESP_EMQTT5_KEEPALIVE_PERCENT)
+  #define MQTTKeepAlivePercent CONFIG_ESP_EMQTT5_KEEPALIVE_PERCENT
+#else
+  #define MQTTKeepAlivePercent 75
+#endif
+
 
 // The part below is for building only, it's made to generate a message so the configuration is visible at build time
 #if MQTTUseAuth == 1
@@ -88,6 +312,12 @@
   #define CONF_DUMP "_"
 #endif
 
+#if MQTTPacketTrace > 0
+  #define CONF_TRACE "Trace_"
+#else
+  #define CONF_TRACE "_"
+#endif
+
 #if MQTTAvoidValidation == 1
   #define CONF_VALID "Check_"
 #else
@@ -100,19 +330,133 @@
   #define CONF_TLS "_"
 #endif
 
+#if MQTTUseTLS == 1 && MQTTTLSSessionResumption == 1
+  #define CONF_TLSRESUME "Resume_"
+#else
+  #define CONF_TLSRESUME "_"
+#endif
+
+#if MQTTUseTLS == 1 && MQTTTLSLowMemory == 1
+  #define CONF_TLSLOWMEM "LowMem_"
+#else
+  #define CONF_TLSLOWMEM "_"
+#endif
+
 #if MQTTLowLatency == 1
   #define CONF_LL "LL_"
 #else
   #define CONF_LL "_"
 #endif
 
+#if MQTTMaxInFlight > 0
+  #define CONF_INFLIGHT "Async_"
+#else
+  #define CONF_INFLIGHT "_"
+#endif
+
+#if MQTTOutTopicAliasMax > 0
+  #define CONF_OUTALIAS "OutAlias_"
+#else
+  #define CONF_OUTALIAS "_"
+#endif
+
+#if MQTTInTopicAliasMax > 0
+  #define CONF_INALIAS "InAlias_"
+#else
+  #define CONF_INALIAS "_"
+#endif
+
+#if MQTTUseTopicRouter == 1
+  #define CONF_ROUTER "Router_"
+#else
+  #define CONF_ROUTER "_"
+#endif
+
+#if MQTTStreamLargePublish == 1
+  #define CONF_STREAM "Stream_"
+#else
+  #define CONF_STREAM "_"
+#endif
+
+#if MQTTUseOfflineQueue == 1
+  #define CONF_QUEUE "Queue_"
+#else
+  #define CONF_QUEUE "_"
+#endif
+
+#if MQTTUseClientPool == 1
+  #define CONF_POOL "Pool_"
+#else
+  #define CONF_POOL "_"
+#endif
+
+#if MQTTUseStatistics == 1
+  #define CONF_STATS "Stats_"
+#else
+  #define CONF_STATS "_"
+#endif
+
+#if MQTTUseAutoReconnect == 1
+  #define CONF_RECONNECT "Reconnect_"
+#else
+  #define CONF_RECONNECT "_"
+#endif
+
+#if MQTTUseAsyncConnect == 1
+  #define CONF_ASYNCCONNECT "AsyncConnect_"
+#else
+  #define CONF_ASYNCCONNECT "_"
+#endif
+
+#if MQTTCacheBrokerAddress == 1
+  #define CONF_DNSCACHE "DNSCache_"
+#else
+  #define CONF_DNSCACHE "_"
+#endif
+
+#if MQTTUsePublishStream == 1
+  #define CONF_PUBSTREAM "PubStream_"
+#else
+  #define CONF_PUBSTREAM "_"
+#endif
+
+#if MQTTUsePublishBatch == 1
+  #define CONF_PUBBATCH "PubBatch_"
+#else
+  #define CONF_PUBBATCH "_"
+#endif
+
+#if MQTTManualAckWindow > 0
+  #define CONF_MANUALACK "ManualAck_"
+#else
+  #define CONF_MANUALACK "_"
+#endif
+
+#if MQTTReceivedQoS2Max > 0
+  #define CONF_QOS2TABLE "QoS2Table_"
+#else
+  #define CONF_QOS2TABLE "_"
+#endif
+
+#if MQTTReceiveBufferPool > 0
+  #define CONF_RECVPOOL "RecvPool_"
+#else
+  #define CONF_RECVPOOL "_"
+#endif
+
+#if MQTTUseLocalBroker == 1
+  #define CONF_BROKER "Broker_"
+#else
+  #define CONF_BROKER "_"
+#endif
+
 #if MQTTOnlyBSDSocket == 1
   #define CONF_SOCKET "BSD"
 #else
   #define CONF_SOCKET "CP"
 #endif
 
-#pragma message("Building eMQTT5 with flags: " CONF_AUTH CONF_UNSUB CONF_DUMP CONF_VALID CONF_TLS CONF_LL CONF_SOCKET)
+#pragma message("Building eMQTT5 with flags: " CONF_AUTH CONF_UNSUB CONF_DUMP CONF_TRACE CONF_VALID CONF_TLS CONF_TLSRESUME CONF_TLSLOWMEM CONF_LL CONF_INFLIGHT CONF_OUTALIAS CONF_INALIAS CONF_ROUTER CONF_STREAM CONF_QUEUE CONF_POOL CONF_STATS CONF_RECONNECT CONF_ASYNCCONNECT CONF_DNSCACHE CONF_PUBSTREAM CONF_PUBBATCH CONF_MANUALACK CONF_QOS2TABLE CONF_RECVPOOL CONF_BROKER CONF_SOCKET)
 
 
 #endif
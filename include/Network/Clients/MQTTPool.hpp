@@ -0,0 +1,147 @@
+#ifndef hpp_CPP_MQTTPool_CPP_hpp
+#define hpp_CPP_MQTTPool_CPP_hpp
+
+// We need the client declaration
+#include "MQTT.hpp"
+
+#if MQTTUseClientPool == 1
+namespace Network
+{
+    namespace Client
+    {
+        /** Service many MQTTv5 clients from a single thread.
+
+            Instead of running one task (and one stack) per connection, each calling its own blocking event loop, the clients are
+            added to a pool whose run method waits on all their sockets with a single select call. Only the clients whose socket
+            is readable or whose keep alive expired are serviced.
+
+            The keep alive deadlines are stored in a hashed timing wheel, so rescheduling a client and finding the next deadline
+            doesn't depend on the number of clients. Ticks are 128ms long, which is the precision of the keep alive timers
+            (way below the keep alive period which is counted in seconds).
+
+            The clients are not owned by the pool, they must be connected before being added, and outlive the pool (or be removed).
+            A typical gateway loop is:
+            @code
+                MQTTv5Pool pool(&listener);
+                for (int i = 0; i < count; i++)
+                    if (clients[i].connectTo(...) == MQTTv5::ErrorType::Success) pool.add(clients[i]);
+
+                for (;;)
+                {
+                    if (pool.run(1000) < 0) break;
+                    // Do your own periodic work here, reconnect the failed clients and add them back to the pool
+                }
+            @endcode
+
+            @warning Don't add or remove clients from the MessageReceived callbacks of a pooled client, only from Listener::clientFailed
+                     or outside of the run method.
+            @warning The clients are waited with select, so the socket descriptors must be lower than FD_SETSIZE */
+        class MQTTv5Pool
+        {
+            // Type definition and enumeration
+        public:
+            /** The interface to be notified when a pooled client fails */
+            struct Listener
+            {
+                /** The given client failed while being serviced (network error, server disconnection, etc.).
+                    It was removed from the pool before this is called, so you can reconnect it and add it back from here.
+                    A client with the automatic reconnection (@sa MQTTv5::setAutoReconnect) or connecting asynchronously stays in the pool
+                    while it's disconnected, it's only reported if its connection is lost for good
+                    @param client   The failed client
+                    @param error    The error reported by the client's event loop */
+                virtual void clientFailed(MQTTv5 & client, const MQTTv5::ErrorType error) = 0;
+
+                virtual ~Listener() {}
+            };
+
+        private:
+            /** The timing wheel configuration: 64 slots of 128ms each, so a revolution is about 8s */
+            enum { TickShift = 7, SlotCount = 64 };
+
+            /** A client in the pool. The entries of a slot are kept in a doubly linked list */
+            struct Entry
+            {
+                /** The client */
+                MQTTv5 *    client;
+                /** The time when the client must be serviced, in milliseconds */
+                uint32      expiry;
+                /** The previous entry in the same slot */
+                Entry *     prev;
+                /** The next entry in the same slot */
+                Entry *     next;
+                /** The next entry to service in this run */
+                Entry *     nextDue;
+                /** Set if the entry is already in the list of entries to service */
+                bool        due;
+                /** Set if the client's socket is readable */
+                bool        readable;
+
+                Entry(MQTTv5 & client) : client(&client), expiry(0), prev(0), next(0), nextDue(0), due(false), readable(false) {}
+            };
+
+            // Members
+        private:
+            /** The timing wheel */
+            Entry *     slots[SlotCount];
+            /** The pooled clients */
+            Entry **    entries;
+            /** The number of pooled clients */
+            uint32      count;
+            /** The allocated size of the entries array */
+            uint32      capacity;
+            /** The last tick that was processed */
+            uint32      cursor;
+            /** The entries to service in this run */
+            Entry *     pending;
+            /** The listener to notify (can be 0) */
+            Listener *  listener;
+
+            // Helpers
+        private:
+            /** Get the current time in milliseconds from a monotonic clock */
+            static uint32 getTimeMs();
+            /** Insert the entry in the wheel's slot for its expiry time */
+            void link(Entry & entry);
+            /** Remove the entry from its wheel's slot */
+            void unlink(Entry & entry);
+            /** Reschedule the entry for its client's next deadline
+                @return false if the client isn't connected anymore */
+            bool schedule(Entry & entry, const uint32 now);
+            /** Get the time before the earliest expiry in the wheel, up to the given maximum, in milliseconds */
+            uint32 timeBeforeExpiry(const uint32 now, const uint32 maxWaitMs) const;
+            /** Find the index of the given client in the entries array
+                @return count if not found */
+            uint32 find(const MQTTv5 & client) const;
+            /** Remove the entry at the given index */
+            void removeAt(const uint32 index);
+
+            // Interface
+        public:
+            /** Add a connected client to the pool
+                @return Success, NotConnected if the client isn't connected, BadParameter if it's already pooled or its socket
+                        can't be waited with select, or UnknownError on allocation failure */
+            MQTTv5::ErrorType add(MQTTv5 & client);
+            /** Remove a client from the pool (it's not disconnected)
+                @return false if the client wasn't found */
+            bool remove(MQTTv5 & client);
+            /** Get the number of clients in the pool */
+            uint32 getCount() const { return count; }
+
+            /** Wait for activity on any pooled client and service them.
+                The clients whose socket is readable have their event loop run (processing all the received packets), while the clients
+                whose keep alive expired ping their server. A client failing is removed from the pool and reported to the listener.
+                @param maxWaitMs    The maximum time to wait in milliseconds, if there's nothing to do
+                @return The number of clients serviced (0 on timeout), or -1 on select error */
+            int run(const uint32 maxWaitMs);
+
+            /** Build a pool
+                @param listener     If provided, it's notified when a pooled client fails. It must outlive the pool */
+            MQTTv5Pool(Listener * listener = 0);
+            /** The clients are removed from the pool, but not disconnected */
+            ~MQTTv5Pool();
+        };
+    }
+}
+#endif
+
+#endif
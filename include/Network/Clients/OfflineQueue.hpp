@@ -0,0 +1,267 @@
+#ifndef hpp_CPP_OfflineQueue_CPP_hpp
+#define hpp_CPP_OfflineQueue_CPP_hpp
+
+// We need configuration here
+#include "MQTTConfig.hpp"
+// We need the basic types
+#include "../../Types.hpp"
+
+#if defined(ESP_PLATFORM)
+  #include "esp_partition.h"
+#endif
+
+namespace Network
+{
+    namespace Client
+    {
+        /** The storage interface for the offline publication queue (@sa MQTTv5::setOfflineQueue).
+            The queue stores opaque records, retrieved in the same order they were pushed.
+            You can implement this interface with any storage you want (file, EEPROM, external SPI RAM, ...). */
+        struct QueueStorage
+        {
+            /** Append a record at the end of the queue.
+                The record is made of 2 parts that are stored contiguously (to avoid copying the publication's payload)
+                @param head     The first part of the record
+                @param headSize The first part size in bytes
+                @param data     The second part of the record (can be 0 if dataSize is 0)
+                @param dataSize The second part size in bytes
+                @return false if there is no space left for this record */
+            virtual bool push(const uint8 * head, const uint32 headSize, const uint8 * data, const uint32 dataSize) = 0;
+            /** Get the size of the first record in bytes
+                @return 0 if the queue is empty */
+            virtual uint32 frontSize() = 0;
+            /** Read the first record
+                @param buffer   A buffer that's frontSize() bytes long
+                @param size     The buffer size in bytes
+                @return false on error */
+            virtual bool front(uint8 * buffer, const uint32 size) = 0;
+            /** Remove the first record from the queue */
+            virtual void pop() = 0;
+
+            /** Check if the queue is empty */
+            bool isEmpty() { return frontSize() == 0; }
+
+            virtual ~QueueStorage() {}
+        };
+
+        /** A queue storage using a ring buffer in RAM.
+            The records are lost upon reboot, but this is fast and it doesn't wear any flash */
+        class MemoryQueueStorage Final : public QueueStorage
+        {
+            /** The ring buffer */
+            uint8 *     buffer;
+            /** The ring buffer size in bytes */
+            uint32      size;
+            /** The position of the first record */
+            uint32      head;
+            /** The used size in bytes */
+            uint32      used;
+            /** Set if we own the buffer */
+            bool        owned;
+
+            /** Copy data in the ring buffer, at the given position (wrapping around the end if required) */
+            void write(const uint32 pos, const uint8 * data, const uint32 length)
+            {
+                const uint32 first = min(length, size - pos);
+                memcpy(&buffer[pos], data, first);
+                memcpy(buffer, data + first, length - first);
+            }
+            /** Copy data from the ring buffer, at the given position (wrapping around the end if required) */
+            void read(const uint32 pos, uint8 * data, const uint32 length) const
+            {
+                const uint32 first = min(length, size - pos);
+                memcpy(data, &buffer[pos], first);
+                memcpy(data + first, buffer, length - first);
+            }
+            /** Wrap a position in the ring buffer */
+            uint32 wrap(const uint32 pos) const { return pos >= size ? pos - size : pos; }
+
+        public:
+            bool push(const uint8 * h, const uint32 headSize, const uint8 * data, const uint32 dataSize)
+            {
+                const uint32 length = headSize + dataSize;
+                if (!buffer || length == 0 || (uint64)length + sizeof(length) > size - used) return false;
+                uint32 pos = wrap(head + used);
+                write(pos, (const uint8*)&length, sizeof(length)); pos = wrap(pos + sizeof(length));
+                write(pos, h, headSize); pos = wrap(pos + headSize);
+                if (dataSize) write(pos, data, dataSize);
+                used += length + sizeof(length);
+                return true;
+            }
+            uint32 frontSize()
+            {
+                if (!used) return 0;
+                uint32 length = 0;
+                read(head, (uint8*)&length, sizeof(length));
+                return length;
+            }
+            bool front(uint8 * data, const uint32 length)
+            {
+                if (!used || length < frontSize()) return false;
+                read(wrap(head + sizeof(uint32)), data, frontSize());
+                return true;
+            }
+            void pop()
+            {
+                if (!used) return;
+                const uint32 length = frontSize() + sizeof(uint32);
+                head = wrap(head + length);
+                used -= length;
+            }
+
+            /** Build a RAM queue storage
+                @param buffer   If provided, the memory area to use for the ring buffer, else it's allocated on the heap
+                @param size     The ring buffer size in bytes */
+            MemoryQueueStorage(const uint32 size, uint8 * buffer = 0)
+                : buffer(buffer ? buffer : (uint8*)::malloc(size)), size(size), head(0), used(0), owned(buffer == 0) {}
+            ~MemoryQueueStorage() { if (owned) ::free(buffer); buffer = 0; }
+        };
+
+#if defined(ESP_PLATFORM)
+        /** A queue storage using an append only log on a flash partition.
+            The records survive a reboot. Each record is written once and marked as sent by clearing a state byte (flash
+            bits can be cleared without erasing), so it costs a single erase of the partition once all records are sent and
+            the log is full.
+            @warning This isn't power loss safe: a record's header, its sent state and the partition erase are separate flash writes, so a
+                     power loss in between can lose the pending records (while erasing or writing a header) or send a record again after
+                     the reboot (if it was sent but not marked yet).
+            You need to declare a data partition in your partition table for this, like:
+            @verbatim
+            mqttq,    data, 0x99,    ,  64K
+            @endverbatim */
+        class PartitionQueueStorage Final : public QueueStorage
+        {
+            /** The record header in the log */
+            struct Record
+            {
+                /** The record size in bytes (0xFFFFFFFF for erased flash, meaning the end of the log) */
+                uint32  size;
+                /** The record state (0xFF when pending, 0 when sent) */
+                uint8   state;
+                uint8   padding[3];
+            };
+            enum { Pending = 0xFF, Sent = 0, EndOfLog = 0xFFFFFFFF };
+
+            /** The partition used */
+            const esp_partition_t * partition;
+            /** The position of the first pending record */
+            uint32      readPos;
+            /** The position of the end of the log */
+            uint32      writePos;
+
+            /** Flash writes are made by 4 bytes words */
+            static uint32 align(const uint32 size) { return (size + 3) & ~3; }
+            /** Find the next pending record from the given position */
+            uint32 findPending(uint32 pos)
+            {
+                Record r;
+                while (pos < writePos && esp_partition_read(partition, pos, &r, sizeof(r)) == ESP_OK && r.state != Pending)
+                    pos += sizeof(r) + align(r.size);
+                return min(pos, writePos);
+            }
+            /** Find the end of the programmed (not erased) bytes in the given range, or the range start if it's all erased */
+            uint32 findProgrammedEnd(uint32 pos, const uint32 end)
+            {
+                uint8 chunk[64];
+                uint32 last = pos;
+                while (pos < end)
+                {
+                    const uint32 n = min(end - pos, (uint32)sizeof(chunk));
+                    if (esp_partition_read(partition, pos, chunk, n) != ESP_OK) return end;
+                    for (uint32 i = 0; i < n; i++) if (chunk[i] != 0xFF) last = pos + i + 1;
+                    pos += n;
+                }
+                return last;
+            }
+
+        public:
+            bool push(const uint8 * head, const uint32 headSize, const uint8 * data, const uint32 dataSize)
+            {
+                Record r = { headSize + dataSize, Pending, { 0xFF, 0xFF, 0xFF } };
+                if (!partition || !r.size) return false;
+                if (writePos + sizeof(r) + align(r.size) > partition->size)
+                {   // The log is full, we can only reclaim the space if all the records were sent
+                    if (readPos != writePos || esp_partition_erase_range(partition, 0, partition->size) != ESP_OK) return false;
+                    readPos = writePos = 0;
+                    if (sizeof(r) + align(r.size) > partition->size) return false;
+                }
+                // Write the data first and then the header, so a power loss doesn't leave a valid but incomplete record
+                // Flash writes must be word aligned, so the parts are joined in a small chunk before writing
+                uint8 chunk[64];
+                uint32 fill = 0, pos = writePos + sizeof(r);
+                const uint8 * parts[2] = { head, data };
+                const uint32 sizes[2] = { headSize, dataSize };
+                for (int p = 0; p < 2; p++)
+                {
+                    for (uint32 i = 0; i < sizes[p]; )
+                    {
+                        const uint32 n = min(sizes[p] - i, (uint32)sizeof(chunk) - fill);
+                        memcpy(chunk + fill, parts[p] + i, n);
+                        fill += n; i += n;
+                        if (fill == sizeof(chunk))
+                        {
+                            if (esp_partition_write(partition, pos, chunk, fill) != ESP_OK) return false;
+                            pos += fill; fill = 0;
+                        }
+                    }
+                }
+                if (fill)
+                {
+                    memset(chunk + fill, 0xFF, align(fill) - fill);
+                    if (esp_partition_write(partition, pos, chunk, align(fill)) != ESP_OK) return false;
+                }
+                if (esp_partition_write(partition, writePos, &r, sizeof(r)) != ESP_OK) return false;
+                writePos += sizeof(r) + align(r.size);
+                return true;
+            }
+            uint32 frontSize()
+            {
+                Record r;
+                if (!partition || readPos == writePos || esp_partition_read(partition, readPos, &r, sizeof(r)) != ESP_OK) return 0;
+                return r.size;
+            }
+            bool front(uint8 * buffer, const uint32 size)
+            {
+                const uint32 length = frontSize();
+                if (!length || size < length) return false;
+                return esp_partition_read(partition, readPos + sizeof(Record), buffer, length) == ESP_OK;
+            }
+            void pop()
+            {
+                const uint32 length = frontSize();
+                if (!length) return;
+                const uint8 sent[4] = { Sent, 0xFF, 0xFF, 0xFF };
+                esp_partition_write(partition, readPos + sizeof(uint32), sent, sizeof(sent));
+                readPos = findPending(readPos + sizeof(Record) + align(length));
+            }
+
+            /** Build a flash queue storage
+                @param label    The label of the data partition to use
+                This scans the log to find the records that were not sent before the reboot.
+                The data written past the end of the log (by a push interrupted by a power loss) is skipped, since it can't be written again without an erase */
+            PartitionQueueStorage(const char * label)
+                : partition(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label)), readPos(0), writePos(0)
+            {
+                if (!partition) return;
+                Record r = { 0, Sent, { 0, 0, 0 } };
+                while (writePos + sizeof(r) <= partition->size && esp_partition_read(partition, writePos, &r, sizeof(r)) == ESP_OK && r.size != EndOfLog)
+                    writePos += sizeof(r) + align(r.size);
+                if (writePos > partition->size) writePos = partition->size; // Corrupted log, don't write anymore until it's drained
+                else if (writePos + sizeof(r) <= partition->size && r.size == EndOfLog)
+                {   // The header is written last, so check the area after it wasn't already written by an interrupted push
+                    const uint32 end = findProgrammedEnd(writePos + sizeof(r), partition->size);
+                    if (end > writePos + sizeof(r))
+                    {   // Cover the interrupted record with a sent record, so it's skipped now and after the next reboot
+                        Record skip = { align(end - writePos - sizeof(r)), Sent, { 0xFF, 0xFF, 0xFF } };
+                        if (esp_partition_write(partition, writePos, &skip, sizeof(skip)) == ESP_OK) writePos += sizeof(skip) + skip.size;
+                        else writePos = partition->size;
+                    }
+                }
+                readPos = findPending(0);
+            }
+        };
+#endif
+    }
+}
+
+#endif
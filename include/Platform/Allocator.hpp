@@ -0,0 +1,79 @@
+#ifndef hpp_Allocator_hpp
+#define hpp_Allocator_hpp
+
+#include "../Types.hpp"
+
+namespace Platform
+{
+    /** The memory allocator interface used for the client's buffers (receiving buffer and temporary packet buffers).
+        By default, the heap is used, but you can provide your own allocator to use a static arena, a PSRAM pool
+        or any other memory region that suits your application. */
+    struct Allocator
+    {
+        /** Allocate a memory block
+            @param size     The block size in bytes
+            @return A pointer on the block or 0 if no memory is available */
+        virtual void * allocate(const size_t size) = 0;
+        /** Release a memory block
+            @param ptr      A pointer to a block returned by allocate (can be 0)
+            @param size     The block size in bytes, as given to allocate */
+        virtual void release(void * ptr, const size_t size) = 0;
+
+        virtual ~Allocator() {}
+
+        /** Get the default (heap based) allocator */
+        static inline Allocator & getDefault();
+    };
+
+    /** The default allocator, using the heap */
+    struct HeapAllocator Final : public Allocator
+    {
+        void * allocate(const size_t size) { return ::malloc(size); }
+        void release(void * ptr, const size_t) { ::free(ptr); }
+    };
+
+    inline Allocator & Allocator::getDefault() { static HeapAllocator heap; return heap; }
+
+    /** An allocator working on a user provided memory area (like a static array or a PSRAM block).
+        Blocks are allocated like a stack, so releasing only reclaims the memory if it's the last allocated block.
+        This never fragments and the allocation cost is constant, which is what's expected for the client buffers:
+        the receiving buffer is allocated once and the temporary packet buffers are released in reverse order.
+        If the arena is exhausted, the allocation falls back to the given allocator (if any) */
+    class ArenaAllocator Final : public Allocator
+    {
+        /** The arena */
+        uint8 *     arena;
+        /** The arena size in bytes */
+        size_t      size;
+        /** The used size in the arena in bytes */
+        size_t      used;
+        /** The fallback allocator (can be 0) */
+        Allocator * fallback;
+
+        /** Round the size to the platform's alignment */
+        static size_t align(const size_t size) { return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1); }
+    public:
+        void * allocate(const size_t s)
+        {
+            if (align(s) <= size - used) { void * p = arena + used; used += align(s); return p; }
+            return fallback ? fallback->allocate(s) : 0;
+        }
+        void release(void * ptr, const size_t s)
+        {
+            if (!ptr) return;
+            if ((uint8*)ptr < arena || (uint8*)ptr >= arena + size) { if (fallback) fallback->release(ptr, s); return; }
+            // Only the last block can be reclaimed
+            if ((uint8*)ptr + align(s) == arena + used) used -= align(s);
+        }
+        /** Get the used size in the arena in bytes */
+        size_t getUsedSize() const { return used; }
+
+        /** Build an arena allocator
+            @param arena    A pointer to the memory area to allocate from. It must be aligned on a pointer boundary
+            @param size     The memory area size in bytes
+            @param fallback If not null, the allocator to use when the arena is exhausted */
+        ArenaAllocator(void * arena, const size_t size, Allocator * fallback = 0) : arena((uint8*)arena), size(size), used(0), fallback(fallback) {}
+    };
+}
+
+#endif
@@ -3,6 +3,14 @@
 // Types like size-t or NULL
 #include "../Types.hpp"
 
+#if defined(ESP_PLATFORM)
+  // We need esp_timer_get_time
+  #include "esp_timer.h"
+  // And xTaskGetCurrentTaskHandle
+  #include "freertos/FreeRTOS.h"
+  #include "freertos/task.h"
+#endif
+
 /** The platform specific declarations */
 namespace Platform
 {
@@ -86,6 +94,41 @@ namespace Platform
 
         return other;
     }
+    /** Get the time in milliseconds from a monotonic clock.
+        Unlike time(), this isn't affected by the wall clock being set (like SNTP does upon boot). It wraps around every 49 days,
+        so only compare differences of its values.
+        If your platform has a better clock, define MQTTMonotonicClockMs to a function returning it in your forced include file */
+    inline uint32 getMonotonicTimeMs()
+    {
+#if defined(MQTTMonotonicClockMs)
+        return (uint32)MQTTMonotonicClockMs();
+#elif defined(ESP_PLATFORM)
+        return (uint32)(esp_timer_get_time() / 1000);
+#elif defined(_WIN32)
+        return (uint32)GetTickCount();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32)ts.tv_sec * 1000 + (uint32)(ts.tv_nsec / 1000000);
+#endif
+    }
+
+    /** Get an identifier of the calling task (or thread), to check which task owns a resource.
+        If your platform has its own tasks, define MQTTCurrentTaskID to a function returning the current task in your forced include file */
+    inline const void * getCurrentTaskID()
+    {
+#if defined(MQTTCurrentTaskID)
+        return (const void *)MQTTCurrentTaskID();
+#elif defined(ESP_PLATFORM)
+        // Not pthread_self, since it fails for the tasks that aren't created with pthread on ESP-IDF
+        return (const void *)xTaskGetCurrentTaskHandle();
+#elif defined(_WIN32)
+        return (const void *)(uintptr_t)GetCurrentThreadId();
+#else
+        return (const void *)(uintptr_t)pthread_self();
+#endif
+    }
+
     /** Ask for a hidden input that'll be stored in the UTF-8 buffer.
         This requires a console. 
         Under Windows, this requires the process to be run from a command line.
@@ -2,6 +2,8 @@
 #define hpp_StackHeapBuffer_hpp
 
 #include "../Types.hpp"
+// We need the allocator interface
+#include "Allocator.hpp"
 
 namespace Platform
 {
@@ -11,14 +13,16 @@ namespace Platform
     {
         void *      ptr;
         ssize_t     size;
+        /** The allocator used for heap allocation (if 0, ::free is used) */
+        Allocator * allocator;
     
         /** Removed copy constructor */
         StackHeapBuffer(const StackHeapBuffer & other); // : ptr(other.ptr), size(other.size) { const_cast<ssize_t&>(other.size) = -1; }
     public:
         /** Construction */
-        StackHeapBuffer(void * ptr, const ssize_t size) :  ptr(ptr), size(size) {}
+        StackHeapBuffer(void * ptr, const ssize_t size, Allocator * allocator = 0) :  ptr(ptr), size(size), allocator(allocator) {}
         /** Destruction */
-        ~StackHeapBuffer() { if (size > 0) { ::free(ptr); ptr = 0; } }
+        ~StackHeapBuffer() { if (size > 0) { if (allocator) allocator->release(ptr, (size_t)size); else ::free(ptr); ptr = 0; } }
         /** Main operator */
         operator void * () const { return ptr; }
         /** A conversion operator */
@@ -80,6 +84,13 @@ namespace Platform
     #define DeclareStackHeapBuffer(name, size, threshold) \
         Platform::StackHeapBuffer name(size <= threshold ? ::alloca(size) : ::malloc(size), size <= threshold ? -(ssize_t)size : (ssize_t)size)
 
+    /** Same as DeclareStackHeapBuffer, except that the heap allocation is done with the given allocator.
+        @sa DeclareStackHeapBuffer
+        @param allocator    A reference to a Platform::Allocator used when the size is above the threshold.
+        @warning The allocation can fail, so check the buffer's pointer before using it */
+    #define DeclareStackHeapBufferFrom(name, size, threshold, allocator) \
+        Platform::StackHeapBuffer name(size <= threshold ? ::alloca(size) : (allocator).allocate(size), size <= threshold ? -(ssize_t)size : (ssize_t)size, &(allocator))
+
 }
 
 #endif
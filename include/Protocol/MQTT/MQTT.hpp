@@ -321,7 +321,7 @@ namespace Protocol
                 /** Copy operator */
                 DynamicString & operator = (const DynamicString & other) { if (this != &other) { this->~DynamicString(); length = other.length; data = (char*)Platform::malloc(length); memcpy(data, other.data, length); } return *this; }
                 /** Copy operator */
-                void from(const char * str, const size_t len = 0) { this->~DynamicString(); length = len ? len : (strlen(str)+1); data = (char*)Platform::malloc(length); memcpy(data, str, length); data[length - 1] = 0; }
+                void from(const char * str, const size_t len = 0) { this->~DynamicString(); length = len ? len : strlen(str); data = (char*)Platform::malloc(length); memcpy(data, str, length); }
 
             };
 
@@ -596,6 +596,32 @@ namespace Protocol
 
 #pragma pack(pop)
 
+            /** Decode a variable byte integer (section 1.5.5).
+                The remaining length of almost all packets, and most properties' length, fit in 1 or 2 bytes (up to 16383), so these
+                are decoded directly without looping, the other encodings are only used for large packets.
+                @param buffer       A pointer to the buffer to read from
+                @param bufLength    The length of the buffer to read from
+                @param value        On output, the decoded value
+                @return the number of bytes used in the buffer (1 to 4), NotEnoughData if the buffer ends before the last byte,
+                        or BadData if the encoding is longer than 4 bytes */
+            static inline uint32 decodeVBInt(const uint8 * buffer, const uint32 bufLength, uint32 & value)
+            {
+                if (!bufLength) return NotEnoughData;
+                if (buffer[0] < 0x80) { value = buffer[0]; return 1; }
+                if (bufLength < 2) return NotEnoughData;
+                value = (buffer[0] & 0x7F) | ((uint32)buffer[1] << 7);
+                if (buffer[1] < 0x80) return 2;
+
+                value &= 0x3FFF;
+                for (uint32 i = 2; i < 4; i++)
+                {
+                    if (i >= bufLength) return NotEnoughData;
+                    value |= (uint32)(buffer[i] & 0x7F) << (7 * i);
+                    if (buffer[i] < 0x80) return i + 1;
+                }
+                return BadData;
+            }
+
             /** The variable byte integer encoding (section 1.5.5).
                 It's always stored encoded as a network version */
             struct VBInt Final : public Serializable
@@ -685,14 +711,10 @@ namespace Protocol
                     @return The number of bytes read from the buffer, or BadData upon error */
                 uint32 readFrom(const uint8 * buffer, uint32 bufLength)
                 {
-                    for (size = 0;;)
-                    {
-                        if ((uint32)(size+1) > bufLength) return NotEnoughData;
-                        value[size] = buffer[size];
-                        if (value[size++] < 0x80) break;
-                        if (size == 4) return BadData;
-                    }
-                    return size;
+                    uint32 v = 0, s = decodeVBInt(buffer, bufLength, v);
+                    if (isError(s)) return s;
+                    word = 0; memcpy(value, buffer, s); size = (uint16)s;
+                    return s;
                 }
 #if MQTTDumpCommunication == 1
                 void dump(MQTTString & out, const int indent = 0) { out += MQTTStringPrintf("%*sVBInt: %u\n", (int)indent, "", (uint32)*this); }
@@ -714,26 +736,8 @@ namespace Protocol
                     @return the number of bytes used in the buffer */
                 uint32 acceptBuffer(const uint8 * buffer, const uint32 bufLength)
                 {
-                    uint32 size = 0; uint32 & o = getValue(); o = 0;
-                    for (size = 0; size < 4 && size < bufLength; )
-                    {
-                        if (size+1 > bufLength) return NotEnoughData;
-                        if (buffer[size++] < 0x80) break;
-                    }
-
-                    switch(size)
-                    {
-                    default:
-                    case 0: return BadData; // This is an error anyway
-                    case 4: o = buffer[3] << 21;            // Intentionally no break here
-                    // fall through
-                    case 3: o |= (buffer[2] & 0x7F) << 14;  // Same
-                    // fall through
-                    case 2: o |= (buffer[1] & 0x7F) << 7;   // Ditto
-                    // fall through
-                    case 1: o |= buffer[0] & 0x7F; // Break is useless here too
-                    }
-                    return size;
+                    getValue() = 0;
+                    return decodeVBInt(buffer, bufLength, getValue());
                 }
             };
 
@@ -865,8 +869,9 @@ namespace Protocol
                 WildcardSubscriptionsNotSupported   = 0xA2, //!< Wildcard Subscriptions not supported
             };
 
-            /** The dynamic string class we prefer using depends on whether we are using client or server code */
-#if MQTTClientOnlyImplementation == 1
+            /** The dynamic string class we prefer using depends on whether we are using client or server code.
+                The local broker parses the packets in its receiving buffer, so it uses the views too */
+#if MQTTClientOnlyImplementation == 1 || MQTTUseLocalBroker == 1
             typedef DynamicStringView   DynString;
             typedef DynamicBinDataView  DynBinData;
 #else
@@ -1275,6 +1280,14 @@ namespace Protocol
                     if (index == PrivateRegistry::PropertiesCount) return false;
                     return visitor.mutate(propertiesType[index], (PropertyType)propertyType);
                 }
+                /** Get the visitor type for the given property (the index in the VisitorVariant's types)
+                    @return 7 if the property type is unknown */
+                uint8 getVisitorType(const uint8 propertyType) const
+                {
+                    if (propertyType >= MaxUsedPropertyType) return 7;
+                    uint8 index = PrivateRegistry::invPropertyMap[propertyType];
+                    return index == PrivateRegistry::PropertiesCount ? 7 : propertiesType[index];
+                }
 
             private:
                 MemMappedPropertyRegistry()
@@ -2112,16 +2125,16 @@ namespace Protocol
                 }
 
                 /** Make a deep copy. This actually create a version that's heap allocated for each value */
-                Properties * clone()
+                Properties * clone() const
                 {
                     Properties * ret = new Properties();
                     ret->length = length;
                     const PropertyBase * n = head;
-                    PropertyBase * & m = ret->head;
+                    PropertyBase ** m = &ret->head;
                     while (n)
                     {
-                        m = n->clone();
-                        m = m->next;
+                        *m = n->clone();
+                        m = &(*m)->next;
                         n = n->next;
                     }
                     return ret;
@@ -2143,6 +2156,145 @@ namespace Protocol
             };
 
 
+            namespace PrivateRegistry
+            {
+                // The property value types that can be stored inline in a FixedProperties (the other ones own a heap allocated copy)
+                template <typename T> struct isInlineType {};
+
+                template<> struct isInlineType< uint8 >                 { enum { Value = 1 }; };
+                template<> struct isInlineType< uint16 >                { enum { Value = 1 }; };
+                template<> struct isInlineType< uint32 >                { enum { Value = 1 }; };
+                template<> struct isInlineType< VBInt >                 { enum { Value = 1 }; };
+                template<> struct isInlineType< DynamicBinDataView >    { enum { Value = 1 }; };
+                template<> struct isInlineType< DynamicStringView >     { enum { Value = 1 }; };
+                template<> struct isInlineType< DynamicStringPairView > { enum { Value = 1 }; };
+
+                struct MaxInlinePropertySize
+                {
+                    enum { Size = MaxSize<Property<uint8>,
+                        MaxSize<Property<uint16>,
+                        MaxSize<Property<uint32>,
+                        MaxSize<Property<VBInt>,
+                        MaxSize<Property<DynamicBinDataView>,
+                        MaxSize<Property<DynamicStringView>,
+                        SizeOf<Property<DynamicStringPairView> > > > > > > >::Size };
+                };
+            }
+
+            /** A property set with a fixed capacity that's not allocating anything.
+                Unlike Properties that's chaining heap allocated properties, the properties are built in an array that's
+                part of this object, so it can live on the stack. Finding a property by its type is O(1) (via a bitmask and an
+                index table) instead of walking the list.
+
+                It converts to a Properties pointer, so it's accepted by all the methods taking one:
+                @code
+                    FixedProperties<3> props;
+                    props.add<uint8>(PayloadFormat, 1);
+                    props.add<DynamicStringView>(ContentType, "application/json");
+                    props.add<DynamicStringPairView>(UserProperty, DynamicStringPairView("unit", "C"));
+                    client.publish("sensor/t", payload, length, false, QoSDelivery::AtMostOne, 0, props);
+                @endcode
+
+                Only the types that don't own their value can be stored (POD, VBInt and views), so the viewed strings and
+                binary data must outlive this object.
+                @param N    The maximum number of properties in the set */
+            template <size_t N>
+            class FixedProperties
+            {
+                /** The storage for a single property */
+                union Slot
+                {
+                    uint8   buffer[PrivateRegistry::MaxInlinePropertySize::Size];
+                    void *  alignPointer;
+                    uint64  alignInteger;
+                };
+
+                /** The properties storage */
+                Slot            slots[N];
+                /** The number of used slots */
+                uint32          count;
+                /** The property types that are present in the set. Property types are all below 64 */
+                uint64          present;
+                /** The index of the (first) property of a given type in the slots array */
+                uint8           position[MaxUsedPropertyType];
+                /** The properties chained in the order they were added, as expected by the packets */
+                Properties      list;
+                /** The last property in the list */
+                PropertyBase *  tail;
+
+                /** Get the property in the given slot */
+                PropertyBase * at(const uint32 index) const { return reinterpret_cast<PropertyBase*>(const_cast<uint8*>(slots[index].buffer)); }
+
+                /** Prevent copying, the list is pointing inside this object */
+                FixedProperties(const FixedProperties &);
+                FixedProperties & operator = (const FixedProperties &);
+
+            public:
+                /** Add a property to this set.
+                    Like Properties::append, only the user property can be added multiple times.
+                    @param type     The property type
+                    @param value    The property value
+                    @code
+                        props.add<uint32>(SessionExpiryInterval, 3600);
+                    @endcode
+                    @return true upon successful append, false if the set is full, the property exists or is too large */
+                template <typename T, typename U>
+                bool add(const PropertyType type, const U & value)
+                {
+                    // If the compiler stops here, you're trying to store a value type that requires an allocation, use Properties instead
+                    (void)PrivateRegistry::isInlineType<T>::Value;
+                    if (count == N || !type || type >= MaxUsedPropertyType || (type != UserProperty && has(type))) return false;
+
+                    PropertyBase * property = new (slots[count].buffer) Property<T>(type, value);
+                    VBInt l((uint32)list.length + property->getSize());
+                    if (!l.checkImpl()) { property->~PropertyBase(); return false; }
+                    list.length = l;
+                    if (tail) tail->next = property; else list.head = property;
+                    tail = property;
+                    if (!has(type)) { present |= (uint64)1 << type; position[type] = (uint8)count; }
+                    ++count;
+                    return true;
+                }
+
+                /** Check if a property of the given type is present */
+                bool has(const PropertyType type) const { return type < 64 && ((present >> type) & 1); }
+                /** Get the (first) property of the given type in O(1)
+                    @return 0 if not found */
+                const PropertyBase * getProperty(const PropertyType type) const { return has(type) ? at(position[type]) : 0; }
+                /** Get the i-th property of the given type. Searching beyond the first one is only useful for user properties
+                    @return 0 if not found */
+                const PropertyBase * getProperty(const PropertyType type, size_t index) const
+                {
+                    if (!has(type)) return 0;
+                    for (uint32 i = position[type]; i < count; i++)
+                        if (at(i)->type == type && index-- == 0) return at(i);
+                    return 0;
+                }
+                /** Get the number of properties in the set */
+                uint32 getCount() const { return count; }
+                /** This give the size required for serializing these properties in bytes */
+                uint32 getSize() const { return list.getSize(); }
+                /** Remove all the properties */
+                void clear()
+                {
+                    list.head = 0; list.length = 0; tail = 0;
+                    for (uint32 i = 0; i < count; i++) at(i)->~PropertyBase();
+                    count = 0; present = 0;
+                }
+
+                /** Get the property list to use in the methods expecting one */
+                Properties * get() { return &list; }
+                /** Get the property list to use in the methods expecting one */
+                operator Properties * () { return &list; }
+                /** Get the property list to use in the methods expecting one */
+                operator const Properties * () const { return &list; }
+
+                /** Build an empty set */
+                FixedProperties() : count(0), present(0), tail(0) {}
+                ~FixedProperties() { clear(); }
+            };
+
+
             /** A read-only view off property extracted from a packet (section 2.2.2).
                 Unlike the Properties class above that's able to add and parse properties, this
                 one only parse properties but never allocate anything on the heap.
@@ -2259,6 +2411,141 @@ namespace Protocol
 #endif
             };
 
+            /** A one pass index of the properties of a PropertiesView.
+                PropertiesView::getProperty is a O(N) scan mutating a visitor for each property, so looking for K properties
+                costs O(N*K). This index walks the property block once, and records where the (first) property of each
+                type is, so fetching a property is O(1) afterward. The properties that can be repeated (UserProperty and
+                SubscriptionID) are also recorded in order in a small list.
+
+                Nothing is copied or allocated, so the indexed PropertiesView's buffer must outlive this object.
+                Typically, you'll use this class like this:
+                @code
+                    PropertiesIndex index(props);
+                    LittleEndianPODVisitor<uint16> receiveMax;
+                    if (index.getProperty(ReceiveMax, receiveMax)) window = receiveMax.getValue();
+                    DynamicStringPairView pair;
+                    for (size_t i = 0; index.getProperty(UserProperty, pair, i); i++)
+                    {
+                        // Do something with pair
+                    }
+                @endcode */
+            class PropertiesIndex
+            {
+            public:
+                /** The number of repeated properties recorded. The following ones are found by scanning from the last recorded one */
+                enum { MaxRepeated = 8 };
+
+            private:
+                /** The indexed property block */
+                const uint8 *   buffer;
+                /** The property block length in bytes (only the valid properties) */
+                uint32          length;
+                /** The property types that are present. Property types are all below 64 */
+                uint64          present;
+                /** The offset of the (first) property of each type. Only valid if the type is present */
+                uint32          offsets[MaxUsedPropertyType];
+                /** The offsets of the repeated properties, in order */
+                uint32          repeated[MaxRepeated];
+                /** The number of repeated properties (can be larger than MaxRepeated) */
+                uint32          repeatedCount;
+
+                /** Check if the property type can be repeated */
+                static bool isRepeatable(const uint8 type) { return type == UserProperty || type == SubscriptionID; }
+                /** Get the size of the property's value at the given position, given its visitor type
+                    @return The value size in bytes or an error code */
+                static uint32 getValueSize(const uint8 visitorType, const uint8 * value, const uint32 left)
+                {
+                    switch (visitorType)
+                    {
+                    case 0: return left < 1 ? (uint32)NotEnoughData : 1;
+                    case 1: return left < 2 ? (uint32)NotEnoughData : 2;
+                    case 2: return left < 4 ? (uint32)NotEnoughData : 4;
+                    case 3: { MappedVBInt v; return v.acceptBuffer(value, left); }
+                    case 4: { DynamicBinDataView v; return v.acceptBuffer(value, left); }
+                    case 5: { DynamicStringView v; return v.acceptBuffer(value, left); }
+                    case 6: { DynamicStringPairView v; return v.acceptBuffer(value, left); }
+                    default: return BadData;
+                    }
+                }
+                /** Get the offset of the property following the one at the given offset
+                    @return The next offset or an error code */
+                uint32 skip(const uint32 offset) const
+                {
+                    const uint32 s = getValueSize(MemMappedPropertyRegistry::getInstance().getVisitorType(buffer[offset]), &buffer[offset + 1], length - offset - 1);
+                    return isError(s) ? s : offset + 1 + s;
+                }
+                /** Find the offset of the i-th property of the given type
+                    @return length if not found */
+                uint32 find(const PropertyType type, size_t index) const
+                {
+                    if (!has(type)) return length;
+                    if (!index) return offsets[type];
+                    if (!isRepeatable(type)) return length;
+                    uint32 o = 0;
+                    for (; o < repeatedCount && o < MaxRepeated; o++)
+                        if (buffer[repeated[o]] == type && index-- == 0) return repeated[o];
+                    // Not recorded, so scan from the last recorded property
+                    if (repeatedCount <= MaxRepeated) return length;
+                    for (o = skip(repeated[MaxRepeated - 1]); !isError(o) && o < length; o = skip(o))
+                        if (buffer[o] == type && index-- == 0) return o;
+                    return length;
+                }
+
+            public:
+                /** Index the given properties
+                    @return false if a property is malformed (in that case, only the properties before it are indexed) */
+                bool index(const PropertiesView & view)
+                {
+                    buffer = view.buffer; length = buffer ? (uint32)view.length : 0; present = 0; repeatedCount = 0;
+                    uint32 o = 0;
+                    while (o < length)
+                    {
+                        const uint8 type = buffer[o];
+                        const uint32 next = skip(o);
+                        if (isError(next)) { length = o; return false; }
+                        if (!has((PropertyType)type)) { present |= (uint64)1 << type; offsets[type] = o; }
+                        if (isRepeatable(type))
+                        {
+                            if (repeatedCount < MaxRepeated) repeated[repeatedCount] = o;
+                            ++repeatedCount;
+                        }
+                        o = next;
+                    }
+                    return true;
+                }
+
+                /** Check if a property of the given type is present */
+                bool has(const PropertyType type) const { return type < 64 && ((present >> type) & 1); }
+                /** Fetch the i-th property of the given type with the given visitor.
+                    @param type     The property type to fetch
+                    @param visitor  The visitor to fill with the property value. It must match the property type, like a
+                                    LittleEndianPODVisitor<uint16> for ReceiveMax or a DynamicStringView for ContentType
+                    @param index    The index of the property to fetch, only useful for the properties that can be repeated
+                    @return true if the property was found */
+                template <typename T>
+                bool getProperty(const PropertyType type, T & visitor, size_t index = 0) const
+                {
+                    const uint32 o = find(type, index);
+                    if (o >= length || MemMappedPropertyRegistry::getInstance().getVisitorType(type) != (uint8)PrivateRegistry::isValidType<T>::Value)
+                        return false;
+                    return !isError(visitor.acceptBuffer(&buffer[o + 1], length - o - 1));
+                }
+                /** Get the number of properties of the given type */
+                size_t getCount(const PropertyType type) const
+                {
+                    if (!has(type)) return 0;
+                    if (!isRepeatable(type)) return 1;
+                    size_t count = 0;
+                    while (find(type, count) < length) count++;
+                    return count;
+                }
+
+                /** Build an empty index */
+                PropertiesIndex() : buffer(0), length(0), present(0), repeatedCount(0) {}
+                /** Build an index for the given properties */
+                PropertiesIndex(const PropertiesView & view) { index(view); }
+            };
+
             /** The possible value for retain handling in subscribe packet */
             enum RetainHandling
             {
@@ -2306,6 +2593,10 @@ namespace Protocol
                 void append(ScribeTopicBase * newTopic) { ScribeTopicBase ** end = &next; while(*end) { end = &(*end)->next; } *end = newTopic; }
                 /** Count the number of topic */
                 uint32 count() const { uint32 c = 1; const ScribeTopicBase * p = next; while (p) { c++; p = p->next; } return c; }
+                /** Get the topic filter */
+                const DynString & getTopic() const { return topic; }
+                /** Get the next topic in the list (or 0 if it's the last one) */
+                const ScribeTopicBase * getNext() const { return next; }
 
 
             public:
@@ -3041,7 +3332,8 @@ namespace Protocol
 #endif
 
                 Payload() : willMessage(0), fixedHeader(0) {}
-#if MQTTClientOnlyImplementation != 1
+                // With the local broker, the client's packet still refers to the user's will, so the broker deletes the will it has read by itself
+#if MQTTClientOnlyImplementation != 1 && MQTTUseLocalBroker != 1
                 ~Payload() { delete0(willMessage); }
 #endif
 
@@ -3343,12 +3635,21 @@ namespace Protocol
                     @param buffer   A pointer to an allocated buffer that's getSize() long.
                     @return The number of bytes used in the buffer */
                 uint32 copyInto(uint8 * buffer) const
+                {
+                    uint32 o = copyHeaderInto(buffer);
+                    o += payload.copyInto(buffer+o);
+                    return o;
+                }
+                /** Copy the packet without its payload into the given buffer.
+                    This is used to send the payload directly from its own buffer (without copying it).
+                    @param buffer   A pointer to an allocated buffer that's getSize() - payload.getSize() long.
+                    @return The number of bytes used in the buffer */
+                uint32 copyHeaderInto(uint8 * buffer) const
                 {
                     uint32 o = 1; buffer[0] = header.typeAndFlags;
                     o += remLength.copyInto(buffer+o);
                     o += fixedVariableHeader.copyInto(buffer+o);
                     o += props.copyInto(buffer+o);
-                    o += payload.copyInto(buffer+o);
                     return o;
                 }
                 /** Read the value from a buffer.
@@ -3381,6 +3682,31 @@ namespace Protocol
                     if (isError(s)) return s;
                     return o + s;
                 }
+                /** Read the packet without its payload from a buffer.
+                    This is used for packets that are larger than the receiving buffer, whose payload is received in chunks.
+                    Unlike readFrom, the buffer only needs to contain the fixed header, the variable header and the properties.
+                    @param buffer   A pointer to an allocated buffer that's at least 1 byte long
+                    @return The number of bytes read from the buffer (the payload starts at this offset), or an error */
+                uint32 readHeaderFrom(const uint8 * buffer, uint32 bufLength)
+                {
+                    if (bufLength < 2) return NotEnoughData;
+                    uint32 o = 1; const_cast<uint8&>(header.typeAndFlags) = buffer[0];
+
+                    buffer += o; bufLength -= o;
+
+                    uint32 s = remLength.readFrom(buffer, bufLength);
+                    if (isError(s)) return s;
+                    o += s; buffer += s; bufLength -= s;
+
+                    fixedVariableHeader.setRemainingLength((uint32)remLength);
+                    s = fixedVariableHeader.readFrom(buffer, bufLength);
+                    if (isError(s)) return s;
+                    o += s; buffer += s; bufLength -= s;
+
+                    s = props.readFrom(buffer, bufLength);
+                    if (isError(s)) return s;
+                    return o + s;
+                }
 #if MQTTAvoidValidation != 1
                 /** Check if this property is valid */
                 bool check() const
@@ -3402,8 +3728,9 @@ namespace Protocol
                 /** The variable header containing properties */
                 typename VHPropertyChooser<type, propertyMapped>::VHProperty    props;
                 /** The payload (if any required) */
-#if MQTTClientOnlyImplementation == 1
+#if MQTTClientOnlyImplementation == 1 || MQTTUseLocalBroker == 1
                 // Client implementation never need to allocate anything here, either it's client provided or server's buffer provided
+                // (the local broker only reads the packets from its receiving buffer too)
                 typename PayloadSelector<type, true>::PayloadType               payload;
 #else
                 typename PayloadSelector<type, propertyMapped>::PayloadType     payload;
@@ -3502,6 +3829,132 @@ namespace Protocol
             typedef ControlPacket<PINGREQ>          PingReqPacket;
             typedef ControlPacket<PINGRESP>         PingRespPacket;
 
+            /** Specialized serializers for the packets that are sent and received the most.
+                The generic ControlPacket code above is made to be small, so it encodes each field through its own
+                virtual serializer. For the packets exchanged for every publication, the layout is known at compile time,
+                so it's cheaper to write the bytes directly: the fixed header byte, the remaining length and the packet
+                identifier are then inlined in the caller.
+                The output is a valid MQTT v5 packet, the reason code (and the properties) of the replies are only present
+                when required (section 3.4.2.1) */
+            namespace FastPath
+            {
+                /** Get the number of bytes required to encode the given value as a variable byte integer */
+                static inline uint32 getVBIntSize(const uint32 value) { return 1 + (value > 127) + (value > 16383) + (value > 2097151); }
+                /** Encode a variable byte integer (up to MaxPossibleSize)
+                    @return The number of bytes used in the buffer */
+                static inline uint32 writeVBInt(uint8 * buffer, uint32 value)
+                {
+                    uint32 o = 0;
+                    while (value > 127) { buffer[o++] = (uint8)(value | 0x80); value >>= 7; }
+                    buffer[o++] = (uint8)value;
+                    return o;
+                }
+                /** Write a big endian 16 bits value */
+                static inline void writeUInt16(uint8 * buffer, const uint16 value) { buffer[0] = (uint8)(value >> 8); buffer[1] = (uint8)value; }
+                /** Read a big endian 16 bits value */
+                static inline uint16 readUInt16(const uint8 * buffer) { return (uint16)((buffer[0] << 8) | buffer[1]); }
+
+                /** The specialized encoder for a control packet type */
+                template <ControlPacketType type> struct Encoder;
+
+                /** The ping request is a constant */
+                template <> struct Encoder<PINGREQ>
+                {
+                    enum { Size = 2 };
+                    /** Encode the ping request in the given buffer (Size bytes long) */
+                    static inline uint32 encode(uint8 * buffer) { buffer[0] = PINGREQ << 4; buffer[1] = 0; return Size; }
+                };
+
+                /** The publication replies only contain a packet identifier and an optional reason code */
+                template <ControlPacketType type> struct ReplyEncoder
+                {
+                    enum { TypeAndFlags = (type << 4) | (type == PUBREL ? 2 : 0), MaxSize = 5 };
+                    /** Encode the reply in the given buffer (MaxSize bytes long)
+                        @return The number of bytes used in the buffer */
+                    static inline uint32 encode(uint8 * buffer, const uint16 packetID, const uint8 reasonCode = 0)
+                    {
+                        buffer[0] = TypeAndFlags;
+                        buffer[1] = reasonCode ? 3 : 2;
+                        writeUInt16(buffer + 2, packetID);
+                        buffer[4] = reasonCode;
+                        return reasonCode ? 5 : 4;
+                    }
+                };
+                template <> struct Encoder<PUBACK>  : public ReplyEncoder<PUBACK>  {};
+                template <> struct Encoder<PUBREC>  : public ReplyEncoder<PUBREC>  {};
+                template <> struct Encoder<PUBREL>  : public ReplyEncoder<PUBREL>  {};
+                template <> struct Encoder<PUBCOMP> : public ReplyEncoder<PUBCOMP> {};
+
+                /** Encode a publication reply whose type is only known at runtime
+                    @param buffer   A buffer that's ReplyEncoder::MaxSize bytes long
+                    @return The number of bytes used in the buffer, or 0 if the type isn't a publication reply */
+                static inline uint32 encodeReply(const ControlPacketType type, uint8 * buffer, const uint16 packetID, const uint8 reasonCode = 0)
+                {
+                    switch (type)
+                    {
+                    case PUBACK:  return Encoder<PUBACK>::encode(buffer, packetID, reasonCode);
+                    case PUBREC:  return Encoder<PUBREC>::encode(buffer, packetID, reasonCode);
+                    case PUBREL:  return Encoder<PUBREL>::encode(buffer, packetID, reasonCode);
+                    case PUBCOMP: return Encoder<PUBCOMP>::encode(buffer, packetID, reasonCode);
+                    default: return 0;
+                    }
+                }
+
+                /** The publication header (everything but the payload) */
+                template <> struct Encoder<PUBLISH>
+                {
+                    /** Get the size of the header, that is the packet size without the payload
+                        @param topicLength      The topic name length in bytes
+                        @param withID           Set if the publication has a packet identifier (QoS above 0)
+                        @param propertiesSize   The properties' size in bytes (including their length, so at least 1)
+                        @param payloadLength    The payload size in bytes */
+                    static inline uint32 getHeaderSize(const uint32 topicLength, const bool withID, const uint32 propertiesSize, const uint32 payloadLength)
+                    {
+                        const uint32 remLength = 2 + topicLength + (withID ? 2 : 0) + propertiesSize + payloadLength;
+                        return 1 + getVBIntSize(remLength) + remLength - payloadLength;
+                    }
+                    /** Encode the publication header in the given buffer
+                        @param buffer           A buffer that's getHeaderSize() bytes long
+                        @param typeAndFlags     The fixed header byte (with the QoS, retain and dup flags)
+                        @param topic            The topic name
+                        @param topicLength      The topic name length in bytes
+                        @param packetID         The packet identifier (only written if QoS is above 0)
+                        @param props            The publication properties
+                        @param payloadLength    The payload size in bytes
+                        @return The number of bytes used in the buffer */
+                    static inline uint32 encodeHeader(uint8 * buffer, const uint8 typeAndFlags, const uint8 * topic, const uint16 topicLength,
+                                                      const uint16 packetID, const Properties & props, const uint32 payloadLength)
+                    {
+                        const bool withID = (typeAndFlags & 6) != 0;
+                        uint32 o = 1; buffer[0] = typeAndFlags;
+                        o += writeVBInt(buffer + o, 2 + topicLength + (withID ? 2 : 0) + props.getSize() + payloadLength);
+                        writeUInt16(buffer + o, topicLength); o += 2;
+                        memcpy(buffer + o, topic, topicLength); o += topicLength;
+                        if (withID) { writeUInt16(buffer + o, packetID); o += 2; }
+                        return o + props.copyInto(buffer + o);
+                    }
+                };
+
+                /** Decode a publication reply in a single pass.
+                    @param buffer       The complete packet
+                    @param length       The packet length in bytes
+                    @param packetID     On output, the packet identifier
+                    @param reasonCode   On output, the reason code (0 if not present)
+                    @return The number of bytes used in the buffer, or an error (the properties are skipped) */
+                static inline uint32 decodeReply(const uint8 * buffer, const uint32 length, uint16 & packetID, uint8 & reasonCode)
+                {
+                    if (length < 4) return NotEnoughData;
+                    uint32 remLength = 0, o = decodeVBInt(buffer + 1, length - 1, remLength);
+                    if (isError(o)) return o;
+                    o++;
+                    if (remLength < 2) return BadData;
+                    if (length < o + remLength) return NotEnoughData;
+                    packetID = readUInt16(buffer + o);
+                    reasonCode = remLength > 2 ? buffer[o + 2] : 0;
+                    return o + remLength;
+                }
+            }
+
         }
     }
 }
@@ -0,0 +1,243 @@
+#ifndef hpp_CPP_TopicTrie_CPP_hpp
+#define hpp_CPP_TopicTrie_CPP_hpp
+
+// We need the protocol types
+#include "MQTT.hpp"
+
+namespace Protocol
+{
+    namespace MQTT
+    {
+        namespace Common
+        {
+            /** A topic filter trie used to find all the filters matching a topic name (section 4.7).
+
+                Each level of a topic filter (the text between the '/' separators) is a node in the trie.
+                The single level ('+') and multi level ('#') wildcards are stored in dedicated children, so that matching a topic name
+                only costs a child lookup per level of the topic name (plus the wildcard branches, if any).
+                Allocations only happen when inserting a filter, matching a topic never allocates.
+
+                @param T    The value type attached to a filter. It must be copy constructible and comparable with operator == */
+            template <typename T>
+            struct TopicTrie
+            {
+                // Type definition and enumeration
+            private:
+                /** A value attached to a filter */
+                struct Value
+                {
+                    /** The value itself */
+                    T           value;
+                    /** The next value for the same filter */
+                    Value *     next;
+
+                    Value(const T & value, Value * next) : value(value), next(next) {}
+                };
+
+                /** A node in the trie */
+                struct Node
+                {
+                    /** The level name (empty for the root and the wildcard nodes) */
+                    DynamicString   name;
+                    /** The first child for this level */
+                    Node *          children;
+                    /** The next sibling for this level */
+                    Node *          next;
+                    /** The single level wildcard child */
+                    Node *          plus;
+                    /** The multi level wildcard child */
+                    Node *          hash;
+                    /** The values for the filter ending on this node */
+                    Value *         values;
+
+                    /** Find the child with the given level name
+                        @return A pointer on the child or 0 if not found */
+                    Node * findChild(const char * level, const uint16 length) const
+                    {
+                        for (Node * child = children; child; child = child->next)
+                            if (child->name.length == length && !memcmp(child->name.data, level, length)) return child;
+                        return 0;
+                    }
+                    /** Check if this node is useless and can be removed */
+                    bool isEmpty() const { return !children && !plus && !hash && !values; }
+                    /** Delete all the children and values of this node */
+                    void clear()
+                    {
+                        while (children) { Node * n = children->next; delete children; children = n; }
+                        delete plus; plus = 0;
+                        delete hash; hash = 0;
+                        while (values) { Value * n = values->next; delete values; values = n; }
+                    }
+
+                    Node(const char * level = 0, const uint16 length = 0) : children(0), next(0), plus(0), hash(0), values(0) { if (length) name.from(level, length); }
+                    ~Node() { clear(); }
+                };
+
+                // Members
+            private:
+                /** The root for the trie */
+                Node    root;
+
+                // Helpers
+            private:
+                /** Get the length of the first level in the given topic */
+                static uint16 levelLength(const char * topic, const uint16 length)
+                {
+                    const char * sep = (const char*)memchr(topic, '/', length);
+                    return sep ? (uint16)(sep - topic) : length;
+                }
+                /** Check if a level is the given wildcard */
+                static bool isWildcard(const char * level, const uint16 length, const char wildcard) { return length == 1 && level[0] == wildcard; }
+                /** Get the child slot for the given level, either the wildcard slots or the slot in the children's list */
+                static Node ** getSlot(Node & node, const char * level, const uint16 length)
+                {
+                    if (isWildcard(level, length, '#')) return &node.hash;
+                    if (isWildcard(level, length, '+')) return &node.plus;
+                    Node ** slot = &node.children;
+                    while (*slot && !((*slot)->name.length == length && !memcmp((*slot)->name.data, level, length))) slot = &(*slot)->next;
+                    return slot;
+                }
+                /** Call the visitor for all the values of the given node */
+                template <typename Visitor>
+                static uint32 visitValues(const Node & node, Visitor & visitor)
+                {
+                    uint32 count = 0;
+                    for (Value * v = node.values; v; v = v->next, count++) visitor(v->value);
+                    return count;
+                }
+                /** Match the remaining topic levels from the given node
+                    @param node         The node that matched the previous level
+                    @param topic        The remaining topic levels
+                    @param length       The remaining topic length in bytes
+                    @param end          If true, there is no remaining level at all
+                    @param visitor      The visitor to call for each matching value
+                    @param noWildcard   If true, the wildcards children are not matched at this level */
+                template <typename Visitor>
+                static uint32 matchFrom(const Node & node, const char * topic, const uint16 length, const bool end, Visitor & visitor, const bool noWildcard)
+                {
+                    uint32 count = 0;
+                    // The multi level wildcard matches the remaining levels, including none (so "a/#" matches "a")
+                    if (node.hash && !noWildcard) count += visitValues(*node.hash, visitor);
+                    if (end) return count + visitValues(node, visitor);
+
+                    const uint16 len = levelLength(topic, length);
+                    const bool last = len == length;
+                    const char * next = last ? topic + len : topic + len + 1;
+                    const uint16 nextLength = last ? 0 : length - len - 1;
+                    if (node.plus && !noWildcard) count += matchFrom(*node.plus, next, nextLength, last, visitor, false);
+                    if (const Node * child = node.findChild(topic, len)) count += matchFrom(*child, next, nextLength, last, visitor, false);
+                    return count;
+                }
+                /** Remove the value for the remaining filter levels from the given node
+                    @return true if the value was found and removed */
+                static bool removeFrom(Node & node, const char * filter, const uint16 length, const T & value)
+                {
+                    const uint16 len = levelLength(filter, length);
+                    Node ** slot = getSlot(node, filter, len);
+                    if (!*slot) return false;
+
+                    Node & child = **slot;
+                    bool found = false;
+                    if (len == length)
+                    {
+                        for (Value ** v = &child.values; *v; v = &(*v)->next)
+                        {
+                            if (!((*v)->value == value)) continue;
+                            Value * n = *v; *v = n->next; delete n;
+                            found = true;
+                            break;
+                        }
+                    }
+                    else found = removeFrom(child, filter + len + 1, length - len - 1, value);
+
+                    // Prune the useless branches (the wildcard nodes don't have siblings, so this works for any slot)
+                    if (found && child.isEmpty()) { *slot = child.next; child.next = 0; delete &child; }
+                    return found;
+                }
+
+                // Interface
+            public:
+                /** Check if the given topic filter is valid (section 4.7.1)
+                    @param filter   The topic filter
+                    @param length   The topic filter length in bytes */
+                static bool isValidFilter(const char * filter, const uint16 length)
+                {
+                    if (!filter || !length) return false;
+                    for (uint16 pos = 0; ; pos++)
+                    {
+                        const uint16 len = levelLength(filter + pos, length - pos);
+                        for (uint16 i = 0; i < len; i++)
+                        {
+                            const char c = filter[pos + i];
+                            if ((c == '+' || c == '#') && len != 1) return false;
+                        }
+                        pos += len;
+                        // The multi level wildcard must be the last level
+                        if (isWildcard(filter + pos - len, len, '#')) return pos == length;
+                        if (pos == length) return true;
+                    }
+                }
+
+                /** Insert a value for the given topic filter
+                    @param filter   The topic filter, it can contain '+' and '#' wildcards
+                    @param length   The topic filter length in bytes
+                    @param value    The value to attach to this filter. If it's already attached, it's not added again
+                    @return false if the filter is invalid */
+                bool insert(const char * filter, const uint16 length, const T & value)
+                {
+                    if (!isValidFilter(filter, length)) return false;
+                    Node * node = &root;
+                    for (uint16 pos = 0; ; pos++)
+                    {
+                        const uint16 len = levelLength(filter + pos, length - pos);
+                        Node ** slot = getSlot(*node, filter + pos, len);
+                        if (!*slot)
+                        {
+                            // Wildcard nodes don't store their name, only the slot they are in matters
+                            const bool wildcard = isWildcard(filter + pos, len, '#') || isWildcard(filter + pos, len, '+');
+                            *slot = wildcard ? new Node : new Node(filter + pos, len);
+                        }
+                        node = *slot;
+                        pos += len;
+                        if (pos == length) break;
+                    }
+                    for (Value * v = node->values; v; v = v->next)
+                        if (v->value == value) return true;
+                    node->values = new Value(value, node->values);
+                    return true;
+                }
+
+                /** Remove a value for the given topic filter
+                    @param filter   The topic filter, as used in insert
+                    @param length   The topic filter length in bytes
+                    @param value    The value to remove
+                    @return true if the value was found and removed */
+                bool remove(const char * filter, const uint16 length, const T & value)
+                {
+                    if (!filter || !length) return false;
+                    return removeFrom(root, filter, length, value);
+                }
+
+                /** Find all the values whose filter matches the given topic name.
+                    As required by the standard, the topics starting with '$' are not matched by a filter starting with a wildcard
+                    @param topic    The topic name (without any wildcard)
+                    @param length   The topic name length in bytes
+                    @param visitor  A functor called with each matching value (as `visitor(const T &)`)
+                    @return The number of matching values */
+                template <typename Visitor>
+                uint32 match(const char * topic, const uint16 length, Visitor & visitor) const
+                {
+                    if (!length || root.isEmpty()) return 0;
+                    return matchFrom(root, topic, length, false, visitor, topic[0] == '$');
+                }
+
+                /** Check if the trie is empty */
+                bool isEmpty() const { return root.isEmpty(); }
+                /** Remove all the filters */
+                void clear() { root.clear(); }
+            };
+        }
+    }
+}
+
+#endif
@@ -95,6 +95,7 @@
     #include <fcntl.h>
     #include <netdb.h>
     #include <netinet/in.h>
+    #include <netinet/tcp.h>
     #include <pthread.h>
     #include <signal.h>
     #include <sys/poll.h>
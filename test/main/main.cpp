@@ -38,7 +38,10 @@ Network::Client::MQTTv5 client("eMQTT5", &receiver);
 
 static void process(void *p) {
   for (;;) {
-    if (Network::Client::MQTTv5::ErrorType ret = client.eventLoop())
+    // Sleep until some data is received or the keep alive deadline expires, instead of spinning on the event loop
+    Network::Client::MQTTv5::ErrorType ret = client.waitForActivity(60000);
+    if (ret == Network::Client::MQTTv5::ErrorType::TimedOut) continue;
+    if (ret || (ret = client.eventLoop(0)))
     {
         ESP_LOGE(LOGNAME, "Event loop failed with error: %d", (int)ret);
         vTaskDelete(NULL);
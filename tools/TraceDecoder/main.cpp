@@ -0,0 +1,73 @@
+// Host decoder for the eMQTT5 packet trace.
+// The trace entries are saved as is from the device (MQTTv5::getTrace), for example:
+//   MQTTv5::TraceEntry entries[CONFIG_ESP_EMQTT5_TRACE_ENTRIES];
+//   fwrite(entries, sizeof(*entries), client.getTrace(entries, CONFIG_ESP_EMQTT5_TRACE_ENTRIES), file);
+// Each entry is printed on a line, and the packets that were entirely captured are decoded with their dump method.
+// Usage: eMQTT5TraceDecoder trace.bin
+#include <Network/Clients/MQTT.hpp>
+#include <stdio.h>
+
+using namespace Network::Client;
+using namespace Protocol::MQTT::V5;
+
+/** Decode a packet and dump it */
+template <typename Packet>
+static bool decode(const MQTTv5::TraceEntry & entry, MQTTString & out)
+{
+    Packet packet;
+    if (Protocol::MQTT::Common::isError(packet.readFrom(entry.data, entry.length))) return false;
+    packet.dump(out, 2);
+    return true;
+}
+
+/** Decode the packets the client is able to parse (it's a client only implementation, so it can't parse CONNECT or SUBSCRIBE) */
+static bool decode(const MQTTv5::TraceEntry & entry, MQTTString & out)
+{
+    switch ((ControlPacketType)(entry.typeAndFlags >> 4))
+    {
+    case CONNACK:       return decode<ControlPacket<CONNACK> >(entry, out);
+    case PUBLISH:       return decode<ROPublishPacket>(entry, out);
+    case PUBACK:        return decode<ControlPacket<PUBACK> >(entry, out);
+    case PUBREC:        return decode<ControlPacket<PUBREC> >(entry, out);
+    case PUBREL:        return decode<ControlPacket<PUBREL> >(entry, out);
+    case PUBCOMP:       return decode<ControlPacket<PUBCOMP> >(entry, out);
+    case SUBACK:        return decode<ControlPacket<SUBACK> >(entry, out);
+    case UNSUBACK:      return decode<ControlPacket<UNSUBACK> >(entry, out);
+    case PINGREQ:       return decode<ControlPacket<PINGREQ> >(entry, out);
+    case PINGRESP:      return decode<ControlPacket<PINGRESP> >(entry, out);
+    case DISCONNECT:    return decode<ControlPacket<DISCONNECT> >(entry, out);
+    case AUTH:          return decode<ControlPacket<AUTH> >(entry, out);
+    default:            return false;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s trace.bin\nThe trace is decoded with %d captured bytes per packet (set CONFIG_ESP_EMQTT5_TRACE_BYTES to change it)\n",
+                argv[0], (int)MQTTv5::TraceEntry::CapturedBytes);
+        return 1;
+    }
+    FILE * file = fopen(argv[1], "rb");
+    if (!file) { fprintf(stderr, "Can't open %s\n", argv[1]); return 1; }
+
+    MQTTv5::TraceEntry entry;
+    uint32 first = 0;
+    for (uint32 i = 0; fread(&entry, sizeof(entry), 1, file) == 1; i++)
+    {
+        if (!i) first = entry.timeMs;
+        printf("+%8u ms %c %-11s id:%-5u len:%-6u ", (unsigned)(entry.timeMs - first), entry.sent ? '>' : '<',
+               Protocol::MQTT::Common::Helper::getControlPacketName((ControlPacketType)(entry.typeAndFlags >> 4)),
+               (unsigned)entry.packetID, (unsigned)entry.length);
+        for (uint32 j = 0; j < entry.getCapturedSize(); j++) printf("%02X", entry.data[j]);
+        printf(entry.getCapturedSize() < entry.length ? "...\n" : "\n");
+
+        // Only the packets that were entirely captured can be decoded
+        MQTTString out;
+        if (entry.getCapturedSize() == entry.length && decode(entry, out))
+            printf("%s%s", out.c_str(), out.size() && out[out.size() - 1] != '\n' ? "\n" : "");
+    }
+    fclose(file);
+    return 0;
+}
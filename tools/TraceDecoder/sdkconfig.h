@@ -0,0 +1,23 @@
+#ifndef hpp_TraceDecoderSDKConfig_hpp
+#define hpp_TraceDecoderSDKConfig_hpp
+
+// This replaces the configuration generated by ESP-IDF from the Kconfig file for the host build.
+// The packets are decoded with their dump methods, so the communication dump is enabled here.
+// The number of captured bytes must be the same as on the device (CONFIG_ESP_EMQTT5_TRACE_BYTES) for the entries' layout to match
+#ifndef CONFIG_ESP_EMQTT5_ENABLED
+  #define CONFIG_ESP_EMQTT5_ENABLED 1
+#endif
+#ifndef CONFIG_ESP_EMQTT5_DUMP
+  #define CONFIG_ESP_EMQTT5_DUMP 1
+#endif
+#ifndef CONFIG_ESP_EMQTT5_TRACE_ENTRIES
+  #define CONFIG_ESP_EMQTT5_TRACE_ENTRIES 1
+#endif
+#ifndef CONFIG_ESP_EMQTT5_TRACE_BYTES
+  #define CONFIG_ESP_EMQTT5_TRACE_BYTES 16
+#endif
+#ifndef CONFIG_ESP_EMQTT5_STACK_SIZE
+  #define CONFIG_ESP_EMQTT5_STACK_SIZE 256
+#endif
+
+#endif